@@ -0,0 +1,781 @@
+/***************************************************************************
+ *
+ * hal-bench.c : microbenchmarks for the libhal API
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/utsname.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include <dbus/dbus.h>
+
+#include "libhal.h"
+
+/*
+ * Usage: hal-bench [-t SECONDS] [-f PATTERN] [-o FILE] [-n DEVICES] [-T]
+ *
+ * Runs each benchmark for about SECONDS (0.2 by default) and writes
+ * the results as JSON to FILE, or to stdout.  -f runs only the
+ * benchmarks whose name matches the glob PATTERN.  Tracing is turned
+ * off unless -T is given, so that the numbers are those of the calls
+ * themselves; statistics stay as configured.  -n adds DEVICES devices
+ * to the GDL first, one in ten with info.category "storage", to see
+ * how the calls scale; "make bench-scale" runs the string match and
+ * GDL snapshot benchmarks with 100, 10000 and 100000 of them.
+ *
+ * For each benchmark the output has the time per operation, the
+ * number of malloc(), calloc() and realloc() calls per operation and,
+ * where perf events can be opened, the user space instructions per
+ * operation.  These include the few nanoseconds and instructions of
+ * the loop calling the benchmark; see the "loop" benchmark.
+ *
+ * Most benchmarks are a single libhal call.  Those of functions that
+ * consume or need an object of their own also create it, as noted
+ * in their name: compare them to the benchmark creating the object.
+ * Those named scan_* do with several libhal calls what the benchmark
+ * of the same name minus the prefix does with one, for comparison.
+ * Those named changeset_N build, or commit, a changeset of N changes
+ * of a device of their own.
+ */
+
+#define UDI        "/org/freedesktop/Hal/devices/computer"
+#define KEY        "system.hardware.serial"
+#define CAPABILITY "volume"
+#define INTERFACE  "org.freedesktop.Hal.Device.Storage"
+#define CATEGORY   "storage"
+#define CHANGESET_UDI "/org/freedesktop/Hal/devices/bench_changeset"
+#define CHANGESET_MAX 100
+
+typedef struct {
+	LibHalContext *ctx;
+	LibHalPropertySet *set;
+	LibHalPropertySetIterator iter;
+	LibHalPropertySetIterator typed[6];   /**< positioned on a property of each type */
+	int has_typed[6];
+	LibHalChangeSet *changeset;
+	LibHalChangeSet *sized[3];            /**< of 1, 10 and 100 changes, on CHANGESET_UDI */
+} Fixture;
+
+static uint64_t allocations;
+static int tracing;
+static int num_devices;
+
+static const char *strlist[] = { "one", "two", "three", NULL };
+static char changeset_keys[CHANGESET_MAX][32];
+
+/* DBusConnection is opaque and never dereferenced by libhal */
+static int fake_connection;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+void *
+malloc (size_t size)
+{
+	allocations++;
+	return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+	allocations++;
+	return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+	allocations++;
+	return __libc_realloc (ptr, size);
+}
+
+#define HAVE_ALLOCATION_COUNT 1
+#else
+#define HAVE_ALLOCATION_COUNT 0
+#endif
+
+static int
+typed_index (LibHalPropertyType type)
+{
+	switch (type) {
+	case LIBHAL_PROPERTY_TYPE_STRING:
+		return 0;
+	case LIBHAL_PROPERTY_TYPE_INT32:
+		return 1;
+	case LIBHAL_PROPERTY_TYPE_UINT64:
+		return 2;
+	case LIBHAL_PROPERTY_TYPE_DOUBLE:
+		return 3;
+	case LIBHAL_PROPERTY_TYPE_BOOLEAN:
+		return 4;
+	case LIBHAL_PROPERTY_TYPE_STRLIST:
+		return 5;
+	default:
+		return -1;
+	}
+}
+
+static char **
+new_string_array (void)
+{
+	char **array;
+	int i;
+
+	array = malloc (4 * sizeof (char *));
+	for (i = 0; i < 3; i++)
+		array[i] = strdup (strlist[i]);
+	array[3] = NULL;
+	return array;
+}
+
+/* What libhal_manager_find_device_string_match() does, from outside */
+static char **
+scan_string_match (LibHalContext *ctx, const char *key, const char *value, int *num_found)
+{
+	char **udis;
+	char **found;
+	char *s;
+	int n;
+	int i;
+
+	*num_found = 0;
+	udis = libhal_get_all_devices (ctx, &n, NULL);
+	if (udis == NULL)
+		return NULL;
+	found = malloc ((n + 1) * sizeof (char *));
+	for (i = 0; i < n; i++) {
+		s = libhal_device_get_property_string (ctx, udis[i], key, NULL);
+		if (s != NULL && strcmp (s, value) == 0)
+			found[(*num_found)++] = strdup (udis[i]);
+		libhal_free_string (s);
+	}
+	found[*num_found] = NULL;
+	libhal_free_string_array (udis);
+	return found;
+}
+
+/* A changeset of @size changes of CHANGESET_UDI, of each type in turn */
+static LibHalChangeSet *
+new_changeset (int size)
+{
+	LibHalChangeSet *changeset;
+	int i;
+
+	changeset = libhal_device_new_changeset (CHANGESET_UDI);
+	for (i = 0; i < size && i < CHANGESET_MAX; i++) {
+		switch (i % 6) {
+		case 0:
+			libhal_changeset_set_property_string (changeset, changeset_keys[i], "value");
+			break;
+		case 1:
+			libhal_changeset_set_property_int (changeset, changeset_keys[i], 42);
+			break;
+		case 2:
+			libhal_changeset_set_property_uint64 (changeset, changeset_keys[i], 42);
+			break;
+		case 3:
+			libhal_changeset_set_property_double (changeset, changeset_keys[i], 4.2);
+			break;
+		case 4:
+			libhal_changeset_set_property_bool (changeset, changeset_keys[i], TRUE);
+			break;
+		default:
+			libhal_changeset_set_property_strlist (changeset, changeset_keys[i], strlist);
+			break;
+		}
+	}
+	return changeset;
+}
+
+static void
+free_property_sets (int num, char **udis, LibHalPropertySet **sets)
+{
+	int i;
+
+	for (i = 0; i < num; i++)
+		libhal_free_property_set (sets[i]);
+	free (sets);
+	libhal_free_string_array (udis);
+}
+
+/*
+ * The benchmarks: BENCH (name, body) and BENCH_IF (name, condition,
+ * body), where body is one operation and sees the fixture as @f.  A
+ * benchmark whose condition is false, e.g. because the fixture has no
+ * property of the type it needs, is reported as skipped.  A "__" in
+ * the name stands for a "+" in the output.
+ */
+#define BENCH_CASES \
+	BENCH (loop, (void) 0) \
+	\
+	/* context lifecycle */ \
+	BENCH (libhal_ctx_new__libhal_ctx_free, \
+		libhal_ctx_free (libhal_ctx_new ())) \
+	BENCH (libhal_ctx_init__libhal_ctx_shutdown, \
+		libhal_ctx_init (f->ctx, NULL), libhal_ctx_shutdown (f->ctx, NULL)) \
+	BENCH (libhal_ctx_new__init__shutdown__free, \
+		({ LibHalContext *ctx = libhal_ctx_new (); \
+		   libhal_ctx_set_dbus_connection (ctx, (DBusConnection *) &fake_connection); \
+		   libhal_ctx_init (ctx, NULL); \
+		   libhal_ctx_shutdown (ctx, NULL); \
+		   libhal_ctx_free (ctx); })) \
+	BENCH (libhal_ctx_init_direct, \
+		({ LibHalContext *ctx = libhal_ctx_init_direct (NULL); \
+		   if (ctx != NULL) libhal_ctx_free (ctx); })) \
+	BENCH (libhal_ctx_set_cache, libhal_ctx_set_cache (f->ctx, FALSE)) \
+	BENCH (libhal_ctx_set_dbus_connection, \
+		libhal_ctx_set_dbus_connection (f->ctx, (DBusConnection *) &fake_connection)) \
+	BENCH (libhal_ctx_get_dbus_connection, libhal_ctx_get_dbus_connection (f->ctx)) \
+	BENCH (libhal_ctx_set_user_data, libhal_ctx_set_user_data (f->ctx, f)) \
+	BENCH (libhal_ctx_get_user_data, libhal_ctx_get_user_data (f->ctx)) \
+	BENCH (libhal_ctx_set_device_added, libhal_ctx_set_device_added (f->ctx, NULL)) \
+	BENCH (libhal_ctx_set_device_removed, libhal_ctx_set_device_removed (f->ctx, NULL)) \
+	BENCH (libhal_ctx_set_device_new_capability, \
+		libhal_ctx_set_device_new_capability (f->ctx, NULL)) \
+	BENCH (libhal_ctx_set_device_lost_capability, \
+		libhal_ctx_set_device_lost_capability (f->ctx, NULL)) \
+	BENCH (libhal_ctx_set_device_property_modified, \
+		libhal_ctx_set_device_property_modified (f->ctx, NULL)) \
+	BENCH (libhal_ctx_set_device_condition, libhal_ctx_set_device_condition (f->ctx, NULL)) \
+	BENCH (libhal_ctx_set_global_interface_lock_acquired, \
+		libhal_ctx_set_global_interface_lock_acquired (f->ctx, NULL)) \
+	BENCH (libhal_ctx_set_global_interface_lock_released, \
+		libhal_ctx_set_global_interface_lock_released (f->ctx, NULL)) \
+	BENCH (libhal_ctx_set_interface_lock_acquired, \
+		libhal_ctx_set_interface_lock_acquired (f->ctx, NULL)) \
+	BENCH (libhal_ctx_set_interface_lock_released, \
+		libhal_ctx_set_interface_lock_released (f->ctx, NULL)) \
+	BENCH (libhal_ctx_set_singleton_device_added, \
+		libhal_ctx_set_singleton_device_added (f->ctx, NULL)) \
+	BENCH (libhal_ctx_set_singleton_device_removed, \
+		libhal_ctx_set_singleton_device_removed (f->ctx, NULL)) \
+	\
+	/* device queries */ \
+	BENCH (libhal_get_all_devices, \
+		({ int n; libhal_free_string_array (libhal_get_all_devices (f->ctx, &n, NULL)); })) \
+	BENCH (libhal_device_exists, libhal_device_exists (f->ctx, UDI, NULL)) \
+	BENCH (libhal_device_get_generation, libhal_device_get_generation (f->ctx, UDI, NULL)) \
+	BENCH (libhal_get_gdl_generation, libhal_get_gdl_generation (f->ctx, NULL)) \
+	BENCH (libhal_device_property_exists, libhal_device_property_exists (f->ctx, UDI, KEY, NULL)) \
+	BENCH (libhal_device_get_property_type, libhal_device_get_property_type (f->ctx, UDI, KEY, NULL)) \
+	BENCH (libhal_device_get_property_string, \
+		libhal_free_string (libhal_device_get_property_string (f->ctx, UDI, KEY, NULL))) \
+	BENCH (libhal_device_get_property_int, \
+		libhal_device_get_property_int (f->ctx, UDI, "info.version", NULL)) \
+	BENCH (libhal_device_get_property_uint64, \
+		libhal_device_get_property_uint64 (f->ctx, UDI, "info.size", NULL)) \
+	BENCH (libhal_device_get_property_double, \
+		libhal_device_get_property_double (f->ctx, UDI, "info.ratio", NULL)) \
+	BENCH (libhal_device_get_property_bool, \
+		libhal_device_get_property_bool (f->ctx, UDI, "info.removable", NULL)) \
+	BENCH (libhal_device_get_property_strlist, \
+		libhal_free_string_array (libhal_device_get_property_strlist (f->ctx, UDI, "info.capabilities", NULL))) \
+	BENCH (libhal_manager_find_device_string_match, \
+		({ int n; libhal_free_string_array (libhal_manager_find_device_string_match (f->ctx, "info.product", "Computer", &n, NULL)); })) \
+	BENCH (libhal_manager_find_device_string_match_category, \
+		({ int n; libhal_free_string_array (libhal_manager_find_device_string_match (f->ctx, "info.category", CATEGORY, &n, NULL)); })) \
+	BENCH (scan_libhal_manager_find_device_string_match_category, \
+		({ int n; libhal_free_string_array (scan_string_match (f->ctx, "info.category", CATEGORY, &n)); })) \
+	BENCH (libhal_device_query_capability, \
+		libhal_device_query_capability (f->ctx, UDI, CAPABILITY, NULL)) \
+	BENCH (libhal_find_device_by_capability, \
+		({ int n; libhal_free_string_array (libhal_find_device_by_capability (f->ctx, CAPABILITY, &n, NULL)); })) \
+	BENCH (libhal_device_matches, \
+		libhal_device_matches (f->ctx, UDI, UDI, "info", NULL)) \
+	BENCH (libhal_device_is_caller_locked_out, \
+		libhal_device_is_caller_locked_out (f->ctx, UDI, INTERFACE, ":1.0", NULL)) \
+	BENCH (libhal_device_is_locked_by_others, \
+		libhal_device_is_locked_by_others (f->ctx, UDI, INTERFACE, NULL)) \
+	BENCH (libhal_device_is_caller_privileged, \
+		libhal_free_string (libhal_device_is_caller_privileged (f->ctx, UDI, "org.freedesktop.hal.storage.mount-removable", ":1.0", NULL))) \
+	\
+	/* device changes */ \
+	BENCH (libhal_device_set_property_string, \
+		libhal_device_set_property_string (f->ctx, UDI, "bench.string", "value", NULL)) \
+	BENCH (libhal_device_set_property_int, \
+		libhal_device_set_property_int (f->ctx, UDI, "bench.int", 42, NULL)) \
+	BENCH (libhal_device_set_property_uint64, \
+		libhal_device_set_property_uint64 (f->ctx, UDI, "bench.uint64", 42, NULL)) \
+	BENCH (libhal_device_set_property_double, \
+		libhal_device_set_property_double (f->ctx, UDI, "bench.double", 4.2, NULL)) \
+	BENCH (libhal_device_set_property_bool, \
+		libhal_device_set_property_bool (f->ctx, UDI, "bench.bool", TRUE, NULL)) \
+	BENCH (libhal_device_property_strlist_append__remove_index, \
+		libhal_device_property_strlist_append (f->ctx, UDI, "bench.strlist", "value", NULL), \
+		libhal_device_property_strlist_remove_index (f->ctx, UDI, "bench.strlist", 0, NULL)) \
+	BENCH (libhal_device_property_strlist_prepend__remove, \
+		libhal_device_property_strlist_prepend (f->ctx, UDI, "bench.strlist", "value", NULL), \
+		libhal_device_property_strlist_remove (f->ctx, UDI, "bench.strlist", "value", NULL)) \
+	BENCH (libhal_device_set_property_int__remove_property, \
+		libhal_device_set_property_int (f->ctx, UDI, "bench.removed", 1, NULL), \
+		libhal_device_remove_property (f->ctx, UDI, "bench.removed", NULL)) \
+	BENCH (libhal_device_add_capability, \
+		libhal_device_add_capability (f->ctx, UDI, CAPABILITY, NULL)) \
+	BENCH (libhal_device_lock__unlock, \
+		libhal_device_lock (f->ctx, UDI, "bench", NULL, NULL), \
+		libhal_device_unlock (f->ctx, UDI, NULL)) \
+	BENCH (libhal_new_device__commit_to_gdl__remove_device, \
+		({ char *udi = libhal_new_device (f->ctx, NULL); \
+		   if (udi != NULL) { \
+			libhal_device_commit_to_gdl (f->ctx, udi, "/org/freedesktop/Hal/devices/bench", NULL); \
+			libhal_remove_device (f->ctx, "/org/freedesktop/Hal/devices/bench", NULL); \
+			libhal_free_string (udi); } })) \
+	BENCH (libhal_merge_properties, libhal_merge_properties (f->ctx, UDI, UDI, NULL)) \
+	BENCH (libhal_device_property_watch_all, libhal_device_property_watch_all (f->ctx, NULL)) \
+	BENCH (libhal_device_property_remove_watch_all, \
+		libhal_device_property_remove_watch_all (f->ctx, NULL)) \
+	BENCH (libhal_device_add_property_watch, libhal_device_add_property_watch (f->ctx, UDI, NULL)) \
+	BENCH (libhal_device_remove_property_watch, \
+		libhal_device_remove_property_watch (f->ctx, UDI, NULL)) \
+	BENCH (libhal_device_rescan, libhal_device_rescan (f->ctx, UDI, NULL)) \
+	BENCH (libhal_device_reprobe, libhal_device_reprobe (f->ctx, UDI, NULL)) \
+	BENCH (libhal_device_emit_condition, \
+		libhal_device_emit_condition (f->ctx, UDI, "ButtonPressed", "power", NULL)) \
+	BENCH (libhal_device_claim_interface, \
+		libhal_device_claim_interface (f->ctx, UDI, INTERFACE, "", NULL)) \
+	BENCH (libhal_device_addon_is_ready, libhal_device_addon_is_ready (f->ctx, UDI, NULL)) \
+	BENCH (libhal_device_singleton_addon_is_ready, \
+		libhal_device_singleton_addon_is_ready (f->ctx, "hald-addon-bench", NULL)) \
+	BENCH (libhal_device_acquire_interface_lock__release, \
+		libhal_device_acquire_interface_lock (f->ctx, UDI, INTERFACE, FALSE, NULL), \
+		libhal_device_release_interface_lock (f->ctx, UDI, INTERFACE, NULL)) \
+	BENCH (libhal_acquire_global_interface_lock__release, \
+		libhal_acquire_global_interface_lock (f->ctx, INTERFACE, FALSE, NULL), \
+		libhal_release_global_interface_lock (f->ctx, INTERFACE, NULL)) \
+	\
+	/* changesets */ \
+	BENCH (libhal_device_new_changeset__free_changeset, \
+		libhal_device_free_changeset (libhal_device_new_changeset (UDI))) \
+	BENCH (libhal_changeset_set_property_string__new__free, \
+		({ LibHalChangeSet *cs = libhal_device_new_changeset (UDI); \
+		   libhal_changeset_set_property_string (cs, "bench.string", "value"); \
+		   libhal_device_free_changeset (cs); })) \
+	BENCH (libhal_changeset_set_property_int__new__free, \
+		({ LibHalChangeSet *cs = libhal_device_new_changeset (UDI); \
+		   libhal_changeset_set_property_int (cs, "bench.int", 42); \
+		   libhal_device_free_changeset (cs); })) \
+	BENCH (libhal_changeset_set_property_uint64__new__free, \
+		({ LibHalChangeSet *cs = libhal_device_new_changeset (UDI); \
+		   libhal_changeset_set_property_uint64 (cs, "bench.uint64", 42); \
+		   libhal_device_free_changeset (cs); })) \
+	BENCH (libhal_changeset_set_property_double__new__free, \
+		({ LibHalChangeSet *cs = libhal_device_new_changeset (UDI); \
+		   libhal_changeset_set_property_double (cs, "bench.double", 4.2); \
+		   libhal_device_free_changeset (cs); })) \
+	BENCH (libhal_changeset_set_property_bool__new__free, \
+		({ LibHalChangeSet *cs = libhal_device_new_changeset (UDI); \
+		   libhal_changeset_set_property_bool (cs, "bench.bool", TRUE); \
+		   libhal_device_free_changeset (cs); })) \
+	BENCH (libhal_changeset_set_property_strlist__new__free, \
+		({ LibHalChangeSet *cs = libhal_device_new_changeset (UDI); \
+		   libhal_changeset_set_property_strlist (cs, "bench.strlist", strlist); \
+		   libhal_device_free_changeset (cs); })) \
+	BENCH (libhal_device_commit_changeset, \
+		libhal_device_commit_changeset (f->ctx, f->changeset, NULL)) \
+	BENCH (changeset_1__new__free, libhal_device_free_changeset (new_changeset (1))) \
+	BENCH (changeset_10__new__free, libhal_device_free_changeset (new_changeset (10))) \
+	BENCH (changeset_100__new__free, libhal_device_free_changeset (new_changeset (100))) \
+	BENCH (changeset_1__commit, libhal_device_commit_changeset (f->ctx, f->sized[0], NULL)) \
+	BENCH (changeset_10__commit, libhal_device_commit_changeset (f->ctx, f->sized[1], NULL)) \
+	BENCH (changeset_100__commit, libhal_device_commit_changeset (f->ctx, f->sized[2], NULL)) \
+	\
+	/* property sets */ \
+	BENCH (libhal_device_get_all_properties__free_property_set, \
+		libhal_free_property_set (libhal_device_get_all_properties (f->ctx, UDI, NULL))) \
+	BENCH (libhal_get_all_devices_with_properties__free, \
+		({ int n; char **udis; LibHalPropertySet **sets; \
+		   if (libhal_get_all_devices_with_properties (f->ctx, &n, &udis, &sets, NULL)) \
+			free_property_sets (n, udis, sets); })) \
+	BENCH (libhal_property_set_sort, libhal_property_set_sort (f->set)) \
+	BENCH (libhal_property_set_get_num_elems, \
+		libhal_property_set_get_num_elems (f->set)) \
+	BENCH_IF (libhal_ps_get_type, f->set != NULL, libhal_ps_get_type (f->set, KEY)) \
+	BENCH_IF (libhal_ps_get_string, f->set != NULL, libhal_ps_get_string (f->set, KEY)) \
+	BENCH_IF (libhal_ps_get_int32, f->set != NULL, libhal_ps_get_int32 (f->set, "info.version")) \
+	BENCH_IF (libhal_ps_get_uint64, f->set != NULL, libhal_ps_get_uint64 (f->set, "info.size")) \
+	BENCH_IF (libhal_ps_get_double, f->set != NULL, libhal_ps_get_double (f->set, "info.ratio")) \
+	BENCH_IF (libhal_ps_get_bool, f->set != NULL, libhal_ps_get_bool (f->set, "info.removable")) \
+	BENCH_IF (libhal_ps_get_strlist, f->set != NULL, libhal_ps_get_strlist (f->set, "info.capabilities")) \
+	BENCH (libhal_psi_init__iterate, \
+		({ LibHalPropertySetIterator iter; \
+		   for (libhal_psi_init (&iter, f->set); libhal_psi_has_more (&iter); libhal_psi_next (&iter)) { \
+			libhal_psi_get_type (&iter); \
+			libhal_psi_get_key (&iter); } })) \
+	BENCH (libhal_psi_has_more, libhal_psi_has_more (&f->iter)) \
+	BENCH_IF (libhal_psi_get_type, f->has_typed[0], libhal_psi_get_type (&f->typed[0])) \
+	BENCH_IF (libhal_psi_get_key, f->has_typed[0], libhal_psi_get_key (&f->typed[0])) \
+	BENCH_IF (libhal_psi_get_string, f->has_typed[0], libhal_psi_get_string (&f->typed[0])) \
+	BENCH_IF (libhal_psi_get_int, f->has_typed[1], libhal_psi_get_int (&f->typed[1])) \
+	BENCH_IF (libhal_psi_get_uint64, f->has_typed[2], libhal_psi_get_uint64 (&f->typed[2])) \
+	BENCH_IF (libhal_psi_get_double, f->has_typed[3], libhal_psi_get_double (&f->typed[3])) \
+	BENCH_IF (libhal_psi_get_bool, f->has_typed[4], libhal_psi_get_bool (&f->typed[4])) \
+	BENCH_IF (libhal_psi_get_strlist, f->has_typed[5], libhal_psi_get_strlist (&f->typed[5])) \
+	BENCH (libhal_psi_next, \
+		({ LibHalPropertySetIterator iter = f->iter; \
+		   if (libhal_psi_has_more (&iter)) libhal_psi_next (&iter); })) \
+	\
+	/* strings */ \
+	BENCH (libhal_string_array_length, \
+		libhal_string_array_length ((char **) strlist)) \
+	BENCH (libhal_free_string__strdup, libhal_free_string (strdup ("value"))) \
+	BENCH (libhal_free_string_array__new, libhal_free_string_array (new_string_array ())) \
+	\
+	/* libhal-dummy */ \
+	BENCH (libhal_dummy_get_stats__free_stats, \
+		({ LibHalDummyStats *stats; int n; \
+		   if (libhal_dummy_get_stats (&stats, &n)) libhal_dummy_free_stats (stats); })) \
+	BENCH_IF (libhal_dummy_set_trace_mask, !tracing, libhal_dummy_set_trace_mask ("none"))
+
+
+#define BENCH(_name_, ...) BENCH_IF (_name_, TRUE, __VA_ARGS__)
+#define BENCH_IF(_name_, _condition_, ...) \
+static int \
+bench_##_name_ (Fixture *f, uint64_t n) \
+{ \
+	uint64_t i; \
+	if (!(_condition_)) \
+		return FALSE; \
+	for (i = 0; i < n; i++) { \
+		__VA_ARGS__; \
+		__asm__ __volatile__ ("" : : : "memory"); \
+	} \
+	return TRUE; \
+}
+BENCH_CASES
+#undef BENCH_IF
+#undef BENCH
+
+typedef struct {
+	const char *name;
+	int (*run) (Fixture *f, uint64_t n);
+} BenchCase;
+
+static const BenchCase cases[] = {
+#define BENCH(_name_, ...) { #_name_, bench_##_name_ },
+#define BENCH_IF(_name_, _condition_, ...) { #_name_, bench_##_name_ },
+	BENCH_CASES
+#undef BENCH_IF
+#undef BENCH
+};
+
+typedef struct {
+	uint64_t iterations;
+	uint64_t ns;
+	uint64_t allocations;
+	uint64_t instructions;
+	int has_instructions;
+} Result;
+
+static int perf_fd = -1;
+
+static uint64_t
+now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+open_instruction_counter (void)
+{
+#ifdef __linux__
+	struct perf_event_attr attr;
+
+	memset (&attr, 0, sizeof (attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof (attr);
+	attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	perf_fd = syscall (__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+static void
+measure (const BenchCase *c, Fixture *f, uint64_t n, Result *r)
+{
+	uint64_t start;
+	uint64_t start_allocations;
+
+	memset (r, 0, sizeof (Result));
+	r->iterations = n;
+
+#ifdef __linux__
+	if (perf_fd >= 0) {
+		ioctl (perf_fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl (perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+	start_allocations = allocations;
+	start = now_ns ();
+	c->run (f, n);
+	r->ns = now_ns () - start;
+	r->allocations = allocations - start_allocations;
+#ifdef __linux__
+	if (perf_fd >= 0) {
+		ioctl (perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read (perf_fd, &r->instructions, sizeof (uint64_t)) == sizeof (uint64_t))
+			r->has_instructions = TRUE;
+	}
+#endif
+}
+
+/* Returns FALSE if the benchmark was skipped */
+static int
+run_case (const BenchCase *c, Fixture *f, double seconds, Result *r)
+{
+	uint64_t target = (uint64_t) (seconds * 1e9);
+	uint64_t n = 1;
+
+	if (!c->run (f, 1))
+		return FALSE;
+
+	/* grow the batch until it takes a tenth of the time, then scale */
+	for (;;) {
+		measure (c, f, n, r);
+		if (r->ns >= target / 10 || n >= (1ULL << 40))
+			break;
+		n *= r->ns < target / 1000 ? 10 : 2;
+	}
+	if (r->ns < target) {
+		n = (uint64_t) ((double) n * target / (r->ns ? r->ns : 1));
+		measure (c, f, n, r);
+	}
+	return TRUE;
+}
+
+static void
+add_devices (LibHalContext *ctx, int n)
+{
+	char udi[64];
+	char *temp_udi;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		temp_udi = libhal_new_device (ctx, NULL);
+		if (temp_udi == NULL)
+			break;
+		snprintf (udi, sizeof (udi), "/org/freedesktop/Hal/devices/bench_%06d", i);
+		libhal_device_set_property_string (ctx, temp_udi, "info.category",
+						   i % 10 == 0 ? CATEGORY : "volume", NULL);
+		libhal_device_set_property_string (ctx, temp_udi, "info.product", "Bench device", NULL);
+		libhal_device_commit_to_gdl (ctx, temp_udi, udi, NULL);
+		libhal_free_string (temp_udi);
+	}
+}
+
+static void
+setup (Fixture *f)
+{
+	LibHalPropertySetIterator iter;
+	char *temp_udi;
+	int i;
+
+	memset (f, 0, sizeof (Fixture));
+
+	f->ctx = libhal_ctx_new ();
+	libhal_ctx_set_dbus_connection (f->ctx, (DBusConnection *) &fake_connection);
+	libhal_ctx_init (f->ctx, NULL);
+	add_devices (f->ctx, num_devices);
+
+	f->set = libhal_device_get_all_properties (f->ctx, UDI, NULL);
+	libhal_psi_init (&f->iter, f->set);
+	for (libhal_psi_init (&iter, f->set); libhal_psi_has_more (&iter); libhal_psi_next (&iter)) {
+		i = typed_index (libhal_psi_get_type (&iter));
+		if (i >= 0 && !f->has_typed[i]) {
+			f->typed[i] = iter;
+			f->has_typed[i] = TRUE;
+		}
+	}
+
+	f->changeset = libhal_device_new_changeset (UDI);
+	libhal_changeset_set_property_string (f->changeset, "bench.string", "value");
+	libhal_changeset_set_property_int (f->changeset, "bench.int", 42);
+	libhal_changeset_set_property_uint64 (f->changeset, "bench.uint64", 42);
+	libhal_changeset_set_property_double (f->changeset, "bench.double", 4.2);
+	libhal_changeset_set_property_bool (f->changeset, "bench.bool", TRUE);
+	libhal_changeset_set_property_strlist (f->changeset, "bench.strlist", strlist);
+
+	temp_udi = libhal_new_device (f->ctx, NULL);
+	if (temp_udi != NULL) {
+		libhal_device_commit_to_gdl (f->ctx, temp_udi, CHANGESET_UDI, NULL);
+		libhal_free_string (temp_udi);
+	}
+	for (i = 0; i < CHANGESET_MAX; i++)
+		snprintf (changeset_keys[i], sizeof (changeset_keys[i]), "bench.changeset.key%d", i);
+	f->sized[0] = new_changeset (1);
+	f->sized[1] = new_changeset (10);
+	f->sized[2] = new_changeset (100);
+}
+
+static void
+teardown (Fixture *f)
+{
+	int i;
+
+	for (i = 0; i < 3; i++)
+		libhal_device_free_changeset (f->sized[i]);
+	libhal_device_free_changeset (f->changeset);
+	if (f->set != NULL)
+		libhal_free_property_set (f->set);
+	libhal_ctx_shutdown (f->ctx, NULL);
+	libhal_ctx_free (f->ctx);
+}
+
+static void
+display_name (const char *name, char *buf, size_t len)
+{
+	size_t i = 0;
+
+	while (*name != '\0' && i + 1 < len) {
+		if (name[0] == '_' && name[1] == '_') {
+			buf[i++] = '+';
+			name += 2;
+		} else {
+			buf[i++] = *name++;
+		}
+	}
+	buf[i] = '\0';
+}
+
+int
+main (int argc, char *argv[])
+{
+	struct utsname uts;
+	const char *pattern = NULL;
+	const char *output = NULL;
+	double seconds = 0.2;
+	Fixture fixture;
+	Result r;
+	FILE *out = stdout;
+	char name[128];
+	int first = TRUE;
+	int opt;
+	size_t i;
+
+	while ((opt = getopt (argc, argv, "t:f:o:n:Th")) != -1) {
+		switch (opt) {
+		case 't':
+			seconds = atof (optarg);
+			if (seconds <= 0)
+				seconds = 0.2;
+			break;
+		case 'f':
+			pattern = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'n':
+			num_devices = atoi (optarg);
+			break;
+		case 'T':
+			tracing = TRUE;
+			break;
+		default:
+			fprintf (stderr, "usage: %s [-t SECONDS] [-f PATTERN] [-o FILE] [-n DEVICES] [-T]\n", argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (output != NULL) {
+		out = fopen (output, "w");
+		if (out == NULL) {
+			perror (output);
+			return 1;
+		}
+	}
+
+	if (!tracing)
+		libhal_dummy_set_trace_mask ("none");
+	open_instruction_counter ();
+	setup (&fixture);
+
+	if (uname (&uts) != 0)
+		strcpy (uts.nodename, "unknown");
+
+	fprintf (out, "{\n");
+	fprintf (out, "  \"benchmark\": \"hal-bench\",\n");
+#ifdef PACKAGE_VERSION
+	fprintf (out, "  \"version\": \"%s\",\n", PACKAGE_VERSION);
+#endif
+	fprintf (out, "  \"timestamp\": %ld,\n", (long) time (NULL));
+	fprintf (out, "  \"host\": \"%s\",\n", uts.nodename);
+	fprintf (out, "  \"cpus\": %ld,\n", sysconf (_SC_NPROCESSORS_ONLN));
+	fprintf (out, "  \"tracing\": %s,\n", tracing ? "true" : "false");
+	fprintf (out, "  \"devices\": %d,\n", num_devices);
+	fprintf (out, "  \"seconds_per_benchmark\": %g,\n", seconds);
+	fprintf (out, "  \"results\": [");
+
+	for (i = 0; i < sizeof (cases) / sizeof (cases[0]); i++) {
+		display_name (cases[i].name, name, sizeof (name));
+		if (pattern != NULL && fnmatch (pattern, name, 0) != 0)
+			continue;
+
+		fprintf (out, "%s\n    { \"name\": \"%s\", ", first ? "" : ",", name);
+		first = FALSE;
+		if (!run_case (&cases[i], &fixture, seconds, &r)) {
+			fprintf (out, "\"skipped\": true }");
+			continue;
+		}
+
+		fprintf (out, "\"iterations\": %llu, \"ns_per_op\": %.2f, ",
+			 (unsigned long long) r.iterations, (double) r.ns / r.iterations);
+		if (HAVE_ALLOCATION_COUNT)
+			fprintf (out, "\"allocs_per_op\": %.2f, ", (double) r.allocations / r.iterations);
+		else
+			fprintf (out, "\"allocs_per_op\": null, ");
+		if (r.has_instructions)
+			fprintf (out, "\"instructions_per_op\": %.1f }", (double) r.instructions / r.iterations);
+		else
+			fprintf (out, "\"instructions_per_op\": null }");
+		fflush (out);
+	}
+
+	fprintf (out, "\n  ]\n}\n");
+
+	teardown (&fixture);
+	if (out != stdout && fclose (out) != 0) {
+		perror (output);
+		return 1;
+	}
+	return 0;
+}
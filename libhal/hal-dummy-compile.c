@@ -0,0 +1,403 @@
+/***************************************************************************
+ *
+ * hal-dummy-compile.c : compile a fixture into an image libhal can map
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dbus/dbus.h>
+
+#include "libhal.h"
+#include "libhal-image.h"
+#include "libhal-private.h"
+
+/*
+ * Usage: hal-dummy-compile FIXTURE IMAGE
+ *
+ * Reads FIXTURE, in the format described in libhal-fixture.c, and
+ * writes the same devices to IMAGE in the layout of libhal-image.h.
+ * Pointing the "fixture" setting at IMAGE then makes libhal map it
+ * instead of parsing the text in every process.  IMAGE is replaced
+ * atomically, so processes that have the old one mapped keep it.
+ */
+
+typedef struct {
+	char *udi;
+	uint32_t udi_offset;            /**< in the string pool */
+	HalImageProperty *props;
+	unsigned int num_props;
+	unsigned int max_props;
+	uint32_t index;                 /**< position in the image */
+} Device;
+
+/* the string pool: every distinct string once, in the order first seen */
+static char *pool;
+static size_t pool_size;
+static size_t pool_max;
+static uint32_t *pool_table;            /**< offset + 1 of each string, 0 if free */
+static size_t pool_table_size;
+static size_t pool_count;
+
+static Device *devices;
+static unsigned int num_devices;
+static unsigned int max_devices;
+static uint32_t *device_table;          /**< device index + 1, 0 if free */
+static size_t device_table_size;
+
+static uint32_t *lists;
+static size_t num_list_words;
+static size_t max_list_words;
+
+static void *
+xrealloc (void *p, size_t size)
+{
+	p = realloc (p, size);
+	if (p == NULL) {
+		fprintf (stderr, "out of memory\n");
+		exit (1);
+	}
+	return p;
+}
+
+static uint32_t
+hash_string (const char *s)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *s != '\0'; s++)
+		h = (h ^ (unsigned char) *s) * 16777619u;
+	return h;
+}
+
+static void
+pool_rehash (void)
+{
+	size_t size = pool_table_size ? pool_table_size * 2 : 1024;
+	uint32_t *table = calloc (size, sizeof (uint32_t));
+	size_t i;
+	size_t j;
+
+	if (table == NULL) {
+		fprintf (stderr, "out of memory\n");
+		exit (1);
+	}
+	for (i = 0; i < pool_table_size; i++) {
+		if (pool_table[i] == 0)
+			continue;
+		for (j = hash_string (pool + pool_table[i] - 1) & (size - 1); table[j] != 0; j = (j + 1) & (size - 1))
+			;
+		table[j] = pool_table[i];
+	}
+	free (pool_table);
+	pool_table = table;
+	pool_table_size = size;
+}
+
+/* Offset of @s in the pool, adding it if it is not there yet */
+static uint32_t
+intern (const char *s)
+{
+	size_t len = strlen (s) + 1;
+	size_t i;
+
+	if ((pool_count + 1) * 2 > pool_table_size)
+		pool_rehash ();
+	for (i = hash_string (s) & (pool_table_size - 1); pool_table[i] != 0; i = (i + 1) & (pool_table_size - 1)) {
+		if (strcmp (pool + pool_table[i] - 1, s) == 0)
+			return pool_table[i] - 1;
+	}
+	if (pool_size + len > UINT32_MAX - 1) {
+		fprintf (stderr, "too many strings\n");
+		exit (1);
+	}
+	if (pool_size + len > pool_max) {
+		pool_max = (pool_size + len) * 2;
+		pool = xrealloc (pool, pool_max);
+	}
+	memcpy (pool + pool_size, s, len);
+	pool_table[i] = pool_size + 1;
+	pool_count++;
+	pool_size += len;
+	return pool_table[i] - 1;
+}
+
+static void
+device_rehash (void)
+{
+	size_t size = device_table_size ? device_table_size * 2 : 256;
+	uint32_t *table = calloc (size, sizeof (uint32_t));
+	size_t i;
+	size_t j;
+
+	if (table == NULL) {
+		fprintf (stderr, "out of memory\n");
+		exit (1);
+	}
+	for (i = 0; i < device_table_size; i++) {
+		if (device_table[i] == 0)
+			continue;
+		for (j = hash_string (devices[device_table[i] - 1].udi) & (size - 1); table[j] != 0; j = (j + 1) & (size - 1))
+			;
+		table[j] = device_table[i];
+	}
+	free (device_table);
+	device_table = table;
+	device_table_size = size;
+}
+
+static int
+set_property (void *target, const char *key, int type, const HalValue *value)
+{
+	Device *device = &devices[(uintptr_t) target - 1];
+	HalImageProperty *p;
+	uint32_t key_offset = intern (key);
+	uint32_t i;
+
+	for (i = 0; i < device->num_props; i++) {
+		if (device->props[i].key == key_offset)
+			break;
+	}
+	if (i == device->num_props) {
+		if (device->num_props == device->max_props) {
+			device->max_props = device->max_props ? device->max_props * 2 : 16;
+			device->props = xrealloc (device->props, device->max_props * sizeof (HalImageProperty));
+		}
+		device->num_props++;
+	}
+	p = &device->props[i];
+	memset (p, 0, sizeof (HalImageProperty));
+	p->key = key_offset;
+	p->type = type;
+
+	switch (type) {
+	case LIBHAL_PROPERTY_TYPE_STRING:
+		p->value.str_value = intern (value->str_value);
+		break;
+	case LIBHAL_PROPERTY_TYPE_STRLIST:
+		for (i = 0; value->strlist_value[i] != NULL; i++)
+			;
+		if (num_list_words + i + 1 > max_list_words) {
+			max_list_words = (num_list_words + i + 1) * 2;
+			lists = xrealloc (lists, max_list_words * sizeof (uint32_t));
+		}
+		p->value.strlist_value = num_list_words;
+		lists[num_list_words++] = i;
+		for (i = 0; value->strlist_value[i] != NULL; i++)
+			lists[num_list_words++] = intern (value->strlist_value[i]);
+		break;
+	case LIBHAL_PROPERTY_TYPE_INT32:
+		p->value.int_value = value->int_value;
+		break;
+	case LIBHAL_PROPERTY_TYPE_UINT64:
+		p->value.uint64_value = value->uint64_value;
+		break;
+	case LIBHAL_PROPERTY_TYPE_DOUBLE:
+		p->value.double_value = value->double_value;
+		break;
+	case LIBHAL_PROPERTY_TYPE_BOOLEAN:
+		p->value.bool_value = value->bool_value != 0;
+		break;
+	}
+
+	return TRUE;
+}
+
+static void *
+add_device (void *data, const char *udi)
+{
+	HalValue value;
+	uint32_t i;
+
+	if ((num_devices + 1) * 2 > device_table_size)
+		device_rehash ();
+	for (i = hash_string (udi) & (device_table_size - 1); device_table[i] != 0; i = (i + 1) & (device_table_size - 1)) {
+		if (strcmp (devices[device_table[i] - 1].udi, udi) == 0)
+			return (void *) (uintptr_t) device_table[i];
+	}
+
+	if (num_devices == max_devices) {
+		max_devices = max_devices ? max_devices * 2 : 64;
+		devices = xrealloc (devices, max_devices * sizeof (Device));
+	}
+	memset (&devices[num_devices], 0, sizeof (Device));
+	devices[num_devices].udi = strdup (udi);
+	if (devices[num_devices].udi == NULL) {
+		fprintf (stderr, "out of memory\n");
+		exit (1);
+	}
+	devices[num_devices].udi_offset = intern (udi);
+	device_table[i] = ++num_devices;
+
+	/* as libhal does for devices it adds */
+	value.str_value = (char *) udi;
+	set_property ((void *) (uintptr_t) num_devices, "info.udi", LIBHAL_PROPERTY_TYPE_STRING, &value);
+
+	return (void *) (uintptr_t) num_devices;
+}
+
+static int
+compare_devices (const void *a, const void *b)
+{
+	const Device *da = *(const Device * const *) a;
+	const Device *db = *(const Device * const *) b;
+
+	return strcmp (da->udi, db->udi);
+}
+
+static int
+compare_properties (const void *a, const void *b)
+{
+	const HalImageProperty *pa = a;
+	const HalImageProperty *pb = b;
+
+	return strcmp (pool + pa->key, pool + pb->key);
+}
+
+static size_t
+align (size_t n)
+{
+	return (n + HAL_IMAGE_ALIGN - 1) & ~(size_t) (HAL_IMAGE_ALIGN - 1);
+}
+
+static int
+write_image (const char *path)
+{
+	HalImageHeader *header;
+	HalImageDevice *image_devices;
+	uint32_t *order;
+	HalImageProperty *props;
+	Device **sorted;
+	Device *d;
+	char *image;
+	char *tmp;
+	size_t num_props = 0;
+	size_t size;
+	unsigned int i;
+	unsigned int j;
+	FILE *fp;
+
+	for (i = 0; i < num_devices; i++)
+		num_props += devices[i].num_props;
+	if (pool_size == 0)
+		intern ("");
+
+	size = align (sizeof (HalImageHeader));
+	size += align (num_devices * sizeof (HalImageDevice));
+	size += align (num_devices * sizeof (uint32_t));
+	size += align (num_props * sizeof (HalImageProperty));
+	size += align (num_list_words * sizeof (uint32_t));
+	size += pool_size;
+	if (size > UINT32_MAX) {
+		fprintf (stderr, "%s: image would be too large\n", path);
+		return FALSE;
+	}
+
+	image = calloc (1, size);
+	sorted = malloc ((num_devices + 1) * sizeof (Device *));
+	if (image == NULL || sorted == NULL) {
+		fprintf (stderr, "out of memory\n");
+		return FALSE;
+	}
+
+	header = (HalImageHeader *) image;
+	header->magic = HAL_IMAGE_MAGIC;
+	header->version = HAL_IMAGE_VERSION;
+	header->num_devices = num_devices;
+	header->num_properties = num_props;
+	header->num_list_words = num_list_words;
+	header->strings_size = pool_size;
+	header->devices = align (sizeof (HalImageHeader));
+	header->order = header->devices + align (num_devices * sizeof (HalImageDevice));
+	header->properties = header->order + align (num_devices * sizeof (uint32_t));
+	header->lists = header->properties + align (num_props * sizeof (HalImageProperty));
+	header->strings = header->lists + align (num_list_words * sizeof (uint32_t));
+
+	image_devices = (HalImageDevice *) (image + header->devices);
+	order = (uint32_t *) (image + header->order);
+	props = (HalImageProperty *) (image + header->properties);
+
+	for (i = 0; i < num_devices; i++)
+		sorted[i] = &devices[i];
+	qsort (sorted, num_devices, sizeof (Device *), compare_devices);
+	for (i = 0; i < num_devices; i++)
+		sorted[i]->index = i;
+
+	for (i = 0, j = 0; i < num_devices; i++) {
+		d = sorted[i];
+		order[i] = devices[i].index;
+		image_devices[i].udi = d->udi_offset;
+		image_devices[i].first_property = j;
+		image_devices[i].num_properties = d->num_props;
+		qsort (d->props, d->num_props, sizeof (HalImageProperty), compare_properties);
+		memcpy (props + j, d->props, d->num_props * sizeof (HalImageProperty));
+		j += d->num_props;
+	}
+	if (num_list_words > 0)
+		memcpy (image + header->lists, lists, num_list_words * sizeof (uint32_t));
+	memcpy (image + header->strings, pool, pool_size);
+
+	tmp = malloc (strlen (path) + 5);
+	if (tmp == NULL) {
+		fprintf (stderr, "out of memory\n");
+		return FALSE;
+	}
+	sprintf (tmp, "%s.tmp", path);
+	fp = fopen (tmp, "wb");
+	if (fp == NULL) {
+		perror (tmp);
+		return FALSE;
+	}
+	if (fwrite (image, 1, size, fp) != size || fclose (fp) != 0) {
+		perror (tmp);
+		remove (tmp);
+		return FALSE;
+	}
+	if (rename (tmp, path) != 0) {
+		perror (path);
+		remove (tmp);
+		return FALSE;
+	}
+
+	printf ("%s: %u devices, %zu properties, %zu bytes\n", path, num_devices, num_props, size);
+	free (tmp);
+	free (sorted);
+	free (image);
+	return TRUE;
+}
+
+int
+main (int argc, char *argv[])
+{
+	if (argc != 3) {
+		fprintf (stderr, "usage: %s FIXTURE IMAGE\n", argv[0]);
+		return argc == 2 && (strcmp (argv[1], "-h") == 0 || strcmp (argv[1], "--help") == 0) ? 0 : 1;
+	}
+
+	if (!hal_fixture_load (argv[1], add_device, set_property, NULL))
+		return 1;
+	if (!write_image (argv[2]))
+		return 1;
+
+	return 0;
+}
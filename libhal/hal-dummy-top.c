@@ -0,0 +1,466 @@
+/***************************************************************************
+ *
+ * hal-dummy-top.c : show which processes are calling libhal
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libhal-trace.h"
+#include "libhal-stats.h"
+
+/*
+ * Usage: hal-dummy-top [-b] [-d SECONDS] [-n COUNT] [-u UID]
+ *
+ * Every SECONDS (2 by default) reads the slots of every segment in
+ * /dev/shm/hal-dummy-stats.<uid> it can open, so all of them when run
+ * by root and only the user's own otherwise, and prints the processes
+ * using libhal and the functions they call most, busiest first.  Each
+ * segment must belong to the uid in its name and be private to it.
+ * -u only reads the segment of UID, -n stops after COUNT updates and
+ * -b prints them one after the other instead of redrawing the screen.
+ */
+
+#define MAX_ROWS 20
+#define SHM_DIR  "/dev/shm"
+
+static const HalFunctionInfo functions[HAL_FN_LAST] = {
+#define HAL_FUNCTION(_name_, _args_, _level_) HAL_FUNCTION_INFO (_name_, _args_, _level_)
+#include "libhal-functions.h"
+#undef HAL_FUNCTION
+};
+
+typedef struct {
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t total_ns;
+} Counters;
+
+typedef struct {
+	uint32_t pid;
+	uint32_t uid;
+	uint64_t start_time;
+	char comm[17];
+	Counters total;
+	Counters rate;                  /**< change since the last update */
+} Process;
+
+typedef struct {
+	unsigned int function;
+	Counters total;
+	Counters rate;
+} Function;
+
+typedef struct {
+	uid_t uid;
+	const HalStatsShmHeader *header;
+} Segment;
+
+static Segment *segments;
+static unsigned int num_segments;
+static unsigned int num_slots;          /**< in all segments */
+static unsigned int num_functions;      /**< the most any segment counts */
+
+static Process *processes;
+static Process *previous;
+static unsigned int num_processes;
+static unsigned int num_previous;
+static Function *fn_now;
+static Function *fn_before;
+
+static const char *
+function_name (unsigned int function, char *buf, size_t len)
+{
+	if (function < HAL_FN_LAST)
+		return functions[function].name;
+	snprintf (buf, len, "function-%u", function);
+	return buf;
+}
+
+static void
+add_counters (Counters *total, const HalStatsShmCounters *c)
+{
+	total->calls += __atomic_load_n (&c->calls, __ATOMIC_RELAXED);
+	total->errors += __atomic_load_n (&c->errors, __ATOMIC_RELAXED);
+	total->total_ns += __atomic_load_n (&c->total_ns, __ATOMIC_RELAXED);
+}
+
+static void
+sub_counters (Counters *rate, const Counters *now, const Counters *before)
+{
+	rate->calls = now->calls - before->calls;
+	rate->errors = now->errors - before->errors;
+	rate->total_ns = now->total_ns - before->total_ns;
+}
+
+/* Map the segment of @uid; 0, saying why if @verbose, if it cannot be read or trusted */
+static int
+open_segment (uid_t uid, int verbose)
+{
+	const HalStatsShmHeader *h;
+	struct stat st;
+	Segment *s;
+	Process *p;
+	char name[64];
+	void *map;
+	int fd;
+
+	hal_stats_shm_name (name, sizeof (name), uid);
+	fd = shm_open (name, O_RDONLY, 0);
+	if (fd < 0) {
+		if (verbose)
+			fprintf (stderr, "no libhal statistics (%s): %s\n", name, strerror (errno));
+		return 0;
+	}
+	if (fstat (fd, &st) != 0 || (size_t) st.st_size < sizeof (HalStatsShmHeader)) {
+		if (verbose)
+			fprintf (stderr, "%s: not a libhal statistics segment\n", name);
+		close (fd);
+		return 0;
+	}
+	/* its processes could have been handed forged counters */
+	if (st.st_uid != uid || (st.st_mode & 077) != 0) {
+		if (verbose)
+			fprintf (stderr, "%s: not private to uid %u\n", name, (unsigned int) uid);
+		close (fd);
+		return 0;
+	}
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED) {
+		if (verbose)
+			perror (name);
+		return 0;
+	}
+
+	h = map;
+	if (h->magic != HAL_STATS_SHM_MAGIC || h->version != HAL_STATS_SHM_VERSION ||
+	    h->slot_size < sizeof (HalStatsShmSlot) || h->num_functions > HAL_STATS_SHM_FUNCTIONS ||
+	    h->header_size + (size_t) h->num_slots * h->slot_size > (size_t) st.st_size) {
+		if (verbose)
+			fprintf (stderr, "%s: not a libhal statistics segment\n", name);
+		munmap (map, st.st_size);
+		return 0;
+	}
+
+	s = realloc (segments, (num_segments + 1) * sizeof (Segment));
+	if (s == NULL)
+		goto oom;
+	segments = s;
+	p = realloc (processes, (num_slots + h->num_slots) * sizeof (Process));
+	if (p == NULL)
+		goto oom;
+	processes = p;
+	p = realloc (previous, (num_slots + h->num_slots) * sizeof (Process));
+	if (p == NULL)
+		goto oom;
+	previous = p;
+
+	segments[num_segments].uid = uid;
+	segments[num_segments].header = h;
+	num_segments++;
+	num_slots += h->num_slots;
+	if (h->num_functions > num_functions)
+		num_functions = h->num_functions;
+	return 1;
+
+oom:
+	fprintf (stderr, "out of memory\n");
+	exit (1);
+}
+
+/* Map the segments not mapped yet, of every user or only @uid if it is not -1 */
+static void
+open_segments (long uid, int verbose)
+{
+	struct dirent *entry;
+	unsigned long n;
+	unsigned int i;
+	char *end;
+	DIR *dir;
+	size_t len = strlen (HAL_STATS_SHM_PREFIX) - 1;
+
+	if (uid >= 0) {
+		if (num_segments == 0)
+			open_segment ((uid_t) uid, verbose);
+		return;
+	}
+
+	dir = opendir (SHM_DIR);
+	if (dir == NULL) {
+		if (verbose)
+			perror (SHM_DIR);
+		return;
+	}
+	while ((entry = readdir (dir)) != NULL) {
+		/* the names of the segments, without the leading / */
+		if (strncmp (entry->d_name, HAL_STATS_SHM_PREFIX + 1, len) != 0)
+			continue;
+		errno = 0;
+		n = strtoul (entry->d_name + len, &end, 10);
+		if (entry->d_name[len] == '\0' || *end != '\0' || errno != 0 || n != (uid_t) n)
+			continue;
+		for (i = 0; i < num_segments && segments[i].uid != n; i++)
+			;
+		/* others' segments are only readable by root */
+		if (i == num_segments && faccessat (dirfd (dir), entry->d_name, R_OK, AT_EACCESS) == 0)
+			open_segment ((uid_t) n, verbose);
+	}
+	closedir (dir);
+}
+
+static void
+snapshot (void)
+{
+	const HalStatsShmHeader *header;
+	const HalStatsShmSlot *slot;
+	Process *p;
+	uint32_t pid;
+	unsigned int s;
+	unsigned int i;
+	unsigned int f;
+
+	for (f = 0; f < num_functions; f++) {
+		fn_now[f].function = f;
+		memset (&fn_now[f].total, 0, sizeof (Counters));
+	}
+
+	num_processes = 0;
+	for (s = 0; s < num_segments; s++) {
+		header = segments[s].header;
+		for (i = 0; i < header->num_slots; i++) {
+			slot = hal_stats_shm_slot (header, i);
+			pid = __atomic_load_n (&slot->pid, __ATOMIC_ACQUIRE);
+			if (pid == 0 || (kill (pid, 0) != 0 && errno == ESRCH))
+				continue;
+
+			p = &processes[num_processes++];
+			memset (p, 0, sizeof (Process));
+			p->pid = pid;
+			p->uid = segments[s].uid;
+			p->start_time = slot->start_time;
+			memcpy (p->comm, slot->comm, sizeof (slot->comm));
+			p->comm[sizeof (slot->comm)] = '\0';
+			for (f = 0; f < header->num_functions; f++) {
+				add_counters (&p->total, &slot->counters[f]);
+				add_counters (&fn_now[f].total, &slot->counters[f]);
+			}
+		}
+	}
+}
+
+static void
+compute_rates (void)
+{
+	Counters zero;
+	unsigned int i;
+	unsigned int j;
+
+	memset (&zero, 0, sizeof (zero));
+
+	for (i = 0; i < num_processes; i++) {
+		const Counters *before = &zero;
+
+		for (j = 0; j < num_previous; j++) {
+			if (previous[j].pid == processes[i].pid &&
+			    previous[j].start_time == processes[i].start_time) {
+				before = &previous[j].total;
+				break;
+			}
+		}
+		sub_counters (&processes[i].rate, &processes[i].total, before);
+	}
+
+	/* processes that went away take their counts with them */
+	for (i = 0; i < num_functions; i++) {
+		if (fn_now[i].total.calls < fn_before[i].total.calls)
+			memset (&fn_now[i].rate, 0, sizeof (Counters));
+		else
+			sub_counters (&fn_now[i].rate, &fn_now[i].total, &fn_before[i].total);
+	}
+}
+
+static int
+compare_processes (const void *a, const void *b)
+{
+	const Process *pa = a;
+	const Process *pb = b;
+
+	if (pa->rate.calls != pb->rate.calls)
+		return pa->rate.calls > pb->rate.calls ? -1 : 1;
+	if (pa->total.calls != pb->total.calls)
+		return pa->total.calls > pb->total.calls ? -1 : 1;
+	return (int) pa->pid - (int) pb->pid;
+}
+
+static int
+compare_functions (const void *a, const void *b)
+{
+	const Function *fa = a;
+	const Function *fb = b;
+
+	if (fa->rate.calls != fb->rate.calls)
+		return fa->rate.calls > fb->rate.calls ? -1 : 1;
+	if (fa->total.calls != fb->total.calls)
+		return fa->total.calls > fb->total.calls ? -1 : 1;
+	return (int) fa->function - (int) fb->function;
+}
+
+/* "-" unless the calls were timed (stats_timing = yes) */
+static const char *
+average_ns (const Counters *c, char *buf, size_t len)
+{
+	if (c->calls == 0 || c->total_ns == 0)
+		return "-";
+	snprintf (buf, len, "%.0f", (double) c->total_ns / c->calls);
+	return buf;
+}
+
+static void
+show (double seconds, int batch)
+{
+	Function *sorted;
+	char buf[32];
+	char avg[32];
+	unsigned int i;
+
+	if (!batch)
+		fputs ("\033[H\033[2J", stdout);
+
+	qsort (processes, num_processes, sizeof (Process), compare_processes);
+	printf ("%u processes using libhal, in %u segment%s\n\n", num_processes, num_segments,
+		num_segments != 1 ? "s" : "");
+	printf ("%7s %6s %-16s %10s %12s %10s %10s\n",
+		"PID", "UID", "COMMAND", "CALLS/S", "CALLS", "ERRORS", "AVG_NS");
+	for (i = 0; i < num_processes && i < MAX_ROWS; i++) {
+		const Process *p = &processes[i];
+
+		printf ("%7u %6u %-16s %10.0f %12llu %10llu %10s\n",
+			p->pid, p->uid, p->comm, p->rate.calls / seconds,
+			(unsigned long long) p->total.calls,
+			(unsigned long long) p->total.errors,
+			average_ns (p->rate.calls ? &p->rate : &p->total, avg, sizeof (avg)));
+	}
+
+	sorted = malloc (num_functions * sizeof (Function));
+	if (sorted == NULL)
+		return;
+	memcpy (sorted, fn_now, num_functions * sizeof (Function));
+	qsort (sorted, num_functions, sizeof (Function), compare_functions);
+
+	printf ("\n%-48s %10s %12s %10s %10s\n",
+		"FUNCTION", "CALLS/S", "CALLS", "ERRORS", "AVG_NS");
+	for (i = 0; i < num_functions && i < MAX_ROWS && sorted[i].total.calls > 0; i++) {
+		const Function *f = &sorted[i];
+
+		printf ("%-48s %10.0f %12llu %10llu %10s\n",
+			function_name (f->function, buf, sizeof (buf)),
+			f->rate.calls / seconds,
+			(unsigned long long) f->total.calls,
+			(unsigned long long) f->total.errors,
+			average_ns (f->rate.calls ? &f->rate : &f->total, avg, sizeof (avg)));
+	}
+	free (sorted);
+
+	if (batch)
+		putchar ('\n');
+	fflush (stdout);
+}
+
+int
+main (int argc, char *argv[])
+{
+	double delay = 2.0;
+	long count = 0;
+	long uid = -1;
+	long n;
+	int batch = 0;
+	int opt;
+
+	while ((opt = getopt (argc, argv, "bd:n:u:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			batch = 1;
+			break;
+		case 'd':
+			delay = atof (optarg);
+			if (delay <= 0)
+				delay = 2.0;
+			break;
+		case 'n':
+			count = atol (optarg);
+			break;
+		case 'u':
+			uid = atol (optarg);
+			break;
+		default:
+			fprintf (stderr, "usage: %s [-b] [-d SECONDS] [-n COUNT] [-u UID]\n", argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	fn_now = calloc (HAL_STATS_SHM_FUNCTIONS, sizeof (Function));
+	fn_before = calloc (HAL_STATS_SHM_FUNCTIONS, sizeof (Function));
+	if (fn_now == NULL || fn_before == NULL) {
+		fprintf (stderr, "out of memory\n");
+		return 1;
+	}
+
+	open_segments (uid, 1);
+	if (num_segments == 0) {
+		if (uid < 0)
+			fprintf (stderr, "no libhal statistics in " SHM_DIR "\n");
+		return 1;
+	}
+
+	snapshot ();
+	for (n = 0; count == 0 || n < count; n++) {
+		Process *swap_p;
+		Function *swap_f;
+
+		swap_p = previous;
+		previous = processes;
+		processes = swap_p;
+		num_previous = num_processes;
+		swap_f = fn_before;
+		fn_before = fn_now;
+		fn_now = swap_f;
+
+		usleep ((useconds_t) (delay * 1000000));
+		/* users who started using libhal since */
+		open_segments (uid, 0);
+		snapshot ();
+		compute_rates ();
+		show (delay, batch);
+	}
+
+	return 0;
+}
@@ -0,0 +1,149 @@
+/***************************************************************************
+ *
+ * hal-log-dump.c : print the records of a libhal log ring
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libhal-log-ring.h"
+
+/*
+ * Usage: hal-log-dump [RING]
+ *
+ * Prints the records still held in RING (/tmp/libhal.ring by
+ * default), oldest first, in the format of /tmp/libhal.log.  The
+ * ring may belong to processes that are still running or that
+ * crashed; records that were being written at the time are skipped.
+ */
+
+static const HalLogRingHeader *header;
+static const char *data;
+static uint64_t mask;
+
+static uint64_t
+load_u64 (uint64_t pos)
+{
+	return __atomic_load_n ((const uint64_t *) (data + (pos & mask)), __ATOMIC_ACQUIRE);
+}
+
+static void
+copy_out (char *dest, uint64_t pos, size_t len)
+{
+	size_t offset = pos & mask;
+	size_t first = mask + 1 - offset;
+
+	if (first >= len) {
+		memcpy (dest, data + offset, len);
+	} else {
+		memcpy (dest, data + offset, first);
+		memcpy (dest + first, data, len - first);
+	}
+}
+
+int
+main (int argc, char *argv[])
+{
+	const char *path = HAL_LOG_RING_FILE;
+	struct stat st;
+	void *map;
+	char *text;
+	uint64_t cursor;
+	uint64_t pos;
+	uint64_t size;
+	uint32_t length;
+	int fd;
+
+	if (argc > 2 || (argc == 2 && (strcmp (argv[1], "-h") == 0 || strcmp (argv[1], "--help") == 0))) {
+		fprintf (stderr, "usage: %s [RING]\n", argv[0]);
+		return argc == 2 ? 0 : 1;
+	}
+	if (argc == 2)
+		path = argv[1];
+
+	fd = open (path, O_RDONLY);
+	if (fd < 0) {
+		perror (path);
+		return 1;
+	}
+	if (fstat (fd, &st) != 0 || (size_t) st.st_size < sizeof (HalLogRingHeader)) {
+		fprintf (stderr, "%s: not a libhal log ring\n", path);
+		return 1;
+	}
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED) {
+		perror (path);
+		return 1;
+	}
+
+	header = map;
+	if (header->magic != HAL_LOG_RING_MAGIC || header->version != HAL_LOG_RING_VERSION ||
+	    header->header_size < sizeof (HalLogRingHeader) ||
+	    header->data_size < HAL_LOG_RING_MIN_SIZE ||
+	    (header->data_size & (header->data_size - 1)) != 0 ||
+	    header->header_size + header->data_size > (uint64_t) st.st_size) {
+		fprintf (stderr, "%s: not a libhal log ring\n", path);
+		return 1;
+	}
+	data = (const char *) map + header->header_size;
+	mask = header->data_size - 1;
+
+	text = malloc (header->data_size / 4);
+	if (text == NULL) {
+		fprintf (stderr, "out of memory\n");
+		return 1;
+	}
+
+	cursor = __atomic_load_n (&header->cursor, __ATOMIC_ACQUIRE);
+	pos = cursor > header->data_size ? cursor - header->data_size : 0;
+
+	while (pos < cursor) {
+		if (load_u64 (pos) != pos) {
+			/* overwritten or unfinished, look for the next record */
+			pos += HAL_LOG_RING_ALIGN;
+			continue;
+		}
+
+		length = *(const uint32_t *) (data + ((pos + 8) & mask));
+		size = hal_log_ring_record_size (length);
+		if (length > header->data_size / 4 || pos + size > cursor) {
+			pos += HAL_LOG_RING_ALIGN;
+			continue;
+		}
+		copy_out (text, pos + sizeof (HalLogRingRecord), length);
+
+		/* a live writer may have lapped us while we copied */
+		if (__atomic_load_n (&header->cursor, __ATOMIC_ACQUIRE) <= pos + header->data_size)
+			fwrite (text, 1, length, stdout);
+		pos += size;
+	}
+
+	free (text);
+	return 0;
+}
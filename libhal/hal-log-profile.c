@@ -0,0 +1,697 @@
+/***************************************************************************
+ *
+ * hal-log-profile.c : summarise libhal call logs
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libhal-trace.h"
+
+/*
+ * Usage: hal-log-profile [-j THREADS] [-n TOP] [-g BURST_GAP_US] [-m BURST_CALLS] LOG...
+ *
+ * Reads logs in the format hal_logger writes to /tmp/libhal.log,
+ *
+ *   <sec>.<usec> <function> <args>
+ *
+ * and prints, per function, the number of calls, calls per second
+ * and the gaps between consecutive calls; the most frequent udi/key
+ * pairs; and the bursts, runs of at least BURST_CALLS (100) calls
+ * less than BURST_GAP_US (1000) microseconds apart.
+ *
+ * Each log is mapped and cut into one chunk per thread at line
+ * boundaries; the chunks are parsed in parallel, in place, and the
+ * results merged in order.
+ */
+
+#define GAP_BUCKETS     40              /* log2 histogram of gaps in usec */
+#define NAME_SLOTS      512             /* power of two, > HAL_FN_LAST */
+#define PAIR_INITIAL    4096
+
+static const HalFunctionInfo functions[HAL_FN_LAST] = {
+#define HAL_FUNCTION(_name_, _args_, _level_) HAL_FUNCTION_INFO (_name_, _args_, _level_)
+#include "libhal-functions.h"
+#undef HAL_FUNCTION
+};
+
+/* the function id that counts lines naming no known function */
+#define FN_OTHER HAL_FN_LAST
+#define NUM_FN   (HAL_FN_LAST + 1)
+
+typedef struct {
+	uint64_t calls;
+	uint64_t first_us;
+	uint64_t last_us;
+	uint64_t gaps;                  /**< number of gaps measured */
+	uint64_t gap_total_us;
+	uint64_t gap_max_us;
+	uint64_t gap_histogram[GAP_BUCKETS];
+} FunctionStats;
+
+typedef struct {
+	uint64_t hash;
+	const char *udi;
+	const char *key;
+	uint32_t udi_len;
+	uint32_t key_len;
+	uint64_t count;
+} Pair;
+
+typedef struct {
+	Pair *slots;
+	size_t size;                    /**< power of two */
+	size_t used;
+} PairTable;
+
+typedef struct {
+	uint64_t start_us;
+	uint64_t end_us;
+	uint64_t calls;
+} Burst;
+
+typedef struct {
+	Burst *items;
+	size_t len;
+	size_t max;
+} BurstList;
+
+typedef struct {
+	const char *start;
+	const char *end;
+
+	uint64_t lines;
+	uint64_t malformed;
+	uint64_t first_us;
+	uint64_t last_us;
+	FunctionStats fn[NUM_FN];
+	PairTable pairs;
+
+	/* bursts[0] is the run the chunk starts with and the last one the
+	 * run it ends with, whatever their length, so runs can be joined
+	 * across chunk boundaries */
+	BurstList bursts;
+} Chunk;
+
+static int num_threads;
+static unsigned int top_n = 20;
+static uint64_t burst_gap_us = 1000;
+static uint64_t burst_min_calls = 100;
+
+static int16_t name_table[NAME_SLOTS];
+
+static uint64_t
+hash_bytes (const char *s, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char) s[i]) * 1099511628211ULL;
+	return h;
+}
+
+static void
+build_name_table (void)
+{
+	unsigned int i;
+	unsigned int slot;
+
+	memset (name_table, 0xff, sizeof (name_table));
+	for (i = 0; i < HAL_FN_LAST; i++) {
+		slot = hash_bytes (functions[i].name, strlen (functions[i].name)) & (NAME_SLOTS - 1);
+		while (name_table[slot] >= 0)
+			slot = (slot + 1) & (NAME_SLOTS - 1);
+		name_table[slot] = i;
+	}
+}
+
+static unsigned int
+lookup_function (const char *name, size_t len)
+{
+	unsigned int slot;
+	int fn;
+
+	slot = hash_bytes (name, len) & (NAME_SLOTS - 1);
+	while ((fn = name_table[slot]) >= 0) {
+		if (strncmp (functions[fn].name, name, len) == 0 && functions[fn].name[len] == '\0')
+			return fn;
+		slot = (slot + 1) & (NAME_SLOTS - 1);
+	}
+	return FN_OTHER;
+}
+
+static void *
+xrealloc (void *p, size_t size)
+{
+	p = realloc (p, size);
+	if (p == NULL) {
+		fprintf (stderr, "out of memory\n");
+		exit (1);
+	}
+	return p;
+}
+
+static void
+pair_table_grow (PairTable *t)
+{
+	Pair *old = t->slots;
+	size_t old_size = t->size;
+	size_t i;
+	size_t slot;
+
+	t->size = old_size ? old_size * 2 : PAIR_INITIAL;
+	t->slots = xrealloc (NULL, t->size * sizeof (Pair));
+	memset (t->slots, 0, t->size * sizeof (Pair));
+	for (i = 0; i < old_size; i++) {
+		if (old[i].count == 0)
+			continue;
+		slot = old[i].hash & (t->size - 1);
+		while (t->slots[slot].count != 0)
+			slot = (slot + 1) & (t->size - 1);
+		t->slots[slot] = old[i];
+	}
+	free (old);
+}
+
+static void
+pair_table_add (PairTable *t, const char *udi, size_t udi_len,
+		const char *key, size_t key_len, uint64_t count)
+{
+	Pair *p;
+	uint64_t hash;
+	size_t slot;
+
+	if (t->used * 2 >= t->size)
+		pair_table_grow (t);
+
+	hash = hash_bytes (udi, udi_len) * 31 + hash_bytes (key, key_len);
+	slot = hash & (t->size - 1);
+	for (;;) {
+		p = &t->slots[slot];
+		if (p->count == 0)
+			break;
+		if (p->hash == hash && p->udi_len == udi_len && p->key_len == key_len &&
+		    memcmp (p->udi, udi, udi_len) == 0 && memcmp (p->key, key, key_len) == 0) {
+			p->count += count;
+			return;
+		}
+		slot = (slot + 1) & (t->size - 1);
+	}
+
+	p->hash = hash;
+	p->udi = udi;
+	p->udi_len = udi_len;
+	p->key = key;
+	p->key_len = key_len;
+	p->count = count;
+	t->used++;
+}
+
+static void
+burst_list_add (BurstList *l, const Burst *b)
+{
+	if (l->len == l->max) {
+		l->max = l->max ? l->max * 2 : 64;
+		l->items = xrealloc (l->items, l->max * sizeof (Burst));
+	}
+	l->items[l->len++] = *b;
+}
+
+static void
+add_gap (FunctionStats *f, uint64_t gap)
+{
+	int bucket;
+
+	bucket = gap == 0 ? 0 : 64 - __builtin_clzll (gap);
+	if (bucket >= GAP_BUCKETS)
+		bucket = GAP_BUCKETS - 1;
+	f->gaps++;
+	f->gap_total_us += gap;
+	if (gap > f->gap_max_us)
+		f->gap_max_us = gap;
+	f->gap_histogram[bucket]++;
+}
+
+/* Parse an unsigned decimal number, returning the first byte after it */
+static const char *
+parse_number (const char *p, const char *end, uint64_t *value)
+{
+	const char *start = p;
+	uint64_t n = 0;
+
+	while (p < end && *p >= '0' && *p <= '9')
+		n = n * 10 + (*p++ - '0');
+	*value = n;
+	return p == start ? NULL : p;
+}
+
+static void *
+parse_chunk (void *data)
+{
+	Chunk *c = data;
+	const char *p = c->start;
+	const char *end = c->end;
+	const char *line_end;
+	const char *name;
+	const char *udi;
+	const char *key;
+	const char *q;
+	FunctionStats *f;
+	Burst run;
+	uint64_t sec;
+	uint64_t usec;
+	uint64_t ts;
+	uint64_t prev_ts = 0;
+	unsigned int fn;
+	int first = 1;
+
+	memset (&run, 0, sizeof (run));
+
+	for (; p < end; p = line_end + 1) {
+		line_end = memchr (p, '\n', end - p);
+		if (line_end == NULL)
+			line_end = end;
+		c->lines++;
+
+		q = parse_number (p, line_end, &sec);
+		if (q == NULL || q >= line_end || *q != '.')
+			goto malformed;
+		q = parse_number (q + 1, line_end, &usec);
+		if (q == NULL || q >= line_end || *q != ' ')
+			goto malformed;
+		ts = sec * 1000000 + usec;
+
+		name = q + 1;
+		for (q = name; q < line_end && *q != ' '; q++)
+			;
+		if (q == name)
+			goto malformed;
+		fn = lookup_function (name, q - name);
+
+		/* udi/key pairs */
+		if (fn != FN_OTHER && strcmp (functions[fn].args, "ss") == 0 && q < line_end) {
+			udi = q + 1;
+			for (key = udi; key < line_end && *key != ' '; key++)
+				;
+			if (key < line_end)
+				pair_table_add (&c->pairs, udi, key - udi, key + 1, line_end - key - 1, 1);
+		}
+
+		f = &c->fn[fn];
+		if (f->calls == 0)
+			f->first_us = ts;
+		else
+			add_gap (f, ts > f->last_us ? ts - f->last_us : 0);
+		f->last_us = ts;
+		f->calls++;
+
+		/* Lines from different threads and processes are only
+		 * roughly ordered, treat going backwards as no gap. */
+		if (first) {
+			c->first_us = ts;
+			run.start_us = ts;
+			first = 0;
+		} else if (ts > prev_ts + burst_gap_us) {
+			if (c->bursts.len == 0 || run.calls >= burst_min_calls)
+				burst_list_add (&c->bursts, &run);
+			run.start_us = ts;
+			run.calls = 0;
+		}
+		run.end_us = ts > run.end_us ? ts : run.end_us;
+		run.calls++;
+		prev_ts = ts > prev_ts ? ts : prev_ts;
+		c->last_us = prev_ts;
+		continue;
+
+	malformed:
+		c->malformed++;
+	}
+
+	if (run.calls > 0)
+		burst_list_add (&c->bursts, &run);
+
+	return NULL;
+}
+
+/* State merged across chunks and files, in log order */
+static FunctionStats total_fn[NUM_FN];
+static PairTable total_pairs;
+static BurstList total_bursts;
+static Burst open_run;
+static uint64_t total_lines;
+static uint64_t total_malformed;
+static uint64_t total_first_us;
+static uint64_t total_last_us;
+static int have_calls = 0;
+
+static void
+close_run (void)
+{
+	if (open_run.calls >= burst_min_calls)
+		burst_list_add (&total_bursts, &open_run);
+	open_run.calls = 0;
+}
+
+static void
+merge_chunk (const Chunk *c)
+{
+	const FunctionStats *f;
+	FunctionStats *t;
+	size_t i;
+	int b;
+
+	total_lines += c->lines;
+	total_malformed += c->malformed;
+
+	for (i = 0; i < NUM_FN; i++) {
+		f = &c->fn[i];
+		t = &total_fn[i];
+		if (f->calls == 0)
+			continue;
+		if (t->calls == 0) {
+			t->first_us = f->first_us;
+		} else {
+			/* the gap across the chunk boundary */
+			add_gap (t, f->first_us > t->last_us ? f->first_us - t->last_us : 0);
+		}
+		t->last_us = f->last_us;
+		t->calls += f->calls;
+		t->gaps += f->gaps;
+		t->gap_total_us += f->gap_total_us;
+		if (f->gap_max_us > t->gap_max_us)
+			t->gap_max_us = f->gap_max_us;
+		for (b = 0; b < GAP_BUCKETS; b++)
+			t->gap_histogram[b] += f->gap_histogram[b];
+	}
+
+	for (i = 0; i < c->pairs.size; i++) {
+		const Pair *p = &c->pairs.slots[i];
+
+		if (p->count > 0)
+			pair_table_add (&total_pairs, p->udi, p->udi_len, p->key, p->key_len, p->count);
+	}
+
+	if (c->bursts.len == 0)
+		return;
+
+	if (!have_calls) {
+		total_first_us = c->first_us;
+		have_calls = 1;
+	}
+	if (c->last_us > total_last_us)
+		total_last_us = c->last_us;
+
+	for (i = 0; i < c->bursts.len; i++) {
+		const Burst *b = &c->bursts.items[i];
+
+		if (open_run.calls > 0 && b->start_us <= open_run.end_us + burst_gap_us) {
+			/* continues the run the previous chunk ended with */
+			if (b->end_us > open_run.end_us)
+				open_run.end_us = b->end_us;
+			open_run.calls += b->calls;
+		} else {
+			close_run ();
+			open_run = *b;
+		}
+	}
+}
+
+static int
+profile_file (const char *path)
+{
+	struct stat st;
+	pthread_t *threads;
+	int *started;
+	Chunk *chunks;
+	const char *data;
+	const char *p;
+	size_t size;
+	int fd;
+	int i;
+
+	fd = open (path, O_RDONLY);
+	if (fd < 0) {
+		perror (path);
+		return -1;
+	}
+	if (fstat (fd, &st) != 0) {
+		perror (path);
+		close (fd);
+		return -1;
+	}
+	size = st.st_size;
+	if (size == 0) {
+		close (fd);
+		return 0;
+	}
+	data = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (data == MAP_FAILED) {
+		perror (path);
+		return -1;
+	}
+	madvise ((void *) data, size, MADV_SEQUENTIAL | MADV_WILLNEED);
+
+	chunks = xrealloc (NULL, num_threads * sizeof (Chunk));
+	threads = xrealloc (NULL, num_threads * sizeof (pthread_t));
+	started = xrealloc (NULL, num_threads * sizeof (int));
+	memset (chunks, 0, num_threads * sizeof (Chunk));
+
+	/* cut at line boundaries */
+	p = data;
+	for (i = 0; i < num_threads; i++) {
+		const char *end = data + size * (i + 1) / num_threads;
+
+		if (end < p)
+			end = p;
+		if (i < num_threads - 1 && end < data + size) {
+			const char *nl = memchr (end, '\n', data + size - end);
+			end = nl != NULL ? nl + 1 : data + size;
+		} else {
+			end = data + size;
+		}
+		chunks[i].start = p;
+		chunks[i].end = end;
+		p = end;
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		started[i] = pthread_create (&threads[i], NULL, parse_chunk, &chunks[i]) == 0;
+		if (!started[i])
+			parse_chunk (&chunks[i]);
+	}
+	for (i = 0; i < num_threads; i++) {
+		if (started[i])
+			pthread_join (threads[i], NULL);
+	}
+
+	/* the pairs point into the log, so it stays mapped */
+	for (i = 0; i < num_threads; i++) {
+		merge_chunk (&chunks[i]);
+		free (chunks[i].pairs.slots);
+		free (chunks[i].bursts.items);
+	}
+
+	free (chunks);
+	free (threads);
+	free (started);
+	return 0;
+}
+
+static uint64_t
+gap_percentile (const FunctionStats *f, double fraction)
+{
+	uint64_t want = (uint64_t) (f->gaps * fraction);
+	uint64_t seen = 0;
+	int b;
+
+	for (b = 0; b < GAP_BUCKETS; b++) {
+		seen += f->gap_histogram[b];
+		if (seen > want) {
+			/* the top of the bucket, but no more than was seen */
+			if (b == 0)
+				return 0;
+			return (1ULL << b) - 1 < f->gap_max_us ? (1ULL << b) - 1 : f->gap_max_us;
+		}
+	}
+	return f->gap_max_us;
+}
+
+static int
+compare_functions (const void *a, const void *b)
+{
+	const FunctionStats *fa = &total_fn[*(const unsigned int *) a];
+	const FunctionStats *fb = &total_fn[*(const unsigned int *) b];
+
+	if (fa->calls != fb->calls)
+		return fa->calls > fb->calls ? -1 : 1;
+	return 0;
+}
+
+static int
+compare_pairs (const void *a, const void *b)
+{
+	const Pair *pa = a;
+	const Pair *pb = b;
+
+	if (pa->count != pb->count)
+		return pa->count > pb->count ? -1 : 1;
+	return 0;
+}
+
+static int
+compare_bursts (const void *a, const void *b)
+{
+	const Burst *ba = a;
+	const Burst *bb = b;
+
+	if (ba->calls != bb->calls)
+		return ba->calls > bb->calls ? -1 : 1;
+	return ba->start_us < bb->start_us ? -1 : ba->start_us > bb->start_us;
+}
+
+static void
+report (void)
+{
+	unsigned int order[NUM_FN];
+	double span;
+	size_t n;
+	size_t i;
+
+	span = have_calls && total_last_us > total_first_us ?
+		(total_last_us - total_first_us) / 1e6 : 0.0;
+
+	printf ("%llu lines, %llu malformed, %.3f seconds\n\n",
+		(unsigned long long) total_lines, (unsigned long long) total_malformed, span);
+
+	for (i = 0; i < NUM_FN; i++)
+		order[i] = i;
+	qsort (order, NUM_FN, sizeof (unsigned int), compare_functions);
+
+	printf ("%-48s %12s %10s %12s %10s %10s %12s\n", "FUNCTION", "CALLS", "CALLS/S",
+		"GAP_MEAN_US", "GAP_P50", "GAP_P99", "GAP_MAX");
+	for (i = 0; i < NUM_FN && total_fn[order[i]].calls > 0; i++) {
+		const FunctionStats *f = &total_fn[order[i]];
+
+		printf ("%-48s %12llu %10.1f %12.1f %10llu %10llu %12llu\n",
+			order[i] == FN_OTHER ? "(other)" : functions[order[i]].name,
+			(unsigned long long) f->calls,
+			span > 0 ? f->calls / span : 0.0,
+			f->gaps ? (double) f->gap_total_us / f->gaps : 0.0,
+			(unsigned long long) gap_percentile (f, 0.50),
+			(unsigned long long) gap_percentile (f, 0.99),
+			(unsigned long long) f->gap_max_us);
+	}
+
+	/* compact the pair table and sort it */
+	for (i = 0, n = 0; i < total_pairs.size; i++) {
+		if (total_pairs.slots[i].count > 0)
+			total_pairs.slots[n++] = total_pairs.slots[i];
+	}
+	qsort (total_pairs.slots, n, sizeof (Pair), compare_pairs);
+
+	printf ("\n%llu distinct udi/key pairs, hottest:\n", (unsigned long long) n);
+	for (i = 0; i < n && i < top_n; i++) {
+		const Pair *p = &total_pairs.slots[i];
+
+		printf ("%12llu %.*s %.*s\n", (unsigned long long) p->count,
+			(int) p->udi_len, p->udi, (int) p->key_len, p->key);
+	}
+
+	close_run ();
+	qsort (total_bursts.items, total_bursts.len, sizeof (Burst), compare_bursts);
+
+	printf ("\n%llu bursts of %llu or more calls less than %llu us apart, largest:\n",
+		(unsigned long long) total_bursts.len, (unsigned long long) burst_min_calls,
+		(unsigned long long) burst_gap_us);
+	if (total_bursts.len > 0)
+		printf ("%17s %12s %12s %12s\n", "START", "DURATION_MS", "CALLS", "CALLS/S");
+	for (i = 0; i < total_bursts.len && i < top_n; i++) {
+		const Burst *b = &total_bursts.items[i];
+		uint64_t duration = b->end_us - b->start_us;
+
+		printf ("%10llu.%06llu %12.3f %12llu %12.0f\n",
+			(unsigned long long) (b->start_us / 1000000),
+			(unsigned long long) (b->start_us % 1000000),
+			duration / 1e3, (unsigned long long) b->calls,
+			duration > 0 ? b->calls / (duration / 1e6) : 0.0);
+	}
+}
+
+static void
+usage (const char *argv0)
+{
+	fprintf (stderr, "usage: %s [-j THREADS] [-n TOP] [-g BURST_GAP_US] [-m BURST_CALLS] LOG...\n",
+		 argv0);
+}
+
+int
+main (int argc, char *argv[])
+{
+	int opt;
+	int i;
+
+	num_threads = sysconf (_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt (argc, argv, "j:n:g:m:h")) != -1) {
+		switch (opt) {
+		case 'j':
+			num_threads = atoi (optarg);
+			break;
+		case 'n':
+			top_n = atoi (optarg);
+			break;
+		case 'g':
+			burst_gap_us = strtoull (optarg, NULL, 10);
+			break;
+		case 'm':
+			burst_min_calls = strtoull (optarg, NULL, 10);
+			break;
+		default:
+			usage (argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind >= argc) {
+		usage (argv[0]);
+		return 1;
+	}
+	if (num_threads < 1)
+		num_threads = 1;
+	if (burst_min_calls < 1)
+		burst_min_calls = 1;
+
+	build_name_table ();
+
+	for (i = optind; i < argc; i++)
+		profile_file (argv[i]);
+
+	report ();
+	return 0;
+}
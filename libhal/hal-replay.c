@@ -0,0 +1,602 @@
+/***************************************************************************
+ *
+ * hal-replay.c : replay a libhal call log as a load test
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <dbus/dbus.h>
+
+#include "libhal.h"
+#include "libhal-trace.h"
+
+/*
+ * Usage: hal-replay [-t THREADS] [-x SPEED] [-l LOOPS] [-q] LOG
+ *
+ * Reads a log in the format hal_logger writes to /tmp/libhal.log and
+ * makes the same calls again, each of THREADS threads (1 by default)
+ * replaying the whole log LOOPS times with a context of its own.
+ * With -x the calls keep the timing of the log, sped up SPEED times;
+ * by default they are made as fast as possible.  -q turns tracing of
+ * the replayed calls off.
+ *
+ * Calls whose udi and key are not in the log use the last ones seen.
+ * Calls that cannot be rebuilt from a log line, such as those taking
+ * property sets, iterators or callbacks, are skipped.
+ *
+ * Reports throughput and the latency distribution, overall and per
+ * function.
+ */
+
+#define DEFAULT_UDI   "/org/freedesktop/Hal/devices/computer"
+#define DEFAULT_KEY   "info.product"
+#define CAPABILITY    "volume"
+
+/* latency histogram: 16 linear sub-buckets per power of two */
+#define SUB_BITS      4
+#define NUM_BUCKETS   ((64 - SUB_BITS + 1) << SUB_BITS)
+
+static const HalFunctionInfo functions[HAL_FN_LAST] = {
+#define HAL_FUNCTION(_name_, _args_, _level_) HAL_FUNCTION_INFO (_name_, _args_, _level_)
+#include "libhal-functions.h"
+#undef HAL_FUNCTION
+};
+
+/*
+ * The calls that can be replayed.  @s0 and @s1 are the two string
+ * arguments of the log line, or the udi and key last seen.
+ */
+#define REPLAY_CALLS \
+	REPLAY (libhal_get_all_devices, \
+		libhal_free_string_array (libhal_get_all_devices (ctx, &n, NULL))) \
+	REPLAY (libhal_device_get_all_properties, \
+		free_property_set (libhal_device_get_all_properties (ctx, s0, NULL))) \
+	REPLAY (libhal_get_all_devices_with_properties, \
+		get_all_devices_with_properties (ctx)) \
+	REPLAY (libhal_device_get_property_type, \
+		libhal_device_get_property_type (ctx, s0, s1, NULL)) \
+	REPLAY (libhal_device_get_property_strlist, \
+		libhal_free_string_array (libhal_device_get_property_strlist (ctx, s0, s1, NULL))) \
+	REPLAY (libhal_device_get_property_string, \
+		libhal_free_string (libhal_device_get_property_string (ctx, s0, s1, NULL))) \
+	REPLAY (libhal_device_get_property_int, \
+		libhal_device_get_property_int (ctx, s0, s1, NULL)) \
+	REPLAY (libhal_device_get_property_uint64, \
+		libhal_device_get_property_uint64 (ctx, s0, s1, NULL)) \
+	REPLAY (libhal_device_get_property_double, \
+		libhal_device_get_property_double (ctx, s0, s1, NULL)) \
+	REPLAY (libhal_device_get_property_bool, \
+		libhal_device_get_property_bool (ctx, s0, s1, NULL)) \
+	REPLAY (libhal_device_set_property_string, \
+		libhal_device_set_property_string (ctx, s0, s1, "hal-replay", NULL)) \
+	REPLAY (libhal_device_set_property_int, \
+		libhal_device_set_property_int (ctx, s0, s1, 1, NULL)) \
+	REPLAY (libhal_device_set_property_uint64, \
+		libhal_device_set_property_uint64 (ctx, s0, s1, 1, NULL)) \
+	REPLAY (libhal_device_set_property_double, \
+		libhal_device_set_property_double (ctx, s0, s1, 1.0, NULL)) \
+	REPLAY (libhal_device_set_property_bool, \
+		libhal_device_set_property_bool (ctx, s0, s1, TRUE, NULL)) \
+	REPLAY (libhal_device_remove_property, \
+		libhal_device_remove_property (ctx, s0, s1, NULL)) \
+	REPLAY (libhal_device_exists, \
+		libhal_device_exists (ctx, s0, NULL)) \
+	REPLAY (libhal_device_property_exists, \
+		libhal_device_property_exists (ctx, s0, s1, NULL)) \
+	REPLAY (libhal_manager_find_device_string_match, \
+		libhal_free_string_array (libhal_manager_find_device_string_match (ctx, s0, s1, &n, NULL))) \
+	REPLAY (libhal_device_add_capability, \
+		libhal_device_add_capability (ctx, s0, CAPABILITY, NULL)) \
+	REPLAY (libhal_device_query_capability, \
+		libhal_device_query_capability (ctx, s0, CAPABILITY, NULL)) \
+	REPLAY (libhal_find_device_by_capability, \
+		libhal_free_string_array (libhal_find_device_by_capability (ctx, CAPABILITY, &n, NULL)))
+
+typedef struct {
+	uint64_t time_us;               /**< timestamp in the log */
+	uint16_t function;
+	const char *s0;
+	const char *s1;
+} Op;
+
+typedef struct {
+	pthread_t thread;
+	LibHalContext *ctx;
+	uint64_t calls;
+	uint64_t histogram[NUM_BUCKETS];
+	uint64_t *fn_calls;
+	uint64_t *fn_histogram;         /**< HAL_FN_LAST x NUM_BUCKETS */
+} Worker;
+
+static Op *ops;
+static size_t num_ops;
+static uint64_t skipped;
+static double speed = 0.0;
+static long loops = 1;
+static uint64_t start_ns;
+
+static uint64_t
+now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *
+xmalloc (size_t size)
+{
+	void *p = calloc (1, size);
+
+	if (p == NULL) {
+		fprintf (stderr, "out of memory\n");
+		exit (1);
+	}
+	return p;
+}
+
+static void
+free_property_set (LibHalPropertySet *set)
+{
+	if (set != NULL)
+		libhal_free_property_set (set);
+}
+
+static void
+get_all_devices_with_properties (LibHalContext *ctx)
+{
+	LibHalPropertySet **props;
+	char **udis;
+	int n;
+	int i;
+
+	if (!libhal_get_all_devices_with_properties (ctx, &n, &udis, &props, NULL))
+		return;
+	for (i = 0; i < n; i++)
+		free_property_set (props[i]);
+	free (props);
+	libhal_free_string_array (udis);
+}
+
+static int
+replayable (int function)
+{
+	switch (function) {
+#define REPLAY(_fn_, _call_) case HAL_FN_##_fn_:
+	REPLAY_CALLS
+#undef REPLAY
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static void
+replay (LibHalContext *ctx, const Op *op)
+{
+	const char *s0 = op->s0;
+	const char *s1 = op->s1;
+	int n;
+
+	switch (op->function) {
+#define REPLAY(_fn_, _call_) case HAL_FN_##_fn_: _call_; break;
+	REPLAY_CALLS
+#undef REPLAY
+	default:
+		break;
+	}
+	(void) n;
+}
+
+static unsigned int
+bucket (uint64_t ns)
+{
+	int e;
+
+	if (ns < (1 << SUB_BITS))
+		return ns;
+	e = 63 - __builtin_clzll (ns);
+	return ((e - SUB_BITS + 1) << SUB_BITS) + ((ns >> (e - SUB_BITS)) & ((1 << SUB_BITS) - 1));
+}
+
+/* the largest value that falls in bucket @b */
+static uint64_t
+bucket_limit (unsigned int b)
+{
+	int e;
+
+	if (b < (1 << SUB_BITS))
+		return b;
+	e = (b >> SUB_BITS) + SUB_BITS - 1;
+	return ((uint64_t) ((1 << SUB_BITS) + (b & ((1 << SUB_BITS) - 1))) << (e - SUB_BITS)) +
+		(1ULL << (e - SUB_BITS)) - 1;
+}
+
+static void *
+worker_thread (void *data)
+{
+	Worker *w = data;
+	uint64_t t0, t1;
+	uint64_t first_us = ops[0].time_us;
+	unsigned int b;
+	long loop;
+	size_t i;
+
+	for (loop = 0; loop < loops; loop++) {
+		uint64_t loop_start = now_ns ();
+
+		for (i = 0; i < num_ops; i++) {
+			const Op *op = &ops[i];
+
+			if (speed > 0 && op->time_us >= first_us) {
+				uint64_t due = loop_start + (uint64_t) ((op->time_us - first_us) * 1000 / speed);
+				struct timespec ts;
+
+				ts.tv_sec = due / 1000000000ULL;
+				ts.tv_nsec = due % 1000000000ULL;
+				while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+					;
+			}
+
+			t0 = now_ns ();
+			replay (w->ctx, op);
+			t1 = now_ns ();
+
+			b = bucket (t1 - t0);
+			w->calls++;
+			w->histogram[b]++;
+			w->fn_calls[op->function]++;
+			w->fn_histogram[(size_t) op->function * NUM_BUCKETS + b]++;
+		}
+	}
+
+	return NULL;
+}
+
+/* Look up strings and keep one copy of each */
+static const char *
+intern (const char *s, size_t len)
+{
+	static char **table;
+	static size_t size;
+	static size_t used;
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+	size_t slot;
+	char *copy;
+
+	if (used * 2 >= size) {
+		char **old = table;
+		size_t old_size = size;
+
+		size = size ? size * 2 : 1024;
+		table = xmalloc (size * sizeof (char *));
+		for (i = 0; i < old_size; i++) {
+			uint64_t oh = 14695981039346656037ULL;
+			const char *p;
+
+			if (old[i] == NULL)
+				continue;
+			for (p = old[i]; *p != '\0'; p++)
+				oh = (oh ^ (unsigned char) *p) * 1099511628211ULL;
+			for (slot = oh & (size - 1); table[slot] != NULL; slot = (slot + 1) & (size - 1))
+				;
+			table[slot] = old[i];
+		}
+		free (old);
+	}
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char) s[i]) * 1099511628211ULL;
+	for (slot = h & (size - 1); table[slot] != NULL; slot = (slot + 1) & (size - 1)) {
+		if (strncmp (table[slot], s, len) == 0 && table[slot][len] == '\0')
+			return table[slot];
+	}
+
+	copy = xmalloc (len + 1);
+	memcpy (copy, s, len);
+	table[slot] = copy;
+	used++;
+	return copy;
+}
+
+static int
+compare_names (const void *a, const void *b)
+{
+	return strcmp (functions[*(const uint16_t *) a].name, functions[*(const uint16_t *) b].name);
+}
+
+static int
+lookup_function (const uint16_t *sorted, const char *name, size_t len)
+{
+	size_t lo = 0;
+	size_t hi = HAL_FN_LAST;
+	size_t mid;
+	int cmp;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		cmp = strncmp (functions[sorted[mid]].name, name, len);
+		if (cmp == 0 && functions[sorted[mid]].name[len] != '\0')
+			cmp = 1;
+		if (cmp == 0)
+			return sorted[mid];
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return -1;
+}
+
+static int
+load (const char *path)
+{
+	uint16_t sorted[HAL_FN_LAST];
+	const char *udi = DEFAULT_UDI;
+	const char *key = DEFAULT_KEY;
+	const char *data;
+	const char *p;
+	const char *end;
+	const char *line_end;
+	const char *q;
+	const char *arg;
+	struct stat st;
+	size_t max_ops = 0;
+	char *dot;
+	int fd;
+	int fn;
+	int i;
+
+	for (i = 0; i < HAL_FN_LAST; i++)
+		sorted[i] = i;
+	qsort (sorted, HAL_FN_LAST, sizeof (uint16_t), compare_names);
+
+	fd = open (path, O_RDONLY);
+	if (fd < 0 || fstat (fd, &st) != 0) {
+		perror (path);
+		return -1;
+	}
+	if (st.st_size == 0) {
+		close (fd);
+		return 0;
+	}
+	data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (data == MAP_FAILED) {
+		perror (path);
+		return -1;
+	}
+
+	end = data + st.st_size;
+	for (p = data; p < end; p = line_end + 1) {
+		Op *op;
+		const char *s0;
+		const char *s1;
+		unsigned long long sec;
+		unsigned long usec;
+
+		line_end = memchr (p, '\n', end - p);
+		if (line_end == NULL)
+			line_end = end;
+
+		/* <sec>.<usec> <function>[ <arg>[ <arg>]] */
+		sec = strtoull (p, &dot, 10);
+		if (dot == p || *dot != '.')
+			continue;
+		usec = strtoul (dot + 1, (char **) &q, 10);
+		if (q >= line_end || *q != ' ')
+			continue;
+		for (arg = ++q; arg < line_end && *arg != ' '; arg++)
+			;
+		fn = lookup_function (sorted, q, arg - q);
+		if (fn < 0)
+			continue;
+		if (!replayable (fn)) {
+			skipped++;
+			continue;
+		}
+
+		s0 = udi;
+		s1 = key;
+		if (strcmp (functions[fn].args, "ss") == 0 && arg < line_end) {
+			const char *a0 = arg + 1;
+			const char *a1;
+
+			for (a1 = a0; a1 < line_end && *a1 != ' '; a1++)
+				;
+			if (a1 < line_end) {
+				s0 = intern (a0, a1 - a0);
+				s1 = intern (a1 + 1, line_end - a1 - 1);
+				/* a key and a value, not a udi and a key */
+				if (fn != HAL_FN_libhal_manager_find_device_string_match) {
+					udi = s0;
+					key = s1;
+				}
+			}
+		}
+
+		if (num_ops == max_ops) {
+			max_ops = max_ops ? max_ops * 2 : 65536;
+			ops = realloc (ops, max_ops * sizeof (Op));
+			if (ops == NULL) {
+				fprintf (stderr, "out of memory\n");
+				exit (1);
+			}
+		}
+		op = &ops[num_ops++];
+		op->time_us = sec * 1000000 + usec;
+		op->function = fn;
+		op->s0 = s0;
+		op->s1 = s1;
+	}
+
+	munmap ((void *) data, st.st_size);
+	return 0;
+}
+
+static uint64_t
+percentile (const uint64_t *histogram, uint64_t total, double fraction)
+{
+	uint64_t want = (uint64_t) (total * fraction + 0.5);
+	uint64_t seen = 0;
+	unsigned int b;
+
+	if (want == 0)
+		want = 1;
+	for (b = 0; b < NUM_BUCKETS; b++) {
+		seen += histogram[b];
+		if (seen >= want)
+			return bucket_limit (b);
+	}
+	return 0;
+}
+
+static void
+print_latency (const char *name, const uint64_t *histogram, uint64_t calls, double seconds)
+{
+	printf ("%-48s %12llu %12.0f %8llu %8llu %8llu %8llu %10llu\n", name,
+		(unsigned long long) calls, seconds > 0 ? calls / seconds : 0.0,
+		(unsigned long long) percentile (histogram, calls, 0.50),
+		(unsigned long long) percentile (histogram, calls, 0.90),
+		(unsigned long long) percentile (histogram, calls, 0.99),
+		(unsigned long long) percentile (histogram, calls, 0.999),
+		(unsigned long long) percentile (histogram, calls, 1.0));
+}
+
+int
+main (int argc, char *argv[])
+{
+	Worker *workers;
+	uint64_t *total;
+	uint64_t *fn_total;
+	uint64_t *fn_calls;
+	uint64_t calls = 0;
+	double seconds;
+	int num_threads = 1;
+	int quiet = 0;
+	int opt;
+	int i;
+	int fn;
+	unsigned int b;
+
+	while ((opt = getopt (argc, argv, "t:x:l:qh")) != -1) {
+		switch (opt) {
+		case 't':
+			num_threads = atoi (optarg);
+			break;
+		case 'x':
+			speed = atof (optarg);
+			break;
+		case 'l':
+			loops = atol (optarg);
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default:
+			fprintf (stderr, "usage: %s [-t THREADS] [-x SPEED] [-l LOOPS] [-q] LOG\n", argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf (stderr, "usage: %s [-t THREADS] [-x SPEED] [-l LOOPS] [-q] LOG\n", argv[0]);
+		return 1;
+	}
+	if (num_threads < 1)
+		num_threads = 1;
+	if (loops < 1)
+		loops = 1;
+
+	if (load (argv[optind]) != 0)
+		return 1;
+	if (num_ops == 0) {
+		fprintf (stderr, "%s: no calls to replay\n", argv[optind]);
+		return 1;
+	}
+
+	if (quiet)
+		libhal_dummy_set_trace_mask ("none");
+
+	workers = xmalloc (num_threads * sizeof (Worker));
+	for (i = 0; i < num_threads; i++) {
+		workers[i].ctx = libhal_ctx_new ();
+		libhal_ctx_init (workers[i].ctx, NULL);
+		workers[i].fn_calls = xmalloc (HAL_FN_LAST * sizeof (uint64_t));
+		workers[i].fn_histogram = xmalloc ((size_t) HAL_FN_LAST * NUM_BUCKETS * sizeof (uint64_t));
+	}
+
+	start_ns = now_ns ();
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create (&workers[i].thread, NULL, worker_thread, &workers[i]) != 0) {
+			fprintf (stderr, "cannot create thread\n");
+			return 1;
+		}
+	}
+	for (i = 0; i < num_threads; i++)
+		pthread_join (workers[i].thread, NULL);
+	seconds = (now_ns () - start_ns) / 1e9;
+
+	total = xmalloc (NUM_BUCKETS * sizeof (uint64_t));
+	fn_total = xmalloc ((size_t) HAL_FN_LAST * NUM_BUCKETS * sizeof (uint64_t));
+	fn_calls = xmalloc (HAL_FN_LAST * sizeof (uint64_t));
+	for (i = 0; i < num_threads; i++) {
+		calls += workers[i].calls;
+		for (b = 0; b < NUM_BUCKETS; b++)
+			total[b] += workers[i].histogram[b];
+		for (fn = 0; fn < HAL_FN_LAST; fn++) {
+			fn_calls[fn] += workers[i].fn_calls[fn];
+			for (b = 0; b < NUM_BUCKETS; b++)
+				fn_total[(size_t) fn * NUM_BUCKETS + b] +=
+					workers[i].fn_histogram[(size_t) fn * NUM_BUCKETS + b];
+		}
+		libhal_ctx_shutdown (workers[i].ctx, NULL);
+		libhal_ctx_free (workers[i].ctx);
+	}
+
+	printf ("%zu calls in the log, %llu skipped; %d threads x %ld loops%s\n",
+		num_ops, (unsigned long long) skipped, num_threads, loops,
+		speed > 0 ? "" : ", as fast as possible");
+	printf ("%.3f seconds, %.0f calls/s\n\n", seconds, calls / seconds);
+
+	printf ("%-48s %12s %12s %8s %8s %8s %8s %10s\n", "FUNCTION", "CALLS", "CALLS/S",
+		"P50_NS", "P90_NS", "P99_NS", "P999_NS", "MAX_NS");
+	print_latency ("(all)", total, calls, seconds);
+	for (fn = 0; fn < HAL_FN_LAST; fn++) {
+		if (fn_calls[fn] > 0)
+			print_latency (functions[fn].name, &fn_total[(size_t) fn * NUM_BUCKETS],
+				       fn_calls[fn], seconds);
+	}
+
+	return 0;
+}
@@ -0,0 +1,540 @@
+/***************************************************************************
+ *
+ * hal-stress.c : multithreaded stress and scalability test of libhal
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <dbus/dbus.h>
+
+#include "libhal.h"
+
+/*
+ * Usage: hal-stress [-t THREADS] [-c CONTEXTS] [-w PERCENT] [-d SECONDS]
+ *                   [-D DEVICES] [-k KEYS] [-S SHARDS] [-T]
+ *
+ * Runs a mixed workload of getters, setters, changesets and watches
+ * with 1, 2, 4, ... up to THREADS threads (the number of CPUs by
+ * default), each step for SECONDS (1 by default), and prints the
+ * throughput at each step, with the share of operations that failed.
+ *
+ * PERCENT of the operations (20 by default) change properties, the
+ * others read them.  The operations pick one of DEVICES devices (16)
+ * and KEYS keys (64) at random.  The threads share CONTEXTS contexts
+ * (1 by default) round robin; -c 0 gives each thread its own.
+ * Tracing is turned off unless -T is given.
+ *
+ * -S splits the device store into SHARDS shards rather than as the
+ * "store_shards" setting says; "make stress-shards" runs all writes
+ * with 1, 2, 4, ... shards, to show writes to different devices
+ * scaling with the number of shards.
+ *
+ * Contention shows up as calls getting slower as threads are added,
+ * so the functions whose time per call grew most between one thread
+ * and THREADS, as counted by libhal_dummy_get_stats(), are listed as
+ * hotspots.  This needs statistics and call timing to be enabled
+ * (stats_timing = yes, which "make stress" sets).
+ */
+
+#define MAX_HOTSPOTS 10
+
+typedef enum {
+	OP_GET_STRING,
+	OP_GET_INT,
+	OP_GET_BOOL,
+	OP_GET_STRLIST,
+	OP_GET_TYPE,
+	OP_PROPERTY_EXISTS,
+	OP_QUERY_CAPABILITY,
+	OP_GET_ALL_PROPERTIES,
+	OP_FIND_STRING_MATCH,
+	OP_GET_GENERATION,
+	OP_LAST_READ = OP_GET_GENERATION,
+	OP_SET_STRING,
+	OP_SET_INT,
+	OP_SET_BOOL,
+	OP_STRLIST_APPEND,
+	OP_REMOVE_PROPERTY,
+	OP_CHANGESET,
+	OP_WATCH,
+	OP_LAST
+} Op;
+
+typedef struct {
+	pthread_t thread;
+	LibHalContext *ctx;
+	uint64_t seed;
+	uint64_t ops;
+	uint64_t failed;
+	char padding[64];
+} Worker;
+
+typedef struct {
+	int threads;
+	double ops_per_second;
+	double failed_percent;          /**< operations a call of which failed */
+	LibHalDummyStats *stats;        /**< calls made in this step */
+	int num_stats;
+} Step;
+
+static int write_percent = 20;
+static int num_devices = 16;
+static int num_keys = 64;
+static char **udis;
+static char **keys;
+
+static pthread_barrier_t start_barrier;
+static int stop;
+
+/* DBusConnection is opaque and never dereferenced by libhal */
+static int fake_connection;
+
+static uint64_t
+now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t
+next_random (uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return (uint32_t) (x >> 32);
+}
+
+static char **
+make_names (const char *format, int n)
+{
+	char **names;
+	char buf[128];
+	int i;
+
+	names = calloc (n, sizeof (char *));
+	if (names == NULL)
+		return NULL;
+	for (i = 0; i < n; i++) {
+		snprintf (buf, sizeof (buf), format, i);
+		names[i] = strdup (buf);
+		if (names[i] == NULL)
+			return NULL;
+	}
+	return names;
+}
+
+/* Returns FALSE if the call reported a failure */
+static int
+run_op (LibHalContext *ctx, Op op, const char *udi, const char *key)
+{
+	LibHalChangeSet *changeset;
+	LibHalPropertySet *set;
+	char **strings;
+	char *str;
+	dbus_uint64_t generation;
+	int n;
+	int ok = TRUE;
+
+	switch (op) {
+	case OP_GET_STRING:
+		str = libhal_device_get_property_string (ctx, udi, key, NULL);
+		ok = str != NULL;
+		libhal_free_string (str);
+		break;
+	case OP_GET_INT:
+		libhal_device_get_property_int (ctx, udi, key, NULL);
+		break;
+	case OP_GET_BOOL:
+		libhal_device_get_property_bool (ctx, udi, key, NULL);
+		break;
+	case OP_GET_STRLIST:
+		strings = libhal_device_get_property_strlist (ctx, udi, key, NULL);
+		ok = strings != NULL;
+		libhal_free_string_array (strings);
+		break;
+	case OP_GET_TYPE:
+		ok = libhal_device_get_property_type (ctx, udi, key, NULL) != LIBHAL_PROPERTY_TYPE_INVALID;
+		break;
+	case OP_PROPERTY_EXISTS:
+		ok = libhal_device_property_exists (ctx, udi, key, NULL);
+		break;
+	case OP_QUERY_CAPABILITY:
+		ok = libhal_device_query_capability (ctx, udi, "volume", NULL);
+		break;
+	case OP_GET_ALL_PROPERTIES:
+		set = libhal_device_get_all_properties (ctx, udi, NULL);
+		ok = set != NULL;
+		if (set != NULL)
+			libhal_free_property_set (set);
+		break;
+	case OP_FIND_STRING_MATCH:
+		strings = libhal_manager_find_device_string_match (ctx, key, "stress", &n, NULL);
+		ok = strings != NULL;
+		libhal_free_string_array (strings);
+		break;
+	case OP_GET_GENERATION:
+		/* a device never gets ahead of the GDL */
+		generation = libhal_device_get_generation (ctx, udi, NULL);
+		ok = generation != 0 && libhal_get_gdl_generation (ctx, NULL) >= generation;
+		break;
+	case OP_SET_STRING:
+		ok = libhal_device_set_property_string (ctx, udi, key, "stress", NULL);
+		break;
+	case OP_SET_INT:
+		ok = libhal_device_set_property_int (ctx, udi, key, 42, NULL);
+		break;
+	case OP_SET_BOOL:
+		ok = libhal_device_set_property_bool (ctx, udi, key, TRUE, NULL);
+		break;
+	case OP_STRLIST_APPEND:
+		ok = libhal_device_property_strlist_append (ctx, udi, key, "stress", NULL) &&
+			libhal_device_property_strlist_remove (ctx, udi, key, "stress", NULL);
+		break;
+	case OP_REMOVE_PROPERTY:
+		ok = libhal_device_remove_property (ctx, udi, key, NULL);
+		break;
+	case OP_CHANGESET:
+		changeset = libhal_device_new_changeset (udi);
+		if (changeset == NULL)
+			return FALSE;
+		libhal_changeset_set_property_string (changeset, key, "stress");
+		libhal_changeset_set_property_int (changeset, "stress.int", 42);
+		libhal_changeset_set_property_bool (changeset, "stress.bool", TRUE);
+		ok = libhal_device_commit_changeset (ctx, changeset, NULL);
+		libhal_device_free_changeset (changeset);
+		break;
+	case OP_WATCH:
+		ok = libhal_device_add_property_watch (ctx, udi, NULL) &&
+			libhal_device_remove_property_watch (ctx, udi, NULL);
+		break;
+	default:
+		break;
+	}
+	return ok;
+}
+
+static void *
+worker_thread (void *data)
+{
+	Worker *w = data;
+	uint32_t r;
+	Op op;
+
+	pthread_barrier_wait (&start_barrier);
+
+	while (!__atomic_load_n (&stop, __ATOMIC_RELAXED)) {
+		r = next_random (&w->seed);
+		if ((int) (r % 100) < write_percent)
+			op = OP_LAST_READ + 1 + (r >> 8) % (OP_LAST - OP_LAST_READ - 1);
+		else
+			op = (r >> 8) % (OP_LAST_READ + 1);
+		r = next_random (&w->seed);
+		if (!run_op (w->ctx, op, udis[r % num_devices], keys[(r >> 16) % num_keys]))
+			w->failed++;
+		w->ops++;
+	}
+
+	return NULL;
+}
+
+static LibHalContext *
+new_context (void)
+{
+	LibHalContext *ctx;
+
+	ctx = libhal_ctx_new ();
+	if (ctx == NULL) {
+		fprintf (stderr, "cannot create a context\n");
+		exit (1);
+	}
+	libhal_ctx_set_dbus_connection (ctx, (DBusConnection *) &fake_connection);
+	libhal_ctx_init (ctx, NULL);
+	return ctx;
+}
+
+/* put the devices in the device list, so the calls find them */
+static void
+add_devices (void)
+{
+	LibHalContext *ctx;
+	char *temp_udi;
+	int i;
+
+	ctx = new_context ();
+	for (i = 0; i < num_devices; i++) {
+		temp_udi = libhal_new_device (ctx, NULL);
+		if (temp_udi == NULL)
+			break;
+		libhal_device_commit_to_gdl (ctx, temp_udi, udis[i], NULL);
+		libhal_free_string (temp_udi);
+	}
+	libhal_ctx_shutdown (ctx, NULL);
+	libhal_ctx_free (ctx);
+}
+
+static void
+run_step (Step *step, int num_threads, LibHalContext **contexts, int num_contexts, double seconds)
+{
+	Worker *workers;
+	uint64_t start;
+	uint64_t ops = 0;
+	uint64_t failed = 0;
+	int i;
+
+	workers = calloc (num_threads, sizeof (Worker));
+	if (workers == NULL) {
+		fprintf (stderr, "out of memory\n");
+		exit (1);
+	}
+
+	__atomic_store_n (&stop, 0, __ATOMIC_RELAXED);
+	pthread_barrier_init (&start_barrier, NULL, num_threads + 1);
+	for (i = 0; i < num_threads; i++) {
+		workers[i].ctx = num_contexts > 0 ? contexts[i % num_contexts] : new_context ();
+		workers[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+		if (pthread_create (&workers[i].thread, NULL, worker_thread, &workers[i]) != 0) {
+			fprintf (stderr, "cannot create thread\n");
+			exit (1);
+		}
+	}
+
+	libhal_dummy_reset_stats ();
+	pthread_barrier_wait (&start_barrier);
+	start = now_ns ();
+	usleep ((useconds_t) (seconds * 1000000));
+	__atomic_store_n (&stop, 1, __ATOMIC_RELAXED);
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_join (workers[i].thread, NULL);
+		ops += workers[i].ops;
+		failed += workers[i].failed;
+	}
+	step->threads = num_threads;
+	step->ops_per_second = ops / ((now_ns () - start) / 1e9);
+	step->failed_percent = ops ? 100.0 * failed / ops : 0.0;
+	if (!libhal_dummy_get_stats (&step->stats, &step->num_stats))
+		step->stats = NULL;
+
+	if (num_contexts == 0) {
+		for (i = 0; i < num_threads; i++) {
+			libhal_ctx_shutdown (workers[i].ctx, NULL);
+			libhal_ctx_free (workers[i].ctx);
+		}
+	}
+	pthread_barrier_destroy (&start_barrier);
+	free (workers);
+}
+
+typedef struct {
+	const char *function;
+	double ns_first;
+	double ns_last;
+	unsigned long long calls;
+} Hotspot;
+
+static int
+compare_hotspots (const void *a, const void *b)
+{
+	const Hotspot *ha = a;
+	const Hotspot *hb = b;
+	double ra = ha->ns_last / ha->ns_first;
+	double rb = hb->ns_last / hb->ns_first;
+
+	if (ra != rb)
+		return ra > rb ? -1 : 1;
+	return strcmp (ha->function, hb->function);
+}
+
+static void
+print_hotspots (const Step *first, const Step *last)
+{
+	Hotspot hotspots[MAX_HOTSPOTS + 1];
+	Hotspot h;
+	int timed = FALSE;
+	int num = 0;
+	int i;
+
+	if (first->stats == NULL || last->stats == NULL) {
+		printf ("\nno statistics (stats=off), cannot look for hotspots\n");
+		return;
+	}
+
+	/* both steps list every function, in the same order */
+	for (i = 0; i < first->num_stats && i < last->num_stats; i++) {
+		const LibHalDummyStats *a = &first->stats[i];
+		const LibHalDummyStats *b = &last->stats[i];
+
+		if (a->calls == 0 || b->calls == 0)
+			continue;
+		h.function = b->function;
+		h.ns_first = (double) a->total_ns / a->calls;
+		h.ns_last = (double) b->total_ns / b->calls;
+		h.calls = b->calls;
+		if (b->total_ns > 0)
+			timed = TRUE;
+		if (h.ns_first <= 0)
+			continue;
+
+		/* keep the MAX_HOTSPOTS worst, sorted, with a spare slot at the end */
+		hotspots[num] = h;
+		qsort (hotspots, num + 1, sizeof (Hotspot), compare_hotspots);
+		if (num < MAX_HOTSPOTS)
+			num++;
+	}
+	if (!timed) {
+		printf ("\ncalls were not timed (stats_timing=off), cannot look for hotspots\n");
+		return;
+	}
+
+	printf ("\nhotspots, time per call at %d and %d threads:\n\n", first->threads, last->threads);
+	printf ("%-48s %10s %10s %9s %12s\n", "FUNCTION", "NS@FIRST", "NS@LAST", "SLOWDOWN", "CALLS");
+	for (i = 0; i < num; i++) {
+		printf ("%-48s %10.0f %10.0f %8.2fx %12llu\n", hotspots[i].function,
+			hotspots[i].ns_first, hotspots[i].ns_last,
+			hotspots[i].ns_last / hotspots[i].ns_first, hotspots[i].calls);
+	}
+}
+
+int
+main (int argc, char *argv[])
+{
+	LibHalContext **contexts = NULL;
+	Step *steps;
+	double seconds = 1.0;
+	int max_threads;
+	int num_contexts = 1;
+	int num_steps = 0;
+	int tracing = FALSE;
+	int threads;
+	int opt;
+	int i;
+
+	max_threads = sysconf (_SC_NPROCESSORS_ONLN);
+
+	while ((opt = getopt (argc, argv, "t:c:w:d:D:k:S:Th")) != -1) {
+		switch (opt) {
+		case 't':
+			max_threads = atoi (optarg);
+			break;
+		case 'c':
+			num_contexts = atoi (optarg);
+			break;
+		case 'w':
+			write_percent = atoi (optarg);
+			break;
+		case 'd':
+			seconds = atof (optarg);
+			break;
+		case 'D':
+			num_devices = atoi (optarg);
+			break;
+		case 'k':
+			num_keys = atoi (optarg);
+			break;
+		case 'S':
+			/* read by the store when it is set up, before any device is touched */
+			setenv ("HAL_DUMMY_STORE_SHARDS", optarg, 1);
+			break;
+		case 'T':
+			tracing = TRUE;
+			break;
+		default:
+			fprintf (stderr, "usage: %s [-t THREADS] [-c CONTEXTS] [-w PERCENT] [-d SECONDS] "
+				 "[-D DEVICES] [-k KEYS] [-S SHARDS] [-T]\n", argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (max_threads < 1)
+		max_threads = 1;
+	if (num_contexts < 0)
+		num_contexts = 0;
+	if (write_percent < 0 || write_percent > 100)
+		write_percent = 20;
+	if (seconds <= 0)
+		seconds = 1.0;
+	if (num_devices < 1)
+		num_devices = 1;
+	if (num_keys < 1)
+		num_keys = 1;
+
+	udis = make_names ("/org/freedesktop/Hal/devices/stress_%d", num_devices);
+	keys = make_names ("stress.key%d", num_keys);
+	steps = calloc (max_threads + 1, sizeof (Step));
+	if (num_contexts > 0)
+		contexts = calloc (num_contexts, sizeof (LibHalContext *));
+	if (udis == NULL || keys == NULL || steps == NULL || (num_contexts > 0 && contexts == NULL)) {
+		fprintf (stderr, "out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < num_contexts; i++)
+		contexts[i] = new_context ();
+	add_devices ();
+
+	if (!tracing)
+		libhal_dummy_set_trace_mask ("none");
+
+	printf ("%d%% writes, %d devices x %d keys, ", write_percent, num_devices, num_keys);
+	if (getenv ("HAL_DUMMY_STORE_SHARDS") != NULL)
+		printf ("%s store shards, ", getenv ("HAL_DUMMY_STORE_SHARDS"));
+	if (num_contexts > 0)
+		printf ("%d shared context%s\n\n", num_contexts, num_contexts > 1 ? "s" : "");
+	else
+		printf ("a context per thread\n\n");
+	printf ("%7s %14s %8s %10s %7s\n", "THREADS", "OPS/S", "SPEEDUP", "EFFICIENCY", "FAILED");
+
+	for (threads = 1; ; threads = threads * 2 < max_threads ? threads * 2 : max_threads) {
+		Step *step = &steps[num_steps++];
+
+		run_step (step, threads, contexts, num_contexts, seconds);
+		printf ("%7d %14.0f %7.2fx %9.0f%% %6.1f%%\n", threads, step->ops_per_second,
+			step->ops_per_second / steps[0].ops_per_second,
+			100.0 * step->ops_per_second / (steps[0].ops_per_second * threads),
+			step->failed_percent);
+		fflush (stdout);
+		if (threads == max_threads)
+			break;
+	}
+
+	if (num_steps > 1)
+		print_hotspots (&steps[0], &steps[num_steps - 1]);
+
+	for (i = 0; i < num_steps; i++)
+		libhal_dummy_free_stats (steps[i].stats);
+	for (i = 0; i < num_contexts; i++) {
+		libhal_ctx_shutdown (contexts[i], NULL);
+		libhal_ctx_free (contexts[i]);
+	}
+	return 0;
+}
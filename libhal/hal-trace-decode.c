@@ -0,0 +1,279 @@
+/***************************************************************************
+ *
+ * hal-trace-decode.c : turn binary libhal traces back into text
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libhal-trace.h"
+
+/*
+ * Usage: hal-trace-decode [-r] [TRACE...]
+ *
+ * Prints the records of the given traces, or of every
+ * /dev/shm/libhal-trace.* when none are given, in the same format
+ * hal_logger writes to /tmp/libhal.log, ordered by time.  -r then
+ * removes the traces of processes that are gone, which are only left
+ * behind with trace_keep = yes or when the process was killed.
+ */
+
+#define SHM_DIR "/dev/shm"
+
+static const HalFunctionInfo functions[HAL_FN_LAST] = {
+#define HAL_FUNCTION(_name_, _args_, _level_) HAL_FUNCTION_INFO (_name_, _args_, _level_)
+#include "libhal-functions.h"
+#undef HAL_FUNCTION
+};
+
+typedef struct {
+	const HalTraceHeader *header;
+	size_t size;
+	const char *blob;
+	char *path;
+} Trace;
+
+typedef struct {
+	uint64_t realtime_ns;
+	const Trace *trace;
+	const HalTraceRecord *record;
+} Entry;
+
+static Trace *traces = NULL;
+static unsigned int num_traces = 0;
+static Entry *entries = NULL;
+static size_t num_entries = 0;
+static size_t max_entries = 0;
+
+static int
+open_trace (const char *path)
+{
+	const HalTraceHeader *h;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open (path, O_RDONLY);
+	if (fd < 0) {
+		perror (path);
+		return -1;
+	}
+	if (fstat (fd, &st) != 0 || (size_t) st.st_size < sizeof (HalTraceHeader)) {
+		fprintf (stderr, "%s: not a libhal trace\n", path);
+		close (fd);
+		return -1;
+	}
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED) {
+		perror (path);
+		return -1;
+	}
+
+	h = map;
+	if (h->magic != HAL_TRACE_MAGIC || h->version != HAL_TRACE_VERSION ||
+	    h->header_size < sizeof (HalTraceHeader) ||
+	    (h->ring_size & (h->ring_size - 1)) != 0 ||
+	    hal_trace_total_size (h) > (size_t) st.st_size) {
+		fprintf (stderr, "%s: not a libhal trace\n", path);
+		munmap (map, st.st_size);
+		return -1;
+	}
+
+	traces = realloc (traces, (num_traces + 1) * sizeof (Trace));
+	traces[num_traces].header = h;
+	traces[num_traces].size = st.st_size;
+	traces[num_traces].blob = (const char *) h + hal_trace_strtab_offset (h) +
+		(size_t) h->strtab_slots * sizeof (uint32_t);
+	traces[num_traces].path = strdup (path);
+	num_traces++;
+
+	return 0;
+}
+
+static void
+collect (const Trace *t)
+{
+	const HalTraceHeader *h = t->header;
+	const HalTraceRing *ring;
+	const HalTraceRecord *records;
+	uint64_t head;
+	uint64_t seq;
+	unsigned int i;
+
+	for (i = 0; i < h->num_rings; i++) {
+		ring = (const HalTraceRing *) ((const char *) h + hal_trace_ring_offset (h, i));
+		records = (const HalTraceRecord *) (ring + 1);
+		head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+
+		seq = head > h->ring_size ? head - h->ring_size : 0;
+		for (; seq < head; seq++) {
+			const HalTraceRecord *rec = &records[seq & (h->ring_size - 1)];
+
+			if (rec->function >= HAL_FN_LAST)
+				continue;
+			if (num_entries == max_entries) {
+				max_entries = max_entries ? max_entries * 2 : 65536;
+				entries = realloc (entries, max_entries * sizeof (Entry));
+				if (entries == NULL) {
+					fprintf (stderr, "out of memory\n");
+					exit (1);
+				}
+			}
+			entries[num_entries].realtime_ns = h->base_realtime_ns +
+				(rec->timestamp_ns - h->base_monotonic_ns);
+			entries[num_entries].trace = t;
+			entries[num_entries].record = rec;
+			num_entries++;
+		}
+	}
+}
+
+static int
+compare_entries (const void *a, const void *b)
+{
+	const Entry *ea = a;
+	const Entry *eb = b;
+
+	if (ea->realtime_ns != eb->realtime_ns)
+		return ea->realtime_ns < eb->realtime_ns ? -1 : 1;
+	/* same ring: keep write order */
+	return ea->record < eb->record ? -1 : ea->record > eb->record;
+}
+
+static void
+print_string (const Trace *t, uint64_t id)
+{
+	const HalTraceHeader *h = t->header;
+
+	if (id == HAL_TRACE_STR_NULL)
+		fputs (" (null)", stdout);
+	else if (id == HAL_TRACE_STR_DROPPED || id > h->strtab_used || id > h->strtab_size)
+		fputs (" (dropped)", stdout);
+	else
+		printf (" %s", t->blob + id - 1);
+}
+
+static void
+print_entry (const Entry *e)
+{
+	const HalFunctionInfo *fn = &functions[e->record->function];
+	const char *kind;
+	int i;
+
+	printf ("%" PRIu64 ".%06" PRIu64 " %s",
+		e->realtime_ns / 1000000000, (e->realtime_ns % 1000000000) / 1000,
+		fn->name);
+	for (kind = fn->args, i = 0; *kind != '\0'; kind++, i++) {
+		if (*kind == 's')
+			print_string (e->trace, e->record->args[i]);
+		else if (e->record->args[i] == 0)
+			fputs (" (nil)", stdout);
+		else
+			printf (" 0x%" PRIx64, e->record->args[i]);
+	}
+	putchar ('\n');
+}
+
+/* Remove the traces whose process has exited */
+static void
+reap (void)
+{
+	const Trace *t;
+	unsigned int i;
+
+	for (i = 0; i < num_traces; i++) {
+		t = &traces[i];
+		if (t->path == NULL || kill (t->header->pid, 0) == 0 || errno != ESRCH)
+			continue;
+		if (unlink (t->path) != 0)
+			perror (t->path);
+	}
+}
+
+int
+main (int argc, char *argv[])
+{
+	size_t n;
+	int do_reap = 0;
+	int opt;
+	int i;
+
+	while ((opt = getopt (argc, argv, "rh")) != -1) {
+		switch (opt) {
+		case 'r':
+			do_reap = 1;
+			break;
+		default:
+			fprintf (stderr, "usage: %s [-r] [TRACE...]\n", argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (optind < argc) {
+		for (i = optind; i < argc; i++)
+			open_trace (argv[i]);
+	} else {
+		DIR *dir;
+		struct dirent *d;
+		char path[512];
+
+		dir = opendir (SHM_DIR);
+		if (dir != NULL) {
+			while ((d = readdir (dir)) != NULL) {
+				if (strncmp (d->d_name, HAL_TRACE_SHM_PREFIX + 1,
+					     strlen (HAL_TRACE_SHM_PREFIX + 1)) != 0)
+					continue;
+				snprintf (path, sizeof (path), SHM_DIR "/%s", d->d_name);
+				open_trace (path);
+			}
+			closedir (dir);
+		}
+	}
+
+	if (num_traces == 0) {
+		fprintf (stderr, "no traces found\n");
+		return 1;
+	}
+
+	for (i = 0; i < (int) num_traces; i++)
+		collect (&traces[i]);
+
+	qsort (entries, num_entries, sizeof (Entry), compare_entries);
+	for (n = 0; n < num_entries; n++)
+		print_entry (&entries[n]);
+
+	if (do_reap)
+		reap ();
+
+	return 0;
+}
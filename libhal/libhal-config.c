@@ -0,0 +1,226 @@
+/***************************************************************************
+ *
+ * libhal-config.c : run-time settings of the HAL convenience library
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "libhal-private.h"
+
+/*
+ * Settings are read once from the system config file,
+ * $(sysconfdir)/hal-dummy.conf (or the file named by HAL_DUMMY_CONFIG),
+ * which holds lines of the form
+ *
+ *   # comment
+ *   trace_mode = binary
+ *
+ * Any setting can be overridden by an environment variable named
+ * HAL_DUMMY_ followed by the upper-cased key, e.g. HAL_DUMMY_TRACE_MODE.
+ */
+
+#ifndef PACKAGE_SYSCONF_DIR
+#define PACKAGE_SYSCONF_DIR "/etc"
+#endif
+
+#define HAL_CONFIG_FILE       PACKAGE_SYSCONF_DIR "/hal-dummy.conf"
+#define HAL_CONFIG_MAX_KEYS   64
+
+typedef struct {
+	char *key;
+	char *value;
+} HalConfigEntry;
+
+static pthread_once_t hal_config_once = PTHREAD_ONCE_INIT;
+static HalConfigEntry hal_config_entries[HAL_CONFIG_MAX_KEYS];
+static unsigned int hal_config_num_entries = 0;
+
+static char *
+hal_config_strip (char *s)
+{
+	char *end;
+
+	while (isspace ((unsigned char) *s))
+		s++;
+	end = s + strlen (s);
+	while (end > s && isspace ((unsigned char) end[-1]))
+		*--end = '\0';
+
+	return s;
+}
+
+static void
+hal_config_load (void)
+{
+	const char *path;
+	char line[1024];
+	char *key;
+	char *value;
+	char *eq;
+	FILE *fp;
+	int lineno = 0;
+
+	path = getenv ("HAL_DUMMY_CONFIG");
+	if (path == NULL)
+		path = HAL_CONFIG_FILE;
+
+	fp = fopen (path, "re");
+	if (fp == NULL)
+		return;
+
+	while (fgets (line, sizeof (line), fp) != NULL) {
+		lineno++;
+		key = hal_config_strip (line);
+		if (*key == '\0' || *key == '#')
+			continue;
+
+		eq = strchr (key, '=');
+		if (eq == NULL) {
+			fprintf (stderr, "%s:%d : expected 'key = value'\n", path, lineno);
+			continue;
+		}
+		*eq = '\0';
+		key = hal_config_strip (key);
+		value = hal_config_strip (eq + 1);
+
+		if (hal_config_num_entries == HAL_CONFIG_MAX_KEYS) {
+			fprintf (stderr, "%s:%d : too many settings\n", path, lineno);
+			break;
+		}
+		hal_config_entries[hal_config_num_entries].key = strdup (key);
+		hal_config_entries[hal_config_num_entries].value = strdup (value);
+		if (hal_config_entries[hal_config_num_entries].key != NULL &&
+		    hal_config_entries[hal_config_num_entries].value != NULL)
+			hal_config_num_entries++;
+	}
+
+	fclose (fp);
+}
+
+/**
+ * hal_config_get:
+ * @key: name of the setting, e.g. "trace_mode"
+ *
+ * Look up a setting.
+ *
+ * Returns: the value, valid for the lifetime of the process, or NULL
+ * if the setting is not set.
+ */
+const char *
+hal_config_get (const char *key)
+{
+	char env[128];
+	const char *value;
+	unsigned int i;
+
+	snprintf (env, sizeof (env), "HAL_DUMMY_%s", key);
+	for (i = strlen ("HAL_DUMMY_"); env[i] != '\0'; i++)
+		env[i] = toupper ((unsigned char) env[i]);
+	value = getenv (env);
+	if (value != NULL)
+		return value;
+
+	pthread_once (&hal_config_once, hal_config_load);
+	for (i = 0; i < hal_config_num_entries; i++) {
+		if (strcmp (hal_config_entries[i].key, key) == 0)
+			return hal_config_entries[i].value;
+	}
+
+	return NULL;
+}
+
+/**
+ * hal_config_get_int:
+ * @key: name of the setting
+ * @default_value: value to use if the setting is unset or not a number
+ *
+ * Look up a numeric setting.
+ *
+ * Returns: the value of the setting
+ */
+long
+hal_config_get_int (const char *key, long default_value)
+{
+	const char *value;
+	char *end;
+	long n;
+
+	value = hal_config_get (key);
+	if (value == NULL || *value == '\0')
+		return default_value;
+
+	n = strtol (value, &end, 0);
+	if (*end != '\0') {
+		fprintf (stderr, "%s %d : setting %s: '%s' is not a number\n",
+			 __FILE__, __LINE__, key, value);
+		return default_value;
+	}
+
+	return n;
+}
+
+/**
+ * hal_config_get_size:
+ * @key: name of the setting
+ * @default_value: value to use if the setting is unset or invalid
+ *
+ * Look up a size setting, which may carry a K, M or G suffix.
+ *
+ * Returns: the value of the setting in bytes
+ */
+size_t
+hal_config_get_size (const char *key, size_t default_value)
+{
+	const char *value;
+	char *end;
+	unsigned long long n;
+
+	value = hal_config_get (key);
+	if (value == NULL || *value == '\0')
+		return default_value;
+
+	n = strtoull (value, &end, 0);
+	switch (*end) {
+	case 'G': case 'g':
+		n *= 1024;
+		/* fall through */
+	case 'M': case 'm':
+		n *= 1024;
+		/* fall through */
+	case 'K': case 'k':
+		n *= 1024;
+		end++;
+		break;
+	}
+	if (end == value || *end != '\0' || value[0] == '-') {
+		fprintf (stderr, "%s %d : setting %s: '%s' is not a size\n",
+			 __FILE__, __LINE__, key, value);
+		return default_value;
+	}
+
+	return n;
+}
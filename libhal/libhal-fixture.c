@@ -0,0 +1,331 @@
+/***************************************************************************
+ *
+ * libhal-fixture.c : read device descriptions from a text file
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dbus/dbus.h>
+
+#include "libhal.h"
+#include "libhal-private.h"
+
+/*
+ * A fixture describes the devices in the format lshal prints them,
+ * so the output of lshal on a real machine can be used as is:
+ *
+ *   # comment
+ *   udi = '/org/freedesktop/Hal/devices/computer'
+ *     info.capabilities = {'a', 'b'} (string list)
+ *     info.product = 'Computer'  (string)
+ *     linux.hotplug_type = 2  (0x2)  (int)
+ *     storage.size = 0  (0x0)  (uint64)
+ *     battery.voltage.rate = 1.5 (1.5) (double)
+ *     storage.removable = false  (bool)
+ *
+ * The banner lines lshal prints around the dump are skipped.  Strings
+ * are not escaped, so a string value runs from the first quote to the
+ * last one on the line, and list items are separated by "', '".
+ */
+
+typedef struct {
+	const char *path;
+	int lineno;
+	HalFixtureDeviceFunc device_func;
+	HalFixturePropertyFunc property_func;
+	void *data;
+	void *device;                   /**< the device being described */
+} HalFixture;
+
+static void
+hal_fixture_error (HalFixture *fixture, const char *message)
+{
+	fprintf (stderr, "%s:%d : %s\n", fixture->path, fixture->lineno, message);
+}
+
+static char *
+hal_fixture_strip (char *s)
+{
+	char *end;
+
+	while (isspace ((unsigned char) *s))
+		s++;
+	end = s + strlen (s);
+	while (end > s && isspace ((unsigned char) end[-1]))
+		*--end = '\0';
+
+	return s;
+}
+
+/* Remove the quotes around @s, returns NULL if there are none */
+static char *
+hal_fixture_unquote (char *s)
+{
+	size_t len = strlen (s);
+
+	if (len < 2 || s[0] != '\'' || s[len - 1] != '\'')
+		return NULL;
+	s[len - 1] = '\0';
+	return s + 1;
+}
+
+static char **
+hal_fixture_parse_strlist (char *s)
+{
+	char **strlist;
+	char *item;
+	char *sep;
+	size_t len = strlen (s);
+	unsigned int n = 0;
+	unsigned int i;
+
+	if (len < 2 || s[0] != '{' || s[len - 1] != '}')
+		return NULL;
+	s[len - 1] = '\0';
+	s = hal_fixture_strip (s + 1);
+
+	if (*s != '\0') {
+		n = 1;
+		for (sep = strstr (s, "', '"); sep != NULL; sep = strstr (sep + 4, "', '"))
+			n++;
+	}
+	strlist = calloc (n + 1, sizeof (char *));
+	if (strlist == NULL)
+		return NULL;
+	if (n == 0)
+		return strlist;
+
+	if ((s = hal_fixture_unquote (s)) == NULL) {
+		free (strlist);
+		return NULL;
+	}
+	for (i = 0, item = s; i < n; i++) {
+		sep = strstr (item, "', '");
+		if (sep != NULL)
+			*sep = '\0';
+		strlist[i] = item;
+		if (sep != NULL)
+			item = sep + 4;
+	}
+	return strlist;
+}
+
+static void
+hal_fixture_parse_property (HalFixture *fixture, char *line)
+{
+	char *key;
+	char *value;
+	char *type_name;
+	char *end;
+	char *eq;
+	HalValue v;
+	int type;
+	int ok = TRUE;
+
+	if (fixture->device == NULL) {
+		hal_fixture_error (fixture, "property outside of a device");
+		return;
+	}
+
+	eq = strchr (line, '=');
+	type_name = strrchr (line, '(');
+	if (eq == NULL || type_name == NULL || type_name < eq ||
+	    type_name[strlen (type_name) - 1] != ')') {
+		hal_fixture_error (fixture, "expected 'key = value (type)'");
+		return;
+	}
+	*eq = '\0';
+	*type_name++ = '\0';
+	type_name[strlen (type_name) - 1] = '\0';
+	key = hal_fixture_strip (line);
+	value = hal_fixture_strip (eq + 1);
+
+	if (strcmp (type_name, "string") == 0) {
+		type = LIBHAL_PROPERTY_TYPE_STRING;
+		v.str_value = hal_fixture_unquote (value);
+		ok = v.str_value != NULL;
+	} else if (strcmp (type_name, "string list") == 0) {
+		type = LIBHAL_PROPERTY_TYPE_STRLIST;
+		v.strlist_value = hal_fixture_parse_strlist (value);
+		ok = v.strlist_value != NULL;
+	} else if (strcmp (type_name, "int") == 0) {
+		type = LIBHAL_PROPERTY_TYPE_INT32;
+		v.int_value = strtol (value, &end, 0);
+		ok = end != value;
+	} else if (strcmp (type_name, "uint64") == 0) {
+		type = LIBHAL_PROPERTY_TYPE_UINT64;
+		v.uint64_value = strtoull (value, &end, 0);
+		ok = end != value;
+	} else if (strcmp (type_name, "double") == 0) {
+		type = LIBHAL_PROPERTY_TYPE_DOUBLE;
+		v.double_value = strtod (value, &end);
+		ok = end != value;
+	} else if (strcmp (type_name, "bool") == 0) {
+		type = LIBHAL_PROPERTY_TYPE_BOOLEAN;
+		v.bool_value = strcmp (value, "true") == 0;
+		ok = v.bool_value || strcmp (value, "false") == 0;
+	} else {
+		hal_fixture_error (fixture, "unknown property type");
+		return;
+	}
+
+	if (!ok)
+		hal_fixture_error (fixture, "invalid value");
+	else if (!fixture->property_func (fixture->device, key, type, &v))
+		hal_fixture_error (fixture, "cannot set property");
+
+	if (type == LIBHAL_PROPERTY_TYPE_STRLIST)
+		free (v.strlist_value);
+}
+
+static void
+hal_fixture_parse_line (HalFixture *fixture, char *line)
+{
+	int indented = isspace ((unsigned char) *line);
+	char *udi;
+
+	line = hal_fixture_strip (line);
+	if (*line == '\0' || *line == '#' ||
+	    strncmp (line, "Dump", 4) == 0 || strncmp (line, "---", 3) == 0)
+		return;
+
+	if (indented) {
+		hal_fixture_parse_property (fixture, line);
+		return;
+	}
+
+	if (strncmp (line, "udi", 3) != 0 ||
+	    *(udi = hal_fixture_strip (line + 3)) != '=' ||
+	    (udi = hal_fixture_unquote (hal_fixture_strip (udi + 1))) == NULL) {
+		hal_fixture_error (fixture, "expected udi = '...'");
+		fixture->device = NULL;
+		return;
+	}
+	fixture->device = fixture->device_func (fixture->data, udi);
+	if (fixture->device == NULL)
+		hal_fixture_error (fixture, "cannot add device");
+}
+
+/**
+ * hal_fixture_parse:
+ * @name: where @text comes from, for error messages
+ * @text: the fixture
+ * @len: length of @text
+ * @device_func: called with @data for each device, returns a handle
+ * for the device
+ * @property_func: called with the device handle for each property
+ * @data: user data
+ *
+ * Read the devices described in @text.  Values passed to
+ * @property_func are only valid during the call.  Errors in the text
+ * are reported and the offending lines skipped.
+ */
+void
+hal_fixture_parse (const char *name, const char *text, size_t len,
+		   HalFixtureDeviceFunc device_func, HalFixturePropertyFunc property_func, void *data)
+{
+	HalFixture fixture;
+	const char *p;
+	const char *eol;
+	char *line = NULL;
+	size_t line_size = 0;
+	size_t line_len;
+
+	fixture.path = name;
+	fixture.lineno = 0;
+	fixture.device_func = device_func;
+	fixture.property_func = property_func;
+	fixture.data = data;
+	fixture.device = NULL;
+
+	for (p = text; p < text + len; p = eol + 1) {
+		eol = memchr (p, '\n', text + len - p);
+		if (eol == NULL)
+			eol = text + len;
+		line_len = eol - p;
+		fixture.lineno++;
+
+		/* the text may be read-only, lines are split in a copy */
+		if (line_len + 1 > line_size) {
+			free (line);
+			line_size = line_len + 1 > 256 ? line_len + 1 : 256;
+			line = malloc (line_size);
+			if (line == NULL)
+				break;
+		}
+		memcpy (line, p, line_len);
+		line[line_len] = '\0';
+		hal_fixture_parse_line (&fixture, line);
+	}
+
+	free (line);
+}
+
+/**
+ * hal_fixture_load:
+ * @path: the fixture file
+ * @device_func: as for hal_fixture_parse()
+ * @property_func: as for hal_fixture_parse()
+ * @data: user data
+ *
+ * Map @path and read the devices it describes, see hal_fixture_parse().
+ *
+ * Returns: FALSE if the file could not be read
+ */
+int
+hal_fixture_load (const char *path, HalFixtureDeviceFunc device_func,
+		  HalFixturePropertyFunc property_func, void *data)
+{
+	struct stat st;
+	const char *map;
+	int fd;
+
+	fd = open (path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat (fd, &st) < 0) {
+		fprintf (stderr, "%s %d : cannot open fixture %s\n", __FILE__, __LINE__, path);
+		if (fd >= 0)
+			close (fd);
+		return FALSE;
+	}
+	if (st.st_size == 0) {
+		close (fd);
+		return TRUE;
+	}
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED) {
+		fprintf (stderr, "%s %d : cannot map fixture %s\n", __FILE__, __LINE__, path);
+		return FALSE;
+	}
+
+	hal_fixture_parse (path, map, st.st_size, device_func, property_func, data);
+
+	munmap ((void *) map, st.st_size);
+	return TRUE;
+}
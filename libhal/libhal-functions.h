@@ -0,0 +1,153 @@
+/***************************************************************************
+ *
+ * libhal-functions.h : table of the traced libhal entry points
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+/*
+ * No include guard: define HAL_FUNCTION (name, args, level) and
+ * include this file to expand the list.  @args describes what the
+ * entry point passes to HAL_TRACE() after the function id:
+ *
+ *   NONE  nothing
+ *   P     one pointer
+ *   PP    two pointers
+ *   PS    a pointer and a string
+ *   SS    two strings
+ *
+ * and @level is the lowest trace_level that traces it: CONTEXT,
+ * MODIFY, QUERY or ALL.
+ *
+ * The position of an entry is its function id in binary traces, so
+ * new entry points must be appended at the end.
+ */
+
+HAL_FUNCTION (libhal_free_string_array, NONE, ALL)
+HAL_FUNCTION (libhal_free_string, PS, ALL)
+HAL_FUNCTION (libhal_ctx_set_user_data, NONE, CONTEXT)
+HAL_FUNCTION (libhal_ctx_get_user_data, NONE, CONTEXT)
+HAL_FUNCTION (libhal_device_get_all_properties, NONE, QUERY)
+HAL_FUNCTION (libhal_property_set_sort, NONE, ALL)
+HAL_FUNCTION (libhal_free_property_set, NONE, ALL)
+HAL_FUNCTION (libhal_property_set_get_num_elems, NONE, ALL)
+HAL_FUNCTION (libhal_ps_get_type, NONE, ALL)
+HAL_FUNCTION (libhal_ps_get_string, NONE, ALL)
+HAL_FUNCTION (libhal_ps_get_int32, NONE, ALL)
+HAL_FUNCTION (libhal_ps_get_uint64, NONE, ALL)
+HAL_FUNCTION (libhal_ps_get_double, NONE, ALL)
+HAL_FUNCTION (libhal_ps_get_bool, NONE, ALL)
+HAL_FUNCTION (libhal_ps_get_strlist, NONE, ALL)
+HAL_FUNCTION (libhal_psi_init, NONE, ALL)
+HAL_FUNCTION (libhal_psi_has_more, NONE, ALL)
+HAL_FUNCTION (libhal_psi_next, NONE, ALL)
+HAL_FUNCTION (libhal_psi_get_type, NONE, ALL)
+HAL_FUNCTION (libhal_psi_get_key, NONE, ALL)
+HAL_FUNCTION (libhal_psi_get_string, NONE, ALL)
+HAL_FUNCTION (libhal_psi_get_int, NONE, ALL)
+HAL_FUNCTION (libhal_psi_get_uint64, NONE, ALL)
+HAL_FUNCTION (libhal_psi_get_double, NONE, ALL)
+HAL_FUNCTION (libhal_psi_get_bool, NONE, ALL)
+HAL_FUNCTION (libhal_psi_get_strlist, NONE, ALL)
+HAL_FUNCTION (libhal_get_all_devices, NONE, QUERY)
+HAL_FUNCTION (libhal_device_get_property_type, SS, QUERY)
+HAL_FUNCTION (libhal_device_get_property_strlist, NONE, QUERY)
+HAL_FUNCTION (libhal_device_get_property_string, SS, QUERY)
+HAL_FUNCTION (libhal_device_get_property_int, SS, QUERY)
+HAL_FUNCTION (libhal_device_get_property_uint64, SS, QUERY)
+HAL_FUNCTION (libhal_device_get_property_double, SS, QUERY)
+HAL_FUNCTION (libhal_device_get_property_bool, NONE, QUERY)
+HAL_FUNCTION (libhal_device_set_property_string, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_set_property_int, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_set_property_uint64, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_set_property_double, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_set_property_bool, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_remove_property, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_property_strlist_append, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_property_strlist_prepend, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_property_strlist_remove_index, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_property_strlist_remove, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_lock, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_unlock, NONE, MODIFY)
+HAL_FUNCTION (libhal_new_device, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_commit_to_gdl, NONE, MODIFY)
+HAL_FUNCTION (libhal_remove_device, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_exists, NONE, QUERY)
+HAL_FUNCTION (libhal_device_property_exists, NONE, QUERY)
+HAL_FUNCTION (libhal_merge_properties, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_matches, NONE, QUERY)
+HAL_FUNCTION (libhal_device_print, NONE, QUERY)
+HAL_FUNCTION (libhal_manager_find_device_string_match, SS, QUERY)
+HAL_FUNCTION (libhal_device_add_capability, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_query_capability, NONE, QUERY)
+HAL_FUNCTION (libhal_find_device_by_capability, NONE, QUERY)
+HAL_FUNCTION (libhal_device_property_watch_all, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_property_remove_watch_all, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_add_property_watch, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_remove_property_watch, NONE, MODIFY)
+HAL_FUNCTION (libhal_ctx_new, NONE, CONTEXT)
+HAL_FUNCTION (libhal_ctx_set_cache, NONE, CONTEXT)
+HAL_FUNCTION (libhal_ctx_set_dbus_connection, PP, CONTEXT)
+HAL_FUNCTION (libhal_ctx_get_dbus_connection, NONE, CONTEXT)
+HAL_FUNCTION (libhal_ctx_init, PP, CONTEXT)
+HAL_FUNCTION (libhal_ctx_init_direct, NONE, CONTEXT)
+HAL_FUNCTION (libhal_ctx_shutdown, PP, CONTEXT)
+HAL_FUNCTION (libhal_ctx_free, P, CONTEXT)
+HAL_FUNCTION (libhal_ctx_set_device_added, NONE, CONTEXT)
+HAL_FUNCTION (libhal_ctx_set_device_removed, NONE, CONTEXT)
+HAL_FUNCTION (libhal_ctx_set_device_new_capability, NONE, CONTEXT)
+HAL_FUNCTION (libhal_ctx_set_device_lost_capability, NONE, CONTEXT)
+HAL_FUNCTION (libhal_ctx_set_device_property_modified, NONE, CONTEXT)
+HAL_FUNCTION (libhal_ctx_set_device_condition, NONE, CONTEXT)
+HAL_FUNCTION (libhal_ctx_set_singleton_device_added, NONE, CONTEXT)
+HAL_FUNCTION (libhal_ctx_set_singleton_device_removed, NONE, CONTEXT)
+HAL_FUNCTION (libhal_string_array_length, NONE, ALL)
+HAL_FUNCTION (libhal_device_rescan, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_reprobe, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_emit_condition, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_addon_is_ready, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_singleton_addon_is_ready, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_claim_interface, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_new_changeset, NONE, MODIFY)
+HAL_FUNCTION (libhal_changeset_append, NONE, ALL)
+HAL_FUNCTION (libhal_changeset_set_property_string, NONE, MODIFY)
+HAL_FUNCTION (libhal_changeset_set_property_int, NONE, MODIFY)
+HAL_FUNCTION (libhal_changeset_set_property_uint64, NONE, MODIFY)
+HAL_FUNCTION (libhal_changeset_set_property_double, NONE, MODIFY)
+HAL_FUNCTION (libhal_changeset_set_property_bool, NONE, MODIFY)
+HAL_FUNCTION (libhal_changeset_set_property_strlist, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_commit_changeset, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_free_changeset, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_acquire_interface_lock, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_release_interface_lock, NONE, MODIFY)
+HAL_FUNCTION (libhal_acquire_global_interface_lock, NONE, MODIFY)
+HAL_FUNCTION (libhal_release_global_interface_lock, NONE, MODIFY)
+HAL_FUNCTION (libhal_device_is_caller_locked_out, NONE, QUERY)
+HAL_FUNCTION (libhal_ctx_set_global_interface_lock_acquired, NONE, CONTEXT)
+HAL_FUNCTION (libhal_ctx_set_global_interface_lock_released, NONE, CONTEXT)
+HAL_FUNCTION (libhal_ctx_set_interface_lock_acquired, NONE, CONTEXT)
+HAL_FUNCTION (libhal_ctx_set_interface_lock_released, NONE, CONTEXT)
+HAL_FUNCTION (libhal_device_is_locked_by_others, NONE, QUERY)
+HAL_FUNCTION (libhal_device_is_caller_privileged, NONE, QUERY)
+HAL_FUNCTION (libhal_get_all_devices_with_properties, NONE, QUERY)
+HAL_FUNCTION (libhal_dummy_set_trace_mask, NONE, CONTEXT)
+HAL_FUNCTION (libhal_dummy_get_stats, NONE, QUERY)
+HAL_FUNCTION (libhal_dummy_free_stats, NONE, ALL)
+HAL_FUNCTION (libhal_dummy_reset_stats, NONE, CONTEXT)
+HAL_FUNCTION (libhal_dummy_get_string_pool_stats, NONE, QUERY)
+HAL_FUNCTION (libhal_device_get_generation, NONE, QUERY)
+HAL_FUNCTION (libhal_get_gdl_generation, NONE, QUERY)
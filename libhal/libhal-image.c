@@ -0,0 +1,912 @@
+/***************************************************************************
+ *
+ * libhal-image.c : look up devices in a compiled device list
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dbus/dbus.h>
+
+#include "libhal.h"
+#include "libhal-image.h"
+#include "libhal-private.h"
+
+/*
+ * The image, see libhal-image.h, is mapped read-only and checked once
+ * when opened.  Devices and properties are found by binary search;
+ * nothing is allocated except the copies of strings handed back to
+ * callers.
+ *
+ * The image is opened by the store while it is set up and never
+ * changes afterwards, so no locking is needed here.
+ *
+ * The same lookups work on any image in memory through a #HalImage
+ * view, which is how readers of the shared GDL, see libhal-shared.c,
+ * look at an image the writer may be rewriting under them.  So every
+ * offset is checked before it is followed, a property is copied
+ * before it is looked at, and strings are only trusted to end with
+ * the last byte of the view, which must be a NUL.  What comes back
+ * from a view that changed is garbage, but never a crash.
+ *
+ * hal_image_builder_* write an image, for the writer of the shared
+ * GDL, in two passes over the devices: one to measure and one to fill.
+ */
+
+static HalImage hal_image;
+
+static int
+hal_image_section_valid (size_t size, uint32_t offset, uint32_t count, size_t item_size)
+{
+	return offset % HAL_IMAGE_ALIGN == 0 && offset <= size &&
+		count <= (size - offset) / item_size;
+}
+
+/**
+ * hal_image_view:
+ * @image: the view to set up
+ * @map: an image
+ * @size: bytes at @map, of which the last must be a NUL
+ *
+ * Set up @image to look at @map.  Sections that do not fit in @size
+ * are left empty, and so is the whole view if @map does not start
+ * with an image header.
+ */
+void
+hal_image_view (HalImage *image, const char *map, size_t size)
+{
+	HalImageHeader h;
+
+	memset (image, 0, sizeof (HalImage));
+	image->map = map;
+	image->size = size;
+	image->strings = "";
+
+	if (size < sizeof (HalImageHeader) || map[size - 1] != '\0')
+		return;
+	/* read the header once, it may be changing */
+	memcpy (&h, map, sizeof (HalImageHeader));
+	if (h.magic != HAL_IMAGE_MAGIC || h.version != HAL_IMAGE_VERSION)
+		return;
+
+	if (hal_image_section_valid (size, h.devices, h.num_devices, sizeof (HalImageDevice)) &&
+	    hal_image_section_valid (size, h.order, h.num_devices, sizeof (uint32_t))) {
+		image->num_devices = h.num_devices;
+		image->devices = (const HalImageDevice *) (map + h.devices);
+		image->order = (const uint32_t *) (map + h.order);
+	}
+	if (hal_image_section_valid (size, h.properties, h.num_properties, sizeof (HalImageProperty))) {
+		image->num_properties = h.num_properties;
+		image->properties = (const HalImageProperty *) (map + h.properties);
+	}
+	if (hal_image_section_valid (size, h.lists, h.num_list_words, sizeof (uint32_t))) {
+		image->num_list_words = h.num_list_words;
+		image->lists = (const uint32_t *) (map + h.lists);
+	}
+	if (hal_image_section_valid (size, h.strings, h.strings_size, 1)) {
+		image->strings_size = h.strings_size;
+		image->strings = map + h.strings;
+	}
+}
+
+static int
+hal_image_property_valid (const HalImage *image, const HalImageProperty *p)
+{
+	uint32_t count;
+	uint32_t i;
+
+	if (p->key >= image->strings_size)
+		return FALSE;
+
+	switch (p->type) {
+	case LIBHAL_PROPERTY_TYPE_STRING:
+		return p->value.str_value < image->strings_size;
+	case LIBHAL_PROPERTY_TYPE_STRLIST:
+		if (p->value.strlist_value >= image->num_list_words)
+			return FALSE;
+		count = image->lists[p->value.strlist_value];
+		if (count > image->num_list_words - p->value.strlist_value - 1)
+			return FALSE;
+		for (i = 1; i <= count; i++) {
+			if (image->lists[p->value.strlist_value + i] >= image->strings_size)
+				return FALSE;
+		}
+		return TRUE;
+	case LIBHAL_PROPERTY_TYPE_INT32:
+	case LIBHAL_PROPERTY_TYPE_UINT64:
+	case LIBHAL_PROPERTY_TYPE_DOUBLE:
+	case LIBHAL_PROPERTY_TYPE_BOOLEAN:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+/* Check all of @image once, so that errors in it are reported when it is opened */
+static int
+hal_image_valid (const HalImage *image)
+{
+	const HalImageHeader *h = (const HalImageHeader *) image->map;
+	const HalImageDevice *d;
+	uint32_t i;
+
+	if (image->num_devices != h->num_devices || image->num_properties != h->num_properties ||
+	    image->num_list_words != h->num_list_words || image->strings_size != h->strings_size ||
+	    h->strings_size == 0 || image->strings[h->strings_size - 1] != '\0')
+		return FALSE;
+
+	for (i = 0; i < h->num_devices; i++) {
+		d = &image->devices[i];
+		if (d->udi >= h->strings_size || image->order[i] >= h->num_devices ||
+		    d->first_property > h->num_properties ||
+		    d->num_properties > h->num_properties - d->first_property)
+			return FALSE;
+		if (i > 0 && strcmp (image->strings + image->devices[i - 1].udi,
+				     image->strings + d->udi) >= 0)
+			return FALSE;
+	}
+	for (i = 0; i < h->num_properties; i++) {
+		if (!hal_image_property_valid (image, &image->properties[i]))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * hal_image_open:
+ * @path: a file written by hal-dummy-compile
+ *
+ * Map the image for the other hal_image_* functions.
+ *
+ * Returns: FALSE if @path cannot be read or is not an image, in which
+ * case it is left alone
+ */
+int
+hal_image_open (const char *path)
+{
+	struct stat st;
+	HalImageHeader header;
+	void *map;
+	int fd;
+
+	fd = open (path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return FALSE;
+	if (fstat (fd, &st) < 0 || read (fd, &header, sizeof (header)) != sizeof (header) ||
+	    header.magic != HAL_IMAGE_MAGIC) {
+		close (fd);
+		return FALSE;
+	}
+	if (header.version != HAL_IMAGE_VERSION) {
+		fprintf (stderr, "%s %d : %s: image version %u is not supported\n",
+			 __FILE__, __LINE__, path, header.version);
+		close (fd);
+		return FALSE;
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED) {
+		fprintf (stderr, "%s %d : cannot map image %s\n", __FILE__, __LINE__, path);
+		return FALSE;
+	}
+
+	hal_image_view (&hal_image, map, st.st_size);
+	if (!hal_image_valid (&hal_image)) {
+		fprintf (stderr, "%s %d : %s is not a valid image\n", __FILE__, __LINE__, path);
+		hal_image_close ();
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * hal_image_close:
+ *
+ * Unmap the image.
+ */
+void
+hal_image_close (void)
+{
+	if (hal_image.map != NULL)
+		munmap ((void *) hal_image.map, hal_image.size);
+	memset (&hal_image, 0, sizeof (HalImage));
+}
+
+/**
+ * hal_image_num_devices:
+ *
+ * Returns: the number of devices in the image, 0 if none is open
+ */
+unsigned int
+hal_image_num_devices (void)
+{
+	return hal_image.num_devices;
+}
+
+/**
+ * hal_image_view_find_device:
+ * @image: the image
+ * @udi: the device
+ *
+ * Returns: the index of the device, or -1 if it is not in @image
+ */
+int
+hal_image_view_find_device (const HalImage *image, const char *udi)
+{
+	unsigned int lo = 0;
+	unsigned int hi = image->num_devices;
+	unsigned int mid;
+	uint32_t offset;
+	int cmp;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		offset = image->devices[mid].udi;
+		if (offset >= image->strings_size)
+			return -1;
+		cmp = strcmp (udi, image->strings + offset);
+		if (cmp == 0)
+			return mid;
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return -1;
+}
+
+/**
+ * hal_image_find_device:
+ * @udi: the device
+ *
+ * Returns: the index of the device, or -1 if it is not in the image
+ */
+int
+hal_image_find_device (const char *udi)
+{
+	return hal_image_view_find_device (&hal_image, udi);
+}
+
+/**
+ * hal_image_view_device_udi:
+ * @image: the image
+ * @device: index of the device
+ *
+ * Returns: the udi of the device, in @image
+ */
+const char *
+hal_image_view_device_udi (const HalImage *image, unsigned int device)
+{
+	uint32_t offset;
+
+	if (device >= image->num_devices)
+		return "";
+	offset = image->devices[device].udi;
+	return offset < image->strings_size ? image->strings + offset : "";
+}
+
+/**
+ * hal_image_device_udi:
+ * @device: index of the device
+ *
+ * Returns: the udi of the device, in the image
+ */
+const char *
+hal_image_device_udi (unsigned int device)
+{
+	return hal_image_view_device_udi (&hal_image, device);
+}
+
+/**
+ * hal_image_view_device_at:
+ * @image: the image
+ * @n: position in the GDL @image was made from, less than its number
+ * of devices
+ *
+ * Returns: the index of the @n-th device
+ */
+unsigned int
+hal_image_view_device_at (const HalImage *image, unsigned int n)
+{
+	uint32_t device;
+
+	if (n >= image->num_devices)
+		return 0;
+	device = image->order[n];
+	return device < image->num_devices ? device : 0;
+}
+
+/**
+ * hal_image_device_at:
+ * @n: position in the fixture the image was compiled from
+ *
+ * Returns: the index of the @n-th device of the fixture
+ */
+unsigned int
+hal_image_device_at (unsigned int n)
+{
+	return hal_image_view_device_at (&hal_image, n);
+}
+
+/* The properties of @device, or NULL with *@num_properties 0 if they are out of @image */
+static const HalImageProperty *
+hal_image_device_properties (const HalImage *image, unsigned int device, uint32_t *num_properties)
+{
+	HalImageDevice d;
+
+	*num_properties = 0;
+	if (device >= image->num_devices)
+		return NULL;
+	d = image->devices[device];
+	if (d.first_property > image->num_properties ||
+	    d.num_properties > image->num_properties - d.first_property)
+		return NULL;
+	*num_properties = d.num_properties;
+	return image->properties + d.first_property;
+}
+
+/* Copy the property @key of @device to @prop; FALSE if there is none */
+static int
+hal_image_find_property (const HalImage *image, unsigned int device, const char *key,
+			 HalImageProperty *prop)
+{
+	const HalImageProperty *props;
+	uint32_t num_properties;
+	unsigned int lo = 0;
+	unsigned int hi;
+	unsigned int mid;
+	int cmp;
+
+	props = hal_image_device_properties (image, device, &num_properties);
+	hi = num_properties;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		*prop = props[mid];
+		if (prop->key >= image->strings_size)
+			return FALSE;
+		cmp = strcmp (key, image->strings + prop->key);
+		if (cmp == 0)
+			return TRUE;
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return FALSE;
+}
+
+/*
+ * Fill @value from @p.  With @copy, strings are copied with malloc();
+ * without, they point into the image and a string list is a malloc()ed
+ * array of such pointers.
+ */
+static int
+hal_image_value (const HalImage *image, const HalImageProperty *p, HalValue *value, int copy)
+{
+	const uint32_t *list;
+	uint32_t count;
+	unsigned int i;
+
+	switch (p->type) {
+	case LIBHAL_PROPERTY_TYPE_STRING:
+		if (p->value.str_value >= image->strings_size)
+			return FALSE;
+		value->str_value = (char *) image->strings + p->value.str_value;
+		if (copy)
+			value->str_value = strdup (value->str_value);
+		return value->str_value != NULL;
+	case LIBHAL_PROPERTY_TYPE_STRLIST:
+		if (p->value.strlist_value >= image->num_list_words)
+			return FALSE;
+		list = image->lists + p->value.strlist_value;
+		count = list[0];
+		if (count > image->num_list_words - p->value.strlist_value - 1)
+			return FALSE;
+		value->strlist_value = calloc (count + 1, sizeof (char *));
+		if (value->strlist_value == NULL)
+			return FALSE;
+		for (i = 0; i < count; i++) {
+			if (list[i + 1] >= image->strings_size) {
+				value->strlist_value[i] = NULL;
+				break;
+			}
+			value->strlist_value[i] = (char *) image->strings + list[i + 1];
+			if (copy && (value->strlist_value[i] = strdup (value->strlist_value[i])) == NULL)
+				break;
+		}
+		if (i < count) {
+			if (copy)
+				libhal_free_string_array (value->strlist_value);
+			else
+				free (value->strlist_value);
+			return FALSE;
+		}
+		return TRUE;
+	case LIBHAL_PROPERTY_TYPE_INT32:
+		value->int_value = p->value.int_value;
+		return TRUE;
+	case LIBHAL_PROPERTY_TYPE_UINT64:
+		value->uint64_value = p->value.uint64_value;
+		return TRUE;
+	case LIBHAL_PROPERTY_TYPE_DOUBLE:
+		value->double_value = p->value.double_value;
+		return TRUE;
+	case LIBHAL_PROPERTY_TYPE_BOOLEAN:
+		value->bool_value = p->value.bool_value != 0;
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+/**
+ * hal_image_view_get_property_type:
+ * @image: the image
+ * @device: index of the device
+ * @key: the property
+ *
+ * Returns: the LIBHAL_PROPERTY_TYPE_* of the property, or
+ * LIBHAL_PROPERTY_TYPE_INVALID if there is no such property
+ */
+int
+hal_image_view_get_property_type (const HalImage *image, unsigned int device, const char *key)
+{
+	HalImageProperty p;
+
+	if (!hal_image_find_property (image, device, key, &p))
+		return LIBHAL_PROPERTY_TYPE_INVALID;
+	return p.type;
+}
+
+/**
+ * hal_image_get_property_type:
+ * @device: index of the device
+ * @key: the property
+ *
+ * Returns: the LIBHAL_PROPERTY_TYPE_* of the property, or
+ * LIBHAL_PROPERTY_TYPE_INVALID if there is no such property
+ */
+int
+hal_image_get_property_type (unsigned int device, const char *key)
+{
+	return hal_image_view_get_property_type (&hal_image, device, key);
+}
+
+/**
+ * hal_image_view_get_property:
+ * @image: the image
+ * @device: index of the device
+ * @key: the property
+ * @type: the LIBHAL_PROPERTY_TYPE_* the property should have
+ * @value: where to copy the value
+ *
+ * Strings and string lists are copied with malloc().
+ *
+ * Returns: FALSE if there is no such property of that type, or out of memory
+ */
+int
+hal_image_view_get_property (const HalImage *image, unsigned int device, const char *key,
+			     int type, HalValue *value)
+{
+	HalImageProperty p;
+
+	if (!hal_image_find_property (image, device, key, &p) || p.type != type)
+		return FALSE;
+	return hal_image_value (image, &p, value, TRUE);
+}
+
+/**
+ * hal_image_get_property:
+ * @device: index of the device
+ * @key: the property
+ * @type: the LIBHAL_PROPERTY_TYPE_* the property should have
+ * @value: where to copy the value
+ *
+ * Strings and string lists are copied with malloc().
+ *
+ * Returns: FALSE if there is no such property of that type, or out of memory
+ */
+int
+hal_image_get_property (unsigned int device, const char *key, int type, HalValue *value)
+{
+	return hal_image_view_get_property (&hal_image, device, key, type, value);
+}
+
+/**
+ * hal_image_view_get_string:
+ * @image: the image
+ * @device: index of the device
+ * @key: the property
+ *
+ * Returns: the value of the string property in @image, or NULL if
+ * there is no such property of that type
+ */
+const char *
+hal_image_view_get_string (const HalImage *image, unsigned int device, const char *key)
+{
+	HalImageProperty p;
+
+	if (!hal_image_find_property (image, device, key, &p) ||
+	    p.type != LIBHAL_PROPERTY_TYPE_STRING || p.value.str_value >= image->strings_size)
+		return NULL;
+	return image->strings + p.value.str_value;
+}
+
+/**
+ * hal_image_get_string:
+ * @device: index of the device
+ * @key: the property
+ *
+ * Returns: the value of the string property in the image, or NULL if
+ * there is no such property of that type
+ */
+const char *
+hal_image_get_string (unsigned int device, const char *key)
+{
+	return hal_image_view_get_string (&hal_image, device, key);
+}
+
+/**
+ * hal_image_view_get_strlist:
+ * @image: the image
+ * @device: index of the device
+ * @key: the property
+ * @strlist: where to store the value, NULL if there is no such string list
+ *
+ * The value is an array of strings in @image, to be freed with free().
+ *
+ * Returns: FALSE if out of memory
+ */
+int
+hal_image_view_get_strlist (const HalImage *image, unsigned int device, const char *key,
+			    char ***strlist)
+{
+	HalImageProperty p;
+	HalValue value;
+
+	*strlist = NULL;
+	if (!hal_image_find_property (image, device, key, &p) || p.type != LIBHAL_PROPERTY_TYPE_STRLIST)
+		return TRUE;
+	if (!hal_image_value (image, &p, &value, FALSE))
+		return FALSE;
+	*strlist = value.strlist_value;
+	return TRUE;
+}
+
+/**
+ * hal_image_get_strlist:
+ * @device: index of the device
+ * @key: the property
+ * @strlist: where to store the value, NULL if there is no such string list
+ *
+ * The value is an array of strings in the image, to be freed with free().
+ *
+ * Returns: FALSE if out of memory
+ */
+int
+hal_image_get_strlist (unsigned int device, const char *key, char ***strlist)
+{
+	return hal_image_view_get_strlist (&hal_image, device, key, strlist);
+}
+
+/**
+ * hal_image_view_foreach_property:
+ * @image: the image
+ * @device: index of the device
+ * @func: called for each property, with @target as the device
+ * @target: passed to @func
+ *
+ * The values passed to @func are only valid during the call.
+ *
+ * Returns: FALSE if @func failed or out of memory
+ */
+int
+hal_image_view_foreach_property (const HalImage *image, unsigned int device,
+				 HalFixturePropertyFunc func, void *target)
+{
+	const HalImageProperty *props;
+	HalImageProperty p;
+	HalValue value;
+	uint32_t num_properties;
+	unsigned int i;
+	int ok;
+
+	props = hal_image_device_properties (image, device, &num_properties);
+	for (i = 0; i < num_properties; i++) {
+		p = props[i];
+		if (p.key >= image->strings_size || !hal_image_value (image, &p, &value, FALSE))
+			return FALSE;
+		ok = func (target, image->strings + p.key, p.type, &value);
+		if (p.type == LIBHAL_PROPERTY_TYPE_STRLIST)
+			free (value.strlist_value);
+		if (!ok)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * hal_image_foreach_property:
+ * @device: index of the device
+ * @func: called for each property, with @target as the device
+ * @target: passed to @func
+ *
+ * The values passed to @func are only valid during the call.
+ *
+ * Returns: FALSE if @func failed or out of memory
+ */
+int
+hal_image_foreach_property (unsigned int device, HalFixturePropertyFunc func, void *target)
+{
+	return hal_image_view_foreach_property (&hal_image, device, func, target);
+}
+
+typedef struct {
+	const char *udi;
+	HalImageDevice device;
+} HalImageBuilderDevice;
+
+static size_t
+hal_image_align (size_t n)
+{
+	return (n + HAL_IMAGE_ALIGN - 1) & ~(size_t) (HAL_IMAGE_ALIGN - 1);
+}
+
+/**
+ * hal_image_builder_init:
+ * @builder: the builder
+ *
+ * Start measuring an image.  The devices are given twice, in the order
+ * of the GDL, to hal_image_builder_add_device() and each of their
+ * properties to hal_image_builder_add_property(): once to measure the
+ * image and once after hal_image_builder_place() to write it.
+ */
+void
+hal_image_builder_init (HalImageBuilder *builder)
+{
+	memset (builder, 0, sizeof (HalImageBuilder));
+	builder->strings_size = 1;      /* the empty string */
+}
+
+/* Copy @s into the image, or count it while measuring */
+static uint32_t
+hal_image_builder_string (HalImageBuilder *builder, const char *s)
+{
+	HalImageHeader *h = builder->image;
+	size_t len = strlen (s) + 1;
+	uint32_t offset;
+
+	if (h == NULL) {
+		builder->strings_size += len;
+		return 0;
+	}
+	offset = h->strings_size;
+	memcpy ((char *) h + h->strings + offset, s, len);
+	h->strings_size += len;
+	return offset;
+}
+
+/**
+ * hal_image_builder_add_device:
+ * @builder: the builder, a #HalImageBuilder
+ * @udi: the next device of the GDL
+ *
+ * A #HalFixtureDeviceFunc.
+ *
+ * Returns: @builder, to pass to hal_image_builder_add_property()
+ */
+void *
+hal_image_builder_add_device (void *builder, const char *udi)
+{
+	HalImageBuilder *b = builder;
+	HalImageHeader *h = b->image;
+	HalImageDevice *d;
+
+	if (h == NULL) {
+		b->num_devices++;
+		hal_image_builder_string (b, udi);
+		return b;
+	}
+
+	d = (HalImageDevice *) ((char *) h + h->devices) + h->num_devices;
+	d->udi = hal_image_builder_string (b, udi);
+	d->first_property = h->num_properties;
+	d->num_properties = 0;
+	d->reserved = h->num_devices;   /* its position, until finished */
+	h->num_devices++;
+	return b;
+}
+
+/**
+ * hal_image_builder_add_property:
+ * @builder: the builder, a #HalImageBuilder
+ * @key: the property
+ * @type: the LIBHAL_PROPERTY_TYPE_* of @value
+ * @value: the value, copied into the image
+ *
+ * A #HalFixturePropertyFunc, adding a property to the device last
+ * given to hal_image_builder_add_device().
+ *
+ * Returns: TRUE
+ */
+int
+hal_image_builder_add_property (void *builder, const char *key, int type, const HalValue *value)
+{
+	HalImageBuilder *b = builder;
+	HalImageHeader *h = b->image;
+	HalImageDevice *d;
+	HalImageProperty *props;
+	HalImageProperty p;
+	uint32_t *lists;
+	const char *strings;
+	unsigned int i;
+
+	if (h == NULL) {
+		b->num_properties++;
+		hal_image_builder_string (b, key);
+		if (type == LIBHAL_PROPERTY_TYPE_STRING) {
+			hal_image_builder_string (b, value->str_value);
+		} else if (type == LIBHAL_PROPERTY_TYPE_STRLIST) {
+			for (i = 0; value->strlist_value[i] != NULL; i++)
+				hal_image_builder_string (b, value->strlist_value[i]);
+			b->num_list_words += i + 1;
+		}
+		return TRUE;
+	}
+
+	d = (HalImageDevice *) ((char *) h + h->devices) + h->num_devices - 1;
+	props = (HalImageProperty *) ((char *) h + h->properties);
+	lists = (uint32_t *) ((char *) h + h->lists);
+	strings = (const char *) h + h->strings;
+
+	memset (&p, 0, sizeof (HalImageProperty));
+	p.key = hal_image_builder_string (b, key);
+	p.type = type;
+	switch (type) {
+	case LIBHAL_PROPERTY_TYPE_STRING:
+		p.value.str_value = hal_image_builder_string (b, value->str_value);
+		break;
+	case LIBHAL_PROPERTY_TYPE_STRLIST:
+		p.value.strlist_value = h->num_list_words;
+		for (i = 0; value->strlist_value[i] != NULL; i++)
+			lists[h->num_list_words + 1 + i] = hal_image_builder_string (b, value->strlist_value[i]);
+		lists[h->num_list_words] = i;
+		h->num_list_words += i + 1;
+		break;
+	case LIBHAL_PROPERTY_TYPE_INT32:
+		p.value.int_value = value->int_value;
+		break;
+	case LIBHAL_PROPERTY_TYPE_UINT64:
+		p.value.uint64_value = value->uint64_value;
+		break;
+	case LIBHAL_PROPERTY_TYPE_DOUBLE:
+		p.value.double_value = value->double_value;
+		break;
+	case LIBHAL_PROPERTY_TYPE_BOOLEAN:
+		p.value.bool_value = value->bool_value != 0;
+		break;
+	}
+
+	/* keep the run of the device sorted by key */
+	for (i = h->num_properties;
+	     i > d->first_property && strcmp (strings + props[i - 1].key, strings + p.key) > 0; i--)
+		props[i] = props[i - 1];
+	props[i] = p;
+	h->num_properties++;
+	d->num_properties++;
+	return TRUE;
+}
+
+/**
+ * hal_image_builder_get_size:
+ * @builder: the builder, once all devices have been measured
+ *
+ * Returns: the bytes the image needs
+ */
+size_t
+hal_image_builder_get_size (const HalImageBuilder *builder)
+{
+	return hal_image_align (sizeof (HalImageHeader)) +
+		hal_image_align (builder->num_devices * sizeof (HalImageDevice)) +
+		hal_image_align (builder->num_devices * sizeof (uint32_t)) +
+		hal_image_align (builder->num_properties * sizeof (HalImageProperty)) +
+		hal_image_align (builder->num_list_words * sizeof (uint32_t)) +
+		builder->strings_size;
+}
+
+/**
+ * hal_image_builder_place:
+ * @builder: the builder, once all devices have been measured
+ * @image: hal_image_builder_get_size() bytes, aligned for any value,
+ * at most 4GB
+ *
+ * Lay out the image in @image, ready to be filled.
+ */
+void
+hal_image_builder_place (HalImageBuilder *builder, void *image)
+{
+	HalImageHeader *h = image;
+
+	memset (h, 0, sizeof (HalImageHeader));
+	h->magic = HAL_IMAGE_MAGIC;
+	h->version = HAL_IMAGE_VERSION;
+	h->devices = hal_image_align (sizeof (HalImageHeader));
+	h->order = h->devices + hal_image_align (builder->num_devices * sizeof (HalImageDevice));
+	h->properties = h->order + hal_image_align (builder->num_devices * sizeof (uint32_t));
+	h->lists = h->properties + hal_image_align (builder->num_properties * sizeof (HalImageProperty));
+	h->strings = h->lists + hal_image_align (builder->num_list_words * sizeof (uint32_t));
+	((char *) image)[h->strings] = '\0';
+	h->strings_size = 1;
+
+	builder->image = image;
+}
+
+static int
+hal_image_builder_compare (const void *a, const void *b)
+{
+	return strcmp (((const HalImageBuilderDevice *) a)->udi, ((const HalImageBuilderDevice *) b)->udi);
+}
+
+/**
+ * hal_image_builder_finish:
+ * @builder: the builder, once all devices have been written
+ *
+ * Sort the devices by udi, as lookups expect.
+ *
+ * Returns: FALSE if out of memory
+ */
+int
+hal_image_builder_finish (HalImageBuilder *builder)
+{
+	HalImageHeader *h = builder->image;
+	HalImageDevice *devices = (HalImageDevice *) ((char *) h + h->devices);
+	uint32_t *order = (uint32_t *) ((char *) h + h->order);
+	const char *strings = (const char *) h + h->strings;
+	HalImageBuilderDevice *sorted;
+	unsigned int i;
+
+	if (h->num_devices == 0)
+		return TRUE;
+	sorted = malloc (h->num_devices * sizeof (HalImageBuilderDevice));
+	if (sorted == NULL)
+		return FALSE;
+	for (i = 0; i < h->num_devices; i++) {
+		sorted[i].udi = strings + devices[i].udi;
+		sorted[i].device = devices[i];
+	}
+	qsort (sorted, h->num_devices, sizeof (HalImageBuilderDevice), hal_image_builder_compare);
+	for (i = 0; i < h->num_devices; i++) {
+		devices[i] = sorted[i].device;
+		order[devices[i].reserved] = i;
+		devices[i].reserved = 0;
+	}
+	free (sorted);
+	return TRUE;
+}
@@ -0,0 +1,108 @@
+/***************************************************************************
+ *
+ * libhal-image.h : layout of the compiled device list
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifndef LIBHAL_IMAGE_H
+#define LIBHAL_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * hal-dummy-compile turns a fixture into an image, laid out as
+ *
+ *   HalImageHeader
+ *   HalImageDevice    x num_devices, sorted by udi
+ *   uint32_t          x num_devices, device indexes in fixture order
+ *   HalImageProperty  x num_properties, a run per device sorted by key
+ *   uint32_t          x num_list_words, string lists
+ *   char              x strings_size, NUL terminated strings
+ *
+ * Sections start at the offsets in the header, which are multiples of
+ * eight bytes from the start of the file.  Strings are stored once
+ * and referred to by their offset in the string section; a string
+ * list is a count followed by that many string offsets, and referred
+ * to by the index of the count.  Everything is in the byte order of
+ * the machine that compiled the image, a mismatch shows in the magic.
+ *
+ * libhal maps an image read-only and answers lookups straight from
+ * it, see libhal-image.c.  The writer of the shared GDL lays out the
+ * same image in shared memory, see libhal-shared.c.
+ */
+
+#define HAL_IMAGE_MAGIC          0x4d494448      /* "HDIM" */
+#define HAL_IMAGE_VERSION        1
+#define HAL_IMAGE_ALIGN          8
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_devices;
+	uint32_t num_properties;
+	uint32_t num_list_words;
+	uint32_t strings_size;
+	uint32_t devices;               /**< offsets of the sections */
+	uint32_t order;
+	uint32_t properties;
+	uint32_t lists;
+	uint32_t strings;
+	uint32_t reserved;
+} HalImageHeader;
+
+typedef struct {
+	uint32_t udi;                   /**< string offset */
+	uint32_t first_property;
+	uint32_t num_properties;
+	uint32_t reserved;
+} HalImageDevice;
+
+typedef struct {
+	uint32_t key;                   /**< string offset */
+	int32_t type;                   /**< LIBHAL_PROPERTY_TYPE_* */
+	union {
+		uint32_t str_value;     /**< string offset */
+		int32_t int_value;
+		uint64_t uint64_value;
+		double double_value;
+		uint32_t bool_value;
+		uint32_t strlist_value; /**< index in the lists section */
+	} value;
+} HalImageProperty;
+
+/*
+ * A view of an image in memory, see hal_image_view().  Only the
+ * sections that fit are set, so an offset can be followed once it
+ * has been checked against the counts here.
+ */
+struct HalImage_s {
+	const char *map;
+	size_t size;
+	uint32_t num_devices;
+	uint32_t num_properties;
+	uint32_t num_list_words;
+	uint32_t strings_size;
+	const HalImageDevice *devices;
+	const uint32_t *order;
+	const HalImageProperty *properties;
+	const uint32_t *lists;
+	const char *strings;
+};
+
+#endif /* LIBHAL_IMAGE_H */
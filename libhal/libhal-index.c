@@ -0,0 +1,650 @@
+/***************************************************************************
+ *
+ * libhal-index.c : devices by the value of a string property
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <dbus/dbus.h>
+
+#include "libhal.h"
+#include "libhal-private.h"
+
+/*
+ * An inverted index from (key, string value) to the devices having
+ * that value, for libhal_manager_find_device_string_match().  Only
+ * keys that have been searched for are indexed, up to
+ * HAL_INDEX_MAX_KEYS of them, so that a property change costs at most
+ * one probe per indexed key.
+ *
+ * Each indexed key has an open addressing hash table of its values,
+ * like those of the store.  A value holds its devices in a
+ * HalIndexList, an array sorted by their position in the GDL, so a
+ * match is a probe and a copy of the array, in the order
+ * hal_store_get_all_devices() would list the devices.  Adding at the
+ * end of the GDL appends, and a device is found for removal by a
+ * binary search on its position.
+ *
+ * Capabilities are interned into small ids that never change, so the
+ * store can keep a bitset of them per device, and each capability has
+ * a HalIndexList of the devices that have it.
+ *
+ * The udis are not copied: the store keeps them alive while the
+ * device is indexed.  All calls are made with the store locked, see
+ * libhal-store.c.
+ */
+
+#define HAL_INDEX_MAX_KEYS   16
+#define HAL_INDEX_MIN_VALUES 16
+
+typedef struct {
+	char *value;                    /**< NULL if the slot is free */
+	uint32_t hash;
+	HalIndexList devices;
+} HalIndexValue;
+
+typedef struct {
+	char *key;
+	uint32_t hash;
+	HalIndexValue *values;
+	unsigned int num_values;
+	unsigned int size;              /**< slots in values, a power of two */
+} HalIndexKey;
+
+typedef struct {
+	char *name;
+	uint32_t hash;
+	HalIndexList devices;
+} HalCapability;
+
+static HalIndexKey hal_index_keys[HAL_INDEX_MAX_KEYS];
+static unsigned int hal_index_num_keys;
+
+static HalCapability *hal_capabilities;        /**< by id */
+static unsigned int hal_num_capabilities;
+static int *hal_capability_slots;              /**< ids by hash of the name, -1 if free */
+static unsigned int hal_capability_size;       /**< slots, a power of two */
+
+static uint32_t
+hal_index_hash (const char *s)
+{
+	uint32_t h = 2166136261U;
+
+	while (*s != '\0')
+		h = (h ^ (unsigned char) *s++) * 16777619U;
+	return h;
+}
+
+/*
+ * Device lists
+ */
+
+/* First device of @list at or after @position */
+static unsigned int
+hal_index_list_search (const HalIndexList *list, uint64_t position)
+{
+	unsigned int lo = 0;
+	unsigned int hi = list->num_devices;
+	unsigned int mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (list->devices[mid].position < position)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/**
+ * hal_index_list_add:
+ * @list: the list
+ * @udi: the device, which must stay valid until removed from @list
+ * @position: position of the device in the GDL
+ *
+ * Does nothing if the device is already in @list.  A device already
+ * at @position is replaced, as when a device copied from the image
+ * takes the place of the image device.
+ *
+ * Returns: FALSE if out of memory
+ */
+int
+hal_index_list_add (HalIndexList *list, const char *udi, uint64_t position)
+{
+	HalIndexDevice *devices;
+	unsigned int size;
+	unsigned int i;
+
+	/* devices are mostly added at the end of the GDL */
+	if (list->num_devices == 0 || list->devices[list->num_devices - 1].position < position) {
+		i = list->num_devices;
+	} else {
+		i = hal_index_list_search (list, position);
+		if (list->devices[i].position == position) {
+			list->devices[i].udi = udi;
+			return TRUE;
+		}
+	}
+
+	if (list->num_devices == list->size) {
+		size = list->size ? list->size * 2 : 1;
+		devices = realloc (list->devices, size * sizeof (HalIndexDevice));
+		if (devices == NULL)
+			return FALSE;
+		list->devices = devices;
+		list->size = size;
+	}
+
+	memmove (&list->devices[i + 1], &list->devices[i],
+		 (list->num_devices - i) * sizeof (HalIndexDevice));
+	list->devices[i].udi = udi;
+	list->devices[i].position = position;
+	list->num_devices++;
+	return TRUE;
+}
+
+/**
+ * hal_index_list_remove:
+ * @list: the list
+ * @udi: the device, as given to hal_index_list_add()
+ * @position: as given to hal_index_list_add()
+ *
+ * Does nothing if the device is not in @list.
+ */
+void
+hal_index_list_remove (HalIndexList *list, const char *udi, uint64_t position)
+{
+	unsigned int i;
+
+	i = hal_index_list_search (list, position);
+	if (i == list->num_devices || list->devices[i].udi != udi)
+		return;
+
+	list->num_devices--;
+	memmove (&list->devices[i], &list->devices[i + 1],
+		 (list->num_devices - i) * sizeof (HalIndexDevice));
+}
+
+/**
+ * hal_index_list_udis:
+ * @list: the list, or NULL for none
+ * @num_devices: where to store the number of devices
+ *
+ * Returns: the udis of the devices in @list, in GDL order, as a NULL
+ * terminated array for libhal_free_string_array(), or NULL if out of
+ * memory
+ */
+char **
+hal_index_list_udis (const HalIndexList *list, int *num_devices)
+{
+	char **udis;
+	unsigned int n = list != NULL ? list->num_devices : 0;
+	unsigned int i;
+
+	*num_devices = 0;
+
+	udis = malloc ((n + 1) * sizeof (char *));
+	if (udis == NULL)
+		return NULL;
+	udis[0] = NULL;
+	for (i = 0; i < n; i++) {
+		udis[i] = strdup (list->devices[i].udi);
+		if (udis[i] == NULL) {
+			libhal_free_string_array (udis);
+			return NULL;
+		}
+		udis[i + 1] = NULL;
+	}
+
+	*num_devices = n;
+	return udis;
+}
+
+/*
+ * String properties
+ */
+
+static HalIndexKey *
+hal_index_key_find (const char *key)
+{
+	uint32_t hash;
+	unsigned int i;
+
+	if (hal_index_num_keys == 0)
+		return NULL;
+
+	hash = hal_index_hash (key);
+	for (i = 0; i < hal_index_num_keys; i++) {
+		if (hal_index_keys[i].hash == hash && strcmp (hal_index_keys[i].key, key) == 0)
+			return &hal_index_keys[i];
+	}
+	return NULL;
+}
+
+static HalIndexValue *
+hal_index_value_find (const HalIndexKey *k, const char *value, uint32_t hash)
+{
+	unsigned int mask = k->size - 1;
+	unsigned int i;
+	HalIndexValue *v;
+
+	if (k->size == 0)
+		return NULL;
+
+	for (i = hash & mask; ; i = (i + 1) & mask) {
+		v = &k->values[i];
+		if (v->value == NULL)
+			return NULL;
+		if (v->hash == hash && strcmp (v->value, value) == 0)
+			return v;
+	}
+}
+
+static int
+hal_index_value_grow (HalIndexKey *k)
+{
+	HalIndexValue *old = k->values;
+	unsigned int old_size = k->size;
+	unsigned int size = old_size ? old_size * 2 : HAL_INDEX_MIN_VALUES;
+	unsigned int i;
+	unsigned int j;
+
+	k->values = calloc (size, sizeof (HalIndexValue));
+	if (k->values == NULL) {
+		k->values = old;
+		return FALSE;
+	}
+	k->size = size;
+
+	for (i = 0; i < old_size; i++) {
+		if (old[i].value == NULL)
+			continue;
+		for (j = old[i].hash & (size - 1); k->values[j].value != NULL; j = (j + 1) & (size - 1))
+			;
+		k->values[j] = old[i];
+	}
+	free (old);
+	return TRUE;
+}
+
+static HalIndexValue *
+hal_index_value_insert (HalIndexKey *k, const char *value, uint32_t hash)
+{
+	HalIndexValue *v;
+	unsigned int mask;
+	unsigned int i;
+
+	v = hal_index_value_find (k, value, hash);
+	if (v != NULL)
+		return v;
+
+	if ((k->num_values + 1) * 4 > k->size * 3 && !hal_index_value_grow (k))
+		return NULL;
+
+	mask = k->size - 1;
+	for (i = hash & mask; k->values[i].value != NULL; i = (i + 1) & mask)
+		;
+	v = &k->values[i];
+	v->value = strdup (value);
+	if (v->value == NULL)
+		return NULL;
+	v->hash = hash;
+	memset (&v->devices, 0, sizeof (HalIndexList));
+	k->num_values++;
+	return v;
+}
+
+static void
+hal_index_value_delete (HalIndexKey *k, HalIndexValue *v)
+{
+	unsigned int mask = k->size - 1;
+	unsigned int hole = v - k->values;
+	unsigned int i;
+	unsigned int home;
+
+	free (v->value);
+	free (v->devices.devices);
+	v->value = NULL;
+	k->num_values--;
+
+	for (i = (hole + 1) & mask; k->values[i].value != NULL; i = (i + 1) & mask) {
+		home = k->values[i].hash & mask;
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			k->values[hole] = k->values[i];
+			k->values[i].value = NULL;
+			hole = i;
+		}
+	}
+}
+
+/**
+ * hal_index_has_key:
+ * @key: the property
+ *
+ * Returns: TRUE if the values of @key are indexed
+ */
+int
+hal_index_has_key (const char *key)
+{
+	return hal_index_key_find (key) != NULL;
+}
+
+/**
+ * hal_index_is_full:
+ *
+ * Returns: TRUE if no more keys can be indexed
+ */
+int
+hal_index_is_full (void)
+{
+	return hal_index_num_keys == HAL_INDEX_MAX_KEYS;
+}
+
+/**
+ * hal_index_get_num_keys:
+ *
+ * Returns: the number of indexed keys
+ */
+unsigned int
+hal_index_get_num_keys (void)
+{
+	return hal_index_num_keys;
+}
+
+/**
+ * hal_index_key:
+ * @n: which key, less than hal_index_get_num_keys()
+ *
+ * Returns: the @n-th indexed key
+ */
+const char *
+hal_index_key (unsigned int n)
+{
+	return hal_index_keys[n].key;
+}
+
+/**
+ * hal_index_add_key:
+ * @key: the property
+ *
+ * Start indexing @key, with no devices yet; the caller then adds
+ * those having it with hal_index_add().
+ *
+ * Returns: FALSE if too many keys are indexed, or out of memory
+ */
+int
+hal_index_add_key (const char *key)
+{
+	HalIndexKey *k;
+
+	if (hal_index_is_full ())
+		return FALSE;
+
+	k = &hal_index_keys[hal_index_num_keys];
+	memset (k, 0, sizeof (HalIndexKey));
+	k->key = strdup (key);
+	if (k->key == NULL)
+		return FALSE;
+	k->hash = hal_index_hash (key);
+	hal_index_num_keys++;
+	return TRUE;
+}
+
+/**
+ * hal_index_remove_key:
+ * @key: the property
+ *
+ * Stop indexing @key, e.g. because an update failed and the index
+ * no longer matches the store.
+ */
+void
+hal_index_remove_key (const char *key)
+{
+	HalIndexKey *k;
+	unsigned int i;
+
+	k = hal_index_key_find (key);
+	if (k == NULL)
+		return;
+
+	for (i = 0; i < k->size; i++) {
+		if (k->values[i].value != NULL) {
+			free (k->values[i].value);
+			free (k->values[i].devices.devices);
+		}
+	}
+	free (k->values);
+	free (k->key);
+
+	*k = hal_index_keys[--hal_index_num_keys];
+}
+
+/**
+ * hal_index_add:
+ * @key: the property
+ * @value: its value on the device
+ * @udi: the device, which must stay valid until removed from the index
+ * @position: position of the device in the GDL
+ *
+ * Does nothing if @key is not indexed.
+ *
+ * Returns: FALSE if out of memory, in which case the caller should
+ * stop indexing @key
+ */
+int
+hal_index_add (const char *key, const char *value, const char *udi, uint64_t position)
+{
+	HalIndexKey *k;
+	HalIndexValue *v;
+
+	k = hal_index_key_find (key);
+	if (k == NULL)
+		return TRUE;
+
+	v = hal_index_value_insert (k, value, hal_index_hash (value));
+	if (v == NULL)
+		return FALSE;
+	if (!hal_index_list_add (&v->devices, udi, position)) {
+		if (v->devices.num_devices == 0)
+			hal_index_value_delete (k, v);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * hal_index_remove:
+ * @key: the property
+ * @value: its value on the device
+ * @udi: the device, as given to hal_index_add()
+ * @position: as given to hal_index_add()
+ *
+ * Does nothing if @key is not indexed or the device is not there.
+ */
+void
+hal_index_remove (const char *key, const char *value, const char *udi, uint64_t position)
+{
+	HalIndexKey *k;
+	HalIndexValue *v;
+
+	k = hal_index_key_find (key);
+	if (k == NULL)
+		return;
+	v = hal_index_value_find (k, value, hal_index_hash (value));
+	if (v == NULL)
+		return;
+
+	hal_index_list_remove (&v->devices, udi, position);
+	if (v->devices.num_devices == 0)
+		hal_index_value_delete (k, v);
+}
+
+/**
+ * hal_index_lookup:
+ * @key: an indexed property
+ * @value: the value to match
+ * @num_devices: where to store the number of devices
+ *
+ * Returns: the udis of the devices where @key is @value, in GDL order,
+ * as a NULL terminated array for libhal_free_string_array(), or NULL
+ * if out of memory
+ */
+char **
+hal_index_lookup (const char *key, const char *value, int *num_devices)
+{
+	HalIndexKey *k;
+	HalIndexValue *v = NULL;
+
+	k = hal_index_key_find (key);
+	if (k != NULL)
+		v = hal_index_value_find (k, value, hal_index_hash (value));
+	return hal_index_list_udis (v != NULL ? &v->devices : NULL, num_devices);
+}
+
+/*
+ * Capabilities
+ */
+
+static int
+hal_capability_grow (void)
+{
+	HalCapability *capabilities;
+	int *slots;
+	unsigned int size = hal_capability_size ? hal_capability_size * 2 : HAL_INDEX_MIN_VALUES;
+	unsigned int i;
+	unsigned int j;
+
+	/* the ids fill at most half of the slots */
+	capabilities = realloc (hal_capabilities, size / 2 * sizeof (HalCapability));
+	if (capabilities == NULL)
+		return FALSE;
+	hal_capabilities = capabilities;
+
+	slots = malloc (size * sizeof (int));
+	if (slots == NULL)
+		return FALSE;
+	for (i = 0; i < size; i++)
+		slots[i] = -1;
+	for (i = 0; i < hal_num_capabilities; i++) {
+		for (j = hal_capabilities[i].hash & (size - 1); slots[j] != -1; j = (j + 1) & (size - 1))
+			;
+		slots[j] = i;
+	}
+
+	free (hal_capability_slots);
+	hal_capability_slots = slots;
+	hal_capability_size = size;
+	return TRUE;
+}
+
+/**
+ * hal_capability_id:
+ * @name: the capability
+ * @add: give @name an id if it has none yet
+ *
+ * Returns: the id of @name, from 0 up, or -1 if it has none or out
+ * of memory
+ */
+int
+hal_capability_id (const char *name, int add)
+{
+	HalCapability *capability;
+	uint32_t hash = hal_index_hash (name);
+	unsigned int mask;
+	unsigned int i;
+	int id;
+
+	if (hal_capability_size != 0) {
+		mask = hal_capability_size - 1;
+		for (i = hash & mask; (id = hal_capability_slots[i]) != -1; i = (i + 1) & mask) {
+			if (hal_capabilities[id].hash == hash && strcmp (hal_capabilities[id].name, name) == 0)
+				return id;
+		}
+	}
+	if (!add)
+		return -1;
+
+	if ((hal_num_capabilities + 1) * 2 > hal_capability_size && !hal_capability_grow ())
+		return -1;
+
+	capability = &hal_capabilities[hal_num_capabilities];
+	capability->name = strdup (name);
+	if (capability->name == NULL)
+		return -1;
+	capability->hash = hash;
+	memset (&capability->devices, 0, sizeof (HalIndexList));
+
+	mask = hal_capability_size - 1;
+	for (i = hash & mask; hal_capability_slots[i] != -1; i = (i + 1) & mask)
+		;
+	hal_capability_slots[i] = hal_num_capabilities;
+	return hal_num_capabilities++;
+}
+
+/**
+ * hal_capability_get_num:
+ *
+ * Returns: the number of capabilities with an id; ids are below it
+ */
+unsigned int
+hal_capability_get_num (void)
+{
+	return hal_num_capabilities;
+}
+
+/**
+ * hal_capability_devices:
+ * @id: id of the capability
+ *
+ * Returns: the list of the devices with the capability
+ */
+HalIndexList *
+hal_capability_devices (int id)
+{
+	return &hal_capabilities[id].devices;
+}
+
+/**
+ * hal_capability_reset:
+ *
+ * Forget all capabilities and their devices, e.g. because an update
+ * failed and the lists no longer match the store.
+ */
+void
+hal_capability_reset (void)
+{
+	unsigned int i;
+
+	for (i = 0; i < hal_num_capabilities; i++) {
+		free (hal_capabilities[i].name);
+		free (hal_capabilities[i].devices.devices);
+	}
+	free (hal_capabilities);
+	free (hal_capability_slots);
+	hal_capabilities = NULL;
+	hal_capability_slots = NULL;
+	hal_num_capabilities = 0;
+	hal_capability_size = 0;
+}
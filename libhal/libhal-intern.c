@@ -0,0 +1,265 @@
+/***************************************************************************
+ *
+ * libhal-intern.c : one shared copy of each udi and property key
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "libhal-private.h"
+
+/*
+ * The store, property sets and changesets keep their property keys,
+ * and the store the udis of the devices in the GDL, as interned
+ * strings: a single copy of each, so two interned strings are equal
+ * exactly when they are the same pointer.
+ *
+ * The pool only grows.  Strings are carved from chunks that are never
+ * freed, each with its hash in front, and found through an open
+ * addressing hash table of pointers to them.  Lookups take no lock:
+ * a string is fully written before the release store that puts it in
+ * a slot, and the table is replaced as a whole when it fills up, the
+ * old one being kept so that readers still probing it are safe.
+ * Adding a string takes a mutex.
+ */
+
+#define HAL_INTERN_MIN_SLOTS   256
+#define HAL_INTERN_CHUNK_SIZE  65536
+
+typedef struct {
+	uint32_t hash;
+	char chars[];
+} HalInternString;
+
+typedef struct HalInternTable_s HalInternTable;
+
+struct HalInternTable_s {
+	HalInternTable *old;            /**< the table it replaced */
+	unsigned int size;              /**< slots, a power of two */
+	HalInternString *slots[];
+};
+
+typedef struct HalInternChunk_s HalInternChunk;
+
+struct HalInternChunk_s {
+	HalInternChunk *prev;
+	uint32_t data[];
+};
+
+static pthread_mutex_t hal_intern_lock = PTHREAD_MUTEX_INITIALIZER;
+static HalInternTable *hal_intern_table;
+static HalInternChunk *hal_intern_chunk;
+static size_t hal_intern_chunk_used;           /**< bytes of data */
+static unsigned int hal_intern_num_strings;
+static size_t hal_intern_string_bytes;
+static size_t hal_intern_pool_bytes;
+
+static uint32_t
+hal_intern_hash_string (const char *s)
+{
+	uint32_t h = 2166136261U;
+
+	while (*s != '\0')
+		h = (h ^ (unsigned char) *s++) * 16777619U;
+	return h;
+}
+
+static HalInternString *
+hal_intern_find (const HalInternTable *table, const char *s, uint32_t hash)
+{
+	unsigned int mask;
+	unsigned int i;
+	HalInternString *string;
+
+	if (table == NULL)
+		return NULL;
+
+	mask = table->size - 1;
+	for (i = hash & mask; ; i = (i + 1) & mask) {
+		string = __atomic_load_n (&table->slots[i], __ATOMIC_ACQUIRE);
+		if (string == NULL)
+			return NULL;
+		if (string->hash == hash && strcmp (string->chars, s) == 0)
+			return string;
+	}
+}
+
+static void
+hal_intern_place (HalInternTable *table, HalInternString *string)
+{
+	unsigned int mask = table->size - 1;
+	unsigned int i;
+
+	for (i = string->hash & mask; table->slots[i] != NULL; i = (i + 1) & mask)
+		;
+	__atomic_store_n (&table->slots[i], string, __ATOMIC_RELEASE);
+}
+
+/* Replace the table by one twice as large; FALSE if out of memory */
+static int
+hal_intern_grow (void)
+{
+	HalInternTable *old = hal_intern_table;
+	HalInternTable *table;
+	unsigned int size = old != NULL ? old->size * 2 : HAL_INTERN_MIN_SLOTS;
+	unsigned int i;
+
+	table = calloc (1, sizeof (HalInternTable) + size * sizeof (HalInternString *));
+	if (table == NULL)
+		return FALSE;
+	table->old = old;
+	table->size = size;
+	for (i = 0; old != NULL && i < old->size; i++) {
+		if (old->slots[i] != NULL)
+			hal_intern_place (table, old->slots[i]);
+	}
+
+	hal_intern_pool_bytes += sizeof (HalInternTable) + size * sizeof (HalInternString *);
+	__atomic_store_n (&hal_intern_table, table, __ATOMIC_RELEASE);
+	return TRUE;
+}
+
+/* Room for @size bytes, aligned for the hash; NULL if out of memory */
+static void *
+hal_intern_alloc (size_t size)
+{
+	HalInternChunk *chunk;
+	size_t chunk_size;
+	void *p;
+
+	size = (size + sizeof (uint32_t) - 1) & ~(sizeof (uint32_t) - 1);
+	if (hal_intern_chunk == NULL || hal_intern_chunk_used + size > HAL_INTERN_CHUNK_SIZE) {
+		chunk_size = size > HAL_INTERN_CHUNK_SIZE ? size : HAL_INTERN_CHUNK_SIZE;
+		chunk = malloc (sizeof (HalInternChunk) + chunk_size);
+		if (chunk == NULL)
+			return NULL;
+		chunk->prev = hal_intern_chunk;
+		hal_intern_pool_bytes += sizeof (HalInternChunk) + chunk_size;
+		/* a string larger than a chunk gets one of its own, the current chunk stays */
+		if (size > HAL_INTERN_CHUNK_SIZE && hal_intern_chunk != NULL) {
+			chunk->prev = hal_intern_chunk->prev;
+			hal_intern_chunk->prev = chunk;
+			return chunk->data;
+		}
+		hal_intern_chunk = chunk;
+		hal_intern_chunk_used = 0;
+	}
+
+	p = (char *) hal_intern_chunk->data + hal_intern_chunk_used;
+	hal_intern_chunk_used += size;
+	return p;
+}
+
+/**
+ * hal_intern:
+ * @s: a string
+ *
+ * Returns: the interned copy of @s, valid for the life of the
+ * process, or NULL if out of memory
+ */
+const char *
+hal_intern (const char *s)
+{
+	HalInternString *string;
+	uint32_t hash = hal_intern_hash_string (s);
+	size_t len;
+
+	string = hal_intern_find (__atomic_load_n (&hal_intern_table, __ATOMIC_ACQUIRE), s, hash);
+	if (string != NULL)
+		return string->chars;
+
+	pthread_mutex_lock (&hal_intern_lock);
+
+	/* it may have been added since */
+	string = hal_intern_find (hal_intern_table, s, hash);
+	if (string != NULL)
+		goto out;
+
+	if ((hal_intern_table == NULL || (hal_intern_num_strings + 1) * 2 > hal_intern_table->size) &&
+	    !hal_intern_grow ())
+		goto out;
+
+	len = strlen (s) + 1;
+	string = hal_intern_alloc (sizeof (HalInternString) + len);
+	if (string == NULL)
+		goto out;
+	string->hash = hash;
+	memcpy (string->chars, s, len);
+	hal_intern_place (hal_intern_table, string);
+	hal_intern_num_strings++;
+	hal_intern_string_bytes += len;
+
+out:
+	pthread_mutex_unlock (&hal_intern_lock);
+	return string != NULL ? string->chars : NULL;
+}
+
+/**
+ * hal_intern_lookup:
+ * @s: a string
+ *
+ * Takes no lock.
+ *
+ * Returns: the interned copy of @s, or NULL if @s has not been interned
+ */
+const char *
+hal_intern_lookup (const char *s)
+{
+	HalInternString *string;
+
+	string = hal_intern_find (__atomic_load_n (&hal_intern_table, __ATOMIC_ACQUIRE),
+				  s, hal_intern_hash_string (s));
+	return string != NULL ? string->chars : NULL;
+}
+
+/**
+ * hal_intern_hash:
+ * @s: an interned string
+ *
+ * Returns: the FNV-1a hash of @s, as hal_store_hash() computes it
+ */
+uint32_t
+hal_intern_hash (const char *s)
+{
+	return ((const HalInternString *) (s - offsetof (HalInternString, chars)))->hash;
+}
+
+/**
+ * hal_intern_get_stats:
+ * @num_strings: where to store the number of strings in the pool
+ * @string_bytes: where to store their size, with their NULs
+ * @pool_bytes: where to store the memory allocated by the pool,
+ * including its hash tables
+ */
+void
+hal_intern_get_stats (size_t *num_strings, size_t *string_bytes, size_t *pool_bytes)
+{
+	pthread_mutex_lock (&hal_intern_lock);
+	*num_strings = hal_intern_num_strings;
+	*string_bytes = hal_intern_string_bytes;
+	*pool_bytes = hal_intern_pool_bytes;
+	pthread_mutex_unlock (&hal_intern_lock);
+}
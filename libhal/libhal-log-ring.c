@@ -0,0 +1,199 @@
+/***************************************************************************
+ *
+ * libhal-log-ring.c : memory-mapped circular call log
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libhal-private.h"
+#include "libhal-log-ring.h"
+
+/*
+ * The ring is mapped once and never unmapped, so appending a record
+ * is an atomic add and a couple of memcpy()s into the page cache; the
+ * kernel writes the pages back on its own and they survive the
+ * process crashing.  See libhal-log-ring.h for the layout and
+ * hal-log-dump for the reader.
+ */
+
+static HalLogRingHeader *hal_log_ring = NULL;
+static char *hal_log_ring_data = NULL;
+static uint64_t hal_log_ring_mask = 0;
+
+static int
+hal_log_ring_valid (const HalLogRingHeader *h, size_t file_size)
+{
+	return h->magic == HAL_LOG_RING_MAGIC &&
+		h->version == HAL_LOG_RING_VERSION &&
+		h->header_size == HAL_LOG_RING_HEADER_SIZE &&
+		h->data_size >= HAL_LOG_RING_MIN_SIZE &&
+		(h->data_size & (h->data_size - 1)) == 0 &&
+		h->header_size + h->data_size == file_size;
+}
+
+/**
+ * hal_log_ring_open:
+ * @path: file to keep the ring in
+ * @size: size of the ring in bytes
+ *
+ * Map the log ring in @path, creating it if needed.  @size is
+ * rounded down to a power of two.  A valid ring that already exists
+ * is appended to and keeps its size, even if that is not @size.
+ * Anything else at @path is left alone: a symbolic link, a file of
+ * another user, or a non-empty file that is not a ring, such as an
+ * old text log.
+ *
+ * Returns: 0 on success, -1 if the ring could not be set up
+ */
+int
+hal_log_ring_open (const char *path, size_t size)
+{
+	HalLogRingHeader *h;
+	struct stat st;
+	void *map;
+	size_t data_size;
+	size_t map_size;
+	int fd;
+
+	for (data_size = HAL_LOG_RING_MIN_SIZE; data_size * 2 <= size && data_size * 2 != 0; data_size *= 2)
+		;
+
+	fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0666);
+	if (fd < 0) {
+		fprintf (stderr, "%s %d : cannot open %s: %s\n",
+			 __FILE__, __LINE__, path, strerror (errno));
+		return -1;
+	}
+
+	/* keep other processes from mapping a half-initialised ring */
+	while (flock (fd, LOCK_EX) != 0 && errno == EINTR)
+		;
+
+	if (fstat (fd, &st) != 0)
+		goto fail;
+	if (!S_ISREG (st.st_mode) || st.st_uid != geteuid ()) {
+		fprintf (stderr, "%s %d : %s is not a file of uid %u, not using it\n",
+			 __FILE__, __LINE__, path, (unsigned int) geteuid ());
+		goto out;
+	}
+
+	map_size = st.st_size;
+	map = NULL;
+	if (map_size > 0) {
+		if (map_size >= sizeof (HalLogRingHeader)) {
+			map = mmap (NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (map == MAP_FAILED)
+				goto fail;
+			if (!hal_log_ring_valid (map, map_size)) {
+				munmap (map, map_size);
+				map = NULL;
+			}
+		}
+		if (map == NULL) {
+			fprintf (stderr, "%s %d : %s is not a log ring, not overwriting it\n",
+				 __FILE__, __LINE__, path);
+			goto out;
+		}
+	}
+
+	if (map == NULL) {
+		map_size = HAL_LOG_RING_HEADER_SIZE + data_size;
+		if (ftruncate (fd, map_size) != 0)
+			goto fail;
+		map = mmap (NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED)
+			goto fail;
+
+		h = map;
+		h->version = HAL_LOG_RING_VERSION;
+		h->header_size = HAL_LOG_RING_HEADER_SIZE;
+		h->data_size = data_size;
+		h->cursor = 0;
+		__atomic_store_n (&h->magic, HAL_LOG_RING_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	flock (fd, LOCK_UN);
+	close (fd);
+
+	hal_log_ring = map;
+	hal_log_ring_data = (char *) map + hal_log_ring->header_size;
+	hal_log_ring_mask = hal_log_ring->data_size - 1;
+
+	return 0;
+
+fail:
+	fprintf (stderr, "%s %d : cannot set up log ring %s: %s\n",
+		 __FILE__, __LINE__, path, strerror (errno));
+out:
+	flock (fd, LOCK_UN);
+	close (fd);
+	return -1;
+}
+
+/**
+ * hal_log_ring_append:
+ * @text: the record
+ * @len: length of @text
+ *
+ * Store a record in the ring opened by hal_log_ring_open(),
+ * overwriting the oldest ones.  Records longer than a quarter of the
+ * ring are truncated.
+ */
+void
+hal_log_ring_append (const char *text, size_t len)
+{
+	HalLogRingRecord *rec;
+	uint64_t pos;
+	size_t offset;
+	size_t first;
+
+	if (len > (hal_log_ring_mask + 1) / 4)
+		len = (hal_log_ring_mask + 1) / 4;
+
+	pos = __atomic_fetch_add (&hal_log_ring->cursor, hal_log_ring_record_size (len),
+				  __ATOMIC_RELAXED);
+
+	/* Both halves of the record header are aligned, so each is
+	 * contiguous even when the record wraps around the end. */
+	rec = (HalLogRingRecord *) (hal_log_ring_data + (pos & hal_log_ring_mask));
+	*(uint32_t *) (hal_log_ring_data + ((pos + 8) & hal_log_ring_mask)) = len;
+
+	offset = (pos + sizeof (HalLogRingRecord)) & hal_log_ring_mask;
+	first = hal_log_ring_mask + 1 - offset;
+	if (first >= len) {
+		memcpy (hal_log_ring_data + offset, text, len);
+	} else {
+		memcpy (hal_log_ring_data + offset, text, first);
+		memcpy (hal_log_ring_data, text + first, len - first);
+	}
+
+	__atomic_store_n (&rec->pos, pos, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,75 @@
+/***************************************************************************
+ *
+ * libhal-log-ring.h : layout of the memory-mapped circular call log
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifndef LIBHAL_LOG_RING_H
+#define LIBHAL_LOG_RING_H
+
+#include <stdint.h>
+
+/*
+ * A log ring is a file, /tmp/libhal.ring by default, laid out as
+ *
+ *   HalLogRingHeader   padded to header_size bytes
+ *   char               x data_size   (the ring)
+ *
+ * Positions in the ring are byte counts since it was created;
+ * position p lives at offset p % data_size of the data.  A writer
+ * reserves a record by adding its size to the cursor, fills in the
+ * text and length and finally stores the record's position in its
+ * first eight bytes.  A reader walks the last data_size bytes before
+ * the cursor and accepts a record only where the stored position
+ * matches the place it was found, which skips records that were
+ * overwritten, or never finished because the writer crashed.
+ *
+ * Any number of processes can share one ring.
+ */
+
+#define HAL_LOG_RING_MAGIC       0x52424c48      /* "HLBR" */
+#define HAL_LOG_RING_VERSION     1
+
+#define HAL_LOG_RING_FILE        "/tmp/libhal.ring"
+#define HAL_LOG_RING_HEADER_SIZE 4096
+#define HAL_LOG_RING_ALIGN       8
+#define HAL_LOG_RING_MIN_SIZE    (64 * 1024)
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t reserved;
+	uint64_t data_size;             /**< bytes, a power of two */
+	uint64_t reserved2[5];
+	uint64_t cursor;                /**< bytes ever reserved, on its own cache line */
+} HalLogRingHeader;
+
+typedef struct {
+	uint64_t pos;                   /**< position of this record, stored last */
+	uint32_t length;                /**< bytes of text that follow */
+	uint32_t reserved;
+} HalLogRingRecord;
+
+static inline uint64_t
+hal_log_ring_record_size (uint32_t length)
+{
+	return (sizeof (HalLogRingRecord) + length + HAL_LOG_RING_ALIGN - 1) & ~(uint64_t) (HAL_LOG_RING_ALIGN - 1);
+}
+
+#endif /* LIBHAL_LOG_RING_H */
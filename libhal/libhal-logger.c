@@ -0,0 +1,452 @@
+/***************************************************************************
+ *
+ * libhal-logger.c : call logger for the HAL convenience library
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "libhal-private.h"
+#include "libhal-log-ring.h"
+
+/*
+ * Every libhal entry point logs a line of the form
+ *
+ *   <sec>.<usec> <function> <args>
+ *
+ * to /tmp/libhal.log, or the file named by the log_file setting.
+ * Records are formatted into a buffer owned by the calling thread and
+ * a background writer thread appends all pending buffers to the log
+ * with a single write(2) per batch, so a libhal call costs a
+ * gettimeofday() and a memcpy() instead of an open/write/close cycle.
+ *
+ * With the setting log_mode = ring the records go to a fixed-size
+ * memory-mapped ring instead (log_file, /tmp/libhal.ring by default,
+ * of log_size bytes, 16M by default), which bounds the disk space
+ * used and takes no system calls at all; see libhal-log-ring.c.  If
+ * the ring cannot be set up the records go to /tmp/libhal.log, never
+ * as text to the ring's file.
+ */
+
+#define HAL_LOG_FILE            "/tmp/libhal.log"
+#define HAL_LOG_BUFFER_SIZE     8192   /* per-thread record buffer */
+#define HAL_LOG_BATCH_SIZE      65536  /* writer batch */
+#define HAL_LOG_RECORD_SIZE     512    /* records longer than this go through the heap */
+#define HAL_LOG_FLUSH_MSEC      250    /* max time a record waits in a buffer */
+#define HAL_LOG_RING_DEFAULT    (16 * 1024 * 1024)
+
+typedef struct HalLogBuffer_s HalLogBuffer;
+
+struct HalLogBuffer_s {
+	pthread_mutex_t lock;
+	size_t len;
+	int orphaned;                   /**< owning thread has exited */
+	HalLogBuffer *next;
+	char data[HAL_LOG_BUFFER_SIZE];
+};
+
+enum {
+	HAL_LOG_STATE_NONE = 0,         /**< writer not started yet */
+	HAL_LOG_STATE_RUNNING,          /**< writer thread owns flushing */
+	HAL_LOG_STATE_DIRECT            /**< no writer, records are written synchronously */
+};
+
+static pthread_once_t hal_log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t hal_log_key;
+static int hal_log_use_ring = 0;
+static int hal_log_off = 0;                     /**< the ring could not be set up */
+static const char *hal_log_path = HAL_LOG_FILE;
+
+/* hal_log_lock protects everything below */
+static pthread_mutex_t hal_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hal_log_cond = PTHREAD_COND_INITIALIZER;
+static HalLogBuffer *hal_log_buffers = NULL;
+static int hal_log_fd = -1;
+static int hal_log_state = HAL_LOG_STATE_NONE;
+static int hal_log_wakeup = 0;
+static int hal_log_stopping = 0;
+static pthread_t hal_log_writer;
+static char hal_log_batch[HAL_LOG_BATCH_SIZE];
+
+static __thread HalLogBuffer *hal_log_buffer = NULL;
+static __thread int hal_log_exited = 0;         /**< buffer orphaned, see hal_log_thread_exit() */
+
+static void
+hal_log_write_all (const char *data, size_t len)
+{
+	ssize_t ret;
+
+	if (hal_log_fd < 0)
+		hal_log_fd = open (hal_log_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0666);
+	if (hal_log_fd < 0)
+		return;
+
+	while (len > 0) {
+		ret = write (hal_log_fd, data, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		data += ret;
+		len -= ret;
+	}
+}
+
+/* Move every pending record into the batch buffer and write it out.
+ * Called with hal_log_lock held. */
+static void
+hal_log_flush_locked (void)
+{
+	HalLogBuffer *buf;
+	HalLogBuffer **link;
+	size_t batch_len = 0;
+	int orphaned;
+
+	for (link = &hal_log_buffers; (buf = *link) != NULL; ) {
+		pthread_mutex_lock (&buf->lock);
+		if (batch_len + buf->len > sizeof (hal_log_batch)) {
+			hal_log_write_all (hal_log_batch, batch_len);
+			batch_len = 0;
+		}
+		memcpy (hal_log_batch + batch_len, buf->data, buf->len);
+		batch_len += buf->len;
+		buf->len = 0;
+		/* read under the lock, so the exiting thread is done with it before it is freed */
+		orphaned = buf->orphaned;
+		pthread_mutex_unlock (&buf->lock);
+
+		if (orphaned) {
+			*link = buf->next;
+			pthread_mutex_destroy (&buf->lock);
+			free (buf);
+		} else {
+			link = &buf->next;
+		}
+	}
+
+	if (batch_len > 0)
+		hal_log_write_all (hal_log_batch, batch_len);
+}
+
+static void *
+hal_log_writer_thread (void *data)
+{
+	struct timespec deadline;
+
+	pthread_mutex_lock (&hal_log_lock);
+	while (!hal_log_stopping) {
+		clock_gettime (CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += HAL_LOG_FLUSH_MSEC * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		while (!hal_log_wakeup && !hal_log_stopping) {
+			if (pthread_cond_timedwait (&hal_log_cond, &hal_log_lock, &deadline) == ETIMEDOUT)
+				break;
+		}
+		hal_log_wakeup = 0;
+
+		hal_log_flush_locked ();
+	}
+	pthread_mutex_unlock (&hal_log_lock);
+
+	return NULL;
+}
+
+/* Runs on the exiting thread.  The writer frees the buffer once it is
+ * flushed, so records the thread still logs, e.g. from the destructors
+ * of other thread keys, are written synchronously instead. */
+static void
+hal_log_thread_exit (void *data)
+{
+	HalLogBuffer *buf = data;
+
+	hal_log_buffer = NULL;
+	hal_log_exited = 1;
+
+	pthread_mutex_lock (&buf->lock);
+	buf->orphaned = 1;
+	pthread_mutex_unlock (&buf->lock);
+}
+
+static void
+hal_log_atfork_prepare (void)
+{
+	pthread_mutex_lock (&hal_log_lock);
+}
+
+static void
+hal_log_atfork_parent (void)
+{
+	pthread_mutex_unlock (&hal_log_lock);
+}
+
+static void
+hal_log_atfork_child (void)
+{
+	HalLogBuffer *buf;
+
+	/* The writer thread did not survive the fork and the records
+	 * still sitting in the buffers belong to the parent. */
+	for (buf = hal_log_buffers; buf != NULL; buf = buf->next) {
+		pthread_mutex_init (&buf->lock, NULL);
+		buf->len = 0;
+		if (buf != hal_log_buffer)
+			buf->orphaned = 1;
+	}
+
+	if (hal_log_state == HAL_LOG_STATE_RUNNING)
+		hal_log_state = HAL_LOG_STATE_NONE;
+	hal_log_wakeup = 0;
+
+	pthread_cond_init (&hal_log_cond, NULL);
+	pthread_mutex_init (&hal_log_lock, NULL);
+}
+
+static void
+hal_log_init (void)
+{
+	const char *mode;
+	const char *path;
+
+	path = hal_config_get ("log_file");
+	mode = hal_config_get ("log_mode");
+	if (mode != NULL && strcmp (mode, "ring") == 0) {
+		if (path == NULL)
+			path = HAL_LOG_RING_FILE;
+		if (hal_log_ring_open (path, hal_config_get_size ("log_size", HAL_LOG_RING_DEFAULT)) == 0) {
+			hal_log_use_ring = 1;
+			return;
+		}
+		/* never write text where the ring was meant to be */
+		if (strcmp (path, HAL_LOG_FILE) == 0) {
+			fprintf (stderr, "%s %d : not logging\n", __FILE__, __LINE__);
+			hal_log_off = 1;
+			return;
+		}
+		fprintf (stderr, "%s %d : logging to " HAL_LOG_FILE " instead\n", __FILE__, __LINE__);
+		path = NULL;
+	} else if (mode != NULL && strcmp (mode, "append") != 0) {
+		fprintf (stderr, "%s %d : unknown log_mode '%s', using append\n",
+			 __FILE__, __LINE__, mode);
+	}
+	if (path != NULL)
+		hal_log_path = path;
+
+	pthread_key_create (&hal_log_key, hal_log_thread_exit);
+	pthread_atfork (hal_log_atfork_prepare, hal_log_atfork_parent, hal_log_atfork_child);
+}
+
+/* Called with hal_log_lock held */
+static void
+hal_log_start_writer (void)
+{
+	pthread_attr_t attr;
+	sigset_t all, old;
+
+	if (hal_log_state != HAL_LOG_STATE_NONE)
+		return;
+
+	/* keep the application's signals away from our thread */
+	sigfillset (&all);
+	pthread_sigmask (SIG_SETMASK, &all, &old);
+
+	pthread_attr_init (&attr);
+	if (pthread_create (&hal_log_writer, &attr, hal_log_writer_thread, NULL) == 0)
+		hal_log_state = HAL_LOG_STATE_RUNNING;
+	else
+		hal_log_state = HAL_LOG_STATE_DIRECT;
+	pthread_attr_destroy (&attr);
+
+	pthread_sigmask (SIG_SETMASK, &old, NULL);
+}
+
+static HalLogBuffer *
+hal_log_get_buffer (void)
+{
+	HalLogBuffer *buf;
+
+	if (hal_log_buffer != NULL || hal_log_exited)
+		return hal_log_buffer;
+
+	buf = malloc (sizeof (HalLogBuffer));
+	if (buf == NULL)
+		return NULL;
+	pthread_mutex_init (&buf->lock, NULL);
+	buf->len = 0;
+	buf->orphaned = 0;
+
+	pthread_mutex_lock (&hal_log_lock);
+	hal_log_start_writer ();
+	buf->next = hal_log_buffers;
+	hal_log_buffers = buf;
+	pthread_mutex_unlock (&hal_log_lock);
+
+	pthread_setspecific (hal_log_key, buf);
+	hal_log_buffer = buf;
+
+	return buf;
+}
+
+static void
+hal_log_append (const char *record, size_t len)
+{
+	HalLogBuffer *buf;
+	int kick = 0;
+
+	pthread_once (&hal_log_once, hal_log_init);
+	if (hal_log_off)
+		return;
+	if (hal_log_use_ring) {
+		hal_log_ring_append (record, len);
+		return;
+	}
+
+	buf = hal_log_get_buffer ();
+
+	if (buf == NULL || __atomic_load_n (&hal_log_state, __ATOMIC_RELAXED) == HAL_LOG_STATE_DIRECT) {
+		/* flush first, the thread's earlier records may still be buffered */
+		pthread_mutex_lock (&hal_log_lock);
+		hal_log_flush_locked ();
+		hal_log_write_all (record, len);
+		pthread_mutex_unlock (&hal_log_lock);
+		return;
+	}
+
+	pthread_mutex_lock (&buf->lock);
+	if (buf->len + len > sizeof (buf->data)) {
+		/* The writer is falling behind; flush our own buffer
+		 * inline rather than dropping or reordering records. */
+		pthread_mutex_unlock (&buf->lock);
+		pthread_mutex_lock (&hal_log_lock);
+		hal_log_flush_locked ();
+		if (len > sizeof (buf->data)) {
+			hal_log_write_all (record, len);
+			pthread_mutex_unlock (&hal_log_lock);
+			return;
+		}
+		pthread_mutex_unlock (&hal_log_lock);
+		pthread_mutex_lock (&buf->lock);
+	}
+	memcpy (buf->data + buf->len, record, len);
+	buf->len += len;
+	if (buf->len > sizeof (buf->data) / 2)
+		kick = 1;
+	pthread_mutex_unlock (&buf->lock);
+
+	if (kick) {
+		pthread_mutex_lock (&hal_log_lock);
+		hal_log_wakeup = 1;
+		pthread_cond_signal (&hal_log_cond);
+		pthread_mutex_unlock (&hal_log_lock);
+	}
+}
+
+/**
+ * hal_loggerv:
+ * @fmt: printf-style format of the record
+ * @ap: arguments for @fmt
+ *
+ * Append a timestamped record to the log.
+ */
+void
+hal_loggerv (const char *fmt, va_list ap)
+{
+	struct timeval tv;
+	char stack_record[HAL_LOG_RECORD_SIZE];
+	char *record = stack_record;
+	int prefix;
+	int len;
+	va_list ap2;
+
+	gettimeofday (&tv, NULL);
+	prefix = snprintf (stack_record, sizeof (stack_record), "%ld.%06ld ",
+			   (long) tv.tv_sec, (long) tv.tv_usec);
+
+	va_copy (ap2, ap);
+	len = vsnprintf (stack_record + prefix, sizeof (stack_record) - prefix, fmt, ap2);
+	va_end (ap2);
+	if (len < 0)
+		return;
+
+	if ((size_t) (prefix + len + 1) >= sizeof (stack_record)) {
+		record = malloc (prefix + len + 2);
+		if (record == NULL)
+			return;
+		memcpy (record, stack_record, prefix);
+		vsnprintf (record + prefix, len + 1, fmt, ap);
+	}
+	len += prefix;
+	record[len++] = '\n';
+
+	hal_log_append (record, len);
+
+	if (record != stack_record)
+		free (record);
+}
+
+/**
+ * hal_logger_flush:
+ *
+ * Write out every record buffered so far, from all threads.
+ */
+void
+hal_logger_flush (void)
+{
+	pthread_mutex_lock (&hal_log_lock);
+	hal_log_flush_locked ();
+	pthread_mutex_unlock (&hal_log_lock);
+}
+
+static void __attribute__ ((destructor))
+hal_logger_shutdown (void)
+{
+	int join;
+
+	pthread_mutex_lock (&hal_log_lock);
+	join = hal_log_state == HAL_LOG_STATE_RUNNING;
+	hal_log_stopping = 1;
+	pthread_cond_signal (&hal_log_cond);
+	pthread_mutex_unlock (&hal_log_lock);
+
+	if (join)
+		pthread_join (hal_log_writer, NULL);
+
+	/* Threads still running past this point log synchronously */
+	pthread_mutex_lock (&hal_log_lock);
+	hal_log_state = HAL_LOG_STATE_DIRECT;
+	hal_log_flush_locked ();
+	pthread_mutex_unlock (&hal_log_lock);
+}
@@ -0,0 +1,365 @@
+/***************************************************************************
+ *
+ * libhal-private.h : internal helpers shared by the libhal sources
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifndef LIBHAL_PRIVATE_H
+#define LIBHAL_PRIVATE_H
+
+#if defined(__GNUC__)
+#define HAL_INTERNAL __attribute__ ((visibility ("hidden")))
+#define HAL_CLEANUP(_fn_) __attribute__ ((cleanup (_fn_)))
+#define HAL_PRINTF(_fmt_,_args_) __attribute__ ((format (printf, _fmt_, _args_)))
+#define HAL_LIKELY(_expr_) __builtin_expect (!!(_expr_), 1)
+#define HAL_UNLIKELY(_expr_) __builtin_expect (!!(_expr_), 0)
+#else
+#define HAL_INTERNAL
+#define HAL_CLEANUP(_fn_)
+#define HAL_PRINTF(_fmt_,_args_)
+#define HAL_LIKELY(_expr_) (_expr_)
+#define HAL_UNLIKELY(_expr_) (_expr_)
+#endif
+
+/* ThreadSanitizer does not model fences and gcc warns about them
+ * (-Wtsan), so sanitized builds leave them out */
+#if defined(__SANITIZE_THREAD__)
+#define HAL_FENCE(_order_) do { } while (0)
+#else
+#define HAL_FENCE(_order_) __atomic_thread_fence (_order_)
+#endif
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "libhal-trace.h"
+
+/* libhal-logger.c */
+HAL_INTERNAL void hal_loggerv      (const char *fmt, va_list ap) HAL_PRINTF (1, 0);
+HAL_INTERNAL void hal_logger_flush (void);
+
+/* libhal-log-ring.c */
+HAL_INTERNAL int  hal_log_ring_open   (const char *path, size_t size);
+HAL_INTERNAL void hal_log_ring_append (const char *text, size_t len);
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+/* libhal-config.c */
+HAL_INTERNAL const char *hal_config_get      (const char *key);
+HAL_INTERNAL long        hal_config_get_int  (const char *key, long default_value);
+HAL_INTERNAL size_t      hal_config_get_size (const char *key, size_t default_value);
+
+/* libhal-intern.c */
+HAL_INTERNAL const char *hal_intern           (const char *s);
+HAL_INTERNAL const char *hal_intern_lookup    (const char *s);
+HAL_INTERNAL uint32_t    hal_intern_hash      (const char *s);
+HAL_INTERNAL void        hal_intern_get_stats (size_t *num_strings, size_t *string_bytes,
+					       size_t *pool_bytes);
+
+/* libhal-rcu.c */
+typedef struct HalRcuHead_s HalRcuHead;
+
+struct HalRcuHead_s {
+	HalRcuHead *next;
+	uint64_t epoch;                 /**< retired in */
+	void (*free_func) (HalRcuHead *head);
+};
+
+HAL_INTERNAL void hal_rcu_read_lock   (void);
+HAL_INTERNAL void hal_rcu_read_unlock (void);
+HAL_INTERNAL void hal_rcu_retire      (HalRcuHead *head, void (*free_func) (HalRcuHead *head));
+HAL_INTERNAL void hal_rcu_reclaim     (void);
+
+/* libhal-store.c */
+typedef union {
+	char *str_value;
+	int32_t int_value;
+	uint64_t uint64_value;
+	double double_value;
+	int bool_value;
+	char **strlist_value;           /**< NULL terminated */
+} HalValue;
+
+typedef struct {
+	const char *key;
+	int type;                       /**< LIBHAL_PROPERTY_TYPE_* */
+	HalValue value;
+} HalPropertyChange;
+
+HAL_INTERNAL char  *hal_store_new_device        (void);
+HAL_INTERNAL int    hal_store_commit_device     (const char *temp_udi, const char *udi);
+HAL_INTERNAL int    hal_store_remove_device     (const char *udi);
+HAL_INTERNAL int    hal_store_device_exists     (const char *udi);
+HAL_INTERNAL uint64_t hal_store_get_device_generation (const char *udi);
+HAL_INTERNAL uint64_t hal_store_get_gdl_generation (void);
+HAL_INTERNAL char **hal_store_get_all_devices   (int *num_devices);
+HAL_INTERNAL char **hal_store_find_string_match (const char *key, const char *value, int *num_devices);
+HAL_INTERNAL int    hal_store_query_capability  (const char *udi, const char *capability);
+HAL_INTERNAL char **hal_store_find_by_capability (const char *capability, int *num_devices);
+HAL_INTERNAL int    hal_store_add_capability    (const char *udi, const char *capability);
+HAL_INTERNAL struct LibHalPropertySet_s *hal_store_get_all_properties (const char *udi);
+HAL_INTERNAL int    hal_store_get_all_devices_with_properties (int *num_devices, char ***udis,
+							       struct LibHalPropertySet_s ***sets);
+HAL_INTERNAL int    hal_store_get_property_type (const char *udi, const char *key);
+HAL_INTERNAL int    hal_store_get_property      (const char *udi, const char *key, int type, HalValue *value);
+HAL_INTERNAL int    hal_store_set_property      (const char *udi, const char *key, int type, const HalValue *value);
+HAL_INTERNAL int    hal_store_set_properties    (const char *udi, const HalPropertyChange *changes,
+						 unsigned int num_changes);
+HAL_INTERNAL int    hal_store_remove_property   (const char *udi, const char *key);
+HAL_INTERNAL int    hal_store_strlist_insert    (const char *udi, const char *key, const char *value, int prepend);
+HAL_INTERNAL int    hal_store_strlist_remove    (const char *udi, const char *key, const char *value, unsigned int index);
+
+/* libhal-index.c */
+typedef struct {
+	const char *udi;
+	uint64_t position;              /**< in the GDL */
+} HalIndexDevice;
+
+typedef struct {
+	HalIndexDevice *devices;        /**< sorted by position */
+	unsigned int num_devices;
+	unsigned int size;
+} HalIndexList;
+
+HAL_INTERNAL int           hal_index_list_add     (HalIndexList *list, const char *udi, uint64_t position);
+HAL_INTERNAL void          hal_index_list_remove  (HalIndexList *list, const char *udi, uint64_t position);
+HAL_INTERNAL char        **hal_index_list_udis    (const HalIndexList *list, int *num_devices);
+
+HAL_INTERNAL int           hal_index_has_key      (const char *key);
+HAL_INTERNAL int           hal_index_is_full      (void);
+HAL_INTERNAL unsigned int  hal_index_get_num_keys (void);
+HAL_INTERNAL const char   *hal_index_key          (unsigned int n);
+HAL_INTERNAL int           hal_index_add_key      (const char *key);
+HAL_INTERNAL void          hal_index_remove_key   (const char *key);
+HAL_INTERNAL int           hal_index_add          (const char *key, const char *value, const char *udi,
+						   uint64_t position);
+HAL_INTERNAL void          hal_index_remove       (const char *key, const char *value, const char *udi,
+						   uint64_t position);
+HAL_INTERNAL char        **hal_index_lookup       (const char *key, const char *value, int *num_devices);
+
+HAL_INTERNAL int           hal_capability_id      (const char *name, int add);
+HAL_INTERNAL unsigned int  hal_capability_get_num (void);
+HAL_INTERNAL HalIndexList *hal_capability_devices (int id);
+HAL_INTERNAL void          hal_capability_reset   (void);
+
+/* libhal-fixture.c */
+typedef void *(*HalFixtureDeviceFunc)   (void *data, const char *udi);
+typedef int   (*HalFixturePropertyFunc) (void *device, const char *key, int type, const HalValue *value);
+
+HAL_INTERNAL int  hal_fixture_load  (const char *path, HalFixtureDeviceFunc device_func,
+				    HalFixturePropertyFunc property_func, void *data);
+HAL_INTERNAL void hal_fixture_parse (const char *name, const char *text, size_t len,
+				    HalFixtureDeviceFunc device_func, HalFixturePropertyFunc property_func,
+				    void *data);
+
+/* libhal-snapshot.c */
+typedef struct HalSnapshot_s HalSnapshot;
+
+HAL_INTERNAL HalSnapshot *hal_snapshot_new       (size_t size, unsigned int refs);
+HAL_INTERNAL char        *hal_snapshot_data      (HalSnapshot *snapshot);
+HAL_INTERNAL void         hal_snapshot_publish   (HalSnapshot *snapshot, char **udis);
+HAL_INTERNAL void         hal_snapshot_free      (HalSnapshot *snapshot);
+HAL_INTERNAL void         hal_snapshot_ref       (HalSnapshot *snapshot);
+HAL_INTERNAL void         hal_snapshot_unref     (HalSnapshot *snapshot);
+HAL_INTERNAL int          hal_snapshot_free_udis (char **udis);
+
+/* libhal.c */
+typedef struct {
+	struct LibHalPropertySet_s *set; /**< NULL while measuring */
+	unsigned int num_properties;
+	unsigned int num_pointers;      /**< in the string lists, with their NULLs */
+	size_t num_chars;
+	char **pointers;                /**< next free one, once allocated */
+	char **pointers_end;
+	char *chars;
+	char *chars_end;
+} HalPropertySetBuilder;
+
+HAL_INTERNAL void    hal_property_set_builder_init     (HalPropertySetBuilder *builder);
+HAL_INTERNAL int     hal_property_set_builder_add      (void *builder, const char *key, int type,
+							const HalValue *value);
+HAL_INTERNAL size_t  hal_property_set_builder_get_size (const HalPropertySetBuilder *builder);
+HAL_INTERNAL void    hal_property_set_builder_place    (HalPropertySetBuilder *builder, void *block,
+							HalSnapshot *snapshot);
+HAL_INTERNAL int     hal_property_set_builder_alloc    (HalPropertySetBuilder *builder);
+HAL_INTERNAL struct LibHalPropertySet_s *hal_property_set_builder_finish (HalPropertySetBuilder *builder);
+HAL_INTERNAL int     hal_property_set_lookup           (const struct LibHalPropertySet_s *set, const char *key,
+							HalValue *value);
+
+/* libhal-sysfs.c */
+HAL_INTERNAL int hal_sysfs_load (const char *root, HalFixtureDeviceFunc device_func,
+				 HalFixturePropertyFunc property_func, void *data);
+
+/* libhal-image.c */
+typedef struct HalImage_s HalImage;
+
+typedef struct {
+	void *image;                    /**< NULL while measuring */
+	unsigned int num_devices;
+	unsigned int num_properties;
+	unsigned int num_list_words;
+	size_t strings_size;
+} HalImageBuilder;
+
+HAL_INTERNAL int          hal_image_open            (const char *path);
+HAL_INTERNAL void         hal_image_close           (void);
+HAL_INTERNAL unsigned int hal_image_num_devices     (void);
+HAL_INTERNAL int          hal_image_find_device     (const char *udi);
+HAL_INTERNAL const char  *hal_image_device_udi      (unsigned int device);
+HAL_INTERNAL unsigned int hal_image_device_at       (unsigned int n);
+HAL_INTERNAL int          hal_image_get_property_type (unsigned int device, const char *key);
+HAL_INTERNAL int          hal_image_get_property    (unsigned int device, const char *key, int type, HalValue *value);
+HAL_INTERNAL const char  *hal_image_get_string      (unsigned int device, const char *key);
+HAL_INTERNAL int          hal_image_get_strlist     (unsigned int device, const char *key, char ***strlist);
+HAL_INTERNAL int          hal_image_foreach_property (unsigned int device, HalFixturePropertyFunc func, void *target);
+
+HAL_INTERNAL void         hal_image_view            (HalImage *image, const char *map, size_t size);
+HAL_INTERNAL int          hal_image_view_find_device (const HalImage *image, const char *udi);
+HAL_INTERNAL const char  *hal_image_view_device_udi (const HalImage *image, unsigned int device);
+HAL_INTERNAL unsigned int hal_image_view_device_at  (const HalImage *image, unsigned int n);
+HAL_INTERNAL int          hal_image_view_get_property_type (const HalImage *image, unsigned int device,
+							    const char *key);
+HAL_INTERNAL int          hal_image_view_get_property (const HalImage *image, unsigned int device,
+						       const char *key, int type, HalValue *value);
+HAL_INTERNAL const char  *hal_image_view_get_string (const HalImage *image, unsigned int device,
+						     const char *key);
+HAL_INTERNAL int          hal_image_view_get_strlist (const HalImage *image, unsigned int device,
+						      const char *key, char ***strlist);
+HAL_INTERNAL int          hal_image_view_foreach_property (const HalImage *image, unsigned int device,
+							   HalFixturePropertyFunc func, void *target);
+
+HAL_INTERNAL void         hal_image_builder_init    (HalImageBuilder *builder);
+HAL_INTERNAL void        *hal_image_builder_add_device (void *builder, const char *udi);
+HAL_INTERNAL int          hal_image_builder_add_property (void *builder, const char *key, int type,
+							  const HalValue *value);
+HAL_INTERNAL size_t       hal_image_builder_get_size (const HalImageBuilder *builder);
+HAL_INTERNAL void         hal_image_builder_place   (HalImageBuilder *builder, void *image);
+HAL_INTERNAL int          hal_image_builder_finish  (HalImageBuilder *builder);
+
+/* libhal-shared.c */
+HAL_INTERNAL int      hal_shared_open                  (int *writer);
+HAL_INTERNAL void    *hal_shared_publish_begin         (size_t size);
+HAL_INTERNAL void     hal_shared_publish_end           (uint64_t generation);
+HAL_INTERNAL int      hal_shared_device_exists         (const char *udi);
+HAL_INTERNAL uint64_t hal_shared_get_device_generation (const char *udi);
+HAL_INTERNAL uint64_t hal_shared_get_gdl_generation    (void);
+HAL_INTERNAL int      hal_shared_get_property_type     (const char *udi, const char *key);
+HAL_INTERNAL int      hal_shared_get_property          (const char *udi, const char *key, int type,
+							HalValue *value);
+HAL_INTERNAL struct LibHalPropertySet_s *hal_shared_get_all_properties (const char *udi);
+HAL_INTERNAL char   **hal_shared_get_all_devices       (int *num_devices);
+HAL_INTERNAL char   **hal_shared_find_string_match     (const char *key, const char *value, int *num_devices);
+HAL_INTERNAL int      hal_shared_query_capability      (const char *udi, const char *capability);
+HAL_INTERNAL char   **hal_shared_find_by_capability    (const char *capability, int *num_devices);
+HAL_INTERNAL int      hal_shared_get_all_devices_with_properties (int *num_devices, char ***udis,
+								  struct LibHalPropertySet_s ***sets);
+
+/* libhal-trace.c */
+#define HAL_TRACE_MASK_WORDS ((HAL_FN_LAST + 63) / 64)
+
+HAL_INTERNAL extern const HalFunctionInfo hal_functions[HAL_FN_LAST];
+HAL_INTERNAL extern uint64_t hal_trace_mask[HAL_TRACE_MASK_WORDS];
+HAL_INTERNAL void hal_trace               (HalFunctionId function, ...);
+HAL_INTERNAL int  hal_trace_set_functions (const char *spec);
+
+static inline int
+hal_trace_enabled (HalFunctionId function)
+{
+	return (__atomic_load_n (&hal_trace_mask[function / 64], __ATOMIC_RELAXED) >> (function % 64)) & 1;
+}
+
+/* libhal-stats.c */
+#define HAL_STATS_COUNT 1               /* count calls */
+#define HAL_STATS_TIME  2               /* and time them */
+
+typedef struct {
+	uint64_t start_ns;              /**< if timed */
+	HalFunctionId function;
+	int mode;                       /**< HAL_STATS_*, 0 if the call is not counted */
+	int failed;
+} HalStatsCall;
+
+struct LibHalDummyStats_s;
+
+HAL_INTERNAL extern int hal_stats_enabled;     /* HAL_STATS_* */
+HAL_INTERNAL void hal_stats_record (HalStatsCall *call);
+HAL_INTERNAL int  hal_stats_get    (struct LibHalDummyStats_s **out_stats, int *out_num_stats);
+HAL_INTERNAL void hal_stats_reset  (void);
+
+static inline uint64_t
+hal_stats_clock (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline HalStatsCall
+hal_stats_enter (HalFunctionId function)
+{
+	HalStatsCall call;
+
+	call.function = function;
+	call.failed = 0;
+	call.mode = hal_stats_enabled;
+	call.start_ns = HAL_UNLIKELY (call.mode & HAL_STATS_TIME) ? hal_stats_clock () : 0;
+	return call;
+}
+
+/* Run as the function of @call returns; with stats off that is all */
+static inline void
+hal_stats_leave (HalStatsCall *call)
+{
+	if (call->mode != 0)
+		hal_stats_record (call);
+}
+
+/**
+ * HAL_TRACE:
+ * @_fn_: name of the entry point, as listed in libhal-functions.h
+ *
+ * Must be the first statement of every libhal entry point.  Counts
+ * the call, timing it until the function returns if stats_timing is
+ * on, and records it along with the arguments its libhal-functions.h
+ * entry declares.  When the entry point is not being traced that part
+ * is a single test of hal_trace_mask and the arguments are not
+ * evaluated.
+ */
+#define HAL_TRACE(_fn_, ...)							\
+	HalStatsCall hal_stats_call HAL_CLEANUP (hal_stats_leave) =		\
+		hal_stats_enter (HAL_FN_##_fn_);				\
+	do {									\
+		if (HAL_UNLIKELY (hal_trace_enabled (HAL_FN_##_fn_)))		\
+			hal_trace (HAL_FN_##_fn_, ##__VA_ARGS__);		\
+	} while (0)
+
+/**
+ * HAL_CALL_FAILED:
+ *
+ * Count the current call, see HAL_TRACE(), as an error.
+ */
+#define HAL_CALL_FAILED() (hal_stats_call.failed = 1)
+
+#endif /* LIBHAL_PRIVATE_H */
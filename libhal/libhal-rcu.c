@@ -0,0 +1,247 @@
+/***************************************************************************
+ *
+ * libhal-rcu.c : epoch based reclamation for lock-free readers
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "libhal-private.h"
+
+/*
+ * Readers of data that writers replace rather than change in place,
+ * such as the device versions of libhal-store.c, wrap their accesses
+ * in hal_rcu_read_lock() and hal_rcu_read_unlock(), which take no lock
+ * and write only to memory of their own thread.  A writer unpublishes
+ * the old data, then hands it to hal_rcu_retire(), and it is freed
+ * once every reader that could have seen it has left its read side
+ * section: its grace period.
+ *
+ * Grace periods are tracked with a global epoch that each retire
+ * advances.  A reader records the epoch it entered at, and the data
+ * retired at epoch E can be freed once no reader is left that entered
+ * before E.  Retired data waits on a list, reclaimed by later writers.
+ *
+ * Each thread gets a reader record on its first read, kept on a list
+ * and handed to another thread once it exits.  A thread that has
+ * none, being out of memory or past that point, is counted instead,
+ * and nothing is freed while such a reader is inside.
+ */
+
+typedef struct HalRcuReader_s HalRcuReader;
+
+struct HalRcuReader_s {
+	HalRcuReader *next;
+	uint64_t epoch;                 /**< entered at, 0 if outside */
+	unsigned int nesting;
+	int in_use;
+};
+
+static pthread_once_t hal_rcu_once = PTHREAD_ONCE_INIT;
+static pthread_key_t hal_rcu_key;
+static uint64_t hal_rcu_epoch = 1;
+static HalRcuReader *hal_rcu_readers;
+static unsigned int hal_rcu_anonymous;          /**< readers without a record */
+
+/* hal_rcu_lock protects the retired list and adding readers */
+static pthread_mutex_t hal_rcu_lock = PTHREAD_MUTEX_INITIALIZER;
+static HalRcuHead *hal_rcu_retired;
+static HalRcuHead **hal_rcu_retired_tail = &hal_rcu_retired;
+
+static __thread HalRcuReader *hal_rcu_reader = NULL;
+static __thread unsigned int hal_rcu_anonymous_nesting = 0;
+static __thread int hal_rcu_exited = FALSE;      /**< record handed on, see hal_rcu_thread_exit() */
+
+/* Runs on the exiting thread.  Once the record is handed on, read
+ * side sections the thread still enters, e.g. from the destructors of
+ * other thread keys, are counted as anonymous. */
+static void
+hal_rcu_thread_exit (void *data)
+{
+	HalRcuReader *reader = data;
+
+	hal_rcu_reader = NULL;
+	hal_rcu_exited = TRUE;
+	__atomic_store_n (&reader->in_use, FALSE, __ATOMIC_RELEASE);
+}
+
+static void
+hal_rcu_init (void)
+{
+	pthread_key_create (&hal_rcu_key, hal_rcu_thread_exit);
+}
+
+/* A reader record for this thread, or NULL if out of memory */
+static HalRcuReader *
+hal_rcu_reader_get (void)
+{
+	HalRcuReader *reader;
+	int in_use;
+
+	pthread_once (&hal_rcu_once, hal_rcu_init);
+
+	for (reader = __atomic_load_n (&hal_rcu_readers, __ATOMIC_ACQUIRE); reader != NULL; reader = reader->next) {
+		in_use = FALSE;
+		if (__atomic_compare_exchange_n (&reader->in_use, &in_use, TRUE, FALSE,
+						 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+	if (reader == NULL) {
+		reader = calloc (1, sizeof (HalRcuReader));
+		if (reader == NULL)
+			return NULL;
+		reader->in_use = TRUE;
+		pthread_mutex_lock (&hal_rcu_lock);
+		reader->next = hal_rcu_readers;
+		__atomic_store_n (&hal_rcu_readers, reader, __ATOMIC_RELEASE);
+		pthread_mutex_unlock (&hal_rcu_lock);
+	}
+
+	pthread_setspecific (hal_rcu_key, reader);
+	hal_rcu_reader = reader;
+	return reader;
+}
+
+/**
+ * hal_rcu_read_lock:
+ *
+ * Enter a read side section.  Sections nest.
+ */
+void
+hal_rcu_read_lock (void)
+{
+	HalRcuReader *reader = hal_rcu_reader;
+
+	if (reader == NULL && hal_rcu_anonymous_nesting == 0 && !hal_rcu_exited)
+		reader = hal_rcu_reader_get ();
+	if (reader == NULL) {
+		if (hal_rcu_anonymous_nesting++ == 0) {
+			__atomic_add_fetch (&hal_rcu_anonymous, 1, __ATOMIC_RELAXED);
+			HAL_FENCE (__ATOMIC_SEQ_CST);
+		}
+		return;
+	}
+
+	if (reader->nesting++ == 0) {
+		__atomic_store_n (&reader->epoch, __atomic_load_n (&hal_rcu_epoch, __ATOMIC_ACQUIRE),
+				  __ATOMIC_RELAXED);
+		/* a writer scanning readers sees the epoch, or this reader sees its unpublishing */
+		HAL_FENCE (__ATOMIC_SEQ_CST);
+	}
+}
+
+/**
+ * hal_rcu_read_unlock:
+ *
+ * Leave a read side section.
+ */
+void
+hal_rcu_read_unlock (void)
+{
+	HalRcuReader *reader = hal_rcu_reader;
+
+	if (hal_rcu_anonymous_nesting > 0) {
+		if (--hal_rcu_anonymous_nesting == 0)
+			__atomic_sub_fetch (&hal_rcu_anonymous, 1, __ATOMIC_RELEASE);
+		return;
+	}
+	if (--reader->nesting == 0)
+		__atomic_store_n (&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* The oldest epoch a reader is in, or UINT64_MAX if there is none */
+static uint64_t
+hal_rcu_oldest_reader (void)
+{
+	HalRcuReader *reader;
+	uint64_t oldest = UINT64_MAX;
+	uint64_t epoch;
+
+	HAL_FENCE (__ATOMIC_SEQ_CST);
+	if (__atomic_load_n (&hal_rcu_anonymous, __ATOMIC_ACQUIRE) > 0)
+		return 0;
+	for (reader = __atomic_load_n (&hal_rcu_readers, __ATOMIC_ACQUIRE); reader != NULL; reader = reader->next) {
+		epoch = __atomic_load_n (&reader->epoch, __ATOMIC_ACQUIRE);
+		if (epoch != 0 && epoch < oldest)
+			oldest = epoch;
+	}
+	return oldest;
+}
+
+/**
+ * hal_rcu_retire:
+ * @head: the data, already unpublished
+ * @free_func: frees the data once readers are done with it
+ *
+ * Free the data after a grace period.  Also frees data retired
+ * earlier whose grace period is over.
+ */
+void
+hal_rcu_retire (HalRcuHead *head, void (*free_func) (HalRcuHead *head))
+{
+	head->next = NULL;
+	head->free_func = free_func;
+
+	pthread_mutex_lock (&hal_rcu_lock);
+	head->epoch = __atomic_add_fetch (&hal_rcu_epoch, 1, __ATOMIC_SEQ_CST);
+	*hal_rcu_retired_tail = head;
+	hal_rcu_retired_tail = &head->next;
+	pthread_mutex_unlock (&hal_rcu_lock);
+
+	hal_rcu_reclaim ();
+}
+
+/**
+ * hal_rcu_reclaim:
+ *
+ * Free the retired data whose grace period is over.
+ */
+void
+hal_rcu_reclaim (void)
+{
+	HalRcuHead *done = NULL;
+	HalRcuHead *head;
+	uint64_t oldest;
+
+	pthread_mutex_lock (&hal_rcu_lock);
+	if (hal_rcu_retired != NULL) {
+		oldest = hal_rcu_oldest_reader ();
+		/* retired in epoch order, so the list is done up to the first that is not */
+		while (hal_rcu_retired != NULL && hal_rcu_retired->epoch <= oldest) {
+			head = hal_rcu_retired;
+			hal_rcu_retired = head->next;
+			head->next = done;
+			done = head;
+		}
+		if (hal_rcu_retired == NULL)
+			hal_rcu_retired_tail = &hal_rcu_retired;
+	}
+	pthread_mutex_unlock (&hal_rcu_lock);
+
+	while (done != NULL) {
+		head = done;
+		done = head->next;
+		head->free_func (head);
+	}
+}
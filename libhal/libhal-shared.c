@@ -0,0 +1,689 @@
+/***************************************************************************
+ *
+ * libhal-shared.c : one GDL for every process on the host
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dbus/dbus.h>
+
+#include "libhal.h"
+#include "libhal-image.h"
+#include "libhal-private.h"
+
+/*
+ * When the "shared_gdl" setting names a POSIX shared memory object,
+ * e.g. /hal-dummy-gdl, one process publishes its GDL there for every
+ * other process on the host.  The process with shared_gdl_writer = yes
+ * creates the object and owns it, holding a lock on it while it runs;
+ * the others map it read-only and answer queries from it instead of
+ * keeping devices of their own, so the memory used for devices does
+ * not grow with the number of clients.  Only the writer can change
+ * devices.
+ *
+ * The object is laid out as
+ *
+ *   HalSharedHeader, padded to HAL_SHARED_HEADER_SIZE
+ *   buffer 0          buffer_size bytes
+ *   buffer 1          buffer_size bytes
+ *
+ * each buffer holding an image laid out as in libhal-image.h.  After
+ * every change the writer copies the whole GDL into the buffer readers
+ * are not using, see hal_store_publish(), then points them at it.
+ * Each buffer has a sequence number that is odd while it is written.
+ * Readers note it before looking at a buffer and check it afterwards,
+ * starting again if it changed: a seqlock, with readers that take no
+ * lock, make no syscall and never wait for the writer to finish
+ * copying.  The image lookups cope with a buffer changing under them,
+ * see libhal-image.c.
+ *
+ * Every reader trusts what the object holds, and anyone who can write
+ * to it or resize it can forge devices or crash readers with SIGBUS,
+ * so only its owner may write to it.  The writer only takes over an
+ * object it owns; readers want one owned by root, by themselves, or
+ * by the uid the "shared_gdl_uid" setting names.
+ *
+ * shared_gdl_size sets the size of each buffer, 16M by default.  It
+ * is fixed when the object is created, and memory is only used as the
+ * GDL grows into it; a GDL that does not fit is not published.  The
+ * last byte of each buffer is never written, so strings in it always
+ * end.
+ */
+
+#define HAL_SHARED_MAGIC         0x4c444748      /* "HGDL" */
+#define HAL_SHARED_VERSION       1
+#define HAL_SHARED_HEADER_SIZE   4096
+#define HAL_SHARED_DEFAULT_SIZE  (16 * 1024 * 1024)
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t current;               /**< buffer readers use */
+	uint32_t writer;                /**< pid of the writer */
+	uint32_t sequence[2];           /**< per buffer, odd while it is written */
+	uint64_t generation;            /**< of the GDL in the current buffer */
+	uint64_t buffer_generation[2];
+	uint64_t buffer_size;
+	uint32_t reserved[8];
+} HalSharedHeader;
+
+typedef struct {
+	HalImage image;
+	unsigned int buffer;
+	uint32_t sequence;
+	uint64_t generation;
+} HalSharedRead;
+
+typedef int (*HalSharedMatchFunc) (const HalImage *image, unsigned int device,
+				   const char *key, const char *value);
+
+static HalSharedHeader *hal_shared_header;
+static size_t hal_shared_buffer_size;
+
+static const char *
+hal_shared_buffer (unsigned int buffer)
+{
+	return (const char *) hal_shared_header + HAL_SHARED_HEADER_SIZE + buffer * hal_shared_buffer_size;
+}
+
+static int
+hal_shared_setting_on (const char *key)
+{
+	const char *value = hal_config_get (key);
+
+	return value != NULL && (strcmp (value, "yes") == 0 || strcmp (value, "on") == 0 ||
+				 strcmp (value, "1") == 0);
+}
+
+/* FALSE, saying why, unless @name is only writable by the owner it should have */
+static int
+hal_shared_owner_ok (const char *name, const struct stat *st, int writer)
+{
+	long uid = hal_config_get_int ("shared_gdl_uid", -1);
+	int owner;
+
+	if (writer)
+		owner = st->st_uid == geteuid ();
+	else
+		owner = st->st_uid == geteuid () || st->st_uid == 0 || (uid >= 0 && st->st_uid == (uid_t) uid);
+	if (owner && (st->st_mode & 022) == 0)
+		return TRUE;
+
+	fprintf (stderr, "%s %d : shared GDL %s has owner %u and mode %03o, not using it\n",
+		 __FILE__, __LINE__, name, (unsigned int) st->st_uid, (unsigned int) (st->st_mode & 0777));
+	return FALSE;
+}
+
+/* Map @name read-only; FALSE if it is missing or not a shared GDL */
+static int
+hal_shared_open_reader (const char *name)
+{
+	const HalSharedHeader *h;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = shm_open (name, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0) {
+		fprintf (stderr, "%s %d : cannot open shared GDL %s: %s\n",
+			 __FILE__, __LINE__, name, strerror (errno));
+		return FALSE;
+	}
+	if (fstat (fd, &st) != 0 || !hal_shared_owner_ok (name, &st, FALSE)) {
+		close (fd);
+		return FALSE;
+	}
+	map = MAP_FAILED;
+	if ((size_t) st.st_size >= HAL_SHARED_HEADER_SIZE)
+		map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED) {
+		fprintf (stderr, "%s %d : cannot map shared GDL %s\n", __FILE__, __LINE__, name);
+		return FALSE;
+	}
+
+	h = map;
+	if (__atomic_load_n (&h->magic, __ATOMIC_ACQUIRE) != HAL_SHARED_MAGIC ||
+	    h->version != HAL_SHARED_VERSION || h->buffer_size == 0 ||
+	    h->buffer_size > ((size_t) st.st_size - HAL_SHARED_HEADER_SIZE) / 2) {
+		fprintf (stderr, "%s %d : %s is not a shared GDL\n", __FILE__, __LINE__, name);
+		munmap (map, st.st_size);
+		return FALSE;
+	}
+
+	hal_shared_buffer_size = h->buffer_size;
+	hal_shared_header = map;
+	return TRUE;
+}
+
+/* Create or take over @name; FALSE if another process owns it */
+static int
+hal_shared_open_writer (const char *name)
+{
+	HalSharedHeader *h;
+	struct stat st;
+	size_t buffer_size;
+	size_t size;
+	long page_size = sysconf (_SC_PAGESIZE);
+	void *map;
+	int fd;
+
+	fd = shm_open (name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf (stderr, "%s %d : cannot create shared GDL %s: %s\n",
+			 __FILE__, __LINE__, name, strerror (errno));
+		return FALSE;
+	}
+	/* held for as long as the process runs */
+	if (flock (fd, LOCK_EX | LOCK_NB) != 0) {
+		fprintf (stderr, "%s %d : shared GDL %s has another writer\n", __FILE__, __LINE__, name);
+		close (fd);
+		return FALSE;
+	}
+	if (fstat (fd, &st) != 0)
+		goto fail;
+	if (!hal_shared_owner_ok (name, &st, TRUE)) {
+		close (fd);
+		return FALSE;
+	}
+
+	/* a GDL left by an earlier writer keeps its layout, readers may have it mapped */
+	map = MAP_FAILED;
+	if ((size_t) st.st_size >= HAL_SHARED_HEADER_SIZE) {
+		map = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED)
+			goto fail;
+		h = map;
+		if (h->magic == HAL_SHARED_MAGIC && h->version == HAL_SHARED_VERSION &&
+		    h->buffer_size != 0 && h->buffer_size <= ((size_t) st.st_size - HAL_SHARED_HEADER_SIZE) / 2) {
+			hal_shared_buffer_size = h->buffer_size;
+			goto out;
+		}
+		munmap (map, st.st_size);
+	}
+
+	buffer_size = hal_config_get_size ("shared_gdl_size", HAL_SHARED_DEFAULT_SIZE);
+	if (buffer_size > UINT32_MAX)
+		buffer_size = UINT32_MAX;
+	buffer_size = (buffer_size + page_size - 1) & ~(size_t) (page_size - 1);
+	size = HAL_SHARED_HEADER_SIZE + 2 * buffer_size;
+	if (ftruncate (fd, 0) != 0 || ftruncate (fd, size) != 0)
+		goto fail;
+	map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto fail;
+	h = map;
+	h->version = HAL_SHARED_VERSION;
+	h->buffer_size = buffer_size;
+	hal_shared_buffer_size = buffer_size;
+	__atomic_store_n (&h->magic, HAL_SHARED_MAGIC, __ATOMIC_RELEASE);
+
+out:
+	h->writer = getpid ();
+	hal_shared_header = h;
+	/* fd stays open to keep the lock */
+	return TRUE;
+
+fail:
+	fprintf (stderr, "%s %d : cannot set up shared GDL %s: %s\n",
+		 __FILE__, __LINE__, name, strerror (errno));
+	close (fd);
+	return FALSE;
+}
+
+/**
+ * hal_shared_open:
+ * @writer: where to store whether this process publishes the GDL
+ *
+ * Open the shared GDL named by the "shared_gdl" setting, if any.  A
+ * would-be writer that finds another one reads its GDL instead.
+ *
+ * Returns: FALSE if there is no shared GDL to use
+ */
+int
+hal_shared_open (int *writer)
+{
+	const char *name;
+
+	*writer = FALSE;
+	name = hal_config_get ("shared_gdl");
+	if (name == NULL || *name == '\0')
+		return FALSE;
+
+	if (hal_shared_setting_on ("shared_gdl_writer") && hal_shared_open_writer (name)) {
+		*writer = TRUE;
+		return TRUE;
+	}
+	return hal_shared_open_reader (name);
+}
+
+/**
+ * hal_shared_publish_begin:
+ * @size: bytes the image of the GDL needs
+ *
+ * Returns: the buffer readers are not using, to lay out the image in,
+ * or NULL if @size does not fit
+ */
+void *
+hal_shared_publish_begin (size_t size)
+{
+	HalSharedHeader *h = hal_shared_header;
+	unsigned int next = h->current ^ 1;
+
+	if (size >= hal_shared_buffer_size) {
+		fprintf (stderr, "%s %d : the GDL needs %zu bytes, more than shared_gdl_size\n",
+			 __FILE__, __LINE__, size);
+		return NULL;
+	}
+
+	/* readers still in this buffer see it change */
+	if ((h->sequence[next] & 1) == 0) {
+		__atomic_store_n (&h->sequence[next], h->sequence[next] + 1, __ATOMIC_RELAXED);
+		HAL_FENCE (__ATOMIC_RELEASE);
+	}
+	return (void *) hal_shared_buffer (next);
+}
+
+/**
+ * hal_shared_publish_end:
+ * @generation: the generation of the GDL written
+ *
+ * Point readers at the buffer hal_shared_publish_begin() returned.
+ */
+void
+hal_shared_publish_end (uint64_t generation)
+{
+	HalSharedHeader *h = hal_shared_header;
+	unsigned int next = h->current ^ 1;
+
+	h->buffer_generation[next] = generation;
+	__atomic_store_n (&h->sequence[next], h->sequence[next] + 1, __ATOMIC_RELEASE);
+	__atomic_store_n (&h->current, next, __ATOMIC_RELEASE);
+	__atomic_store_n (&h->generation, generation, __ATOMIC_RELEASE);
+}
+
+/* Start looking at the current buffer */
+static void
+hal_shared_read_begin (HalSharedRead *read)
+{
+	const HalSharedHeader *h = hal_shared_header;
+
+	for (;;) {
+		read->buffer = __atomic_load_n (&h->current, __ATOMIC_ACQUIRE) & 1;
+		read->sequence = __atomic_load_n (&h->sequence[read->buffer], __ATOMIC_ACQUIRE);
+		if ((read->sequence & 1) == 0)
+			break;
+		/* the writer is switching buffers */
+		sched_yield ();
+	}
+	read->generation = h->buffer_generation[read->buffer];
+	hal_image_view (&read->image, hal_shared_buffer (read->buffer), hal_shared_buffer_size);
+}
+
+/* TRUE if the buffer changed since hal_shared_read_begin(), so what was read must be dropped */
+static int
+hal_shared_read_retry (const HalSharedRead *read)
+{
+	HAL_FENCE (__ATOMIC_ACQUIRE);
+	return __atomic_load_n (&hal_shared_header->sequence[read->buffer], __ATOMIC_RELAXED) != read->sequence;
+}
+
+/**
+ * hal_shared_device_exists:
+ * @udi: the device
+ *
+ * Returns: TRUE if @udi is in the shared GDL
+ */
+int
+hal_shared_device_exists (const char *udi)
+{
+	HalSharedRead read;
+	int ret;
+
+	do {
+		hal_shared_read_begin (&read);
+		ret = hal_image_view_find_device (&read.image, udi) >= 0;
+	} while (hal_shared_read_retry (&read));
+
+	return ret;
+}
+
+/**
+ * hal_shared_get_device_generation:
+ * @udi: the device
+ *
+ * Devices do not keep a generation of their own in the shared GDL.
+ *
+ * Returns: the generation of the GDL @udi was read from, or 0 if
+ * there is no such device
+ */
+uint64_t
+hal_shared_get_device_generation (const char *udi)
+{
+	HalSharedRead read;
+	uint64_t generation;
+
+	do {
+		hal_shared_read_begin (&read);
+		generation = hal_image_view_find_device (&read.image, udi) >= 0 ? read.generation : 0;
+	} while (hal_shared_read_retry (&read));
+
+	return generation;
+}
+
+/**
+ * hal_shared_get_gdl_generation:
+ *
+ * Returns: the generation of the shared GDL
+ */
+uint64_t
+hal_shared_get_gdl_generation (void)
+{
+	return __atomic_load_n (&hal_shared_header->generation, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * hal_shared_get_property_type:
+ * @udi: the device
+ * @key: the property
+ *
+ * Returns: the LIBHAL_PROPERTY_TYPE_* of the property, or
+ * LIBHAL_PROPERTY_TYPE_INVALID if there is no such property
+ */
+int
+hal_shared_get_property_type (const char *udi, const char *key)
+{
+	HalSharedRead read;
+	int device;
+	int type;
+
+	do {
+		hal_shared_read_begin (&read);
+		device = hal_image_view_find_device (&read.image, udi);
+		type = device >= 0 ? hal_image_view_get_property_type (&read.image, device, key) :
+			LIBHAL_PROPERTY_TYPE_INVALID;
+	} while (hal_shared_read_retry (&read));
+
+	return type;
+}
+
+/**
+ * hal_shared_get_property:
+ * @udi: the device
+ * @key: the property
+ * @type: the LIBHAL_PROPERTY_TYPE_* the property should have
+ * @value: where to copy the value
+ *
+ * Strings and string lists are copied with malloc().
+ *
+ * Returns: FALSE if there is no such property of that type, or out of memory
+ */
+int
+hal_shared_get_property (const char *udi, const char *key, int type, HalValue *value)
+{
+	HalSharedRead read;
+	int device;
+	int ok;
+
+	for (;;) {
+		hal_shared_read_begin (&read);
+		device = hal_image_view_find_device (&read.image, udi);
+		ok = device >= 0 && hal_image_view_get_property (&read.image, device, key, type, value);
+		if (!hal_shared_read_retry (&read))
+			return ok;
+		if (ok && type == LIBHAL_PROPERTY_TYPE_STRING)
+			free (value->str_value);
+		else if (ok && type == LIBHAL_PROPERTY_TYPE_STRLIST)
+			libhal_free_string_array (value->strlist_value);
+	}
+}
+
+/* The properties of @device in a set of their own, or NULL */
+static LibHalPropertySet *
+hal_shared_device_properties (const HalImage *image, unsigned int device)
+{
+	HalPropertySetBuilder builder;
+
+	hal_property_set_builder_init (&builder);
+	if (!hal_image_view_foreach_property (image, device, hal_property_set_builder_add, &builder) ||
+	    !hal_property_set_builder_alloc (&builder))
+		return NULL;
+	/* the builder does not overflow the set if the buffer changed since measuring */
+	if (!hal_image_view_foreach_property (image, device, hal_property_set_builder_add, &builder)) {
+		free (builder.set);
+		return NULL;
+	}
+	return hal_property_set_builder_finish (&builder);
+}
+
+/**
+ * hal_shared_get_all_properties:
+ * @udi: the device
+ *
+ * Returns: the properties of the device, for libhal_free_property_set(),
+ * or NULL if there is no such device or out of memory
+ */
+LibHalPropertySet *
+hal_shared_get_all_properties (const char *udi)
+{
+	HalSharedRead read;
+	LibHalPropertySet *set;
+	int device;
+
+	for (;;) {
+		hal_shared_read_begin (&read);
+		device = hal_image_view_find_device (&read.image, udi);
+		set = device >= 0 ? hal_shared_device_properties (&read.image, device) : NULL;
+		if (!hal_shared_read_retry (&read))
+			return set;
+		if (set != NULL)
+			libhal_free_property_set (set);
+	}
+}
+
+/* The udis of the devices @match accepts, in GDL order */
+static char **
+hal_shared_find (HalSharedMatchFunc match, const char *key, const char *value, int *num_devices)
+{
+	HalSharedRead read;
+	unsigned int device;
+	unsigned int i;
+	unsigned int n;
+	char **udis;
+	int retry;
+
+	*num_devices = 0;
+	for (;;) {
+		hal_shared_read_begin (&read);
+		udis = malloc ((read.image.num_devices + 1) * sizeof (char *));
+		if (udis == NULL)
+			return NULL;
+		n = 0;
+		for (i = 0; i < read.image.num_devices; i++) {
+			device = hal_image_view_device_at (&read.image, i);
+			if (match != NULL && !match (&read.image, device, key, value))
+				continue;
+			udis[n] = strdup (hal_image_view_device_udi (&read.image, device));
+			if (udis[n] == NULL)
+				break;
+			n++;
+		}
+		udis[n] = NULL;
+		retry = hal_shared_read_retry (&read);
+		if (!retry && i == read.image.num_devices) {
+			*num_devices = n;
+			return udis;
+		}
+		libhal_free_string_array (udis);
+		if (!retry)
+			return NULL;
+	}
+}
+
+/**
+ * hal_shared_get_all_devices:
+ * @num_devices: where to store the number of devices
+ *
+ * Returns: the udis of the devices in the shared GDL, in order, as a
+ * NULL terminated array for libhal_free_string_array(), or NULL if
+ * out of memory
+ */
+char **
+hal_shared_get_all_devices (int *num_devices)
+{
+	return hal_shared_find (NULL, NULL, NULL, num_devices);
+}
+
+static int
+hal_shared_match_string (const HalImage *image, unsigned int device, const char *key, const char *value)
+{
+	const char *s = hal_image_view_get_string (image, device, key);
+
+	return s != NULL && strcmp (s, value) == 0;
+}
+
+/**
+ * hal_shared_find_string_match:
+ * @key: the property
+ * @value: the string it should have
+ * @num_devices: where to store the number of devices
+ *
+ * Returns: the udis of the devices where @key is @value, for
+ * libhal_free_string_array(), or NULL if out of memory
+ */
+char **
+hal_shared_find_string_match (const char *key, const char *value, int *num_devices)
+{
+	return hal_shared_find (hal_shared_match_string, key, value, num_devices);
+}
+
+static int
+hal_shared_match_capability (const HalImage *image, unsigned int device, const char *key,
+			     const char *capability)
+{
+	char **strlist;
+	unsigned int i;
+	int ret = FALSE;
+
+	if (!hal_image_view_get_strlist (image, device, "info.capabilities", &strlist) || strlist == NULL)
+		return FALSE;
+	for (i = 0; strlist[i] != NULL && !ret; i++)
+		ret = strcmp (strlist[i], capability) == 0;
+	free (strlist);
+	return ret;
+}
+
+/**
+ * hal_shared_query_capability:
+ * @udi: the device
+ * @capability: the capability
+ *
+ * Returns: TRUE if info.capabilities of @udi has @capability
+ */
+int
+hal_shared_query_capability (const char *udi, const char *capability)
+{
+	HalSharedRead read;
+	int device;
+	int ret;
+
+	do {
+		hal_shared_read_begin (&read);
+		device = hal_image_view_find_device (&read.image, udi);
+		ret = device >= 0 && hal_shared_match_capability (&read.image, device, NULL, capability);
+	} while (hal_shared_read_retry (&read));
+
+	return ret;
+}
+
+/**
+ * hal_shared_find_by_capability:
+ * @capability: the capability
+ * @num_devices: where to store the number of devices
+ *
+ * Returns: the udis of the devices with @capability, for
+ * libhal_free_string_array(), or NULL if out of memory
+ */
+char **
+hal_shared_find_by_capability (const char *capability, int *num_devices)
+{
+	return hal_shared_find (hal_shared_match_capability, NULL, capability, num_devices);
+}
+
+/**
+ * hal_shared_get_all_devices_with_properties:
+ * @num_devices: where to store the number of devices
+ * @udis: where to store the udis of the devices in the shared GDL,
+ * for libhal_free_string_array()
+ * @sets: where to store a NULL terminated array of their properties,
+ * each for libhal_free_property_set(), to be freed with free()
+ *
+ * Returns: FALSE if out of memory
+ */
+int
+hal_shared_get_all_devices_with_properties (int *num_devices, char ***udis, LibHalPropertySet ***sets)
+{
+	HalSharedRead read;
+	unsigned int device;
+	unsigned int num;
+	unsigned int i;
+	int retry;
+
+	*num_devices = 0;
+	for (;;) {
+		hal_shared_read_begin (&read);
+		num = read.image.num_devices;
+		*udis = calloc (num + 1, sizeof (char *));
+		*sets = calloc (num + 1, sizeof (LibHalPropertySet *));
+		for (i = 0; *udis != NULL && *sets != NULL && i < num; i++) {
+			device = hal_image_view_device_at (&read.image, i);
+			(*udis)[i] = strdup (hal_image_view_device_udi (&read.image, device));
+			(*sets)[i] = hal_shared_device_properties (&read.image, device);
+			if ((*udis)[i] == NULL || (*sets)[i] == NULL)
+				break;
+		}
+		retry = hal_shared_read_retry (&read);
+		if (!retry && *udis != NULL && *sets != NULL && i == num) {
+			*num_devices = num;
+			return TRUE;
+		}
+		libhal_free_string_array (*udis);
+		for (i = 0; *sets != NULL && i < num; i++) {
+			if ((*sets)[i] != NULL)
+				libhal_free_property_set ((*sets)[i]);
+		}
+		free (*sets);
+		*udis = NULL;
+		*sets = NULL;
+		if (!retry)
+			return FALSE;
+	}
+}
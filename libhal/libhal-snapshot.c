@@ -0,0 +1,180 @@
+/***************************************************************************
+ *
+ * libhal-snapshot.c : the GDL and its properties in one block
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "libhal-private.h"
+
+/*
+ * libhal_get_all_devices_with_properties() hands out the udis and
+ * the property sets of the whole GDL, all allocated in one block.
+ * The caller still frees the udis with libhal_free_string_array()
+ * and each set with libhal_free_property_set(), as with the real
+ * libhal; those only drop a reference on the snapshot, and the last
+ * one frees the block.  The store also keeps the properties of each
+ * device in a snapshot of their own, see libhal-store.c, and hands
+ * out references to it.
+ *
+ * Snapshots whose udis have not been freed yet are kept on a list,
+ * so that libhal_free_string_array() can tell their udi array from
+ * one it should free string by string.  While there are none, that
+ * check is a single atomic load.
+ */
+
+struct HalSnapshot_s {
+	HalSnapshot *next;              /**< snapshots with live udis */
+	char **udis;                    /**< NULL until published */
+	unsigned int refs;
+	uint64_t data[];
+};
+
+static pthread_mutex_t hal_snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static HalSnapshot *hal_snapshots;
+static unsigned int hal_snapshot_count;
+
+/**
+ * hal_snapshot_new:
+ * @size: bytes of data
+ * @refs: references the snapshot starts with, one for each set and
+ * one for the udis
+ *
+ * Returns: the snapshot, or NULL if out of memory
+ */
+HalSnapshot *
+hal_snapshot_new (size_t size, unsigned int refs)
+{
+	HalSnapshot *snapshot;
+
+	snapshot = malloc (sizeof (HalSnapshot) + size);
+	if (snapshot == NULL)
+		return NULL;
+	snapshot->next = NULL;
+	snapshot->udis = NULL;
+	snapshot->refs = refs;
+	return snapshot;
+}
+
+/**
+ * hal_snapshot_data:
+ * @snapshot: the snapshot
+ *
+ * Returns: the data of @snapshot, aligned for any property value
+ */
+char *
+hal_snapshot_data (HalSnapshot *snapshot)
+{
+	return (char *) snapshot->data;
+}
+
+/**
+ * hal_snapshot_publish:
+ * @snapshot: the snapshot, once filled
+ * @udis: its udi array, in the data of @snapshot
+ *
+ * Let hal_snapshot_free_udis() recognize @udis.
+ */
+void
+hal_snapshot_publish (HalSnapshot *snapshot, char **udis)
+{
+	pthread_mutex_lock (&hal_snapshot_lock);
+	snapshot->udis = udis;
+	snapshot->next = hal_snapshots;
+	hal_snapshots = snapshot;
+	__atomic_store_n (&hal_snapshot_count, hal_snapshot_count + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock (&hal_snapshot_lock);
+}
+
+/**
+ * hal_snapshot_free:
+ * @snapshot: a snapshot that was never published
+ *
+ * Free @snapshot whatever its references, e.g. because filling it
+ * failed.
+ */
+void
+hal_snapshot_free (HalSnapshot *snapshot)
+{
+	free (snapshot);
+}
+
+/**
+ * hal_snapshot_ref:
+ * @snapshot: the snapshot
+ *
+ * Add a reference, e.g. for one more set handed out.
+ */
+void
+hal_snapshot_ref (HalSnapshot *snapshot)
+{
+	__atomic_add_fetch (&snapshot->refs, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * hal_snapshot_unref:
+ * @snapshot: the snapshot
+ *
+ * Drop a reference, freeing @snapshot with the last one.
+ */
+void
+hal_snapshot_unref (HalSnapshot *snapshot)
+{
+	if (__atomic_sub_fetch (&snapshot->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free (snapshot);
+}
+
+/**
+ * hal_snapshot_free_udis:
+ * @udis: a string array given to libhal_free_string_array()
+ *
+ * Returns: TRUE if @udis belonged to a snapshot and has been
+ * released, FALSE if it should be freed as usual
+ */
+int
+hal_snapshot_free_udis (char **udis)
+{
+	HalSnapshot **link;
+	HalSnapshot *snapshot = NULL;
+
+	if (__atomic_load_n (&hal_snapshot_count, __ATOMIC_ACQUIRE) == 0)
+		return FALSE;
+
+	pthread_mutex_lock (&hal_snapshot_lock);
+	for (link = &hal_snapshots; *link != NULL; link = &(*link)->next) {
+		if ((*link)->udis == udis) {
+			snapshot = *link;
+			*link = snapshot->next;
+			__atomic_store_n (&hal_snapshot_count, hal_snapshot_count - 1, __ATOMIC_RELEASE);
+			break;
+		}
+	}
+	pthread_mutex_unlock (&hal_snapshot_lock);
+
+	if (snapshot == NULL)
+		return FALSE;
+	hal_snapshot_unref (snapshot);
+	return TRUE;
+}
@@ -0,0 +1,665 @@
+/***************************************************************************
+ *
+ * libhal-stats.c : call counters and latency histograms
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <dbus/dbus.h>
+
+#include "libhal.h"
+#include "libhal-private.h"
+#include "libhal-stats.h"
+
+/*
+ * HAL_TRACE() counts every libhal call in a shard owned by the calling
+ * thread, so recording takes no locks and no atomic read-modify-writes.
+ * Readers add up the shards of the live threads and the totals of the
+ * threads that have exited.  Resetting just remembers the current
+ * totals as the new zero.
+ *
+ * With stats_timing = yes calls are also timed from entry to return,
+ * for the time totals and histograms.  That takes two clock reads per
+ * call, several times the cost of a stub call, so it is off by default
+ * and those stay zero.  The setting stats = off turns counting off
+ * too.  Unless the application handles SIGUSR2 itself, the signal
+ * writes the statistics to /tmp/libhal-stats.<pid>, or to the file
+ * named by stats_file.
+ *
+ * Each process also publishes its call, error and time totals in a
+ * slot of the segment its user's processes share, described in
+ * libhal-stats.h, for hal-dummy-top to show, unless stats_shm = off.
+ */
+
+#define HAL_STATS_BUCKETS LIBHAL_DUMMY_STATS_BUCKETS
+
+typedef struct {
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t total_ns;
+	uint64_t histogram[HAL_STATS_BUCKETS];
+} HalStatsCounters;
+
+typedef struct HalStatsShard_s HalStatsShard;
+
+struct HalStatsShard_s {
+	HalStatsShard *next;
+	HalStatsCounters counters[HAL_FN_LAST];
+};
+
+int hal_stats_enabled = 0;
+
+static pthread_key_t hal_stats_key;
+
+/* hal_stats_lock protects everything below */
+static pthread_mutex_t hal_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static HalStatsShard *hal_stats_shards = NULL;
+static HalStatsCounters hal_stats_retired[HAL_FN_LAST];
+static HalStatsCounters hal_stats_baseline[HAL_FN_LAST];
+static int hal_stats_started = 0;
+static int hal_stats_pipe[2] = { -1, -1 };
+static int hal_stats_use_shm = 1;
+static HalStatsShmHeader *hal_stats_shm = NULL;
+static char hal_stats_shm_path[64];
+static HalStatsShmSlot *hal_stats_slot = NULL;
+
+static __thread HalStatsShard *hal_stats_shard = NULL;
+static __thread int hal_stats_exited = 0;       /**< shard retired, see hal_stats_thread_exit() */
+
+static void
+hal_stats_add (HalStatsCounters *total, const HalStatsCounters *c)
+{
+	int i;
+
+	total->calls += __atomic_load_n (&c->calls, __ATOMIC_RELAXED);
+	total->errors += __atomic_load_n (&c->errors, __ATOMIC_RELAXED);
+	total->total_ns += __atomic_load_n (&c->total_ns, __ATOMIC_RELAXED);
+	for (i = 0; i < HAL_STATS_BUCKETS; i++)
+		total->histogram[i] += __atomic_load_n (&c->histogram[i], __ATOMIC_RELAXED);
+}
+
+/* Called with hal_stats_lock held */
+static void
+hal_stats_sum_locked (HalStatsCounters *total)
+{
+	HalStatsShard *shard;
+	int fn;
+
+	memcpy (total, hal_stats_retired, sizeof (hal_stats_retired));
+	for (shard = hal_stats_shards; shard != NULL; shard = shard->next) {
+		for (fn = 0; fn < HAL_FN_LAST; fn++)
+			hal_stats_add (&total[fn], &shard->counters[fn]);
+	}
+}
+
+/* Called with hal_stats_lock held */
+static void
+hal_stats_retire_locked (HalStatsShard *shard)
+{
+	HalStatsShard **link;
+	int fn;
+
+	for (fn = 0; fn < HAL_FN_LAST; fn++)
+		hal_stats_add (&hal_stats_retired[fn], &shard->counters[fn]);
+
+	for (link = &hal_stats_shards; *link != NULL; link = &(*link)->next) {
+		if (*link == shard) {
+			*link = shard->next;
+			break;
+		}
+	}
+	free (shard);
+}
+
+/* Runs on the exiting thread.  Calls it still makes, e.g. from the
+ * destructors of other thread keys, are counted in the retired totals
+ * directly rather than in a new shard nothing would free. */
+static void
+hal_stats_thread_exit (void *data)
+{
+	hal_stats_shard = NULL;
+	hal_stats_exited = 1;
+
+	pthread_mutex_lock (&hal_stats_lock);
+	hal_stats_retire_locked (data);
+	pthread_mutex_unlock (&hal_stats_lock);
+}
+
+/* Returns the statistics since the last reset in a new array */
+static HalStatsCounters *
+hal_stats_collect (void)
+{
+	HalStatsCounters *total;
+	int fn;
+	int i;
+
+	total = malloc (sizeof (HalStatsCounters) * HAL_FN_LAST);
+	if (total == NULL)
+		return NULL;
+
+	pthread_mutex_lock (&hal_stats_lock);
+	hal_stats_sum_locked (total);
+	for (fn = 0; fn < HAL_FN_LAST; fn++) {
+		total[fn].calls -= hal_stats_baseline[fn].calls;
+		total[fn].errors -= hal_stats_baseline[fn].errors;
+		total[fn].total_ns -= hal_stats_baseline[fn].total_ns;
+		for (i = 0; i < HAL_STATS_BUCKETS; i++)
+			total[fn].histogram[i] -= hal_stats_baseline[fn].histogram[i];
+	}
+	pthread_mutex_unlock (&hal_stats_lock);
+
+	return total;
+}
+
+static void
+hal_stats_dump (void)
+{
+	HalStatsCounters *total;
+	const char *path;
+	char default_path[64];
+	char tmp_path[1024];
+	FILE *fp;
+	int fn;
+	int i;
+
+	path = hal_config_get ("stats_file");
+	if (path == NULL) {
+		snprintf (default_path, sizeof (default_path), "/tmp/libhal-stats.%d", (int) getpid ());
+		path = default_path;
+	}
+	snprintf (tmp_path, sizeof (tmp_path), "%s.tmp", path);
+
+	total = hal_stats_collect ();
+	if (total == NULL)
+		return;
+
+	fp = fopen (tmp_path, "we");
+	if (fp == NULL) {
+		fprintf (stderr, "%s %d : cannot write %s\n", __FILE__, __LINE__, tmp_path);
+		free (total);
+		return;
+	}
+
+	fprintf (fp, "# function calls errors total_ns histogram[0..%d]\n", HAL_STATS_BUCKETS - 1);
+	for (fn = 0; fn < HAL_FN_LAST; fn++) {
+		if (total[fn].calls == 0)
+			continue;
+		fprintf (fp, "%s %llu %llu %llu", hal_functions[fn].name,
+			 (unsigned long long) total[fn].calls,
+			 (unsigned long long) total[fn].errors,
+			 (unsigned long long) total[fn].total_ns);
+		for (i = 0; i < HAL_STATS_BUCKETS; i++)
+			fprintf (fp, " %llu", (unsigned long long) total[fn].histogram[i]);
+		fputc ('\n', fp);
+	}
+
+	if (fclose (fp) == 0)
+		rename (tmp_path, path);
+	else
+		unlink (tmp_path);
+	free (total);
+}
+
+static void
+hal_stats_signal (int sig)
+{
+	int saved_errno = errno;
+	char c = 0;
+
+	if (write (hal_stats_pipe[1], &c, 1) < 0) {
+		/* a dump is already pending */
+	}
+	errno = saved_errno;
+}
+
+static void *
+hal_stats_dumper_thread (void *data)
+{
+	int fd = (int) (intptr_t) data;
+	char c;
+	ssize_t ret;
+
+	for (;;) {
+		ret = read (fd, &c, 1);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		hal_stats_dump ();
+	}
+
+	return NULL;
+}
+
+/* Called with hal_stats_lock held */
+static void
+hal_stats_start_dumper_locked (void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t all, old;
+	int created;
+
+	if (pipe (hal_stats_pipe) != 0)
+		return;
+	fcntl (hal_stats_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl (hal_stats_pipe[1], F_SETFD, FD_CLOEXEC);
+	fcntl (hal_stats_pipe[1], F_SETFL, O_NONBLOCK);
+
+	/* keep the application's signals away from our thread */
+	sigfillset (&all);
+	pthread_sigmask (SIG_SETMASK, &all, &old);
+	pthread_attr_init (&attr);
+	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+	created = pthread_create (&thread, &attr, hal_stats_dumper_thread,
+				  (void *) (intptr_t) hal_stats_pipe[0]) == 0;
+	pthread_attr_destroy (&attr);
+	pthread_sigmask (SIG_SETMASK, &old, NULL);
+
+	if (!created) {
+		close (hal_stats_pipe[0]);
+		close (hal_stats_pipe[1]);
+		hal_stats_pipe[0] = hal_stats_pipe[1] = -1;
+	}
+}
+
+/* Called with hal_stats_lock held */
+static void
+hal_stats_install_signal_locked (void)
+{
+	struct sigaction sa;
+
+	if (sigaction (SIGUSR2, NULL, &sa) != 0 || sa.sa_handler != SIG_DFL)
+		return;
+
+	hal_stats_start_dumper_locked ();
+	if (hal_stats_pipe[1] < 0)
+		return;
+
+	memset (&sa, 0, sizeof (sa));
+	sa.sa_handler = hal_stats_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset (&sa.sa_mask);
+	sigaction (SIGUSR2, &sa, NULL);
+}
+
+/* Called with hal_stats_lock held */
+static void
+hal_stats_shm_claim_locked (void)
+{
+	HalStatsShmSlot *slot;
+	uint32_t pid;
+	uint32_t owner;
+	unsigned int pass;
+	unsigned int i;
+	FILE *fp;
+
+	pid = getpid ();
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < hal_stats_shm->num_slots; i++) {
+			slot = hal_stats_shm_slot (hal_stats_shm, i);
+			owner = __atomic_load_n (&slot->pid, __ATOMIC_RELAXED);
+			/* first look for a free slot, then for one whose
+			 * owner died without giving it back */
+			if (pass == 0 && owner != 0)
+				continue;
+			if (pass == 1 && (owner == 0 || kill (owner, 0) == 0 || errno != ESRCH))
+				continue;
+			if (__atomic_compare_exchange_n (&slot->pid, &owner, pid, 0,
+							 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				goto claimed;
+		}
+	}
+
+	fprintf (stderr, "%s %d : no free slot in %s\n", __FILE__, __LINE__, hal_stats_shm_path);
+	return;
+
+claimed:
+	memset (slot->counters, 0, sizeof (HalStatsShmCounters) * hal_stats_shm->num_functions);
+	slot->uid = getuid ();
+	slot->start_time = time (NULL);
+	memset (slot->comm, 0, sizeof (slot->comm));
+	fp = fopen ("/proc/self/comm", "re");
+	if (fp != NULL) {
+		if (fgets (slot->comm, sizeof (slot->comm), fp) != NULL)
+			slot->comm[strcspn (slot->comm, "\n")] = '\0';
+		fclose (fp);
+	}
+
+	__atomic_store_n (&hal_stats_slot, slot, __ATOMIC_RELEASE);
+}
+
+/* Called with hal_stats_lock held */
+static void
+hal_stats_shm_attach_locked (void)
+{
+	HalStatsShmHeader *h;
+	struct stat st;
+	size_t size;
+	void *map;
+	int fd;
+
+	hal_stats_shm_name (hal_stats_shm_path, sizeof (hal_stats_shm_path), geteuid ());
+	fd = shm_open (hal_stats_shm_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		fprintf (stderr, "%s %d : cannot open %s: %s\n",
+			 __FILE__, __LINE__, hal_stats_shm_path, strerror (errno));
+		return;
+	}
+
+	map = MAP_FAILED;
+	if (fstat (fd, &st) != 0)
+		goto out_close;
+
+	/* someone else could resize it under us, or read and forge our counters */
+	if (st.st_uid != geteuid () || (st.st_mode & 077) != 0) {
+		fprintf (stderr, "%s %d : %s is not private to uid %u, not using it\n",
+			 __FILE__, __LINE__, hal_stats_shm_path, (unsigned int) geteuid ());
+		goto out_close;
+	}
+
+	/* keep other processes from mapping a half-initialised segment */
+	while (flock (fd, LOCK_EX) != 0 && errno == EINTR)
+		;
+
+	if (fstat (fd, &st) != 0)
+		goto out;
+
+	if (st.st_size == 0) {
+		size = sizeof (HalStatsShmHeader) + (size_t) HAL_STATS_SHM_SLOTS * sizeof (HalStatsShmSlot);
+		if (ftruncate (fd, size) != 0)
+			goto out;
+		map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED)
+			goto out;
+		h = map;
+		h->version = HAL_STATS_SHM_VERSION;
+		h->header_size = sizeof (HalStatsShmHeader);
+		h->num_slots = HAL_STATS_SHM_SLOTS;
+		h->num_functions = HAL_STATS_SHM_FUNCTIONS;
+		h->slot_size = sizeof (HalStatsShmSlot);
+		__atomic_store_n (&h->magic, HAL_STATS_SHM_MAGIC, __ATOMIC_RELEASE);
+	} else {
+		size = st.st_size;
+		map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED)
+			goto out;
+		h = map;
+		if (size < sizeof (HalStatsShmHeader) ||
+		    h->magic != HAL_STATS_SHM_MAGIC || h->version != HAL_STATS_SHM_VERSION ||
+		    h->slot_size != sizeof (HalStatsShmSlot) || h->num_functions < HAL_FN_LAST ||
+		    h->header_size + (size_t) h->num_slots * h->slot_size > size) {
+			fprintf (stderr, "%s %d : %s has an unknown layout\n",
+				 __FILE__, __LINE__, hal_stats_shm_path);
+			munmap (map, size);
+			map = MAP_FAILED;
+		}
+	}
+
+out:
+	flock (fd, LOCK_UN);
+out_close:
+	close (fd);
+
+	if (map != MAP_FAILED) {
+		hal_stats_shm = map;
+		hal_stats_shm_claim_locked ();
+	}
+}
+
+static void __attribute__ ((destructor))
+hal_stats_shm_release (void)
+{
+	HalStatsShmSlot *slot;
+
+	slot = __atomic_exchange_n (&hal_stats_slot, NULL, __ATOMIC_ACQ_REL);
+	if (slot != NULL)
+		__atomic_store_n (&slot->pid, 0, __ATOMIC_RELEASE);
+}
+
+static HalStatsShard *
+hal_stats_new_shard (void)
+{
+	HalStatsShard *shard;
+
+	shard = calloc (1, sizeof (HalStatsShard));
+	if (shard == NULL)
+		return NULL;
+
+	pthread_mutex_lock (&hal_stats_lock);
+	if (!hal_stats_started) {
+		/* the first call recorded in this process */
+		hal_stats_started = 1;
+		hal_stats_install_signal_locked ();
+		if (hal_stats_use_shm)
+			hal_stats_shm_attach_locked ();
+	}
+	shard->next = hal_stats_shards;
+	hal_stats_shards = shard;
+	pthread_mutex_unlock (&hal_stats_lock);
+
+	pthread_setspecific (hal_stats_key, shard);
+	hal_stats_shard = shard;
+
+	return shard;
+}
+
+/**
+ * hal_stats_record:
+ * @call: what hal_stats_enter() returned
+ *
+ * Count a call that is returning.  HAL_TRACE() arranges for
+ * hal_stats_leave() to call this when the function it is used in
+ * returns, if the call is counted.
+ */
+void
+hal_stats_record (HalStatsCall *call)
+{
+	HalStatsShard *shard = hal_stats_shard;
+	HalStatsCounters *c;
+	HalStatsShmCounters *sc;
+	HalStatsShmSlot *slot;
+	uint64_t ns;
+	int bucket;
+
+	ns = 0;
+	bucket = 0;
+	if (call->mode & HAL_STATS_TIME) {
+		ns = hal_stats_clock () - call->start_ns;
+		bucket = ns == 0 ? 0 : 64 - __builtin_clzll (ns);
+		if (bucket >= HAL_STATS_BUCKETS)
+			bucket = HAL_STATS_BUCKETS - 1;
+	}
+
+	if (HAL_UNLIKELY (shard == NULL) && hal_stats_exited) {
+		pthread_mutex_lock (&hal_stats_lock);
+		c = &hal_stats_retired[call->function];
+		c->calls++;
+		if (call->failed)
+			c->errors++;
+		if (call->mode & HAL_STATS_TIME) {
+			c->total_ns += ns;
+			c->histogram[bucket]++;
+		}
+		pthread_mutex_unlock (&hal_stats_lock);
+	} else {
+		if (HAL_UNLIKELY (shard == NULL)) {
+			shard = hal_stats_new_shard ();
+			if (shard == NULL)
+				return;
+		}
+
+		/* Only this thread writes to its shard, the stores just
+		 * have to be atomic for the readers. */
+		c = &shard->counters[call->function];
+		__atomic_store_n (&c->calls, c->calls + 1, __ATOMIC_RELAXED);
+		if (call->failed)
+			__atomic_store_n (&c->errors, c->errors + 1, __ATOMIC_RELAXED);
+		if (call->mode & HAL_STATS_TIME) {
+			__atomic_store_n (&c->total_ns, c->total_ns + ns, __ATOMIC_RELAXED);
+			__atomic_store_n (&c->histogram[bucket], c->histogram[bucket] + 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	/* the process-wide slot is shared by all our threads */
+	slot = __atomic_load_n (&hal_stats_slot, __ATOMIC_ACQUIRE);
+	if (slot != NULL) {
+		sc = &slot->counters[call->function];
+		__atomic_fetch_add (&sc->calls, 1, __ATOMIC_RELAXED);
+		if (call->failed)
+			__atomic_fetch_add (&sc->errors, 1, __ATOMIC_RELAXED);
+		if (call->mode & HAL_STATS_TIME)
+			__atomic_fetch_add (&sc->total_ns, ns, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * hal_stats_get:
+ * @out_stats: return location for the statistics, one per function
+ * @out_num_stats: return location for the number of functions
+ *
+ * Backs libhal_dummy_get_stats().
+ *
+ * Returns: FALSE if out of memory
+ */
+int
+hal_stats_get (LibHalDummyStats **out_stats, int *out_num_stats)
+{
+	HalStatsCounters *total;
+	LibHalDummyStats *stats;
+	int fn;
+	int i;
+
+	total = hal_stats_collect ();
+	stats = malloc (sizeof (LibHalDummyStats) * HAL_FN_LAST);
+	if (total == NULL || stats == NULL) {
+		free (total);
+		free (stats);
+		return FALSE;
+	}
+
+	for (fn = 0; fn < HAL_FN_LAST; fn++) {
+		stats[fn].function = hal_functions[fn].name;
+		stats[fn].calls = total[fn].calls;
+		stats[fn].errors = total[fn].errors;
+		stats[fn].total_ns = total[fn].total_ns;
+		for (i = 0; i < HAL_STATS_BUCKETS; i++)
+			stats[fn].histogram[i] = total[fn].histogram[i];
+	}
+	free (total);
+
+	*out_stats = stats;
+	*out_num_stats = HAL_FN_LAST;
+	return TRUE;
+}
+
+/**
+ * hal_stats_reset:
+ *
+ * Backs libhal_dummy_reset_stats().
+ */
+void
+hal_stats_reset (void)
+{
+	pthread_mutex_lock (&hal_stats_lock);
+	hal_stats_sum_locked (hal_stats_baseline);
+	pthread_mutex_unlock (&hal_stats_lock);
+}
+
+static void
+hal_stats_atfork_prepare (void)
+{
+	pthread_mutex_lock (&hal_stats_lock);
+}
+
+static void
+hal_stats_atfork_parent (void)
+{
+	pthread_mutex_unlock (&hal_stats_lock);
+}
+
+static void
+hal_stats_atfork_child (void)
+{
+	HalStatsShard *shard;
+	HalStatsShard *next;
+
+	/* only the forking thread survived */
+	for (shard = hal_stats_shards; shard != NULL; shard = next) {
+		next = shard->next;
+		if (shard != hal_stats_shard)
+			hal_stats_retire_locked (shard);
+	}
+
+	/* the dumper thread did not, and the pipe is shared with the parent */
+	if (hal_stats_pipe[0] >= 0) {
+		close (hal_stats_pipe[0]);
+		close (hal_stats_pipe[1]);
+		hal_stats_pipe[0] = hal_stats_pipe[1] = -1;
+		hal_stats_start_dumper_locked ();
+	}
+
+	/* and the parent keeps its slot */
+	if (hal_stats_slot != NULL) {
+		hal_stats_slot = NULL;
+		hal_stats_shm_claim_locked ();
+	}
+
+	pthread_mutex_init (&hal_stats_lock, NULL);
+}
+
+static void __attribute__ ((constructor))
+hal_stats_configure (void)
+{
+	const char *value;
+
+	value = hal_config_get ("stats");
+	if (value != NULL && (strcmp (value, "off") == 0 || strcmp (value, "0") == 0 ||
+			      strcmp (value, "no") == 0))
+		return;
+
+	value = hal_config_get ("stats_shm");
+	if (value != NULL && (strcmp (value, "off") == 0 || strcmp (value, "0") == 0 ||
+			      strcmp (value, "no") == 0))
+		hal_stats_use_shm = 0;
+
+	pthread_key_create (&hal_stats_key, hal_stats_thread_exit);
+	pthread_atfork (hal_stats_atfork_prepare, hal_stats_atfork_parent, hal_stats_atfork_child);
+	hal_stats_enabled = HAL_STATS_COUNT;
+
+	value = hal_config_get ("stats_timing");
+	if (value != NULL && (strcmp (value, "yes") == 0 || strcmp (value, "on") == 0 ||
+			      strcmp (value, "1") == 0))
+		hal_stats_enabled |= HAL_STATS_TIME;
+}
@@ -0,0 +1,92 @@
+/***************************************************************************
+ *
+ * libhal-stats.h : layout of the system-wide libhal statistics segment
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifndef LIBHAL_STATS_H
+#define LIBHAL_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Every process using libhal takes a slot in the POSIX shared memory
+ * object of its effective user, /hal-dummy-stats.<uid> (i.e.
+ * /dev/shm/hal-dummy-stats.<uid>), created with mode 0600 and used
+ * only if that user owns it and no one else can access it, so other
+ * users can neither read the counters nor resize the segment under
+ * the processes mapping it; root, e.g. running hal-dummy-top, can
+ * still read every user's segment.  It is laid out as
+ *
+ *   HalStatsShmHeader
+ *   HalStatsShmSlot    x num_slots
+ *
+ * A slot is free when its pid is 0.  A process claims one by
+ * swapping its pid in, counts its calls there with relaxed atomic
+ * adds and gives the slot back when it exits.  Slots of processes
+ * that died without doing so are taken over by new processes, and
+ * viewers such as hal-dummy-top skip them.
+ */
+
+#define HAL_STATS_SHM_MAGIC      0x53424c48      /* "HLBS" */
+#define HAL_STATS_SHM_VERSION    1
+
+#define HAL_STATS_SHM_PREFIX     "/hal-dummy-stats."      /* followed by the uid */
+#define HAL_STATS_SHM_SLOTS      256
+#define HAL_STATS_SHM_FUNCTIONS  256             /* room for new entry points */
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t num_slots;
+	uint32_t num_functions;         /**< counters per slot */
+	uint32_t slot_size;
+	uint32_t reserved[10];
+} HalStatsShmHeader;
+
+typedef struct {
+	uint64_t calls;
+	uint64_t errors;                /**< calls that failed a parameter check */
+	uint64_t total_ns;
+} HalStatsShmCounters;
+
+typedef struct {
+	uint32_t pid;                   /**< owner, 0 if free */
+	uint32_t uid;
+	uint64_t start_time;            /**< CLOCK_REALTIME seconds when claimed */
+	char comm[16];                  /**< program name, see /proc/<pid>/comm */
+	uint32_t reserved[8];
+	HalStatsShmCounters counters[HAL_STATS_SHM_FUNCTIONS];
+} HalStatsShmSlot;
+
+static inline void
+hal_stats_shm_name (char *buf, size_t len, uid_t uid)
+{
+	snprintf (buf, len, HAL_STATS_SHM_PREFIX "%u", (unsigned int) uid);
+}
+
+static inline HalStatsShmSlot *
+hal_stats_shm_slot (const HalStatsShmHeader *h, unsigned int slot)
+{
+	return (HalStatsShmSlot *) ((char *) h + h->header_size + (size_t) slot * h->slot_size);
+}
+
+#endif /* LIBHAL_STATS_H */
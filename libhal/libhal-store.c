@@ -0,0 +1,2716 @@
+/***************************************************************************
+ *
+ * libhal-store.c : in-process Global Device List
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dbus/dbus.h>
+
+#include "libhal.h"
+#include "libhal-private.h"
+
+/*
+ * The devices of all contexts of the process live in one store, as
+ * they would in hald.  Devices are found through an open addressing
+ * hash table keyed on the udi, and each device keeps its properties
+ * in a hash table of its own, so lookups do not depend on the number
+ * of devices or properties.  Both tables use linear probing and
+ * delete by shifting entries back, so there are no tombstones.
+ *
+ * Devices made by hal_store_new_device() are hidden until committed
+ * with hal_store_commit_device(), but their properties can be set and
+ * read meanwhile.  Committed devices are also kept on a list in the
+ * order they were added, which is the order hal_store_get_all_devices()
+ * returns.
+ *
+ * The devices are split into "store_shards" shards (16 by default)
+ * by the hash of their udi, each with its own hash table and its own
+ * read-write lock, so changes to devices in different shards do not
+ * wait on each other.  Above the shards, the GDL lock is taken for
+ * reading by every call and for writing by those that change the
+ * GDL as a whole: adding, committing and removing devices, and
+ * building the index.  A change to the properties of one device takes
+ * the GDL lock for reading and the lock of its shard for writing;
+ * reads of the whole GDL take the GDL lock and then every shard lock
+ * for reading, in shard order.  The index, and the list of committed
+ * devices that a change can append an image device to, have locks of
+ * their own, taken last.  Values are always copied in under the
+ * locks.
+ *
+ * Reads of a single device take no lock.  Each device also has a
+ * version: a snapshot of its properties as one sorted property set,
+ * see libhal-snapshot.c, that is never changed.  When a write lock is
+ * released, every device changed under it gets a new version, swapped
+ * into a hash table of versions keyed on the udi; the old version is
+ * freed after a grace period, see libhal-rcu.c.  Readers find the
+ * version with a single pass over that table of its shard, and keep
+ * using the one they found however long a writer takes.
+ * hal_store_get_all_properties() hands out a reference to the set of
+ * the version rather than a copy.  The table is replaced as a whole
+ * when it grows, and removed versions leave a tombstone until then.
+ *
+ * Property keys and the udis of devices made for the GDL are interned,
+ * see libhal-intern.c, so a property is found by comparing pointers
+ * and a key that was never interned is missing from every device.
+ * Devices made by hal_store_new_device() keep a udi of their own, as
+ * their temporary udis are never seen again once committed.
+ *
+ * The store is set up on first use, from the fixture file named by
+ * the "fixture" setting if there is one, see libhal-fixture.c, from
+ * the sysfs tree named by the "sysfs" setting, see libhal-sysfs.c, or
+ * else with just the computer device.  A context that never looks at
+ * a device does not pay for reading the fixture.
+ *
+ * A fixture compiled by hal-dummy-compile is not read into the store
+ * but left mapped, see libhal-image.c, and its devices are looked up
+ * there when the hash table does not have them.  A device from the
+ * image is copied into the hash table the first time it is changed;
+ * from then on, and once it is removed, the image copy is shadowed.
+ *
+ * Every device in the GDL has a position: the fixture order for image
+ * devices and the copies made of them, and the order of commits,
+ * after all of them, for the others.  The GDL is listed in that
+ * order, with each copy, found by its position, in the place of its
+ * image device.
+ *
+ * The string properties of the keys libhal_manager_find_device_string_match()
+ * has been asked about are indexed, see libhal-index.c, by position,
+ * so a copy takes the place of its image device.  Every change to a
+ * committed device goes through hal_store_index_property() or
+ * hal_store_index_device(), and hiding an image device through
+ * hal_store_image_shadow().
+ *
+ * Once a capability has been asked about, every device also keeps
+ * the ids of its capabilities in a bitset, and the GDL devices with a
+ * capability are listed by the index.  The bitsets of image devices
+ * are in one array, indexed by the device.
+ *
+ * Every change to a device hands it the next generation, and a change
+ * to a committed device, or removing one, also makes that the
+ * generation of the GDL, which is read without taking the lock.  The
+ * GDL as loaded, and so every device still in the image, is
+ * generation 1.  Generations are never reused, so a udi that is
+ * removed and added again still gets a newer one.
+ *
+ * hal_store_get_all_devices_with_properties() measures every device
+ * and then copies it into one snapshot, see libhal-snapshot.c.  With
+ * many devices both passes are split between "snapshot_threads"
+ * threads (one per CPU by default), which read the store under the
+ * read lock of the calling thread.
+ *
+ * With a shared GDL, see libhal-shared.c, the writer keeps its store
+ * as usual and publishes it whenever a write leaves the GDL with a new
+ * generation.  Every other process leaves its store empty: its reads
+ * are answered from the shared GDL and its changes refused.
+ */
+
+#define HAL_STORE_MIN_DEVICES     64
+#define HAL_STORE_MIN_PROPERTIES  8
+
+#define HAL_STORE_COMPUTER_UDI    "/org/freedesktop/Hal/devices/computer"
+#define HAL_STORE_TEMP_UDI        "/org/freedesktop/Hal/devices/tmp%05u"
+#define HAL_STORE_CAPABILITIES    "info.capabilities"
+#define HAL_STORE_END             UINT64_MAX  /* commit after every device */
+
+#define HAL_STORE_MAX_SHARDS      256
+#define HAL_STORE_STACK_CHANGES   8     /* changes set at once without a malloc() */
+
+#define HAL_STORE_SNAPSHOT_MAX_THREADS 16
+#define HAL_STORE_SNAPSHOT_MIN_WORK    1024  /* devices per snapshot thread */
+
+typedef struct {
+	const char *key;                /**< interned, NULL if the slot is free */
+	uint32_t hash;
+	int type;                       /**< LIBHAL_PROPERTY_TYPE_* */
+	HalValue value;
+} HalProperty;
+
+/* A device as lock-free readers see it, replaced as a whole on every change */
+typedef struct {
+	HalRcuHead rcu;
+	HalSnapshot *snapshot;          /**< holding the version and its set */
+	const char *udi;                /**< in the snapshot */
+	uint32_t hash;
+	int committed;
+	uint64_t generation;
+	LibHalPropertySet *set;
+} HalStoreVersion;
+
+typedef struct {
+	HalRcuHead rcu;
+	unsigned int size;              /**< a power of two */
+	HalStoreVersion *slots[];
+} HalStoreVersionTable;
+
+typedef struct HalDevice_s HalDevice;
+
+struct HalDevice_s {
+	const char *udi;                /**< interned, unless temp */
+	uint32_t hash;
+	int temp;                       /**< made by new_device, with a udi of its own */
+	int committed;                  /**< in the GDL, not just made by new_device */
+	uint64_t generation;            /**< of its last change */
+	uint64_t position;              /**< in the GDL, once committed */
+	HalDevice *prev;                /**< committed devices, in order */
+	HalDevice *next;
+	HalProperty *properties;
+	unsigned int num_properties;
+	unsigned int size;              /**< slots in properties, a power of two */
+	uint64_t *capabilities;         /**< bitset of capability ids, once indexed */
+	unsigned int num_capability_words;
+	HalStoreVersion *version;       /**< published, or NULL */
+	int dirty;                      /**< changed since it was published */
+	HalDevice *next_dirty;
+};
+
+/* The devices whose udi hashes to it, each shard on cache lines of its own */
+typedef struct {
+	pthread_rwlock_t lock;
+	HalDevice **devices;
+	unsigned int num_devices;
+	unsigned int size;              /**< slots in devices, a power of two */
+	HalStoreVersionTable *versions; /**< read without the lock */
+	unsigned int num_versions;
+	unsigned int version_tombstones;
+	HalDevice *dirty;               /**< devices to publish on unlock */
+} __attribute__ ((aligned (64))) HalStoreShard;
+
+/* the GDL lock, see above; taking it for writing also locks every shard */
+static pthread_rwlock_t hal_store_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_once_t hal_store_once = PTHREAD_ONCE_INIT;
+
+/* taken after the shard locks */
+static pthread_rwlock_t hal_store_index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t hal_store_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t hal_store_publish_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static HalStoreShard hal_store_shards[HAL_STORE_MAX_SHARDS];
+static unsigned int hal_store_num_shards = 1;
+static HalDevice *hal_store_first;
+static HalDevice *hal_store_last;
+static unsigned int hal_store_num_committed;
+static unsigned int hal_store_temp_counter;
+static unsigned char *hal_store_shadowed;       /**< per image device */
+static unsigned int hal_store_num_image_devices; /**< not shadowed */
+static uint32_t *hal_store_image_positions;     /**< per image device */
+static HalDevice **hal_store_image_copies;      /**< per image position, once copied */
+static uint64_t hal_store_next_position;
+static uint64_t hal_store_changes = 1;          /**< last generation handed out */
+static uint64_t hal_store_generation = 1;       /**< of the GDL, read without the lock */
+static int hal_store_capabilities_indexed;
+static int hal_store_capabilities_failed;       /**< out of memory since, to be indexed again */
+static const char *hal_store_capabilities_key;  /**< interned HAL_STORE_CAPABILITIES */
+static uint64_t *hal_store_image_capabilities;  /**< bitsets per image device, once indexed */
+static unsigned int hal_store_image_capability_words;
+static int hal_store_shared_reader;             /**< the devices are in the shared GDL */
+static int hal_store_shared_writer;             /**< the shared GDL is published from here */
+static uint64_t hal_store_published;            /**< generation in the shared GDL */
+static int hal_store_writing;                   /**< the GDL lock is held for writing */
+static HalStoreVersion hal_store_version_removed; /**< in the slots of removed versions */
+
+static uint32_t
+hal_store_hash (const char *s)
+{
+	uint32_t h = 2166136261U;
+
+	while (*s != '\0')
+		h = (h ^ (unsigned char) *s++) * 16777619U;
+	return h;
+}
+
+/* The shard of the udi with @hash, from its high bits as the tables use the low ones */
+static HalStoreShard *
+hal_store_shard (uint32_t hash)
+{
+	return &hal_store_shards[((uint64_t) hash * hal_store_num_shards) >> 32];
+}
+
+/* Make @generation, that of a change to a committed device, the generation of the GDL */
+static void
+hal_store_generation_advance (uint64_t generation)
+{
+	uint64_t current = __atomic_load_n (&hal_store_generation, __ATOMIC_RELAXED);
+
+	/* changes in other shards may hand out generations meanwhile; the GDL keeps the newest */
+	while (current < generation &&
+	       !__atomic_compare_exchange_n (&hal_store_generation, &current, generation, FALSE,
+					     __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+}
+
+static char **
+hal_store_strlist_dup (char **strlist)
+{
+	char **copy;
+	unsigned int n;
+	unsigned int i;
+
+	for (n = 0; strlist != NULL && strlist[n] != NULL; n++)
+		;
+	copy = malloc ((n + 1) * sizeof (char *));
+	if (copy == NULL)
+		return NULL;
+	for (i = 0; i < n; i++) {
+		copy[i] = strdup (strlist[i]);
+		if (copy[i] == NULL) {
+			copy[i] = NULL;
+			libhal_free_string_array (copy);
+			return NULL;
+		}
+	}
+	copy[n] = NULL;
+	return copy;
+}
+
+/* Copy @src of @type into @dst; FALSE if out of memory */
+static int
+hal_store_value_copy (int type, HalValue *dst, const HalValue *src)
+{
+	switch (type) {
+	case LIBHAL_PROPERTY_TYPE_STRING:
+		dst->str_value = strdup (src->str_value);
+		return dst->str_value != NULL;
+	case LIBHAL_PROPERTY_TYPE_STRLIST:
+		dst->strlist_value = hal_store_strlist_dup (src->strlist_value);
+		return dst->strlist_value != NULL;
+	default:
+		*dst = *src;
+		return TRUE;
+	}
+}
+
+static void
+hal_store_value_free (int type, HalValue *value)
+{
+	switch (type) {
+	case LIBHAL_PROPERTY_TYPE_STRING:
+		free (value->str_value);
+		break;
+	case LIBHAL_PROPERTY_TYPE_STRLIST:
+		libhal_free_string_array (value->strlist_value);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Properties
+ */
+
+/* @key is interned, or NULL if it is not, in which case no device has it */
+static HalProperty *
+hal_store_property_find (const HalDevice *device, const char *key)
+{
+	unsigned int mask = device->size - 1;
+	unsigned int i;
+	HalProperty *p;
+
+	if (device->size == 0 || key == NULL)
+		return NULL;
+
+	for (i = hal_intern_hash (key) & mask; ; i = (i + 1) & mask) {
+		p = &device->properties[i];
+		if (p->key == key)
+			return p;
+		if (p->key == NULL)
+			return NULL;
+	}
+}
+
+static int
+hal_store_property_grow (HalDevice *device)
+{
+	HalProperty *old = device->properties;
+	unsigned int old_size = device->size;
+	unsigned int size = old_size ? old_size * 2 : HAL_STORE_MIN_PROPERTIES;
+	unsigned int i;
+	unsigned int j;
+
+	device->properties = calloc (size, sizeof (HalProperty));
+	if (device->properties == NULL) {
+		device->properties = old;
+		return FALSE;
+	}
+	device->size = size;
+
+	for (i = 0; i < old_size; i++) {
+		if (old[i].key == NULL)
+			continue;
+		for (j = old[i].hash & (size - 1); device->properties[j].key != NULL; j = (j + 1) & (size - 1))
+			;
+		device->properties[j] = old[i];
+	}
+	free (old);
+	return TRUE;
+}
+
+/* Returns the slot for @key, claiming a free one if need be, or NULL if out of memory */
+static HalProperty *
+hal_store_property_insert (HalDevice *device, const char *key)
+{
+	HalProperty *p;
+	uint32_t hash;
+	unsigned int mask;
+	unsigned int i;
+
+	key = hal_intern (key);
+	if (key == NULL)
+		return NULL;
+	p = hal_store_property_find (device, key);
+	if (p != NULL)
+		return p;
+	hash = hal_intern_hash (key);
+
+	if ((device->num_properties + 1) * 4 > device->size * 3 && !hal_store_property_grow (device))
+		return NULL;
+
+	mask = device->size - 1;
+	for (i = hash & mask; device->properties[i].key != NULL; i = (i + 1) & mask)
+		;
+	p = &device->properties[i];
+	p->key = key;
+	p->hash = hash;
+	p->type = LIBHAL_PROPERTY_TYPE_INVALID;
+	device->num_properties++;
+	return p;
+}
+
+static void
+hal_store_property_delete (HalDevice *device, HalProperty *p)
+{
+	unsigned int mask = device->size - 1;
+	unsigned int hole = p - device->properties;
+	unsigned int i;
+	unsigned int home;
+
+	hal_store_value_free (p->type, &p->value);
+	p->key = NULL;
+	device->num_properties--;
+
+	/* move back entries that would no longer be found across the hole */
+	for (i = (hole + 1) & mask; device->properties[i].key != NULL; i = (i + 1) & mask) {
+		home = device->properties[i].hash & mask;
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			device->properties[hole] = device->properties[i];
+			device->properties[i].key = NULL;
+			hole = i;
+		}
+	}
+}
+
+/*
+ * Index
+ */
+
+/* Set the bitset of @device to the capabilities in @strlist; FALSE if out of memory */
+static int
+hal_store_capability_bits (HalDevice *device, char **strlist)
+{
+	uint64_t *words;
+	unsigned int n;
+	int id;
+
+	if (device->capabilities != NULL)
+		memset (device->capabilities, 0, device->num_capability_words * sizeof (uint64_t));
+
+	for (; strlist != NULL && *strlist != NULL; strlist++) {
+		id = hal_capability_id (*strlist, TRUE);
+		if (id < 0)
+			return FALSE;
+		n = id / 64 + 1;
+		if (n > device->num_capability_words) {
+			words = realloc (device->capabilities, n * sizeof (uint64_t));
+			if (words == NULL)
+				return FALSE;
+			memset (words + device->num_capability_words, 0,
+				(n - device->num_capability_words) * sizeof (uint64_t));
+			device->capabilities = words;
+			device->num_capability_words = n;
+		}
+		device->capabilities[id / 64] |= 1ULL << (id % 64);
+	}
+	return TRUE;
+}
+
+/* Add or remove @udi in the lists of the capabilities in @strlist */
+static int
+hal_store_capability_lists (const char *udi, uint64_t position, char **strlist, int add)
+{
+	int id;
+
+	for (; strlist != NULL && *strlist != NULL; strlist++) {
+		id = hal_capability_id (*strlist, add);
+		if (id < 0) {
+			if (add)
+				return FALSE;
+		} else if (!add) {
+			hal_index_list_remove (hal_capability_devices (id), udi, position);
+		} else if (!hal_index_list_add (hal_capability_devices (id), udi, position)) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * The capabilities cannot be dropped from under the queries of other
+ * shards when out of memory, so they are only marked, for the next
+ * query to index them again.  Called with the index lock held.
+ */
+static void
+hal_store_capabilities_fail (void)
+{
+	__atomic_store_n (&hal_store_capabilities_failed, TRUE, __ATOMIC_RELAXED);
+}
+
+/* Add or remove @p of @device in the index if need be */
+static void
+hal_store_index_property (HalDevice *device, const HalProperty *p, int add)
+{
+	if (p->type == LIBHAL_PROPERTY_TYPE_STRLIST && hal_store_capabilities_indexed &&
+	    p->key == hal_store_capabilities_key) {
+		pthread_rwlock_wrlock (&hal_store_index_lock);
+		if (!add) {
+			if (device->committed)
+				hal_store_capability_lists (device->udi, device->position, p->value.strlist_value, FALSE);
+			hal_store_capability_bits (device, NULL);
+		} else if (!hal_store_capability_bits (device, p->value.strlist_value) ||
+			   (device->committed &&
+			    !hal_store_capability_lists (device->udi, device->position, p->value.strlist_value, TRUE))) {
+			hal_store_capabilities_fail ();
+		}
+		pthread_rwlock_unlock (&hal_store_index_lock);
+		return;
+	}
+
+	if (!device->committed || p->type != LIBHAL_PROPERTY_TYPE_STRING)
+		return;
+
+	pthread_rwlock_wrlock (&hal_store_index_lock);
+	if (!add)
+		hal_index_remove (p->key, p->value.str_value, device->udi, device->position);
+	else if (!hal_index_add (p->key, p->value.str_value, device->udi, device->position))
+		hal_index_remove_key (p->key);
+	pthread_rwlock_unlock (&hal_store_index_lock);
+}
+
+/* Add or remove all the indexed properties of @device, as it enters or leaves the GDL */
+static void
+hal_store_index_device (const HalDevice *device, int add)
+{
+	const HalProperty *p;
+	const char *key;
+	unsigned int i;
+
+	pthread_rwlock_wrlock (&hal_store_index_lock);
+	/* going down, as a failed add stops indexing the key in place of the last one */
+	for (i = hal_index_get_num_keys (); i-- > 0; ) {
+		key = hal_index_key (i);
+		p = hal_store_property_find (device, hal_intern_lookup (key));
+		if (p == NULL || p->type != LIBHAL_PROPERTY_TYPE_STRING)
+			continue;
+		if (!add)
+			hal_index_remove (key, p->value.str_value, device->udi, device->position);
+		else if (!hal_index_add (key, p->value.str_value, device->udi, device->position))
+			hal_index_remove_key (key);
+	}
+
+	if (hal_store_capabilities_indexed) {
+		p = hal_store_property_find (device, hal_store_capabilities_key);
+		if (p != NULL && p->type == LIBHAL_PROPERTY_TYPE_STRLIST &&
+		    !hal_store_capability_lists (device->udi, device->position, p->value.strlist_value, add))
+			hal_store_capabilities_fail ();
+	}
+	pthread_rwlock_unlock (&hal_store_index_lock);
+}
+
+/*
+ * Versions
+ */
+
+static int hal_store_foreach_property (const HalDevice *device, int image_device,
+				       HalFixturePropertyFunc func, void *data);
+
+/* The current version of @udi, in a read side section; NULL if there is none */
+static const HalStoreVersion *
+hal_store_version_find (const char *udi)
+{
+	const HalStoreVersionTable *table;
+	const HalStoreVersion *version;
+	uint32_t hash = hal_store_hash (udi);
+	unsigned int mask;
+	unsigned int i;
+
+	table = __atomic_load_n (&hal_store_shard (hash)->versions, __ATOMIC_ACQUIRE);
+	if (table == NULL)
+		return NULL;
+
+	mask = table->size - 1;
+	for (i = hash & mask; ; i = (i + 1) & mask) {
+		version = __atomic_load_n (&table->slots[i], __ATOMIC_ACQUIRE);
+		if (version == NULL)
+			return NULL;
+		if (version != &hal_store_version_removed && version->hash == hash &&
+		    strcmp (version->udi, udi) == 0)
+			return version;
+	}
+}
+
+/*
+ * Find @udi as lock-free readers do, in a read side section: its
+ * current version, or else in @image_device its device in the image,
+ * or -1
+ */
+static const HalStoreVersion *
+hal_store_version_lookup (const char *udi, int *image_device)
+{
+	const HalStoreVersion *version;
+
+	*image_device = -1;
+	version = hal_store_version_find (udi);
+	if (version != NULL || hal_store_shadowed == NULL)
+		return version;
+
+	*image_device = hal_image_find_device (udi);
+	if (*image_device < 0 || !__atomic_load_n (&hal_store_shadowed[*image_device], __ATOMIC_ACQUIRE))
+		return NULL;
+	/* copied from the image since, and published before it was shadowed */
+	*image_device = -1;
+	return hal_store_version_find (udi);
+}
+
+/* The slot of @version, which is in the table of its shard */
+static HalStoreVersion **
+hal_store_version_slot (const HalStoreVersion *version)
+{
+	HalStoreVersionTable *table = hal_store_shard (version->hash)->versions;
+	unsigned int mask = table->size - 1;
+	unsigned int i;
+
+	for (i = version->hash & mask; table->slots[i] != version; i = (i + 1) & mask)
+		;
+	return &table->slots[i];
+}
+
+static void
+hal_store_version_table_free (HalRcuHead *head)
+{
+	free (head);
+}
+
+/* Replace the table of @shard by one without tombstones and with room to grow; FALSE if out of memory */
+static int
+hal_store_version_resize (HalStoreShard *shard)
+{
+	HalStoreVersionTable *old = shard->versions;
+	HalStoreVersionTable *table;
+	HalStoreVersion *version;
+	unsigned int size = HAL_STORE_MIN_DEVICES;
+	unsigned int mask;
+	unsigned int i;
+	unsigned int j;
+
+	while (size < (shard->num_versions + 1) * 4)
+		size *= 2;
+	table = calloc (1, sizeof (HalStoreVersionTable) + size * sizeof (HalStoreVersion *));
+	if (table == NULL)
+		return FALSE;
+	table->size = size;
+	mask = size - 1;
+	for (i = 0; old != NULL && i < old->size; i++) {
+		version = old->slots[i];
+		if (version == NULL || version == &hal_store_version_removed)
+			continue;
+		for (j = version->hash & mask; table->slots[j] != NULL; j = (j + 1) & mask)
+			;
+		table->slots[j] = version;
+	}
+
+	__atomic_store_n (&shard->versions, table, __ATOMIC_RELEASE);
+	shard->version_tombstones = 0;
+	if (old != NULL)
+		hal_rcu_retire (&old->rcu, hal_store_version_table_free);
+	return TRUE;
+}
+
+/* Add @version, whose udi has no version yet; FALSE if out of memory */
+static int
+hal_store_version_insert (HalStoreVersion *version)
+{
+	HalStoreShard *shard = hal_store_shard (version->hash);
+	HalStoreVersionTable *table = shard->versions;
+	unsigned int mask;
+	unsigned int i;
+
+	if ((table == NULL ||
+	     (shard->num_versions + shard->version_tombstones + 1) * 2 > table->size) &&
+	    !hal_store_version_resize (shard))
+		return FALSE;
+
+	table = shard->versions;
+	mask = table->size - 1;
+	for (i = version->hash & mask; table->slots[i] != NULL; i = (i + 1) & mask) {
+		if (table->slots[i] == &hal_store_version_removed) {
+			shard->version_tombstones--;
+			break;
+		}
+	}
+	__atomic_store_n (&table->slots[i], version, __ATOMIC_RELEASE);
+	shard->num_versions++;
+	return TRUE;
+}
+
+static void
+hal_store_version_free (HalRcuHead *head)
+{
+	hal_snapshot_unref (((HalStoreVersion *) head)->snapshot);
+}
+
+/* Take @version out of the table, and free it once readers are done with it */
+static void
+hal_store_version_retire (HalStoreVersion *version)
+{
+	HalStoreShard *shard = hal_store_shard (version->hash);
+
+	__atomic_store_n (hal_store_version_slot (version), &hal_store_version_removed, __ATOMIC_RELEASE);
+	shard->num_versions--;
+	shard->version_tombstones++;
+	hal_rcu_retire (&version->rcu, hal_store_version_free);
+}
+
+/* A version with the current properties of @device, or NULL if out of memory */
+static HalStoreVersion *
+hal_store_version_new (const HalDevice *device)
+{
+	HalPropertySetBuilder builder;
+	HalStoreVersion *version;
+	HalSnapshot *snapshot;
+	size_t set_size;
+	size_t udi_size = strlen (device->udi) + 1;
+	char *data;
+
+	hal_property_set_builder_init (&builder);
+	if (!hal_store_foreach_property (device, -1, hal_property_set_builder_add, &builder))
+		return NULL;
+	set_size = hal_property_set_builder_get_size (&builder);
+	snapshot = hal_snapshot_new (sizeof (HalStoreVersion) + set_size + udi_size, 1);
+	if (snapshot == NULL)
+		return NULL;
+
+	data = hal_snapshot_data (snapshot);
+	hal_property_set_builder_place (&builder, data + sizeof (HalStoreVersion), snapshot);
+	if (!hal_store_foreach_property (device, -1, hal_property_set_builder_add, &builder)) {
+		hal_snapshot_free (snapshot);
+		return NULL;
+	}
+
+	version = (HalStoreVersion *) data;
+	version->snapshot = snapshot;
+	version->udi = memcpy (data + sizeof (HalStoreVersion) + set_size, device->udi, udi_size);
+	version->hash = device->hash;
+	version->committed = device->committed;
+	version->generation = device->generation;
+	version->set = hal_property_set_builder_finish (&builder);
+	return version;
+}
+
+/* Let readers see @device as it is now; FALSE if out of memory */
+static int
+hal_store_version_publish (HalDevice *device)
+{
+	HalStoreVersion *old = device->version;
+	HalStoreVersion *version;
+
+	version = hal_store_version_new (device);
+	if (version == NULL)
+		return FALSE;
+
+	if (old != NULL && old->hash == version->hash && strcmp (old->udi, version->udi) == 0) {
+		__atomic_store_n (hal_store_version_slot (old), version, __ATOMIC_RELEASE);
+		hal_rcu_retire (&old->rcu, hal_store_version_free);
+	} else {
+		/* committed under a new udi, maybe in another shard: the new one appears before the old one goes */
+		if (!hal_store_version_insert (version)) {
+			hal_snapshot_free (version->snapshot);
+			return FALSE;
+		}
+		if (old != NULL)
+			hal_store_version_retire (old);
+	}
+	device->version = version;
+	return TRUE;
+}
+
+/* Publish @device once the lock of its shard, or of the GDL, is released */
+static void
+hal_store_device_dirty (HalDevice *device)
+{
+	HalStoreShard *shard = hal_store_shard (device->hash);
+
+	if (device->dirty)
+		return;
+	device->dirty = TRUE;
+	device->next_dirty = shard->dirty;
+	shard->dirty = device;
+}
+
+/* Take @device off the devices to publish, before its udi changes or it goes */
+static void
+hal_store_device_clean (HalDevice *device)
+{
+	HalDevice **link;
+
+	if (!device->dirty)
+		return;
+	for (link = &hal_store_shard (device->hash)->dirty; *link != device; link = &(*link)->next_dirty)
+		;
+	*link = device->next_dirty;
+	device->dirty = FALSE;
+}
+
+/* Hide @device from readers, for good */
+static void
+hal_store_version_remove (HalDevice *device)
+{
+	hal_store_device_clean (device);
+	if (device->version != NULL) {
+		hal_store_version_retire (device->version);
+		device->version = NULL;
+	}
+}
+
+/* Publish the devices of @shard changed under the lock; those out of memory are tried again next time */
+static void
+hal_store_version_publish_dirty (HalStoreShard *shard)
+{
+	HalDevice **link = &shard->dirty;
+	HalDevice *device;
+
+	while (*link != NULL) {
+		device = *link;
+		if (hal_store_version_publish (device)) {
+			*link = device->next_dirty;
+			device->dirty = FALSE;
+		} else {
+			link = &device->next_dirty;
+		}
+	}
+}
+
+/*
+ * Devices
+ */
+
+/* The slot of @udi in the table of its shard, @shard */
+static HalDevice **
+hal_store_device_slot (HalStoreShard *shard, const char *udi, uint32_t hash)
+{
+	unsigned int mask = shard->size - 1;
+	unsigned int i;
+	HalDevice *d;
+
+	for (i = hash & mask; ; i = (i + 1) & mask) {
+		d = shard->devices[i];
+		if (d == NULL || (d->hash == hash && strcmp (d->udi, udi) == 0))
+			return &shard->devices[i];
+	}
+}
+
+static HalDevice *
+hal_store_device_find (const char *udi)
+{
+	uint32_t hash = hal_store_hash (udi);
+	HalStoreShard *shard = hal_store_shard (hash);
+
+	if (shard->size == 0)
+		return NULL;
+	return *hal_store_device_slot (shard, udi, hash);
+}
+
+static int
+hal_store_device_grow (HalStoreShard *shard)
+{
+	HalDevice **old = shard->devices;
+	unsigned int old_size = shard->size;
+	unsigned int size = old_size ? old_size * 2 : HAL_STORE_MIN_DEVICES;
+	unsigned int i;
+	unsigned int j;
+
+	shard->devices = calloc (size, sizeof (HalDevice *));
+	if (shard->devices == NULL) {
+		shard->devices = old;
+		return FALSE;
+	}
+	shard->size = size;
+
+	for (i = 0; i < old_size; i++) {
+		if (old[i] == NULL)
+			continue;
+		for (j = old[i]->hash & (size - 1); shard->devices[j] != NULL; j = (j + 1) & (size - 1))
+			;
+		shard->devices[j] = old[i];
+	}
+	free (old);
+	return TRUE;
+}
+
+/* Make room for one more device in @shard; FALSE if out of memory */
+static int
+hal_store_device_room (HalStoreShard *shard)
+{
+	return (shard->num_devices + 1) * 2 <= shard->size || hal_store_device_grow (shard);
+}
+
+/* Put @device, whose udi is not in use, into the table of its shard; FALSE if out of memory */
+static int
+hal_store_device_insert (HalDevice *device)
+{
+	HalStoreShard *shard = hal_store_shard (device->hash);
+
+	if (!hal_store_device_room (shard))
+		return FALSE;
+	*hal_store_device_slot (shard, device->udi, device->hash) = device;
+	shard->num_devices++;
+	return TRUE;
+}
+
+/* Add a device; a @temp one keeps a copy of @udi, the others share the interned one */
+static HalDevice *
+hal_store_device_add (const char *udi, int temp)
+{
+	HalDevice *device;
+
+	if (hal_store_device_find (udi) != NULL)
+		return NULL;
+
+	device = calloc (1, sizeof (HalDevice));
+	if (device == NULL)
+		return NULL;
+	device->udi = temp ? strdup (udi) : hal_intern (udi);
+	if (device->udi == NULL) {
+		free (device);
+		return NULL;
+	}
+	device->hash = hal_store_hash (udi);
+	device->temp = temp;
+	device->generation = __atomic_load_n (&hal_store_changes, __ATOMIC_RELAXED);
+
+	if (!hal_store_device_insert (device)) {
+		if (temp)
+			free ((char *) device->udi);
+		free (device);
+		return NULL;
+	}
+	return device;
+}
+
+static void
+hal_store_device_unlink (HalDevice *device)
+{
+	HalStoreShard *shard = hal_store_shard (device->hash);
+	unsigned int mask = shard->size - 1;
+	unsigned int hole;
+	unsigned int i;
+	unsigned int home;
+
+	hole = hal_store_device_slot (shard, device->udi, device->hash) - shard->devices;
+	shard->devices[hole] = NULL;
+	shard->num_devices--;
+
+	for (i = (hole + 1) & mask; shard->devices[i] != NULL; i = (i + 1) & mask) {
+		home = shard->devices[i]->hash & mask;
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			shard->devices[hole] = shard->devices[i];
+			shard->devices[i] = NULL;
+			hole = i;
+		}
+	}
+
+	if (device->committed) {
+		hal_store_index_device (device, FALSE);
+		pthread_mutex_lock (&hal_store_list_lock);
+		if (device->prev != NULL)
+			device->prev->next = device->next;
+		else
+			hal_store_first = device->next;
+		if (device->next != NULL)
+			device->next->prev = device->prev;
+		else
+			hal_store_last = device->prev;
+		if (device->position < hal_image_num_devices ())
+			hal_store_image_copies[device->position] = NULL;
+		hal_store_num_committed--;
+		pthread_mutex_unlock (&hal_store_list_lock);
+	}
+}
+
+static void
+hal_store_device_free (HalDevice *device)
+{
+	unsigned int i;
+
+	for (i = 0; i < device->size; i++) {
+		if (device->properties[i].key != NULL)
+			hal_store_value_free (device->properties[i].type, &device->properties[i].value);
+	}
+	free (device->properties);
+	free (device->capabilities);
+	if (device->temp)
+		free ((char *) device->udi);
+	free (device);
+}
+
+/* Put @device in the GDL at @position, of the image device it copies, or at the end */
+static void
+hal_store_device_commit (HalDevice *device, uint64_t position)
+{
+	pthread_mutex_lock (&hal_store_list_lock);
+	device->committed = TRUE;
+	if (position != HAL_STORE_END) {
+		device->position = position;
+		hal_store_image_copies[position] = device;
+	} else {
+		device->position = hal_store_next_position++;
+	}
+	device->next = NULL;
+	device->prev = hal_store_last;
+	if (hal_store_last != NULL)
+		hal_store_last->next = device;
+	else
+		hal_store_first = device;
+	hal_store_last = device;
+	hal_store_num_committed++;
+	pthread_mutex_unlock (&hal_store_list_lock);
+
+	hal_store_index_device (device, TRUE);
+}
+
+/* Give @device, and the GDL if it is in it, a new generation */
+static void
+hal_store_device_changed (HalDevice *device)
+{
+	device->generation = __atomic_add_fetch (&hal_store_changes, 1, __ATOMIC_RELAXED);
+	if (device->committed)
+		hal_store_generation_advance (device->generation);
+	hal_store_device_dirty (device);
+}
+
+static int
+hal_store_device_set_string (HalDevice *device, const char *key, const char *value)
+{
+	HalProperty *p;
+	char *copy;
+
+	p = hal_store_property_insert (device, key);
+	if (p == NULL)
+		return FALSE;
+	if (p->type != LIBHAL_PROPERTY_TYPE_INVALID && p->type != LIBHAL_PROPERTY_TYPE_STRING)
+		return FALSE;
+	copy = strdup (value);
+	if (copy == NULL) {
+		if (p->type == LIBHAL_PROPERTY_TYPE_INVALID)
+			hal_store_property_delete (device, p);
+		return FALSE;
+	}
+	if (p->type == LIBHAL_PROPERTY_TYPE_STRING)
+		free (p->value.str_value);
+	p->type = LIBHAL_PROPERTY_TYPE_STRING;
+	p->value.str_value = copy;
+	return TRUE;
+}
+
+/* Add @copy to the string list @key of @device, which takes it unless this fails */
+static int
+hal_store_device_strlist_insert (HalDevice *device, const char *key, char *copy, int prepend)
+{
+	HalProperty *p;
+	char **strlist;
+	unsigned int n;
+
+	p = hal_store_property_insert (device, key);
+	if (p == NULL)
+		return FALSE;
+	if (p->type == LIBHAL_PROPERTY_TYPE_INVALID) {
+		p->type = LIBHAL_PROPERTY_TYPE_STRLIST;
+		p->value.strlist_value = NULL;
+	} else if (p->type != LIBHAL_PROPERTY_TYPE_STRLIST) {
+		return FALSE;
+	}
+
+	for (n = 0; p->value.strlist_value != NULL && p->value.strlist_value[n] != NULL; n++)
+		;
+	strlist = realloc (p->value.strlist_value, (n + 2) * sizeof (char *));
+	if (strlist == NULL) {
+		if (n == 0 && p->value.strlist_value == NULL)
+			hal_store_property_delete (device, p);
+		return FALSE;
+	}
+	strlist[n] = NULL;
+	p->value.strlist_value = strlist;
+
+	hal_store_index_property (device, p, FALSE);
+	if (prepend) {
+		memmove (strlist + 1, strlist, n * sizeof (char *));
+		strlist[0] = copy;
+	} else {
+		strlist[n] = copy;
+	}
+	strlist[n + 1] = NULL;
+	hal_store_index_property (device, p, TRUE);
+	return TRUE;
+}
+
+/* Add a device from the fixture, or find it if it is already there */
+static void *
+hal_store_fixture_device (void *data, const char *udi)
+{
+	HalDevice *device;
+
+	device = hal_store_device_find (udi);
+	if (device != NULL)
+		return device;
+
+	device = hal_store_device_add (udi, FALSE);
+	if (device == NULL)
+		return NULL;
+	if (!hal_store_device_set_string (device, "info.udi", udi)) {
+		hal_store_device_unlink (device);
+		hal_store_device_free (device);
+		return NULL;
+	}
+	hal_store_device_commit (device, HAL_STORE_END);
+	return device;
+}
+
+/* Set a property from the fixture, whatever type it had before */
+static int
+hal_store_fixture_property (void *device, const char *key, int type, const HalValue *value)
+{
+	HalProperty *p;
+	HalValue copy;
+
+	if (!hal_store_value_copy (type, &copy, value))
+		return FALSE;
+	p = hal_store_property_insert (device, key);
+	if (p == NULL) {
+		hal_store_value_free (type, &copy);
+		return FALSE;
+	}
+	hal_store_index_property (device, p, FALSE);
+	hal_store_value_free (p->type, &p->value);
+	p->type = type;
+	p->value = copy;
+	hal_store_index_property (device, p, TRUE);
+	return TRUE;
+}
+
+/* Map image devices to their position in the GDL and back; FALSE if out of memory */
+static int
+hal_store_image_positions_init (void)
+{
+	unsigned int n;
+
+	hal_store_image_positions = malloc ((hal_image_num_devices () + 1) * sizeof (uint32_t));
+	hal_store_image_copies = calloc (hal_image_num_devices () + 1, sizeof (HalDevice *));
+	if (hal_store_image_positions == NULL || hal_store_image_copies == NULL)
+		return FALSE;
+	for (n = 0; n < hal_image_num_devices (); n++)
+		hal_store_image_positions[hal_image_device_at (n)] = n;
+	return TRUE;
+}
+
+/* Fill the store from the fixture, or with the computer device */
+static void
+hal_store_load (void)
+{
+	HalDevice *computer;
+	const char *fixture;
+	const char *sysfs;
+
+	fixture = hal_config_get ("fixture");
+	if (fixture != NULL && *fixture != '\0') {
+		if (hal_image_open (fixture)) {
+			hal_store_num_image_devices = hal_image_num_devices ();
+			hal_store_shadowed = calloc (hal_store_num_image_devices + 1, 1);
+			hal_store_next_position = hal_store_num_image_devices;
+			if (hal_store_shadowed != NULL && hal_store_image_positions_init ())
+				return;
+			free (hal_store_shadowed);
+			free (hal_store_image_positions);
+			free (hal_store_image_copies);
+			hal_store_shadowed = NULL;
+			hal_store_image_positions = NULL;
+			hal_store_image_copies = NULL;
+			hal_store_num_image_devices = 0;
+			hal_store_next_position = 0;
+			hal_image_close ();
+		} else if (hal_fixture_load (fixture, hal_store_fixture_device,
+					     hal_store_fixture_property, NULL)) {
+			return;
+		}
+	}
+
+	sysfs = hal_config_get ("sysfs");
+	if (sysfs != NULL && *sysfs != '\0' &&
+	    hal_sysfs_load (sysfs, hal_store_fixture_device, hal_store_fixture_property, NULL))
+		return;
+
+	computer = hal_store_device_add (HAL_STORE_COMPUTER_UDI, FALSE);
+	if (computer == NULL)
+		return;
+	hal_store_device_set_string (computer, "info.udi", HAL_STORE_COMPUTER_UDI);
+	hal_store_device_set_string (computer, "system.hardware.serial", "System Serial Number");
+	hal_store_device_commit (computer, HAL_STORE_END);
+}
+
+static void hal_store_publish (void);
+
+static void
+hal_store_init (void)
+{
+	HalDevice *device;
+	unsigned int i;
+	long n;
+	int writer;
+
+	hal_store_capabilities_key = hal_intern (HAL_STORE_CAPABILITIES);
+
+	n = hal_config_get_int ("store_shards", 16);
+	hal_store_num_shards = n < 1 ? 1 : n > HAL_STORE_MAX_SHARDS ? HAL_STORE_MAX_SHARDS : n;
+	for (i = 0; i < hal_store_num_shards; i++)
+		pthread_rwlock_init (&hal_store_shards[i].lock, NULL);
+
+	if (hal_shared_open (&writer)) {
+		hal_store_shared_writer = writer;
+		hal_store_shared_reader = !writer;
+		if (hal_store_shared_reader)
+			return;
+	}
+
+	hal_store_load ();
+	for (device = hal_store_first; device != NULL; device = device->next)
+		hal_store_device_dirty (device);
+	for (i = 0; i < hal_store_num_shards; i++)
+		hal_store_version_publish_dirty (&hal_store_shards[i]);
+	if (hal_store_shared_writer)
+		hal_store_publish ();
+}
+
+/* TRUE if the devices are those of the shared GDL of another process */
+static int
+hal_store_shared (void)
+{
+	pthread_once (&hal_store_once, hal_store_init);
+	return hal_store_shared_reader;
+}
+
+/* TRUE, with a message, if changes must be made by the writer of the shared GDL */
+static int
+hal_store_read_only (void)
+{
+	if (!hal_store_shared ())
+		return FALSE;
+	fprintf (stderr, "%s %d : the shared GDL can only be changed by its writer\n", __FILE__, __LINE__);
+	return TRUE;
+}
+
+/* TRUE if the shared GDL is published from here and is behind */
+static int
+hal_store_publish_needed (void)
+{
+	return hal_store_shared_writer &&
+		__atomic_load_n (&hal_store_published, __ATOMIC_RELAXED) !=
+		__atomic_load_n (&hal_store_generation, __ATOMIC_ACQUIRE);
+}
+
+/* Lock the GDL for reading only, so that single devices can still change */
+static void
+hal_store_gdl_lock (void)
+{
+	pthread_once (&hal_store_once, hal_store_init);
+	pthread_rwlock_rdlock (&hal_store_lock);
+}
+
+static void
+hal_store_gdl_unlock (void)
+{
+	pthread_rwlock_unlock (&hal_store_lock);
+}
+
+/* Lock the whole store for reading */
+static void
+hal_store_read_lock (void)
+{
+	unsigned int i;
+
+	hal_store_gdl_lock ();
+	for (i = 0; i < hal_store_num_shards; i++)
+		pthread_rwlock_rdlock (&hal_store_shards[i].lock);
+}
+
+/* Lock the whole store for writing, which needs no shard locks */
+static void
+hal_store_write_lock (void)
+{
+	pthread_once (&hal_store_once, hal_store_init);
+	pthread_rwlock_wrlock (&hal_store_lock);
+	hal_store_writing = TRUE;
+}
+
+static void
+hal_store_unlock (void)
+{
+	unsigned int i;
+
+	if (hal_store_writing) {
+		hal_store_writing = FALSE;
+		for (i = 0; i < hal_store_num_shards; i++)
+			hal_store_version_publish_dirty (&hal_store_shards[i]);
+		if (hal_store_publish_needed ())
+			hal_store_publish ();
+	} else {
+		for (i = hal_store_num_shards; i-- > 0; )
+			pthread_rwlock_unlock (&hal_store_shards[i].lock);
+	}
+	pthread_rwlock_unlock (&hal_store_lock);
+}
+
+/* Lock the shard of @udi for writing, and the GDL for reading, to change that device */
+static HalStoreShard *
+hal_store_device_lock (const char *udi)
+{
+	HalStoreShard *shard;
+
+	hal_store_gdl_lock ();
+	shard = hal_store_shard (hal_store_hash (udi));
+	pthread_rwlock_wrlock (&shard->lock);
+	return shard;
+}
+
+/* Unlock @shard, publishing what changed under it */
+static void
+hal_store_device_unlock (HalStoreShard *shard)
+{
+	hal_store_version_publish_dirty (shard);
+	pthread_rwlock_unlock (&shard->lock);
+	hal_store_gdl_unlock ();
+
+	if (hal_store_publish_needed ()) {
+		hal_store_read_lock ();
+		hal_store_publish ();
+		hal_store_unlock ();
+	}
+}
+
+/* The image device for @udi, or -1 if there is none or it is shadowed */
+static int
+hal_store_image_device (const char *udi)
+{
+	int device;
+
+	if (__atomic_load_n (&hal_store_num_image_devices, __ATOMIC_RELAXED) == 0)
+		return -1;
+	device = hal_image_find_device (udi);
+	if (device < 0 || __atomic_load_n (&hal_store_shadowed[device], __ATOMIC_RELAXED))
+		return -1;
+	return device;
+}
+
+/* Add or remove the indexed properties of @image_device, as hal_store_index_device() */
+static void
+hal_store_image_index (unsigned int image_device, int add)
+{
+	const char *udi = hal_image_device_udi (image_device);
+	uint64_t position = hal_store_image_positions[image_device];
+	const char *key;
+	const char *value;
+	const uint64_t *words;
+	unsigned int i;
+	unsigned int id;
+
+	pthread_rwlock_wrlock (&hal_store_index_lock);
+	for (i = hal_index_get_num_keys (); i-- > 0; ) {
+		key = hal_index_key (i);
+		value = hal_image_get_string (image_device, key);
+		if (value == NULL)
+			continue;
+		if (!add)
+			hal_index_remove (key, value, udi, position);
+		else if (!hal_index_add (key, value, udi, position))
+			hal_index_remove_key (key);
+	}
+
+	if (hal_store_capabilities_indexed) {
+		words = hal_store_image_capabilities + image_device * hal_store_image_capability_words;
+		for (id = 0; id < hal_store_image_capability_words * 64; id++) {
+			if (!(words[id / 64] & (1ULL << (id % 64))))
+				continue;
+			if (!add)
+				hal_index_list_remove (hal_capability_devices (id), udi, position);
+			else if (!hal_index_list_add (hal_capability_devices (id), udi, position))
+				hal_store_capabilities_fail ();
+		}
+	}
+	pthread_rwlock_unlock (&hal_store_index_lock);
+}
+
+/* Hide @image_device from now on */
+static void
+hal_store_image_shadow (unsigned int image_device)
+{
+	/* once a copy took its place the index has the copy there, and this does nothing */
+	hal_store_image_index (image_device, FALSE);
+	__atomic_store_n (&hal_store_shadowed[image_device], TRUE, __ATOMIC_RELEASE);
+	__atomic_sub_fetch (&hal_store_num_image_devices, 1, __ATOMIC_RELAXED);
+}
+
+/* Find @udi to change it, copying it from the image if need be */
+static HalDevice *
+hal_store_device_find_writable (const char *udi)
+{
+	HalDevice *device;
+	int image_device;
+
+	device = hal_store_device_find (udi);
+	if (device != NULL)
+		return device;
+	image_device = hal_store_image_device (udi);
+	if (image_device < 0)
+		return NULL;
+
+	device = hal_store_device_add (udi, FALSE);
+	if (device == NULL)
+		return NULL;
+	if (!hal_image_foreach_property (image_device, hal_store_fixture_property, device)) {
+		hal_store_device_unlink (device);
+		hal_store_device_free (device);
+		return NULL;
+	}
+	/* in its place in the GDL, which in the index replaces the image device */
+	hal_store_device_commit (device, hal_store_image_positions[image_device]);
+	/* lock-free readers find the copy before the image device is hidden */
+	if (!hal_store_version_publish (device)) {
+		hal_store_device_unlink (device);
+		hal_store_device_free (device);
+		hal_store_image_index (image_device, TRUE);
+		return NULL;
+	}
+	hal_store_image_shadow (image_device);
+	return device;
+}
+
+/**
+ * hal_store_new_device:
+ *
+ * Make a device hidden from the GDL under a temporary udi.
+ *
+ * Returns: the temporary udi, to be freed by the caller, or NULL
+ */
+char *
+hal_store_new_device (void)
+{
+	HalDevice *device = NULL;
+	char udi[64];
+	char *result = NULL;
+
+	if (hal_store_read_only ())
+		return NULL;
+
+	hal_store_write_lock ();
+	while (device == NULL) {
+		snprintf (udi, sizeof (udi), HAL_STORE_TEMP_UDI, hal_store_temp_counter++);
+		if (hal_store_device_find (udi) != NULL || hal_store_image_device (udi) >= 0)
+			continue;
+		device = hal_store_device_add (udi, TRUE);
+		if (device == NULL)
+			break;
+		if (!hal_store_device_set_string (device, "info.udi", udi)) {
+			hal_store_device_unlink (device);
+			hal_store_device_free (device);
+			device = NULL;
+			break;
+		}
+		hal_store_device_dirty (device);
+	}
+	if (device != NULL)
+		result = strdup (device->udi);
+	hal_store_unlock ();
+
+	return result;
+}
+
+/**
+ * hal_store_commit_device:
+ * @temp_udi: udi returned by hal_store_new_device()
+ * @udi: udi to give the device in the GDL
+ *
+ * Returns: FALSE if @temp_udi is not a hidden device or @udi is in use
+ */
+int
+hal_store_commit_device (const char *temp_udi, const char *udi)
+{
+	HalDevice *device;
+	const char *interned;
+	int ret = FALSE;
+
+	if (hal_store_read_only ())
+		return FALSE;
+
+	hal_store_write_lock ();
+
+	device = hal_store_device_find (temp_udi);
+	if (device == NULL || device->committed)
+		goto out;
+	if (strcmp (temp_udi, udi) != 0 &&
+	    (hal_store_device_find (udi) != NULL || hal_store_image_device (udi) >= 0))
+		goto out;
+	interned = hal_intern (udi);
+	if (interned == NULL)
+		goto out;
+
+	/* a device whose udi changes may move to another shard, which needs room first */
+	if (!hal_store_device_room (hal_store_shard (hal_intern_hash (interned))))
+		goto out;
+	hal_store_device_unlink (device);
+	hal_store_device_clean (device);
+	if (device->temp)
+		free ((char *) device->udi);
+	device->udi = interned;
+	device->temp = FALSE;
+	device->hash = hal_intern_hash (interned);
+	hal_store_device_insert (device);
+
+	hal_store_device_set_string (device, "info.udi", udi);
+	hal_store_device_commit (device, HAL_STORE_END);
+	hal_store_device_changed (device);
+	ret = TRUE;
+
+out:
+	hal_store_unlock ();
+	return ret;
+}
+
+/**
+ * hal_store_remove_device:
+ * @udi: the device
+ *
+ * Returns: FALSE if there is no such device
+ */
+int
+hal_store_remove_device (const char *udi)
+{
+	HalDevice *device;
+	int image_device;
+	int ret = TRUE;
+
+	if (hal_store_read_only ())
+		return FALSE;
+
+	hal_store_write_lock ();
+	device = hal_store_device_find (udi);
+	if (device != NULL) {
+		hal_store_device_unlink (device);
+		hal_store_version_remove (device);
+	} else if ((image_device = hal_store_image_device (udi)) >= 0) {
+		hal_store_image_shadow (image_device);
+	} else {
+		ret = FALSE;
+	}
+	if (ret)
+		hal_store_generation_advance (__atomic_add_fetch (&hal_store_changes, 1, __ATOMIC_RELAXED));
+	hal_store_unlock ();
+
+	if (device != NULL)
+		hal_store_device_free (device);
+	return ret;
+}
+
+/**
+ * hal_store_device_exists:
+ * @udi: the device
+ *
+ * Returns: TRUE if @udi is in the GDL
+ */
+int
+hal_store_device_exists (const char *udi)
+{
+	const HalStoreVersion *version;
+	int image_device;
+	int ret;
+
+	if (hal_store_shared ())
+		return hal_shared_device_exists (udi);
+
+	hal_rcu_read_lock ();
+	version = hal_store_version_lookup (udi, &image_device);
+	ret = version != NULL ? version->committed : image_device >= 0;
+	hal_rcu_read_unlock ();
+
+	return ret;
+}
+
+/**
+ * hal_store_get_device_generation:
+ * @udi: the device
+ *
+ * Returns: the generation of the last change to @udi, or 0 if there
+ * is no such device
+ */
+uint64_t
+hal_store_get_device_generation (const char *udi)
+{
+	const HalStoreVersion *version;
+	uint64_t generation = 0;
+	int image_device;
+
+	if (hal_store_shared ())
+		return hal_shared_get_device_generation (udi);
+
+	hal_rcu_read_lock ();
+	version = hal_store_version_lookup (udi, &image_device);
+	if (version != NULL)
+		generation = version->generation;
+	else if (image_device >= 0)
+		generation = 1;
+	hal_rcu_read_unlock ();
+
+	return generation;
+}
+
+/**
+ * hal_store_get_gdl_generation:
+ *
+ * Takes no lock once the store is set up.
+ *
+ * Returns: the generation of the last change to the GDL
+ */
+uint64_t
+hal_store_get_gdl_generation (void)
+{
+	if (hal_store_shared ())
+		return hal_shared_get_gdl_generation ();
+	return __atomic_load_n (&hal_store_generation, __ATOMIC_ACQUIRE);
+}
+
+/* Walks the GDL in order, with the copies of image devices in their place */
+typedef struct {
+	unsigned int n;                 /**< next position in the image */
+	const HalDevice *device;        /**< next committed device */
+} HalStoreCursor;
+
+static void
+hal_store_cursor_init (HalStoreCursor *cursor)
+{
+	cursor->n = 0;
+	cursor->device = hal_store_first;
+}
+
+/* Step to the next device, *@device or else *@image_device; FALSE at the end of the GDL */
+static int
+hal_store_cursor_next (HalStoreCursor *cursor, const HalDevice **device, int *image_device)
+{
+	unsigned int num = hal_image_num_devices ();
+	unsigned int n;
+
+	*device = NULL;
+	*image_device = -1;
+	while (cursor->n < num) {
+		n = cursor->n++;
+		if (!hal_store_shadowed[hal_image_device_at (n)]) {
+			*image_device = hal_image_device_at (n);
+			return TRUE;
+		}
+		if (hal_store_image_copies[n] != NULL) {
+			*device = hal_store_image_copies[n];
+			return TRUE;
+		}
+	}
+
+	/* the copies were listed already */
+	while (cursor->device != NULL && cursor->device->position < num)
+		cursor->device = cursor->device->next;
+	if (cursor->device == NULL)
+		return FALSE;
+	*device = cursor->device;
+	cursor->device = cursor->device->next;
+	return TRUE;
+}
+
+/**
+ * hal_store_get_all_devices:
+ * @num_devices: where to store the number of devices
+ *
+ * Returns: the udis of the devices in the GDL, in the order they were
+ * added, as a NULL terminated array for libhal_free_string_array(),
+ * or NULL if out of memory.  A device copied from the image on its
+ * first change keeps its place.
+ */
+char **
+hal_store_get_all_devices (int *num_devices)
+{
+	HalStoreCursor cursor;
+	const HalDevice *device;
+	char **udis;
+	int image_device;
+	unsigned int i = 0;
+
+	*num_devices = 0;
+
+	if (hal_store_shared ())
+		return hal_shared_get_all_devices (num_devices);
+
+	hal_store_read_lock ();
+	udis = malloc ((hal_store_num_image_devices + hal_store_num_committed + 1) * sizeof (char *));
+	if (udis != NULL)
+		udis[0] = NULL;
+	hal_store_cursor_init (&cursor);
+	while (udis != NULL && hal_store_cursor_next (&cursor, &device, &image_device)) {
+		udis[i] = strdup (device != NULL ? device->udi : hal_image_device_udi (image_device));
+		if (udis[i] == NULL) {
+			libhal_free_string_array (udis);
+			udis = NULL;
+			break;
+		}
+		udis[++i] = NULL;
+	}
+	hal_store_unlock ();
+
+	if (udis != NULL)
+		*num_devices = i;
+	return udis;
+}
+
+/* Index @key over the GDL; FALSE if it cannot be indexed */
+static int
+hal_store_index_build (const char *key)
+{
+	HalDevice *device;
+	HalProperty *p;
+	const char *value;
+	const char *interned = hal_intern_lookup (key);
+	unsigned int image_device;
+	unsigned int n;
+
+	if (!hal_index_add_key (key))
+		return FALSE;
+
+	for (n = 0; n < hal_image_num_devices (); n++) {
+		image_device = hal_image_device_at (n);
+		if (hal_store_shadowed[image_device])
+			continue;
+		value = hal_image_get_string (image_device, key);
+		if (value != NULL && !hal_index_add (key, value, hal_image_device_udi (image_device), n))
+			goto fail;
+	}
+	for (device = hal_store_first; interned != NULL && device != NULL; device = device->next) {
+		p = hal_store_property_find (device, interned);
+		if (p != NULL && p->type == LIBHAL_PROPERTY_TYPE_STRING &&
+		    !hal_index_add (key, p->value.str_value, device->udi, device->position))
+			goto fail;
+	}
+	return TRUE;
+
+fail:
+	hal_index_remove_key (key);
+	return FALSE;
+}
+
+/* Find the devices where @key is @value the slow way, when it is not indexed */
+static char **
+hal_store_scan_string_match (const char *key, const char *value, int *num_devices)
+{
+	HalStoreCursor cursor;
+	const HalDevice *device;
+	const HalProperty *p;
+	const char *udi;
+	const char *s;
+	const char *interned = hal_intern_lookup (key);
+	char **udis;
+	int image_device;
+	unsigned int i = 0;
+
+	*num_devices = 0;
+
+	udis = malloc ((hal_store_num_image_devices + hal_store_num_committed + 1) * sizeof (char *));
+	if (udis == NULL)
+		return NULL;
+	udis[0] = NULL;
+
+	hal_store_cursor_init (&cursor);
+	while (hal_store_cursor_next (&cursor, &device, &image_device)) {
+		if (device == NULL) {
+			udi = hal_image_device_udi (image_device);
+			s = hal_image_get_string (image_device, key);
+		} else {
+			udi = device->udi;
+			p = hal_store_property_find (device, interned);
+			s = p != NULL && p->type == LIBHAL_PROPERTY_TYPE_STRING ? p->value.str_value : NULL;
+		}
+		if (s == NULL || strcmp (s, value) != 0)
+			continue;
+		if ((udis[i] = strdup (udi)) == NULL)
+			goto oom;
+		udis[++i] = NULL;
+	}
+
+	*num_devices = i;
+	return udis;
+
+oom:
+	libhal_free_string_array (udis);
+	return NULL;
+}
+
+/**
+ * hal_store_find_string_match:
+ * @key: the property
+ * @value: the value to match
+ * @num_devices: where to store the number of devices
+ *
+ * The first search for a key indexes it, later ones and changes to
+ * the GDL keep the index up to date.
+ *
+ * Returns: the udis of the devices in the GDL where @key is the
+ * string @value, in GDL order, as a NULL terminated array for
+ * libhal_free_string_array(), or NULL if out of memory
+ */
+char **
+hal_store_find_string_match (const char *key, const char *value, int *num_devices)
+{
+	char **udis;
+
+	if (hal_store_shared ())
+		return hal_shared_find_string_match (key, value, num_devices);
+
+	/* an indexed key needs only the index, which changes to single devices keep up to date */
+	hal_store_gdl_lock ();
+	pthread_rwlock_rdlock (&hal_store_index_lock);
+	if (hal_index_has_key (key)) {
+		udis = hal_index_lookup (key, value, num_devices);
+		pthread_rwlock_unlock (&hal_store_index_lock);
+		hal_store_gdl_unlock ();
+		return udis;
+	}
+	pthread_rwlock_unlock (&hal_store_index_lock);
+	hal_store_gdl_unlock ();
+
+	hal_store_read_lock ();
+	if (hal_index_is_full ()) {
+		udis = hal_store_scan_string_match (key, value, num_devices);
+		hal_store_unlock ();
+		return udis;
+	}
+	hal_store_unlock ();
+
+	hal_store_write_lock ();
+	if (hal_index_has_key (key) || hal_store_index_build (key))
+		udis = hal_index_lookup (key, value, num_devices);
+	else
+		udis = hal_store_scan_string_match (key, value, num_devices);
+	hal_store_unlock ();
+
+	return udis;
+}
+
+static void hal_store_capabilities_drop (void);
+
+/* Index the capabilities of all devices; FALSE if out of memory */
+static int
+hal_store_capabilities_build (void)
+{
+	HalStoreShard *shard;
+	HalDevice *device;
+	HalProperty *p;
+	char **strlist;
+	uint64_t *words;
+	unsigned int image_device;
+	unsigned int n;
+	unsigned int i;
+	int ok;
+	int id;
+
+	/* ids for the image first, so that its bitsets can all have the same size */
+	for (n = 0; n < hal_image_num_devices (); n++) {
+		if (!hal_image_get_strlist (n, HAL_STORE_CAPABILITIES, &strlist))
+			goto fail;
+		for (i = 0, ok = TRUE; ok && strlist != NULL && strlist[i] != NULL; i++)
+			ok = hal_capability_id (strlist[i], TRUE) >= 0;
+		free (strlist);
+		if (!ok)
+			goto fail;
+	}
+	hal_store_image_capability_words = (hal_capability_get_num () + 63) / 64;
+	if (hal_store_image_capability_words > 0) {
+		hal_store_image_capabilities = calloc ((size_t) hal_image_num_devices () * hal_store_image_capability_words,
+						       sizeof (uint64_t));
+		if (hal_store_image_capabilities == NULL)
+			goto fail;
+	}
+	for (n = 0; n < hal_image_num_devices (); n++) {
+		image_device = hal_image_device_at (n);
+		if (!hal_image_get_strlist (image_device, HAL_STORE_CAPABILITIES, &strlist))
+			goto fail;
+		words = hal_store_image_capabilities + image_device * hal_store_image_capability_words;
+		for (i = 0; strlist != NULL && strlist[i] != NULL; i++) {
+			id = hal_capability_id (strlist[i], FALSE);
+			words[id / 64] |= 1ULL << (id % 64);
+		}
+		ok = hal_store_shadowed[image_device] ||
+			hal_store_capability_lists (hal_image_device_udi (image_device), n, strlist, TRUE);
+		free (strlist);
+		if (!ok)
+			goto fail;
+	}
+
+	/* bitsets for all devices, lists for those in the GDL */
+	for (shard = hal_store_shards; shard < hal_store_shards + hal_store_num_shards; shard++) {
+		for (i = 0; i < shard->size; i++) {
+			device = shard->devices[i];
+			if (device == NULL)
+				continue;
+			p = hal_store_property_find (device, hal_store_capabilities_key);
+			if (p != NULL && p->type == LIBHAL_PROPERTY_TYPE_STRLIST &&
+			    !hal_store_capability_bits (device, p->value.strlist_value))
+				goto fail;
+		}
+	}
+	for (device = hal_store_first; device != NULL; device = device->next) {
+		p = hal_store_property_find (device, hal_store_capabilities_key);
+		if (p != NULL && p->type == LIBHAL_PROPERTY_TYPE_STRLIST &&
+		    !hal_store_capability_lists (device->udi, device->position, p->value.strlist_value, TRUE))
+			goto fail;
+	}
+
+	hal_store_capabilities_indexed = TRUE;
+	return TRUE;
+
+fail:
+	hal_store_capabilities_drop ();
+	return FALSE;
+}
+
+/* Forget the capabilities, e.g. when out of memory; the next query indexes them again */
+static void
+hal_store_capabilities_drop (void)
+{
+	HalStoreShard *shard;
+	HalDevice *device;
+	unsigned int i;
+
+	hal_capability_reset ();
+	for (shard = hal_store_shards; shard < hal_store_shards + hal_store_num_shards; shard++) {
+		for (i = 0; i < shard->size; i++) {
+			device = shard->devices[i];
+			if (device != NULL) {
+				free (device->capabilities);
+				device->capabilities = NULL;
+				device->num_capability_words = 0;
+			}
+		}
+	}
+	free (hal_store_image_capabilities);
+	hal_store_image_capabilities = NULL;
+	hal_store_image_capability_words = 0;
+	hal_store_capabilities_indexed = FALSE;
+	hal_store_capabilities_failed = FALSE;
+}
+
+/*
+ * Lock the GDL for reading, indexing the capabilities first if need
+ * be, or again if that ran out of memory since.  Returns FALSE, with
+ * nothing locked, if they cannot be indexed.
+ */
+static int
+hal_store_capabilities_lock (void)
+{
+	int ok;
+
+	for (;;) {
+		hal_store_gdl_lock ();
+		if (hal_store_capabilities_indexed &&
+		    !__atomic_load_n (&hal_store_capabilities_failed, __ATOMIC_RELAXED))
+			return TRUE;
+		hal_store_gdl_unlock ();
+
+		hal_store_write_lock ();
+		if (hal_store_capabilities_failed)
+			hal_store_capabilities_drop ();
+		ok = hal_store_capabilities_indexed || hal_store_capabilities_build ();
+		hal_store_unlock ();
+		if (!ok)
+			return FALSE;
+	}
+}
+
+/**
+ * hal_store_query_capability:
+ * @udi: the device
+ * @capability: the capability
+ *
+ * Returns: TRUE if @capability is in info.capabilities of @udi, FALSE
+ * if not or out of memory
+ */
+int
+hal_store_query_capability (const char *udi, const char *capability)
+{
+	HalStoreShard *shard;
+	HalDevice *device;
+	const uint64_t *words = NULL;
+	unsigned int num_words = 0;
+	int image_device;
+	int id;
+	int ret = FALSE;
+
+	if (hal_store_shared ())
+		return hal_shared_query_capability (udi, capability);
+
+	if (!hal_store_capabilities_lock ())
+		return FALSE;
+	shard = hal_store_shard (hal_store_hash (udi));
+	pthread_rwlock_rdlock (&shard->lock);
+	pthread_rwlock_rdlock (&hal_store_index_lock);
+	if ((id = hal_capability_id (capability, FALSE)) >= 0) {
+		device = hal_store_device_find (udi);
+		if (device != NULL) {
+			words = device->capabilities;
+			num_words = device->num_capability_words;
+		} else if ((image_device = hal_store_image_device (udi)) >= 0) {
+			words = hal_store_image_capabilities + image_device * hal_store_image_capability_words;
+			num_words = hal_store_image_capability_words;
+		}
+		ret = (unsigned int) id / 64 < num_words && (words[id / 64] >> (id % 64)) & 1;
+	}
+	pthread_rwlock_unlock (&hal_store_index_lock);
+	pthread_rwlock_unlock (&shard->lock);
+	hal_store_gdl_unlock ();
+
+	return ret;
+}
+
+/**
+ * hal_store_find_by_capability:
+ * @capability: the capability
+ * @num_devices: where to store the number of devices
+ *
+ * Returns: the udis of the devices in the GDL with @capability, in
+ * GDL order, as a NULL terminated array for libhal_free_string_array(),
+ * or NULL if out of memory
+ */
+char **
+hal_store_find_by_capability (const char *capability, int *num_devices)
+{
+	char **udis = NULL;
+	int id;
+
+	*num_devices = 0;
+
+	if (hal_store_shared ())
+		return hal_shared_find_by_capability (capability, num_devices);
+
+	if (hal_store_capabilities_lock ()) {
+		pthread_rwlock_rdlock (&hal_store_index_lock);
+		id = hal_capability_id (capability, FALSE);
+		udis = hal_index_list_udis (id >= 0 ? hal_capability_devices (id) : NULL, num_devices);
+		pthread_rwlock_unlock (&hal_store_index_lock);
+		hal_store_gdl_unlock ();
+	}
+
+	return udis;
+}
+
+/**
+ * hal_store_add_capability:
+ * @udi: the device
+ * @capability: the capability
+ *
+ * Add @capability to info.capabilities of @udi, unless it is there
+ * already.
+ *
+ * Returns: FALSE if there is no such device, info.capabilities is not
+ * a string list, or out of memory
+ */
+int
+hal_store_add_capability (const char *udi, const char *capability)
+{
+	HalStoreShard *shard;
+	HalDevice *device;
+	HalProperty *p;
+	char **strlist;
+	char *copy;
+	int ret = FALSE;
+
+	if (hal_store_read_only ())
+		return FALSE;
+
+	copy = strdup (capability);
+	if (copy == NULL)
+		return FALSE;
+
+	shard = hal_store_device_lock (udi);
+	device = hal_store_device_find_writable (udi);
+	if (device == NULL)
+		goto out;
+
+	p = hal_store_property_find (device, hal_store_capabilities_key);
+	if (p != NULL && p->type == LIBHAL_PROPERTY_TYPE_STRLIST) {
+		for (strlist = p->value.strlist_value; strlist != NULL && *strlist != NULL; strlist++) {
+			if (strcmp (*strlist, capability) == 0) {
+				ret = TRUE;
+				goto out;
+			}
+		}
+	}
+	if (hal_store_device_strlist_insert (device, HAL_STORE_CAPABILITIES, copy, FALSE)) {
+		hal_store_device_changed (device);
+		copy = NULL;
+		ret = TRUE;
+	}
+
+out:
+	hal_store_device_unlock (shard);
+	free (copy);
+	return ret;
+}
+
+/* Call @func for each property of @device, or else of @image_device */
+static int
+hal_store_foreach_property (const HalDevice *device, int image_device,
+			    HalFixturePropertyFunc func, void *data)
+{
+	const HalProperty *p;
+	unsigned int i;
+
+	if (device == NULL)
+		return hal_image_foreach_property (image_device, func, data);
+
+	for (i = 0; i < device->size; i++) {
+		p = &device->properties[i];
+		if (p->key != NULL && !func (data, p->key, p->type, &p->value))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Call @device_func for each device in the GDL, in order, then @property_func for its properties */
+static int
+hal_store_foreach_device (HalFixtureDeviceFunc device_func, HalFixturePropertyFunc property_func,
+			  void *data)
+{
+	HalStoreCursor cursor;
+	const HalDevice *device;
+	int image_device;
+	void *target;
+
+	hal_store_cursor_init (&cursor);
+	while (hal_store_cursor_next (&cursor, &device, &image_device)) {
+		target = device_func (data, device != NULL ? device->udi : hal_image_device_udi (image_device));
+		if (target == NULL || !hal_store_foreach_property (device, image_device, property_func, target))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Copy the GDL to the shared GDL, see libhal-shared.c, with the whole
+ * store locked.  Several readers of the store may get here for the
+ * same generation, the first publishes it.  A GDL that cannot be
+ * published leaves readers with the last one that could.
+ */
+static void
+hal_store_publish (void)
+{
+	HalImageBuilder builder;
+	uint64_t generation = __atomic_load_n (&hal_store_generation, __ATOMIC_ACQUIRE);
+	void *image;
+
+	pthread_mutex_lock (&hal_store_publish_lock);
+	if (hal_store_published == generation)
+		goto out;
+	__atomic_store_n (&hal_store_published, generation, __ATOMIC_RELAXED);
+
+	hal_image_builder_init (&builder);
+	if (!hal_store_foreach_device (hal_image_builder_add_device, hal_image_builder_add_property, &builder))
+		goto out;
+	image = hal_shared_publish_begin (hal_image_builder_get_size (&builder));
+	if (image == NULL)
+		goto out;
+	hal_image_builder_place (&builder, image);
+	if (hal_store_foreach_device (hal_image_builder_add_device, hal_image_builder_add_property, &builder) &&
+	    hal_image_builder_finish (&builder))
+		hal_shared_publish_end (generation);
+
+out:
+	pthread_mutex_unlock (&hal_store_publish_lock);
+}
+
+/**
+ * hal_store_get_all_properties:
+ * @udi: the device
+ *
+ * The properties are measured and then copied under the same lock,
+ * so the set is a single allocation.
+ *
+ * Returns: the properties of the device, for libhal_free_property_set(),
+ * or NULL if there is no such device or out of memory
+ */
+LibHalPropertySet *
+hal_store_get_all_properties (const char *udi)
+{
+	HalPropertySetBuilder builder;
+	const HalStoreVersion *version;
+	LibHalPropertySet *set = NULL;
+	int image_device;
+
+	if (hal_store_shared ())
+		return hal_shared_get_all_properties (udi);
+
+	hal_rcu_read_lock ();
+	version = hal_store_version_lookup (udi, &image_device);
+	if (version != NULL) {
+		hal_snapshot_ref (version->snapshot);
+		set = version->set;
+	}
+	hal_rcu_read_unlock ();
+	if (version != NULL || image_device < 0)
+		return set;
+
+	/* the image does not change, it needs no lock */
+	hal_property_set_builder_init (&builder);
+	if (hal_image_foreach_property (image_device, hal_property_set_builder_add, &builder) &&
+	    hal_property_set_builder_alloc (&builder)) {
+		if (hal_image_foreach_property (image_device, hal_property_set_builder_add, &builder))
+			set = hal_property_set_builder_finish (&builder);
+		else
+			free (builder.set);
+	}
+
+	return set;
+}
+
+typedef struct {
+	const HalDevice *device;        /**< or NULL for an image device */
+	int image_device;
+	const char *udi;
+	HalPropertySetBuilder builder;
+	size_t offset;                  /**< of the set in the snapshot data */
+	int ok;
+} HalStoreSnapshotDevice;
+
+typedef struct {
+	HalStoreSnapshotDevice *devices;
+	unsigned int first;
+	unsigned int last;
+	HalSnapshot *snapshot;          /**< NULL while measuring */
+	char **udis;
+} HalStoreSnapshotWork;
+
+/* Measure, or copy into the snapshot, the devices of @data */
+static void *
+hal_store_snapshot_work (void *data)
+{
+	HalStoreSnapshotWork *work = data;
+	HalStoreSnapshotDevice *d;
+	size_t size;
+	unsigned int i;
+
+	for (i = work->first; i < work->last; i++) {
+		d = &work->devices[i];
+		if (work->snapshot == NULL) {
+			d->ok = hal_store_foreach_property (d->device, d->image_device,
+							    hal_property_set_builder_add, &d->builder);
+			continue;
+		}
+
+		size = hal_property_set_builder_get_size (&d->builder);
+		hal_property_set_builder_place (&d->builder, hal_snapshot_data (work->snapshot) + d->offset,
+						work->snapshot);
+		d->ok = hal_store_foreach_property (d->device, d->image_device,
+						    hal_property_set_builder_add, &d->builder);
+		if (d->ok)
+			hal_property_set_builder_finish (&d->builder);
+		work->udis[i] = strcpy (hal_snapshot_data (work->snapshot) + d->offset + size, d->udi);
+	}
+	return NULL;
+}
+
+/* Run a pass of the snapshot over @num_devices devices */
+static void
+hal_store_snapshot_run (HalStoreSnapshotDevice *devices, unsigned int num_devices,
+			HalSnapshot *snapshot, char **udis)
+{
+	HalStoreSnapshotWork work[HAL_STORE_SNAPSHOT_MAX_THREADS];
+	pthread_t threads[HAL_STORE_SNAPSHOT_MAX_THREADS];
+	unsigned int num_threads;
+	unsigned int started;
+	unsigned int i;
+	long n;
+
+	n = hal_config_get_int ("snapshot_threads", sysconf (_SC_NPROCESSORS_ONLN));
+	if (n > (long) (num_devices / HAL_STORE_SNAPSHOT_MIN_WORK))
+		n = num_devices / HAL_STORE_SNAPSHOT_MIN_WORK;
+	num_threads = n < 1 ? 1 : n > HAL_STORE_SNAPSHOT_MAX_THREADS ? HAL_STORE_SNAPSHOT_MAX_THREADS : n;
+
+	for (i = 0; i < num_threads; i++) {
+		work[i].devices = devices;
+		work[i].first = (uint64_t) num_devices * i / num_threads;
+		work[i].last = (uint64_t) num_devices * (i + 1) / num_threads;
+		work[i].snapshot = snapshot;
+		work[i].udis = udis;
+	}
+
+	/* this thread does the first part, and those no thread could be started for */
+	for (started = 1; started < num_threads; started++) {
+		if (pthread_create (&threads[started], NULL, hal_store_snapshot_work, &work[started]) != 0)
+			break;
+	}
+	hal_store_snapshot_work (&work[0]);
+	for (i = started; i < num_threads; i++)
+		hal_store_snapshot_work (&work[i]);
+	for (i = 1; i < started; i++)
+		pthread_join (threads[i], NULL);
+}
+
+/**
+ * hal_store_get_all_devices_with_properties:
+ * @num_devices: where to store the number of devices
+ * @udis: where to store the udis of the devices in the GDL, in the
+ * order of hal_store_get_all_devices()
+ * @sets: where to store a NULL terminated array of their properties,
+ * to be freed with free()
+ *
+ * The udis and the sets are in one snapshot, and are freed as usual
+ * with libhal_free_string_array() and libhal_free_property_set().
+ *
+ * Returns: FALSE if out of memory
+ */
+int
+hal_store_get_all_devices_with_properties (int *num_devices, char ***udis, LibHalPropertySet ***sets)
+{
+	HalStoreSnapshotDevice *devices;
+	HalSnapshot *snapshot = NULL;
+	HalStoreCursor cursor;
+	const HalDevice *device;
+	int image_device;
+	unsigned int num = 0;
+	unsigned int i;
+	size_t size;
+	int ok = FALSE;
+
+	*num_devices = 0;
+	*udis = NULL;
+	*sets = NULL;
+
+	if (hal_store_shared ())
+		return hal_shared_get_all_devices_with_properties (num_devices, udis, sets);
+
+	hal_store_read_lock ();
+	devices = calloc (hal_store_num_image_devices + hal_store_num_committed + 1,
+			  sizeof (HalStoreSnapshotDevice));
+	if (devices == NULL)
+		goto out;
+	hal_store_cursor_init (&cursor);
+	while (hal_store_cursor_next (&cursor, &device, &image_device)) {
+		devices[num].device = device;
+		devices[num].image_device = image_device;
+		devices[num].udi = device != NULL ? device->udi : hal_image_device_udi (image_device);
+		num++;
+	}
+
+	hal_store_snapshot_run (devices, num, NULL, NULL);
+
+	/* the udi array, then each set followed by its udi */
+	size = (num + 1) * sizeof (char *);
+	for (i = 0; i < num; i++) {
+		if (!devices[i].ok)
+			goto out;
+		devices[i].offset = size;
+		size += hal_property_set_builder_get_size (&devices[i].builder) + strlen (devices[i].udi) + 1;
+		size = (size + sizeof (uint64_t) - 1) & ~(sizeof (uint64_t) - 1);
+	}
+
+	*sets = malloc ((num + 1) * sizeof (LibHalPropertySet *));
+	snapshot = hal_snapshot_new (size, num + 1);
+	if (*sets == NULL || snapshot == NULL)
+		goto out;
+	*udis = (char **) hal_snapshot_data (snapshot);
+
+	hal_store_snapshot_run (devices, num, snapshot, *udis);
+
+	for (i = 0; i < num; i++) {
+		if (!devices[i].ok)
+			goto out;
+		(*sets)[i] = devices[i].builder.set;
+	}
+	(*sets)[num] = NULL;
+	(*udis)[num] = NULL;
+	hal_snapshot_publish (snapshot, *udis);
+	*num_devices = num;
+	ok = TRUE;
+
+out:
+	hal_store_unlock ();
+	if (!ok) {
+		if (snapshot != NULL)
+			hal_snapshot_free (snapshot);
+		free (*sets);
+		*udis = NULL;
+		*sets = NULL;
+	}
+	free (devices);
+	return ok;
+}
+
+/**
+ * hal_store_get_property_type:
+ * @udi: the device
+ * @key: the property
+ *
+ * Returns: the LIBHAL_PROPERTY_TYPE_* of the property, or
+ * LIBHAL_PROPERTY_TYPE_INVALID if there is no such property
+ */
+int
+hal_store_get_property_type (const char *udi, const char *key)
+{
+	const HalStoreVersion *version;
+	HalValue value;
+	int image_device;
+	int type = LIBHAL_PROPERTY_TYPE_INVALID;
+
+	if (hal_store_shared ())
+		return hal_shared_get_property_type (udi, key);
+
+	hal_rcu_read_lock ();
+	version = hal_store_version_lookup (udi, &image_device);
+	if (version != NULL)
+		type = hal_property_set_lookup (version->set, key, &value);
+	else if (image_device >= 0)
+		type = hal_image_get_property_type (image_device, key);
+	hal_rcu_read_unlock ();
+
+	return type;
+}
+
+/**
+ * hal_store_get_property:
+ * @udi: the device
+ * @key: the property
+ * @type: the LIBHAL_PROPERTY_TYPE_* the property should have
+ * @value: where to copy the value
+ *
+ * Strings and string lists are copied with malloc().
+ *
+ * Returns: FALSE if there is no such property of that type, or out of memory
+ */
+int
+hal_store_get_property (const char *udi, const char *key, int type, HalValue *value)
+{
+	const HalStoreVersion *version;
+	HalValue current;
+	int image_device;
+	int ret = FALSE;
+
+	if (hal_store_shared ())
+		return hal_shared_get_property (udi, key, type, value);
+
+	hal_rcu_read_lock ();
+	version = hal_store_version_lookup (udi, &image_device);
+	if (version != NULL)
+		ret = hal_property_set_lookup (version->set, key, &current) == type &&
+			hal_store_value_copy (type, value, &current);
+	else if (image_device >= 0)
+		ret = hal_image_get_property (image_device, key, type, value);
+	hal_rcu_read_unlock ();
+
+	return ret;
+}
+
+/**
+ * hal_store_set_property:
+ * @udi: the device
+ * @key: the property
+ * @type: the LIBHAL_PROPERTY_TYPE_* of @value
+ * @value: the value, copied into the store
+ *
+ * Adds the property if the device does not have it yet.
+ *
+ * Returns: FALSE if there is no such device, the property has another
+ * type, or out of memory
+ */
+int
+hal_store_set_property (const char *udi, const char *key, int type, const HalValue *value)
+{
+	HalPropertyChange change;
+
+	change.key = key;
+	change.type = type;
+	change.value = *value;
+	return hal_store_set_properties (udi, &change, 1);
+}
+
+/* Claim a slot in @device for each change, FALSE if one has another type or out of memory */
+static int
+hal_store_device_claim (HalDevice *device, const HalPropertyChange *changes, const char **keys,
+			unsigned int num_changes)
+{
+	HalProperty *p;
+	unsigned int i;
+	unsigned int j;
+
+	for (i = 0; i < num_changes; i++) {
+		p = hal_store_property_insert (device, changes[i].key);
+		if (p == NULL)
+			return FALSE;
+		keys[i] = p->key;
+		if (p->type != LIBHAL_PROPERTY_TYPE_INVALID) {
+			if (p->type != changes[i].type)
+				return FALSE;
+			continue;
+		}
+		/* a new property gets the type of its first change */
+		for (j = 0; j < i; j++) {
+			if (keys[j] == keys[i] && changes[j].type != changes[i].type)
+				return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/**
+ * hal_store_set_properties:
+ * @udi: the device
+ * @changes: properties to set, in order, their values copied into the store
+ * @num_changes: number of @changes
+ *
+ * Sets the properties as one change: under one lock, with one new
+ * generation for the device, and readers see all of them or none.
+ * If one cannot be set, none is.  Adds the properties the device does
+ * not have yet.
+ *
+ * Returns: FALSE if there is no such device, a property has another
+ * type, or out of memory
+ */
+int
+hal_store_set_properties (const char *udi, const HalPropertyChange *changes, unsigned int num_changes)
+{
+	HalValue stack_copies[HAL_STORE_STACK_CHANGES];
+	const char *stack_keys[HAL_STORE_STACK_CHANGES];
+	HalValue *copies = stack_copies;
+	const char **keys = stack_keys;
+	HalStoreShard *shard;
+	HalDevice *device;
+	HalProperty *p;
+	unsigned int num_copies = 0;
+	unsigned int i;
+	int ret = FALSE;
+
+	if (hal_store_read_only ())
+		return FALSE;
+	if (num_changes == 0)
+		return hal_store_device_exists (udi);
+
+	if (num_changes > HAL_STORE_STACK_CHANGES) {
+		copies = malloc (num_changes * sizeof (HalValue));
+		keys = malloc (num_changes * sizeof (const char *));
+		if (copies == NULL || keys == NULL)
+			goto out_free;
+	}
+	/* copied before taking the lock, so it is only held to change the device */
+	for (; num_copies < num_changes; num_copies++) {
+		if (!hal_store_value_copy (changes[num_copies].type, &copies[num_copies],
+					   &changes[num_copies].value))
+			goto out_free;
+	}
+
+	shard = hal_store_device_lock (udi);
+	device = hal_store_device_find_writable (udi);
+	if (device == NULL)
+		goto out;
+	if (!hal_store_device_claim (device, changes, keys, num_changes)) {
+		/* the slots claimed for new properties go again */
+		for (i = 0; i < num_changes; i++) {
+			p = hal_store_property_find (device, hal_intern_lookup (changes[i].key));
+			if (p != NULL && p->type == LIBHAL_PROPERTY_TYPE_INVALID)
+				hal_store_property_delete (device, p);
+		}
+		goto out;
+	}
+
+	/* nothing can fail from here on; slots move as the table grows, so look them up again */
+	for (i = 0; i < num_changes; i++) {
+		p = hal_store_property_find (device, keys[i]);
+		hal_store_index_property (device, p, FALSE);
+		hal_store_value_free (p->type, &p->value);
+		p->type = changes[i].type;
+		p->value = copies[i];
+		hal_store_index_property (device, p, TRUE);
+	}
+	num_copies = 0;
+	hal_store_device_changed (device);
+	ret = TRUE;
+
+out:
+	hal_store_device_unlock (shard);
+out_free:
+	for (i = 0; i < num_copies; i++)
+		hal_store_value_free (changes[i].type, &copies[i]);
+	if (copies != stack_copies)
+		free (copies);
+	if (keys != stack_keys)
+		free (keys);
+	return ret;
+}
+
+/**
+ * hal_store_remove_property:
+ * @udi: the device
+ * @key: the property
+ *
+ * Returns: FALSE if there is no such property
+ */
+int
+hal_store_remove_property (const char *udi, const char *key)
+{
+	HalStoreShard *shard;
+	HalDevice *device;
+	HalProperty *p = NULL;
+
+	if (hal_store_read_only ())
+		return FALSE;
+
+	shard = hal_store_device_lock (udi);
+	device = hal_store_device_find_writable (udi);
+	if (device != NULL) {
+		p = hal_store_property_find (device, hal_intern_lookup (key));
+		if (p != NULL) {
+			hal_store_index_property (device, p, FALSE);
+			hal_store_property_delete (device, p);
+			hal_store_device_changed (device);
+		}
+	}
+	hal_store_device_unlock (shard);
+
+	return p != NULL;
+}
+
+/**
+ * hal_store_strlist_insert:
+ * @udi: the device
+ * @key: the property, a string list
+ * @value: the string to add
+ * @prepend: add @value at the start rather than the end
+ *
+ * Adds the property if the device does not have it yet.
+ *
+ * Returns: FALSE if there is no such device, the property has another
+ * type, or out of memory
+ */
+int
+hal_store_strlist_insert (const char *udi, const char *key, const char *value, int prepend)
+{
+	HalStoreShard *shard;
+	HalDevice *device;
+	char *copy;
+	int ret = FALSE;
+
+	if (hal_store_read_only ())
+		return FALSE;
+
+	copy = strdup (value);
+	if (copy == NULL)
+		return FALSE;
+
+	shard = hal_store_device_lock (udi);
+	device = hal_store_device_find_writable (udi);
+	if (device != NULL)
+		ret = hal_store_device_strlist_insert (device, key, copy, prepend);
+	if (ret)
+		hal_store_device_changed (device);
+	hal_store_device_unlock (shard);
+
+	if (!ret)
+		free (copy);
+	return ret;
+}
+
+/**
+ * hal_store_strlist_remove:
+ * @udi: the device
+ * @key: the property, a string list
+ * @value: the string to remove, or NULL to remove the one at @index
+ * @index: position of the string to remove if @value is NULL
+ *
+ * Returns: FALSE if there is no such string list, or @index is out
+ * of range
+ */
+int
+hal_store_strlist_remove (const char *udi, const char *key, const char *value, unsigned int index)
+{
+	HalStoreShard *shard;
+	HalDevice *device;
+	HalProperty *p;
+	char **strlist;
+	unsigned int n;
+	unsigned int i;
+	int ret = FALSE;
+
+	if (hal_store_read_only ())
+		return FALSE;
+
+	shard = hal_store_device_lock (udi);
+	device = hal_store_device_find_writable (udi);
+	if (device == NULL)
+		goto out;
+	p = hal_store_property_find (device, hal_intern_lookup (key));
+	if (p == NULL || p->type != LIBHAL_PROPERTY_TYPE_STRLIST)
+		goto out;
+
+	strlist = p->value.strlist_value;
+	for (n = 0; strlist != NULL && strlist[n] != NULL; n++)
+		;
+	if (value != NULL) {
+		/* removing a string that is not there is not an error */
+		ret = TRUE;
+		for (index = 0; index < n && strcmp (strlist[index], value) != 0; index++)
+			;
+	}
+	if (index >= n)
+		goto out;
+
+	hal_store_index_property (device, p, FALSE);
+	free (strlist[index]);
+	for (i = index; i < n; i++)
+		strlist[i] = strlist[i + 1];
+	hal_store_index_property (device, p, TRUE);
+	hal_store_device_changed (device);
+	ret = TRUE;
+
+out:
+	hal_store_device_unlock (shard);
+	return ret;
+}
@@ -0,0 +1,989 @@
+/***************************************************************************
+ *
+ * libhal-sysfs.c : describe the machine from sysfs
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libhal-private.h"
+
+/*
+ * With the "sysfs" setting pointing at a sysfs tree, normally /sys,
+ * the store describes the machine instead of holding a fake computer.
+ * The scan looks at
+ *
+ *   class/dmi/id       the computer, system.*
+ *   bus/(*)/devices    pci.*, usb_device.* and usb.*, or just info.*
+ *   block              storage.* and volume.* for the partitions
+ *   class/net          net.*
+ *
+ * and makes udis and properties the way hald did.  Directories are
+ * scanned by a pool of "sysfs_threads" threads (one per CPU by
+ * default), each with a deque of directories to look at: a thread
+ * works from the back of its own deque, pushing any subdirectories it
+ * finds there, and takes from the front of another thread's deque
+ * when its own is empty.
+ *
+ * The result is written out as a fixture, see libhal-fixture.c, and
+ * read into the store from that.  The fixture is also saved in the
+ * "sysfs_cache" file, /tmp/libhal-sysfs.cache by default, under a
+ * first line naming the tree and the boot it was made in, so later
+ * processes of the same user only scan again after a reboot.  Setting
+ * "sysfs_cache" to nothing turns the cache off.
+ */
+
+#define HAL_SYSFS_CACHE_FILE      "/tmp/libhal-sysfs.cache"
+#define HAL_SYSFS_MAX_THREADS     16
+#define HAL_SYSFS_COMPUTER_UDI    "/org/freedesktop/Hal/devices/computer"
+#define HAL_SYSFS_UDI_PREFIX      "/org/freedesktop/Hal/devices/"
+
+typedef struct {
+	char *data;
+	size_t len;
+	size_t size;
+} HalSysfsBuffer;
+
+typedef struct {
+	char *udi;
+	char *sysfs_path;
+	HalSysfsBuffer properties;      /**< in fixture format */
+} HalSysfsDevice;
+
+typedef struct HalSysfsScan_s HalSysfsScan;
+typedef struct HalSysfsWorker_s HalSysfsWorker;
+
+typedef void (*HalSysfsTaskFunc) (HalSysfsWorker *worker, const char *path);
+
+typedef struct {
+	HalSysfsTaskFunc func;
+	char *path;
+} HalSysfsTask;
+
+struct HalSysfsWorker_s {
+	HalSysfsScan *scan;
+	pthread_mutex_t lock;
+	HalSysfsTask *tasks;            /**< [head, tail) are queued */
+	unsigned int head;
+	unsigned int tail;
+	unsigned int size;
+	HalSysfsDevice *devices;        /**< found by this worker */
+	unsigned int num_devices;
+	unsigned int max_devices;
+};
+
+struct HalSysfsScan_s {
+	const char *root;
+	HalSysfsWorker *workers;
+	unsigned int num_workers;
+	int pending;                    /**< tasks queued or running */
+};
+
+/*
+ * Text
+ */
+
+static void hal_sysfs_printf (HalSysfsBuffer *buffer, const char *format, ...) HAL_PRINTF (2, 3);
+
+static void
+hal_sysfs_printf (HalSysfsBuffer *buffer, const char *format, ...)
+{
+	va_list args;
+	char *data;
+	size_t size;
+	int n;
+
+	for (;;) {
+		va_start (args, format);
+		n = vsnprintf (buffer->data + buffer->len, buffer->size - buffer->len, format, args);
+		va_end (args);
+		if (n < 0)
+			return;
+		if (buffer->len + n < buffer->size) {
+			buffer->len += n;
+			return;
+		}
+		size = buffer->size * 2 > buffer->len + n + 1 ? buffer->size * 2 : buffer->len + n + 256;
+		data = realloc (buffer->data, size);
+		if (data == NULL)
+			return;
+		buffer->data = data;
+		buffer->size = size;
+	}
+}
+
+/* Read attribute @name of @dir, stripped, NULL if missing or empty */
+static char *
+hal_sysfs_read (const char *dir, const char *name, char *buf, size_t size)
+{
+	char path[PATH_MAX];
+	ssize_t n;
+	int fd;
+
+	snprintf (path, sizeof (path), "%s/%s", dir, name);
+	fd = open (path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	n = read (fd, buf, size - 1);
+	close (fd);
+	if (n <= 0)
+		return NULL;
+	buf[n] = '\0';
+
+	/* one line, nothing that would end a fixture value early */
+	for (; n > 0 && isspace ((unsigned char) buf[n - 1]); n--)
+		buf[n - 1] = '\0';
+	for (n--; n >= 0; n--) {
+		if (iscntrl ((unsigned char) buf[n]))
+			buf[n] = ' ';
+	}
+	return buf[0] != '\0' ? buf : NULL;
+}
+
+static int
+hal_sysfs_read_int (const char *dir, const char *name, int base, long *value)
+{
+	char buf[64];
+	char *end;
+
+	if (hal_sysfs_read (dir, name, buf, sizeof (buf)) == NULL)
+		return FALSE;
+	*value = strtol (buf, &end, base);
+	return end != buf;
+}
+
+static void
+hal_sysfs_string (HalSysfsBuffer *b, const char *key, const char *value)
+{
+	if (value != NULL)
+		hal_sysfs_printf (b, "  %s = '%s'  (string)\n", key, value);
+}
+
+static void
+hal_sysfs_int (HalSysfsBuffer *b, const char *key, long value)
+{
+	hal_sysfs_printf (b, "  %s = %d  (0x%x)  (int)\n", key, (int) value, (unsigned int) value);
+}
+
+static void
+hal_sysfs_uint64 (HalSysfsBuffer *b, const char *key, unsigned long long value)
+{
+	hal_sysfs_printf (b, "  %s = %llu  (0x%llx)  (uint64)\n", key, value, value);
+}
+
+static void
+hal_sysfs_bool (HalSysfsBuffer *b, const char *key, int value)
+{
+	hal_sysfs_printf (b, "  %s = %s  (bool)\n", key, value ? "true" : "false");
+}
+
+/* A string list of the NULL terminated arguments */
+static void
+hal_sysfs_strlist (HalSysfsBuffer *b, const char *key, ...)
+{
+	va_list args;
+	const char *item;
+	const char *sep = "";
+
+	hal_sysfs_printf (b, "  %s = {", key);
+	va_start (args, key);
+	while ((item = va_arg (args, const char *)) != NULL) {
+		hal_sysfs_printf (b, "%s'%s'", sep, item);
+		sep = ", ";
+	}
+	va_end (args);
+	hal_sysfs_printf (b, "} (string list)\n");
+}
+
+static void
+hal_sysfs_attr_string (HalSysfsBuffer *b, const char *key, const char *dir, const char *name)
+{
+	char buf[256];
+
+	hal_sysfs_string (b, key, hal_sysfs_read (dir, name, buf, sizeof (buf)));
+}
+
+static void
+hal_sysfs_attr_int (HalSysfsBuffer *b, const char *key, const char *dir, const char *name, int base)
+{
+	long value;
+
+	if (hal_sysfs_read_int (dir, name, base, &value))
+		hal_sysfs_int (b, key, value);
+}
+
+/* The udi hald would make from the printf arguments */
+static void hal_sysfs_udi (char *udi, size_t size, const char *format, ...) HAL_PRINTF (3, 4);
+
+static void
+hal_sysfs_udi (char *udi, size_t size, const char *format, ...)
+{
+	va_list args;
+	size_t prefix = strlen (HAL_SYSFS_UDI_PREFIX);
+	char *p;
+
+	snprintf (udi, size, "%s", HAL_SYSFS_UDI_PREFIX);
+	va_start (args, format);
+	vsnprintf (udi + prefix, size - prefix, format, args);
+	va_end (args);
+	for (p = udi + prefix; *p != '\0'; p++) {
+		if (!isalnum ((unsigned char) *p) && *p != '_' && *p != '/')
+			*p = '_';
+	}
+}
+
+static void
+hal_sysfs_common (HalSysfsBuffer *b, const char *dir, const char *subsystem, const char *parent)
+{
+	char path[PATH_MAX];
+	char link[PATH_MAX];
+	ssize_t n;
+
+	hal_sysfs_string (b, "info.subsystem", subsystem);
+	hal_sysfs_string (b, "info.parent", parent);
+	hal_sysfs_string (b, "linux.sysfs_path", realpath (dir, path) != NULL ? path : dir);
+
+	snprintf (path, sizeof (path), "%s/driver", dir);
+	n = readlink (path, link, sizeof (link) - 1);
+	if (n > 0) {
+		link[n] = '\0';
+		hal_sysfs_string (b, "info.linux.driver", strrchr (link, '/') ? strrchr (link, '/') + 1 : link);
+	}
+}
+
+/*
+ * The work-stealing pool
+ */
+
+static void
+hal_sysfs_push (HalSysfsWorker *worker, HalSysfsTaskFunc func, const char *dir, const char *name)
+{
+	HalSysfsTask *tasks;
+	char *path;
+	unsigned int size;
+
+	if (name != NULL) {
+		path = malloc (strlen (dir) + strlen (name) + 2);
+		if (path != NULL)
+			sprintf (path, "%s/%s", dir, name);
+	} else {
+		path = strdup (dir);
+	}
+	if (path == NULL)
+		return;
+
+	__atomic_add_fetch (&worker->scan->pending, 1, __ATOMIC_ACQ_REL);
+	pthread_mutex_lock (&worker->lock);
+	if (worker->tail == worker->size && worker->head > 0) {
+		memmove (worker->tasks, worker->tasks + worker->head,
+			 (worker->tail - worker->head) * sizeof (HalSysfsTask));
+		worker->tail -= worker->head;
+		worker->head = 0;
+	}
+	if (worker->tail == worker->size) {
+		size = worker->size ? worker->size * 2 : 64;
+		tasks = realloc (worker->tasks, size * sizeof (HalSysfsTask));
+		if (tasks == NULL) {
+			pthread_mutex_unlock (&worker->lock);
+			/* do it now rather than not at all */
+			func (worker, path);
+			free (path);
+			__atomic_sub_fetch (&worker->scan->pending, 1, __ATOMIC_ACQ_REL);
+			return;
+		}
+		worker->tasks = tasks;
+		worker->size = size;
+	}
+	worker->tasks[worker->tail].func = func;
+	worker->tasks[worker->tail].path = path;
+	worker->tail++;
+	pthread_mutex_unlock (&worker->lock);
+}
+
+/* Take a task from the back of our own deque, or the front of another's */
+static int
+hal_sysfs_take (HalSysfsWorker *worker, HalSysfsTask *task)
+{
+	HalSysfsScan *scan = worker->scan;
+	HalSysfsWorker *victim;
+	unsigned int i;
+	int found = FALSE;
+
+	pthread_mutex_lock (&worker->lock);
+	if (worker->tail > worker->head) {
+		*task = worker->tasks[--worker->tail];
+		found = TRUE;
+	}
+	pthread_mutex_unlock (&worker->lock);
+
+	for (i = 1; !found && i < scan->num_workers; i++) {
+		victim = &scan->workers[(worker - scan->workers + i) % scan->num_workers];
+		pthread_mutex_lock (&victim->lock);
+		if (victim->tail > victim->head) {
+			*task = victim->tasks[victim->head++];
+			found = TRUE;
+		}
+		pthread_mutex_unlock (&victim->lock);
+	}
+
+	return found;
+}
+
+static void *
+hal_sysfs_work (void *data)
+{
+	HalSysfsWorker *worker = data;
+	HalSysfsTask task;
+
+	for (;;) {
+		if (!hal_sysfs_take (worker, &task)) {
+			if (__atomic_load_n (&worker->scan->pending, __ATOMIC_ACQUIRE) == 0)
+				break;
+			sched_yield ();
+			continue;
+		}
+		task.func (worker, task.path);
+		free (task.path);
+		__atomic_sub_fetch (&worker->scan->pending, 1, __ATOMIC_ACQ_REL);
+	}
+	return NULL;
+}
+
+/* Push a task for each entry of @dir */
+static void
+hal_sysfs_push_entries (HalSysfsWorker *worker, HalSysfsTaskFunc func, const char *dir)
+{
+	struct dirent *entry;
+	DIR *d;
+
+	d = opendir (dir);
+	if (d == NULL)
+		return;
+	while ((entry = readdir (d)) != NULL) {
+		if (entry->d_name[0] != '.')
+			hal_sysfs_push (worker, func, dir, entry->d_name);
+	}
+	closedir (d);
+}
+
+static void
+hal_sysfs_add (HalSysfsWorker *worker, const char *udi, const char *dir, HalSysfsBuffer *properties)
+{
+	HalSysfsDevice *devices;
+	HalSysfsDevice *device;
+	unsigned int max;
+
+	if (worker->num_devices == worker->max_devices) {
+		max = worker->max_devices ? worker->max_devices * 2 : 64;
+		devices = realloc (worker->devices, max * sizeof (HalSysfsDevice));
+		if (devices == NULL)
+			goto fail;
+		worker->devices = devices;
+		worker->max_devices = max;
+	}
+	device = &worker->devices[worker->num_devices];
+	device->udi = strdup (udi);
+	device->sysfs_path = strdup (dir);
+	device->properties = *properties;
+	if (device->udi == NULL || device->sysfs_path == NULL) {
+		free (device->udi);
+		free (device->sysfs_path);
+		goto fail;
+	}
+	worker->num_devices++;
+	return;
+
+fail:
+	free (properties->data);
+}
+
+/*
+ * What to look at
+ */
+
+static const char *
+hal_sysfs_chassis_type (long type)
+{
+	static const char *const names[] = {
+		NULL, "Other", "Unknown", "Desktop", "Low Profile Desktop", "Pizza Box",
+		"Mini Tower", "Tower", "Portable", "Laptop", "Notebook", "Hand Held",
+		"Docking Station", "All In One", "Sub Notebook", "Space-saving",
+		"Lunch Box", "Main Server Chassis", "Expansion Chassis", "Sub Chassis",
+		"Bus Expansion Chassis", "Peripheral Chassis", "RAID Chassis",
+		"Rack Mount Chassis", "Sealed-case PC", "Multi-system", "CompactPCI",
+		"AdvancedTCA", "Blade", "Blade Enclosure", "Tablet", "Convertible",
+		"Detachable"
+	};
+
+	if (type > 0 && type < (long) (sizeof (names) / sizeof (names[0])))
+		return names[type];
+	return NULL;
+}
+
+static const char *
+hal_sysfs_formfactor (long type)
+{
+	switch (type) {
+	case 3: case 4: case 5: case 6: case 7: case 13: case 15: case 16: case 24:
+		return "desktop";
+	case 8: case 9: case 10: case 14: case 30: case 31: case 32:
+		return "laptop";
+	case 11:
+		return "handheld";
+	case 17: case 23: case 28: case 29:
+		return "server";
+	default:
+		return "unknown";
+	}
+}
+
+static void
+hal_sysfs_scan_dmi (HalSysfsWorker *worker, const char *dir)
+{
+	HalSysfsBuffer b = { NULL, 0, 0 };
+	long chassis = 2;
+
+	hal_sysfs_string (&b, "info.product", "Computer");
+	hal_sysfs_string (&b, "info.subsystem", "unknown");
+	hal_sysfs_attr_string (&b, "system.hardware.vendor", dir, "sys_vendor");
+	hal_sysfs_attr_string (&b, "system.hardware.product", dir, "product_name");
+	hal_sysfs_attr_string (&b, "system.hardware.version", dir, "product_version");
+	hal_sysfs_attr_string (&b, "system.hardware.serial", dir, "product_serial");
+	hal_sysfs_attr_string (&b, "system.hardware.uuid", dir, "product_uuid");
+	hal_sysfs_attr_string (&b, "system.firmware.vendor", dir, "bios_vendor");
+	hal_sysfs_attr_string (&b, "system.firmware.version", dir, "bios_version");
+	hal_sysfs_attr_string (&b, "system.firmware.release_date", dir, "bios_date");
+	hal_sysfs_attr_string (&b, "system.board.vendor", dir, "board_vendor");
+	hal_sysfs_attr_string (&b, "system.board.product", dir, "board_name");
+	hal_sysfs_attr_string (&b, "system.board.version", dir, "board_version");
+	hal_sysfs_attr_string (&b, "system.chassis.manufacturer", dir, "chassis_vendor");
+	if (hal_sysfs_read_int (dir, "chassis_type", 10, &chassis))
+		hal_sysfs_string (&b, "system.chassis.type", hal_sysfs_chassis_type (chassis));
+	hal_sysfs_string (&b, "system.formfactor", hal_sysfs_formfactor (chassis));
+
+	hal_sysfs_add (worker, HAL_SYSFS_COMPUTER_UDI, dir, &b);
+}
+
+static void
+hal_sysfs_scan_pci (HalSysfsWorker *worker, const char *dir)
+{
+	HalSysfsBuffer b = { NULL, 0, 0 };
+	char udi[256];
+	long vendor = 0;
+	long product = 0;
+	long class;
+
+	hal_sysfs_read_int (dir, "vendor", 16, &vendor);
+	hal_sysfs_read_int (dir, "device", 16, &product);
+	hal_sysfs_udi (udi, sizeof (udi), "pci_%lx_%lx", vendor, product);
+
+	hal_sysfs_common (&b, dir, "pci", HAL_SYSFS_COMPUTER_UDI);
+	hal_sysfs_int (&b, "pci.vendor_id", vendor);
+	hal_sysfs_int (&b, "pci.product_id", product);
+	hal_sysfs_attr_int (&b, "pci.subsys_vendor_id", dir, "subsystem_vendor", 16);
+	hal_sysfs_attr_int (&b, "pci.subsys_product_id", dir, "subsystem_device", 16);
+	if (hal_sysfs_read_int (dir, "class", 16, &class)) {
+		hal_sysfs_int (&b, "pci.device_class", (class >> 16) & 0xff);
+		hal_sysfs_int (&b, "pci.device_subclass", (class >> 8) & 0xff);
+		hal_sysfs_int (&b, "pci.device_protocol", class & 0xff);
+	}
+
+	hal_sysfs_add (worker, udi, dir, &b);
+}
+
+static void
+hal_sysfs_usb_device_udi (const char *dir, char *udi, size_t size)
+{
+	char serial[128];
+	long vendor = 0;
+	long product = 0;
+
+	hal_sysfs_read_int (dir, "idVendor", 16, &vendor);
+	hal_sysfs_read_int (dir, "idProduct", 16, &product);
+	if (hal_sysfs_read (dir, "serial", serial, sizeof (serial)) == NULL)
+		strcpy (serial, "noserial");
+	hal_sysfs_udi (udi, size, "usb_device_%lx_%lx_%s", vendor, product, serial);
+}
+
+static void
+hal_sysfs_scan_usb (HalSysfsWorker *worker, const char *dir)
+{
+	HalSysfsBuffer b = { NULL, 0, 0 };
+	char parent_dir[PATH_MAX];
+	char parent[256];
+	char udi[sizeof (parent) + 32];
+	char buf[64];
+	const char *name = strrchr (dir, '/') + 1;
+	long number = 0;
+	char *colon;
+
+	colon = strchr (name, ':');
+	if (colon == NULL) {
+		hal_sysfs_usb_device_udi (dir, udi, sizeof (udi));
+		hal_sysfs_common (&b, dir, "usb_device", HAL_SYSFS_COMPUTER_UDI);
+		hal_sysfs_attr_int (&b, "usb_device.vendor_id", dir, "idVendor", 16);
+		hal_sysfs_attr_int (&b, "usb_device.product_id", dir, "idProduct", 16);
+		hal_sysfs_attr_string (&b, "usb_device.vendor", dir, "manufacturer");
+		hal_sysfs_attr_string (&b, "usb_device.product", dir, "product");
+		hal_sysfs_attr_string (&b, "usb_device.serial", dir, "serial");
+		hal_sysfs_attr_int (&b, "usb_device.device_class", dir, "bDeviceClass", 16);
+		hal_sysfs_attr_int (&b, "usb_device.bus_number", dir, "busnum", 10);
+		hal_sysfs_attr_int (&b, "usb_device.linux.device_number", dir, "devnum", 10);
+		hal_sysfs_attr_string (&b, "info.vendor", dir, "manufacturer");
+		hal_sysfs_attr_string (&b, "info.product", dir, "product");
+		if (hal_sysfs_read (dir, "speed", buf, sizeof (buf)) != NULL)
+			hal_sysfs_printf (&b, "  usb_device.speed = %s (%s)  (double)\n", buf, buf);
+	} else {
+		/* an interface, "1-1:1.0", of the device in "1-1" */
+		snprintf (parent_dir, sizeof (parent_dir), "%.*s", (int) (colon - dir), dir);
+		hal_sysfs_usb_device_udi (parent_dir, parent, sizeof (parent));
+		hal_sysfs_read_int (dir, "bInterfaceNumber", 16, &number);
+		snprintf (udi, sizeof (udi), "%s_if%ld", parent, number);
+
+		hal_sysfs_common (&b, dir, "usb", parent);
+		hal_sysfs_int (&b, "usb.interface.number", number);
+		hal_sysfs_attr_int (&b, "usb.interface.class", dir, "bInterfaceClass", 16);
+		hal_sysfs_attr_int (&b, "usb.interface.subclass", dir, "bInterfaceSubClass", 16);
+		hal_sysfs_attr_int (&b, "usb.interface.protocol", dir, "bInterfaceProtocol", 16);
+		hal_sysfs_attr_int (&b, "usb.vendor_id", parent_dir, "idVendor", 16);
+		hal_sysfs_attr_int (&b, "usb.product_id", parent_dir, "idProduct", 16);
+	}
+
+	hal_sysfs_add (worker, udi, dir, &b);
+}
+
+static void
+hal_sysfs_scan_bus_device (HalSysfsWorker *worker, const char *dir)
+{
+	HalSysfsBuffer b = { NULL, 0, 0 };
+	char bus[NAME_MAX + 1];
+	char udi[256];
+	const char *name = strrchr (dir, '/') + 1;
+	const char *end = name - strlen ("/devices/");
+	const char *start = end;
+
+	/* dir is <root>/bus/<bus>/devices/<name> */
+	while (start > dir && start[-1] != '/')
+		start--;
+	snprintf (bus, sizeof (bus), "%.*s", (int) (end - start), start);
+
+	if (strcmp (bus, "pci") == 0) {
+		hal_sysfs_scan_pci (worker, dir);
+		return;
+	}
+	if (strcmp (bus, "usb") == 0) {
+		hal_sysfs_scan_usb (worker, dir);
+		return;
+	}
+
+	hal_sysfs_udi (udi, sizeof (udi), "%s_%s", bus, name);
+	hal_sysfs_common (&b, dir, bus, HAL_SYSFS_COMPUTER_UDI);
+	hal_sysfs_add (worker, udi, dir, &b);
+}
+
+static void
+hal_sysfs_scan_bus (HalSysfsWorker *worker, const char *dir)
+{
+	char devices[PATH_MAX];
+
+	snprintf (devices, sizeof (devices), "%s/devices", dir);
+	hal_sysfs_push_entries (worker, hal_sysfs_scan_bus_device, devices);
+}
+
+static void
+hal_sysfs_block_common (HalSysfsBuffer *b, const char *dir, const char *name)
+{
+	char buf[64];
+	char *colon;
+
+	hal_sysfs_printf (b, "  block.device = '/dev/%s'  (string)\n", name);
+	if (hal_sysfs_read (dir, "dev", buf, sizeof (buf)) != NULL && (colon = strchr (buf, ':')) != NULL) {
+		hal_sysfs_int (b, "block.major", atol (buf));
+		hal_sysfs_int (b, "block.minor", atol (colon + 1));
+	}
+}
+
+static void
+hal_sysfs_storage_udi (const char *dir, const char *name, char *udi, size_t size)
+{
+	char device[PATH_MAX];
+	char serial[128];
+
+	snprintf (device, sizeof (device), "%s/device", dir);
+	if (hal_sysfs_read (device, "serial", serial, sizeof (serial)) != NULL)
+		hal_sysfs_udi (udi, size, "storage_serial_%s", serial);
+	else
+		hal_sysfs_udi (udi, size, "storage_%s", name);
+}
+
+static void
+hal_sysfs_scan_partition (HalSysfsWorker *worker, const char *dir)
+{
+	HalSysfsBuffer b = { NULL, 0, 0 };
+	char disk[PATH_MAX];
+	char parent[256];
+	char udi[256];
+	const char *name = strrchr (dir, '/') + 1;
+	long number = 0;
+	long sectors = 0;
+
+	snprintf (disk, sizeof (disk), "%.*s", (int) (name - 1 - dir), dir);
+	hal_sysfs_storage_udi (disk, strrchr (disk, '/') + 1, parent, sizeof (parent));
+	hal_sysfs_read_int (dir, "partition", 10, &number);
+	hal_sysfs_read_int (dir, "size", 10, &sectors);
+	hal_sysfs_udi (udi, sizeof (udi), "volume_part%ld_size_%llu", number, sectors * 512ULL);
+
+	hal_sysfs_common (&b, dir, "block", parent);
+	hal_sysfs_string (&b, "info.category", "volume");
+	hal_sysfs_strlist (&b, "info.capabilities", "volume", "block", NULL);
+	hal_sysfs_block_common (&b, dir, name);
+	hal_sysfs_bool (&b, "block.is_volume", TRUE);
+	hal_sysfs_string (&b, "block.storage_device", parent);
+	hal_sysfs_int (&b, "volume.partition.number", number);
+	hal_sysfs_uint64 (&b, "volume.size", sectors * 512ULL);
+
+	hal_sysfs_add (worker, udi, dir, &b);
+}
+
+static void
+hal_sysfs_scan_disk (HalSysfsWorker *worker, const char *dir)
+{
+	HalSysfsBuffer b = { NULL, 0, 0 };
+	char device[PATH_MAX];
+	char path[PATH_MAX];
+	char model[256] = "";
+	char udi[256];
+	const char *name = strrchr (dir, '/') + 1;
+	const char *drive_type = "disk";
+	struct dirent *entry;
+	struct stat st;
+	long removable = 0;
+	long sectors = 0;
+	DIR *d;
+
+	snprintf (device, sizeof (device), "%s/device", dir);
+	hal_sysfs_storage_udi (dir, name, udi, sizeof (udi));
+	hal_sysfs_read_int (dir, "removable", 10, &removable);
+	hal_sysfs_read_int (dir, "size", 10, &sectors);
+	if (strncmp (name, "sr", 2) == 0)
+		drive_type = "cdrom";
+	else if (strncmp (name, "fd", 2) == 0)
+		drive_type = "floppy";
+
+	hal_sysfs_common (&b, dir, "block", HAL_SYSFS_COMPUTER_UDI);
+	hal_sysfs_string (&b, "info.category", "storage");
+	hal_sysfs_strlist (&b, "info.capabilities", "storage", "block", NULL);
+	hal_sysfs_string (&b, "info.product", hal_sysfs_read (device, "model", model, sizeof (model)));
+	hal_sysfs_block_common (&b, dir, name);
+	hal_sysfs_bool (&b, "block.is_volume", FALSE);
+	hal_sysfs_string (&b, "block.storage_device", udi);
+	hal_sysfs_string (&b, "storage.drive_type", drive_type);
+	hal_sysfs_bool (&b, "storage.removable", removable != 0);
+	hal_sysfs_uint64 (&b, "storage.size", sectors * 512ULL);
+	hal_sysfs_string (&b, "storage.model", model[0] != '\0' ? model : NULL);
+	hal_sysfs_attr_string (&b, "storage.vendor", device, "vendor");
+	hal_sysfs_attr_string (&b, "storage.serial", device, "serial");
+
+	hal_sysfs_add (worker, udi, dir, &b);
+
+	/* the partitions are the subdirectories with a partition number */
+	d = opendir (dir);
+	if (d == NULL)
+		return;
+	while ((entry = readdir (d)) != NULL) {
+		snprintf (path, sizeof (path), "%s/%s/partition", dir, entry->d_name);
+		if (entry->d_name[0] != '.' && stat (path, &st) == 0)
+			hal_sysfs_push (worker, hal_sysfs_scan_partition, dir, entry->d_name);
+	}
+	closedir (d);
+}
+
+static void
+hal_sysfs_scan_net (HalSysfsWorker *worker, const char *dir)
+{
+	HalSysfsBuffer b = { NULL, 0, 0 };
+	char path[PATH_MAX];
+	char address[64];
+	char udi[256];
+	const char *name = strrchr (dir, '/') + 1;
+	const char *category = "net";
+	unsigned long long mac = 0;
+	struct stat st;
+	long type = 0;
+	char *p;
+
+	hal_sysfs_read_int (dir, "type", 10, &type);
+	if (hal_sysfs_read (dir, "address", address, sizeof (address)) == NULL)
+		address[0] = '\0';
+	for (p = address; *p != '\0'; p++) {
+		if (isxdigit ((unsigned char) *p))
+			mac = (mac << 4) | (isdigit ((unsigned char) *p) ? *p - '0' : (tolower (*p) - 'a' + 10));
+	}
+	if (mac == 0)
+		hal_sysfs_udi (udi, sizeof (udi), "net_computer_loopback");
+	else
+		hal_sysfs_udi (udi, sizeof (udi), "net_%s", address);
+
+	if (type == 1) {
+		snprintf (path, sizeof (path), "%s/wireless", dir);
+		category = stat (path, &st) == 0 ? "net.80211" : "net.80203";
+	}
+
+	hal_sysfs_common (&b, dir, "net", HAL_SYSFS_COMPUTER_UDI);
+	hal_sysfs_string (&b, "info.category", category);
+	if (strcmp (category, "net") != 0)
+		hal_sysfs_strlist (&b, "info.capabilities", "net", category, NULL);
+	else
+		hal_sysfs_strlist (&b, "info.capabilities", "net", NULL);
+	hal_sysfs_string (&b, "net.interface", name);
+	hal_sysfs_string (&b, "net.address", address[0] != '\0' ? address : NULL);
+	hal_sysfs_attr_int (&b, "net.linux.ifindex", dir, "ifindex", 10);
+	hal_sysfs_int (&b, "net.arp_proto_hw_id", type);
+	if (strcmp (category, "net") != 0)
+		hal_sysfs_printf (&b, "  %s.mac_address = %llu  (0x%llx)  (uint64)\n", category, mac, mac);
+
+	hal_sysfs_add (worker, udi, dir, &b);
+}
+
+/*
+ * Putting it together
+ */
+
+static int
+hal_sysfs_compare (const void *a, const void *b)
+{
+	const HalSysfsDevice *da = a;
+	const HalSysfsDevice *db = b;
+	int cmp;
+
+	/* the computer first, then by udi and, for equal udis, by path */
+	cmp = (strcmp (db->udi, HAL_SYSFS_COMPUTER_UDI) == 0) - (strcmp (da->udi, HAL_SYSFS_COMPUTER_UDI) == 0);
+	if (cmp == 0)
+		cmp = strcmp (da->udi, db->udi);
+	if (cmp == 0)
+		cmp = strcmp (da->sysfs_path, db->sysfs_path);
+	return cmp;
+}
+
+/* Scan @root into @out, after @header */
+static void
+hal_sysfs_scan (const char *root, const char *header, HalSysfsBuffer *out)
+{
+	HalSysfsScan scan;
+	HalSysfsDevice *devices;
+	pthread_t *threads;
+	char path[PATH_MAX];
+	unsigned int num_devices = 0;
+	unsigned int num_threads;
+	unsigned int started;
+	unsigned int same = 0;
+	unsigned int i;
+	unsigned int j;
+	long n;
+
+	n = hal_config_get_int ("sysfs_threads", sysconf (_SC_NPROCESSORS_ONLN));
+	num_threads = n < 1 ? 1 : n > HAL_SYSFS_MAX_THREADS ? HAL_SYSFS_MAX_THREADS : n;
+
+	scan.root = root;
+	scan.pending = 0;
+	scan.num_workers = num_threads;
+	scan.workers = calloc (num_threads, sizeof (HalSysfsWorker));
+	threads = calloc (num_threads, sizeof (pthread_t));
+	if (scan.workers == NULL || threads == NULL) {
+		free (scan.workers);
+		free (threads);
+		return;
+	}
+	for (i = 0; i < num_threads; i++) {
+		scan.workers[i].scan = &scan;
+		pthread_mutex_init (&scan.workers[i].lock, NULL);
+	}
+
+	snprintf (path, sizeof (path), "%s/class/dmi/id", root);
+	hal_sysfs_push (&scan.workers[0], hal_sysfs_scan_dmi, path, NULL);
+	snprintf (path, sizeof (path), "%s/bus", root);
+	hal_sysfs_push_entries (&scan.workers[0], hal_sysfs_scan_bus, path);
+	snprintf (path, sizeof (path), "%s/block", root);
+	hal_sysfs_push_entries (&scan.workers[0], hal_sysfs_scan_disk, path);
+	snprintf (path, sizeof (path), "%s/class/net", root);
+	hal_sysfs_push_entries (&scan.workers[0], hal_sysfs_scan_net, path);
+
+	/* this thread is worker 0 */
+	for (started = 1; started < num_threads; started++) {
+		if (pthread_create (&threads[started], NULL, hal_sysfs_work, &scan.workers[started]) != 0)
+			break;
+	}
+	hal_sysfs_work (&scan.workers[0]);
+	for (i = 1; i < started; i++)
+		pthread_join (threads[i], NULL);
+
+	for (i = 0; i < num_threads; i++)
+		num_devices += scan.workers[i].num_devices;
+	devices = malloc ((num_devices + 1) * sizeof (HalSysfsDevice));
+	num_devices = 0;
+	for (i = 0; i < num_threads; i++) {
+		if (devices != NULL)
+			memcpy (devices + num_devices, scan.workers[i].devices,
+				scan.workers[i].num_devices * sizeof (HalSysfsDevice));
+		num_devices += scan.workers[i].num_devices;
+		free (scan.workers[i].devices);
+		free (scan.workers[i].tasks);
+		pthread_mutex_destroy (&scan.workers[i].lock);
+	}
+	free (scan.workers);
+	free (threads);
+	if (devices == NULL)
+		return;
+
+	qsort (devices, num_devices, sizeof (HalSysfsDevice), hal_sysfs_compare);
+	hal_sysfs_printf (out, "%s", header);
+	for (i = 0; i < num_devices; i++) {
+		/* like hald, identical devices after the first get _0, _1, ... */
+		if (i > 0 && strcmp (devices[i].udi, devices[i - 1].udi) == 0) {
+			hal_sysfs_printf (out, "\nudi = '%s_%u'\n", devices[i].udi, same++);
+		} else {
+			hal_sysfs_printf (out, "\nudi = '%s'\n", devices[i].udi);
+			same = 0;
+		}
+		if (devices[i].properties.data != NULL)
+			hal_sysfs_printf (out, "%s", devices[i].properties.data);
+	}
+	for (j = 0; j < num_devices; j++) {
+		free (devices[j].udi);
+		free (devices[j].sysfs_path);
+		free (devices[j].properties.data);
+	}
+	free (devices);
+}
+
+static int
+hal_sysfs_cache_load (const char *cache, const char *header, HalFixtureDeviceFunc device_func,
+		       HalFixturePropertyFunc property_func, void *data)
+{
+	struct stat st;
+	size_t len = strlen (header);
+	char *map;
+	int fd;
+
+	fd = open (cache, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return FALSE;
+	/* only trust a cache written by this user */
+	if (fstat (fd, &st) < 0 || st.st_uid != geteuid () || (size_t) st.st_size < len) {
+		close (fd);
+		return FALSE;
+	}
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED)
+		return FALSE;
+	if (memcmp (map, header, len) != 0) {
+		munmap (map, st.st_size);
+		return FALSE;
+	}
+
+	hal_fixture_parse (cache, map, st.st_size, device_func, property_func, data);
+	munmap (map, st.st_size);
+	return TRUE;
+}
+
+static void
+hal_sysfs_cache_write (const char *cache, const HalSysfsBuffer *text)
+{
+	char *tmp;
+	int fd;
+
+	tmp = malloc (strlen (cache) + 8);
+	if (tmp == NULL)
+		return;
+	sprintf (tmp, "%s.XXXXXX", cache);
+	fd = mkstemp (tmp);
+	if (fd < 0) {
+		free (tmp);
+		return;
+	}
+	if (write (fd, text->data, text->len) != (ssize_t) text->len ||
+	    close (fd) != 0 || rename (tmp, cache) != 0) {
+		fprintf (stderr, "%s %d : cannot write %s\n", __FILE__, __LINE__, cache);
+		unlink (tmp);
+	}
+	free (tmp);
+}
+
+/**
+ * hal_sysfs_load:
+ * @root: the sysfs tree, e.g. "/sys"
+ * @device_func: as for hal_fixture_parse()
+ * @property_func: as for hal_fixture_parse()
+ * @data: user data
+ *
+ * Describe the devices found in @root, from the cache if it was made
+ * in this boot.
+ *
+ * Returns: FALSE if @root is not a directory
+ */
+int
+hal_sysfs_load (const char *root, HalFixtureDeviceFunc device_func,
+		HalFixturePropertyFunc property_func, void *data)
+{
+	HalSysfsBuffer text = { NULL, 0, 0 };
+	const char *cache;
+	char header[PATH_MAX + 128];
+	char boot_id[64];
+	struct stat st;
+
+	if (stat (root, &st) != 0 || !S_ISDIR (st.st_mode)) {
+		fprintf (stderr, "%s %d : %s is not a sysfs tree\n", __FILE__, __LINE__, root);
+		return FALSE;
+	}
+
+	cache = hal_config_get ("sysfs_cache");
+	if (cache == NULL)
+		cache = HAL_SYSFS_CACHE_FILE;
+	if (hal_sysfs_read ("/proc/sys/kernel/random", "boot_id", boot_id, sizeof (boot_id)) == NULL)
+		cache = "";
+	snprintf (header, sizeof (header), "# libhal sysfs scan of %s, boot %s\n", root, boot_id);
+
+	if (*cache != '\0' && hal_sysfs_cache_load (cache, header, device_func, property_func, data))
+		return TRUE;
+
+	hal_sysfs_scan (root, header, &text);
+	if (text.data == NULL)
+		return FALSE;
+	if (*cache != '\0')
+		hal_sysfs_cache_write (cache, &text);
+	hal_fixture_parse (root, text.data, text.len, device_func, property_func, data);
+	free (text.data);
+
+	return TRUE;
+}
@@ -0,0 +1,533 @@
+/***************************************************************************
+ *
+ * libhal-trace.c : call tracing for the HAL convenience library
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "libhal-private.h"
+
+/*
+ * Tracing is configured when the library is loaded (see
+ * libhal-config.c):
+ *
+ * trace_mode selects where HAL_TRACE() records go:
+ *
+ *   text    timestamped lines in /tmp/libhal.log (default)
+ *   binary  per-thread rings in /dev/shm/libhal-trace.<pid>, see
+ *           libhal-trace.h; decode them with hal-trace-decode
+ *   off     nowhere
+ *
+ * A binary trace is removed when the process exits, unless trace_keep
+ * is set to yes, so that it can be decoded afterwards; it then stays
+ * until "hal-trace-decode -r" reaps it.  A process that is killed
+ * leaves its trace behind too.
+ *
+ * trace_level (none, context, modify, query or all, the default)
+ * selects entry points by the level in libhal-functions.h, and
+ * trace_functions narrows that down to a list of name patterns,
+ * e.g. "libhal_device_get_property_*, libhal_ctx_*".  A pattern
+ * prefixed with '-' removes functions instead.
+ *
+ * The result is folded into hal_trace_mask, which HAL_TRACE() tests
+ * before doing anything else.
+ */
+
+enum {
+	HAL_TRACE_MODE_OFF = 0,
+	HAL_TRACE_MODE_TEXT,
+	HAL_TRACE_MODE_BINARY
+};
+
+const HalFunctionInfo hal_functions[HAL_FN_LAST] = {
+#define HAL_FUNCTION(_name_, _args_, _level_) HAL_FUNCTION_INFO (_name_, _args_, _level_)
+#include "libhal-functions.h"
+#undef HAL_FUNCTION
+};
+
+uint64_t hal_trace_mask[HAL_TRACE_MASK_WORDS];
+
+static int hal_trace_mode = HAL_TRACE_MODE_OFF;
+static int hal_trace_keep = 0;
+static int hal_trace_level = HAL_TRACE_LEVEL_ALL;
+static uint64_t hal_trace_functions[HAL_TRACE_MASK_WORDS];
+
+/* hal_trace_lock serialises mask updates and creating the binary trace */
+static pthread_mutex_t hal_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t hal_trace_key;
+static HalTraceHeader *hal_trace_header = NULL;
+static size_t hal_trace_size = 0;
+static int hal_trace_failed = 0;
+static uint32_t *hal_trace_strtab = NULL;
+static char *hal_trace_blob = NULL;
+
+static __thread HalTraceRing *hal_trace_ring = NULL;
+static __thread HalTraceRecord *hal_trace_records = NULL;
+static __thread int hal_trace_exited = 0;       /**< ring released, see hal_trace_thread_exit() */
+
+/* Callers mostly pass the same few udi and key buffers over and over,
+ * so remember which id each buffer had last time.  The content still
+ * has to be compared since the buffer may have been reused. */
+#define HAL_TRACE_CACHE_SIZE 64
+
+typedef struct {
+	const char *str;
+	uint32_t id;
+} HalTraceCacheEntry;
+
+static __thread HalTraceCacheEntry hal_trace_cache[HAL_TRACE_CACHE_SIZE];
+
+static uint64_t
+hal_trace_clock (clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime (clock, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Called with hal_trace_lock held */
+static void
+hal_trace_map (void)
+{
+	HalTraceHeader template;
+	char name[64];
+	void *map;
+	int fd;
+
+	if (hal_trace_header != NULL || hal_trace_failed)
+		return;
+
+	memset (&template, 0, sizeof (template));
+	template.magic = HAL_TRACE_MAGIC;
+	template.version = HAL_TRACE_VERSION;
+	template.header_size = sizeof (HalTraceHeader);
+	template.pid = getpid ();
+	template.num_rings = HAL_TRACE_NUM_RINGS;
+	template.ring_size = HAL_TRACE_RING_SIZE;
+	template.strtab_slots = HAL_TRACE_STRTAB_SLOTS;
+	template.strtab_size = HAL_TRACE_STRTAB_SIZE;
+	hal_trace_size = hal_trace_total_size (&template);
+
+	/* a stale segment may be left over from an earlier process with our pid */
+	snprintf (name, sizeof (name), HAL_TRACE_SHM_PREFIX "%u", template.pid);
+	shm_unlink (name);
+	fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0)
+		goto fail;
+	if (ftruncate (fd, hal_trace_size) != 0) {
+		close (fd);
+		shm_unlink (name);
+		goto fail;
+	}
+	map = mmap (NULL, hal_trace_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED) {
+		shm_unlink (name);
+		goto fail;
+	}
+
+	hal_trace_header = map;
+	hal_trace_strtab = (uint32_t *) ((char *) map + hal_trace_strtab_offset (&template));
+	hal_trace_blob = (char *) (hal_trace_strtab + template.strtab_slots);
+
+	template.base_monotonic_ns = hal_trace_clock (CLOCK_MONOTONIC);
+	template.base_realtime_ns = hal_trace_clock (CLOCK_REALTIME);
+	/* publish the header last so readers never see a half-made one */
+	memcpy (map, &template, sizeof (template));
+	__atomic_store_n (&hal_trace_header->magic, HAL_TRACE_MAGIC, __ATOMIC_RELEASE);
+	return;
+
+fail:
+	fprintf (stderr, "%s %d : cannot create binary trace %s\n", __FILE__, __LINE__, name);
+	hal_trace_failed = 1;
+}
+
+static void __attribute__ ((destructor))
+hal_trace_unlink (void)
+{
+	char name[64];
+
+	/* the trace of a forked child is its own, and unmapped in the parent */
+	if (hal_trace_header == NULL || hal_trace_keep || hal_trace_header->pid != (uint32_t) getpid ())
+		return;
+	snprintf (name, sizeof (name), HAL_TRACE_SHM_PREFIX "%u", hal_trace_header->pid);
+	shm_unlink (name);
+}
+
+static void
+hal_trace_release_ring (HalTraceRing *ring)
+{
+	hal_trace_ring = NULL;
+	hal_trace_records = NULL;
+	__atomic_store_n (&ring->owner, 0, __ATOMIC_RELEASE);
+}
+
+/* Runs on the exiting thread.  Once its ring is up for grabs, a
+ * record it still makes, e.g. from the destructors of other thread
+ * keys, borrows a free ring for just that record. */
+static void
+hal_trace_thread_exit (void *data)
+{
+	hal_trace_exited = 1;
+	hal_trace_release_ring (data);
+}
+
+static HalTraceRing *
+hal_trace_claim_ring (void)
+{
+	HalTraceHeader *h;
+	HalTraceRing *ring;
+	uint32_t tid;
+	uint32_t unowned;
+	unsigned int i;
+
+	pthread_mutex_lock (&hal_trace_lock);
+	hal_trace_map ();
+	pthread_mutex_unlock (&hal_trace_lock);
+
+	h = hal_trace_header;
+	if (h == NULL)
+		return NULL;
+
+	tid = (uint32_t) syscall (SYS_gettid);
+	for (i = 0; i < h->num_rings; i++) {
+		ring = (HalTraceRing *) ((char *) h + hal_trace_ring_offset (h, i));
+		unowned = 0;
+		if (__atomic_compare_exchange_n (&ring->owner, &unowned, tid, 0,
+						 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			hal_trace_ring = ring;
+			hal_trace_records = (HalTraceRecord *) (ring + 1);
+			if (!hal_trace_exited)
+				pthread_setspecific (hal_trace_key, ring);
+			return ring;
+		}
+	}
+
+	/* more live threads than rings; this thread is not traced */
+	return NULL;
+}
+
+static uint32_t
+hal_trace_intern_slow (const char *str)
+{
+	HalTraceHeader *h = hal_trace_header;
+	uint32_t mask = h->strtab_slots - 1;
+	uint32_t hash = 2166136261u;
+	uint32_t id = 0;
+	uint32_t slot;
+	uint32_t used;
+	size_t len;
+	unsigned int i;
+
+	for (len = 0; str[len] != '\0'; len++)
+		hash = (hash ^ (unsigned char) str[len]) * 16777619u;
+
+	for (i = 0; i <= mask; i++) {
+		uint32_t *p = &hal_trace_strtab[(hash + i) & mask];
+
+		slot = __atomic_load_n (p, __ATOMIC_ACQUIRE);
+		if (slot == 0) {
+			if (id == 0) {
+				used = __atomic_load_n (&h->strtab_used, __ATOMIC_RELAXED);
+				if (used + len + 1 > h->strtab_size)
+					return HAL_TRACE_STR_DROPPED;
+				used = __atomic_fetch_add (&h->strtab_used, len + 1, __ATOMIC_RELAXED);
+				if (used + len + 1 > h->strtab_size)
+					return HAL_TRACE_STR_DROPPED;
+				memcpy (hal_trace_blob + used, str, len + 1);
+				id = used + 1;
+			}
+			if (__atomic_compare_exchange_n (p, &slot, id, 0,
+							 __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+				return id;
+			/* somebody else filled the slot first; slot now holds their id */
+		}
+		if (strcmp (hal_trace_blob + slot - 1, str) == 0)
+			return slot;
+	}
+
+	return HAL_TRACE_STR_DROPPED;
+}
+
+static uint32_t
+hal_trace_intern (const char *str)
+{
+	HalTraceCacheEntry *e;
+
+	if (str == NULL)
+		return HAL_TRACE_STR_NULL;
+
+	e = &hal_trace_cache[((uintptr_t) str >> 3) & (HAL_TRACE_CACHE_SIZE - 1)];
+	if (e->str == str && strcmp (hal_trace_blob + e->id - 1, str) == 0)
+		return e->id;
+
+	e->id = hal_trace_intern_slow (str);
+	e->str = e->id != HAL_TRACE_STR_DROPPED ? str : NULL;
+
+	return e->id;
+}
+
+static void
+hal_trace_record (HalFunctionId function, va_list ap)
+{
+	HalTraceRing *ring = hal_trace_ring;
+	HalTraceRecord *rec;
+	const char *kind;
+	uint64_t head;
+	int i;
+
+	if (HAL_UNLIKELY (ring == NULL)) {
+		ring = hal_trace_claim_ring ();
+		if (ring == NULL)
+			return;
+	}
+
+	head = ring->head;
+	rec = &hal_trace_records[head & (HAL_TRACE_RING_SIZE - 1)];
+	rec->timestamp_ns = hal_trace_clock (CLOCK_MONOTONIC);
+	rec->function = function;
+	rec->args[0] = 0;
+	rec->args[1] = 0;
+	for (kind = hal_functions[function].args, i = 0; *kind != '\0'; kind++, i++) {
+		if (*kind == 's')
+			rec->args[i] = hal_trace_intern (va_arg (ap, const char *));
+		else
+			rec->args[i] = (uintptr_t) va_arg (ap, void *);
+	}
+
+	__atomic_store_n (&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	if (HAL_UNLIKELY (hal_trace_exited))
+		hal_trace_release_ring (ring);
+}
+
+static void
+hal_trace_atfork_child (void)
+{
+	/* the child traces into a segment of its own */
+	if (hal_trace_header != NULL)
+		munmap (hal_trace_header, hal_trace_size);
+	hal_trace_header = NULL;
+	hal_trace_ring = NULL;
+	hal_trace_records = NULL;
+	memset (hal_trace_cache, 0, sizeof (hal_trace_cache));
+	pthread_mutex_init (&hal_trace_lock, NULL);
+}
+
+static int
+hal_trace_parse_level (const char *value)
+{
+	static const char *names[] = { "none", "context", "modify", "query", "all" };
+	char *end;
+	long n;
+	int i;
+
+	for (i = 0; i <= HAL_TRACE_LEVEL_ALL; i++) {
+		if (strcmp (value, names[i]) == 0)
+			return i;
+	}
+
+	n = strtol (value, &end, 10);
+	if (*value != '\0' && *end == '\0' && n >= HAL_TRACE_LEVEL_NONE && n <= HAL_TRACE_LEVEL_ALL)
+		return n;
+
+	return -1;
+}
+
+/* Parse a HAL_DUMMY_TRACE_FUNCTIONS style list into @mask */
+static int
+hal_trace_parse_functions (const char *spec, uint64_t *mask)
+{
+	char *copy;
+	char *token;
+	char *saveptr;
+	int exclude;
+	int matched;
+	int ret = TRUE;
+	int i;
+
+	memset (mask, 0, HAL_TRACE_MASK_WORDS * sizeof (uint64_t));
+
+	copy = strdup (spec);
+	if (copy == NULL)
+		return FALSE;
+
+	for (token = strtok_r (copy, ", \t", &saveptr); token != NULL;
+	     token = strtok_r (NULL, ", \t", &saveptr)) {
+		exclude = token[0] == '-';
+		if (exclude)
+			token++;
+		if (strcmp (token, "all") == 0)
+			token = "*";
+		else if (strcmp (token, "none") == 0)
+			continue;
+
+		matched = FALSE;
+		for (i = 0; i < HAL_FN_LAST; i++) {
+			if (fnmatch (token, hal_functions[i].name, 0) != 0)
+				continue;
+			if (exclude)
+				mask[i / 64] &= ~(1ULL << (i % 64));
+			else
+				mask[i / 64] |= 1ULL << (i % 64);
+			matched = TRUE;
+		}
+		if (!matched) {
+			fprintf (stderr, "%s %d : '%s' matches no libhal function\n",
+				 __FILE__, __LINE__, token);
+			ret = FALSE;
+		}
+	}
+
+	free (copy);
+	return ret;
+}
+
+/* Called with hal_trace_lock held */
+static void
+hal_trace_update_mask (void)
+{
+	uint64_t word;
+	int w;
+	int i;
+
+	for (w = 0; w < HAL_TRACE_MASK_WORDS; w++) {
+		word = 0;
+		if (hal_trace_mode != HAL_TRACE_MODE_OFF) {
+			for (i = w * 64; i < HAL_FN_LAST && i < (w + 1) * 64; i++) {
+				if (hal_functions[i].level <= hal_trace_level)
+					word |= 1ULL << (i % 64);
+			}
+			word &= hal_trace_functions[w];
+		}
+		__atomic_store_n (&hal_trace_mask[w], word, __ATOMIC_RELAXED);
+	}
+}
+
+static void __attribute__ ((constructor))
+hal_trace_configure (void)
+{
+	const char *value;
+
+	value = hal_config_get ("trace_mode");
+	if (value == NULL || strcmp (value, "text") == 0) {
+		hal_trace_mode = HAL_TRACE_MODE_TEXT;
+	} else if (strcmp (value, "binary") == 0) {
+		hal_trace_mode = HAL_TRACE_MODE_BINARY;
+	} else if (strcmp (value, "off") == 0) {
+		hal_trace_mode = HAL_TRACE_MODE_OFF;
+	} else {
+		fprintf (stderr, "%s %d : unknown trace_mode '%s', using text\n",
+			 __FILE__, __LINE__, value);
+		hal_trace_mode = HAL_TRACE_MODE_TEXT;
+	}
+
+	value = hal_config_get ("trace_level");
+	if (value != NULL) {
+		hal_trace_level = hal_trace_parse_level (value);
+		if (hal_trace_level < 0) {
+			fprintf (stderr, "%s %d : unknown trace_level '%s', using all\n",
+				 __FILE__, __LINE__, value);
+			hal_trace_level = HAL_TRACE_LEVEL_ALL;
+		}
+	}
+
+	value = hal_config_get ("trace_functions");
+	if (value == NULL || !hal_trace_parse_functions (value, hal_trace_functions))
+		memset (hal_trace_functions, 0xff, sizeof (hal_trace_functions));
+
+	value = hal_config_get ("trace_keep");
+	hal_trace_keep = value != NULL && (strcmp (value, "yes") == 0 || strcmp (value, "on") == 0 ||
+					   strcmp (value, "1") == 0);
+
+	if (hal_trace_mode == HAL_TRACE_MODE_BINARY) {
+		pthread_key_create (&hal_trace_key, hal_trace_thread_exit);
+		pthread_atfork (NULL, NULL, hal_trace_atfork_child);
+	}
+
+	hal_trace_update_mask ();
+}
+
+/**
+ * hal_trace_set_functions:
+ * @spec: list of function name patterns
+ *
+ * Replace the set of traced entry points; see
+ * libhal_dummy_set_trace_mask().
+ *
+ * Returns: FALSE, leaving the set unchanged, if @spec is invalid
+ */
+int
+hal_trace_set_functions (const char *spec)
+{
+	uint64_t mask[HAL_TRACE_MASK_WORDS];
+
+	if (!hal_trace_parse_functions (spec, mask))
+		return FALSE;
+
+	pthread_mutex_lock (&hal_trace_lock);
+	memcpy (hal_trace_functions, mask, sizeof (mask));
+	hal_trace_update_mask ();
+	pthread_mutex_unlock (&hal_trace_lock);
+
+	return TRUE;
+}
+
+/**
+ * hal_trace:
+ * @function: the entry point being called
+ *
+ * Record a call to @function, followed by the arguments described by
+ * its libhal-functions.h entry.  Call sites go through HAL_TRACE(),
+ * which skips this entirely for functions that are not traced.
+ */
+void
+hal_trace (HalFunctionId function, ...)
+{
+	va_list ap;
+
+	va_start (ap, function);
+	switch (hal_trace_mode) {
+	case HAL_TRACE_MODE_TEXT:
+		hal_loggerv (hal_functions[function].format, ap);
+		break;
+	case HAL_TRACE_MODE_BINARY:
+		hal_trace_record (function, ap);
+		break;
+	default:
+		break;
+	}
+	va_end (ap);
+}
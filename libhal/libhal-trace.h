@@ -0,0 +1,151 @@
+/***************************************************************************
+ *
+ * libhal-trace.h : layout of the binary libhal call trace
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ **************************************************************************/
+
+#ifndef LIBHAL_TRACE_H
+#define LIBHAL_TRACE_H
+
+#include <stdint.h>
+
+/*
+ * A binary trace is a POSIX shared memory object named
+ * /libhal-trace.<pid> (i.e. /dev/shm/libhal-trace.<pid>), created
+ * with mode 0600 as the calls it records name udis and keys, and
+ * laid out as
+ *
+ *   HalTraceHeader
+ *   HalTraceRing     x num_rings, each followed by ring_size records
+ *   uint32_t         x strtab_slots   (string hash table)
+ *   char             x strtab_size    (string blob)
+ *
+ * Every thread that traces owns one ring and is its only writer, so
+ * a record is stored and then published by advancing the ring head.
+ * Strings (udis, keys) are interned into the string table once and
+ * records carry their id, which is the blob offset plus one.
+ *
+ * The segment is some 17M.  The process unlinks it when it exits
+ * unless the trace_keep setting is on; kept segments, and those of
+ * processes that were killed, stay until "hal-trace-decode -r" removes
+ * the ones whose process is gone.
+ */
+
+#define HAL_TRACE_MAGIC          0x54424c48      /* "HLBT" */
+#define HAL_TRACE_VERSION        1
+
+#define HAL_TRACE_SHM_PREFIX     "/libhal-trace."
+#define HAL_TRACE_NUM_RINGS      64
+#define HAL_TRACE_RING_SIZE      8192            /* records, power of two */
+#define HAL_TRACE_STRTAB_SLOTS   16384           /* power of two */
+#define HAL_TRACE_STRTAB_SIZE    (1024 * 1024)
+
+/* string ids with a special meaning */
+#define HAL_TRACE_STR_NULL       0
+#define HAL_TRACE_STR_DROPPED    0xffffffffu     /* string table was full */
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t pid;
+	uint32_t num_rings;
+	uint32_t ring_size;
+	uint32_t strtab_slots;
+	uint32_t strtab_size;
+	uint64_t base_monotonic_ns;     /**< CLOCK_MONOTONIC at creation */
+	uint64_t base_realtime_ns;      /**< CLOCK_REALTIME at creation */
+	uint32_t strtab_used;           /**< bytes of blob in use */
+	uint32_t reserved[7];
+} HalTraceHeader;
+
+typedef struct {
+	uint64_t head;                  /**< number of records ever written */
+	uint32_t owner;                 /**< tid of the owning thread, 0 if free */
+	uint32_t reserved[13];          /* pad to a cache line */
+} HalTraceRing;
+
+typedef struct {
+	uint64_t timestamp_ns;          /**< CLOCK_MONOTONIC */
+	uint16_t function;              /**< position in libhal-functions.h */
+	uint16_t reserved;
+	uint32_t reserved2;
+	uint64_t args[2];               /**< pointer values or string ids */
+} HalTraceRecord;
+
+/* function ids */
+typedef enum {
+#define HAL_FUNCTION(_name_, _args_, _level_) HAL_FN_##_name_,
+#include "libhal-functions.h"
+#undef HAL_FUNCTION
+	HAL_FN_LAST
+} HalFunctionId;
+
+/* what each HAL_FUNCTION() args kind expands to in the text log and
+ * how the arguments are stored in a HalTraceRecord */
+#define HAL_ARGS_FORMAT_NONE     ""
+#define HAL_ARGS_FORMAT_P        " %p"
+#define HAL_ARGS_FORMAT_PP       " %p %p"
+#define HAL_ARGS_FORMAT_PS       " %p %s"
+#define HAL_ARGS_FORMAT_SS       " %s %s"
+
+#define HAL_ARGS_KINDS_NONE      ""
+#define HAL_ARGS_KINDS_P         "p"
+#define HAL_ARGS_KINDS_PP        "pp"
+#define HAL_ARGS_KINDS_PS        "ps"
+#define HAL_ARGS_KINDS_SS        "ss"
+
+/* trace levels, see libhal-functions.h */
+enum {
+	HAL_TRACE_LEVEL_NONE = 0,
+	HAL_TRACE_LEVEL_CONTEXT,
+	HAL_TRACE_LEVEL_MODIFY,
+	HAL_TRACE_LEVEL_QUERY,
+	HAL_TRACE_LEVEL_ALL
+};
+
+typedef struct {
+	const char *name;
+	const char *format;             /**< text log format, name included */
+	const char *args;               /**< one 'p' or 's' per argument */
+	int level;                      /**< HAL_TRACE_LEVEL_* */
+} HalFunctionInfo;
+
+#define HAL_FUNCTION_INFO(_name_, _args_, _level_) \
+	{ #_name_, #_name_ HAL_ARGS_FORMAT_##_args_, HAL_ARGS_KINDS_##_args_, HAL_TRACE_LEVEL_##_level_ },
+
+static inline size_t
+hal_trace_ring_offset (const HalTraceHeader *h, unsigned int ring)
+{
+	return h->header_size +
+		(size_t) ring * (sizeof (HalTraceRing) + (size_t) h->ring_size * sizeof (HalTraceRecord));
+}
+
+static inline size_t
+hal_trace_strtab_offset (const HalTraceHeader *h)
+{
+	return hal_trace_ring_offset (h, h->num_rings);
+}
+
+static inline size_t
+hal_trace_total_size (const HalTraceHeader *h)
+{
+	return hal_trace_strtab_offset (h) + (size_t) h->strtab_slots * sizeof (uint32_t) + h->strtab_size;
+}
+
+#endif /* LIBHAL_TRACE_H */
@@ -29,6 +29,7 @@
 #include <dbus/dbus.h>
 
 #include "libhal.h"
+#include "libhal-private.h"
 
 #ifdef ENABLE_NLS
 # include <libintl.h>
@@ -49,28 +50,18 @@
 # define N_(String) (String)
 #endif
 
-#include <sys/time.h>
-#include <stdarg.h>
-
-
-static void hal_logger(char *fmt, ...)
-{
-  struct timeval tv;
-  FILE *fp;
-  va_list ap;
-
-  fp = fopen ("/tmp/libhal.log", "a");
-  if (fp)
-  {
-    gettimeofday(&tv, NULL);
-    fprintf(fp, "%ld.%06ld ", tv.tv_sec, tv.tv_usec);
-    va_start(ap, fmt);
-    vfprintf(fp, fmt, ap);
-    va_end(ap);
-    fprintf(fp, "\n");
-    fclose(fp);
-  }
-}
+/* As in libhal.h, but counting the call as failed */
+#undef LIBHAL_CHECK_LIBHALCONTEXT
+#define LIBHAL_CHECK_LIBHALCONTEXT(_ctx_, _ret_)				\
+	do {									\
+		if (_ctx_ == NULL) {						\
+			fprintf (stderr,					\
+				 "%s %d : LibHalContext *ctx is NULL\n", 	\
+				 __FILE__, __LINE__);				\
+			HAL_CALL_FAILED ();					\
+			return _ret_;						\
+		}								\
+	} while(0)
 
 /**
  * LIBHAL_CHECK_PARAM_VALID:
@@ -86,6 +77,7 @@ static void hal_logger(char *fmt, ...)
 			fprintf (stderr,					\
 				 "%s %d : invalid paramater. %s is NULL.\n",  	\
 				 __FILE__, __LINE__, _name_);	 		\
+			HAL_CALL_FAILED ();					\
 			return _ret_;						\
 		}								\
 	} while(0)
@@ -101,8 +93,9 @@ static void hal_logger(char *fmt, ...)
 	do {										\
 		if (_udi_ == NULL) {							\
 			fprintf (stderr,						\
-				 "%s %d : invalid udi %s. udi is NULL.\n",  		\
-				 __FILE__, __LINE__, _udi_);	 			\
+				 "%s %d : invalid udi. udi is NULL.\n",  		\
+				 __FILE__, __LINE__);	 				\
+			HAL_CALL_FAILED ();						\
 			return _ret_;							\
 		} else {								\
 			if(strncmp(_udi_, "/org/freedesktop/Hal/devices/", 29) != 0) {	\
@@ -110,6 +103,7 @@ static void hal_logger(char *fmt, ...)
                                  	 "%s %d : invalid udi: %s doesn't start"	\
 					 "with '/org/freedesktop/Hal/devices/'. \n",    \
 	                                 __FILE__, __LINE__, _udi_);			\
+				HAL_CALL_FAILED ();					\
 				return _ret_;						\
 			}								\
 		}									\
@@ -125,8 +119,8 @@ static void hal_logger(char *fmt, ...)
 void
 libhal_free_string_array (char **str_array)
 {
-hal_logger("%s", __func__);
-	if (str_array != NULL) {
+HAL_TRACE (libhal_free_string_array);
+	if (str_array != NULL && !hal_snapshot_free_udis (str_array)) {
 		int i;
 
 		for (i = 0; str_array[i] != NULL; i++) {
@@ -148,7 +142,7 @@ hal_logger("%s", __func__);
 void
 libhal_free_string (char *str)
 {
-hal_logger("%s %p %s", __func__, str, str);
+HAL_TRACE (libhal_free_string, str, str);
 
 	if (str != NULL) {
 		free (str);
@@ -157,16 +151,6 @@ hal_logger("%s %p %s", __func__, str, str);
 }
 
 
-/**
- * LibHalPropertySet:
- *
- * Represents a set of properties. Opaque; use the
- * libhal_property_set_*() family of functions to access it.
- */
-struct LibHalPropertySet_s {
-	LibHalProperty *properties;
-};
-
 /**
  * LibHalProperty:
  *
@@ -187,6 +171,25 @@ struct LibHalProperty_s {
 	} v;
 };
 
+/**
+ * LibHalPropertySet:
+ *
+ * Represents a set of properties. Opaque; use the
+ * libhal_property_set_*() family of functions to access it.
+ *
+ * A set is a single block: the properties, sorted by key so they can
+ * be found by a binary search, then the arrays of the string lists,
+ * then the strings, all pointing into the block.  The keys are
+ * interned, see libhal-intern.c.  The sets
+ * of libhal_get_all_devices_with_properties() are all in a snapshot,
+ * see libhal-snapshot.c.
+ */
+struct LibHalPropertySet_s {
+	HalSnapshot *snapshot;		/**< Holding the set, or NULL if it has a block of its own */
+	unsigned int num_properties;
+	LibHalProperty properties[];	/**< Sorted by key */
+};
+
 /**
  * LibHalContext:
  *
@@ -251,7 +254,7 @@ struct LibHalContext_s {
 dbus_bool_t
 libhal_ctx_set_user_data(LibHalContext *ctx, void *user_data)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_ctx_set_user_data);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	ctx->user_data = user_data;
 	return TRUE;
@@ -268,12 +271,268 @@ hal_logger("%s", __func__);
 void*
 libhal_ctx_get_user_data(LibHalContext *ctx)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_ctx_get_user_data);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, NULL);
 	return ctx->user_data;
 }
 
 
+/**
+ * hal_property_set_builder_init:
+ * @builder: the builder
+ *
+ * Start measuring a property set.  The properties are given twice to
+ * hal_property_set_builder_add(): once to measure the set, and once
+ * after hal_property_set_builder_alloc() to copy them into it.
+ */
+void
+hal_property_set_builder_init (HalPropertySetBuilder *builder)
+{
+	memset (builder, 0, sizeof (HalPropertySetBuilder));
+}
+
+/* Copy @s into the set, or count it while measuring; NULL if it does not fit */
+static char *
+hal_property_set_builder_string (HalPropertySetBuilder *builder, const char *s)
+{
+	size_t len = strlen (s) + 1;
+	char *copy;
+
+	if (builder->set == NULL) {
+		builder->num_chars += len;
+		return NULL;
+	}
+	if (len > (size_t) (builder->chars_end - builder->chars))
+		return NULL;
+	copy = builder->chars;
+	memcpy (copy, s, len);
+	builder->chars += len;
+	return copy;
+}
+
+/**
+ * hal_property_set_builder_add:
+ * @builder: the builder, a #HalPropertySetBuilder
+ * @key: the property
+ * @type: the LIBHAL_PROPERTY_TYPE_* of @value
+ * @value: the value, copied into the set
+ *
+ * A #HalFixturePropertyFunc, so devices of the image can be walked
+ * with hal_image_foreach_property().
+ *
+ * Returns: FALSE if there are more properties or strings than were
+ * measured, which may happen if they changed in between, or out of
+ * memory
+ */
+int
+hal_property_set_builder_add (void *builder, const char *key, int type, const HalValue *value)
+{
+	HalPropertySetBuilder *b = builder;
+	LibHalProperty *p;
+	unsigned int i;
+
+	if (b->set == NULL) {
+		b->num_properties++;
+		if (type == LIBHAL_PROPERTY_TYPE_STRING) {
+			hal_property_set_builder_string (b, value->str_value);
+		} else if (type == LIBHAL_PROPERTY_TYPE_STRLIST) {
+			for (i = 0; value->strlist_value[i] != NULL; i++)
+				hal_property_set_builder_string (b, value->strlist_value[i]);
+			b->num_pointers += i + 1;
+		}
+		return TRUE;
+	}
+
+	if (b->set->num_properties == b->num_properties)
+		return FALSE;
+	p = &b->set->properties[b->set->num_properties];
+	p->key = (char *) hal_intern (key);
+	if (p->key == NULL)
+		return FALSE;
+	p->type = type;
+	b->set->num_properties++;
+	switch (type) {
+	case LIBHAL_PROPERTY_TYPE_STRING:
+		p->v.str_value = hal_property_set_builder_string (b, value->str_value);
+		if (p->v.str_value == NULL)
+			return FALSE;
+		break;
+	case LIBHAL_PROPERTY_TYPE_INT32:
+		p->v.int_value = value->int_value;
+		break;
+	case LIBHAL_PROPERTY_TYPE_UINT64:
+		p->v.uint64_value = value->uint64_value;
+		break;
+	case LIBHAL_PROPERTY_TYPE_DOUBLE:
+		p->v.double_value = value->double_value;
+		break;
+	case LIBHAL_PROPERTY_TYPE_BOOLEAN:
+		p->v.bool_value = value->bool_value;
+		break;
+	case LIBHAL_PROPERTY_TYPE_STRLIST:
+		for (i = 0; value->strlist_value[i] != NULL; i++)
+			;
+		if (i + 1 > (size_t) (b->pointers_end - b->pointers))
+			return FALSE;
+		p->v.strlist_value = b->pointers;
+		for (i = 0; value->strlist_value[i] != NULL; i++) {
+			*b->pointers = hal_property_set_builder_string (b, value->strlist_value[i]);
+			if (*b->pointers++ == NULL)
+				return FALSE;
+		}
+		*b->pointers++ = NULL;
+		break;
+	default:
+		break;
+	}
+	return TRUE;
+}
+
+/**
+ * hal_property_set_builder_get_size:
+ * @builder: the builder, once all properties have been measured
+ *
+ * Returns: the bytes the set needs
+ */
+size_t
+hal_property_set_builder_get_size (const HalPropertySetBuilder *builder)
+{
+	return sizeof (LibHalPropertySet) +
+		builder->num_properties * sizeof (LibHalProperty) +
+		builder->num_pointers * sizeof (char *) +
+		builder->num_chars;
+}
+
+/**
+ * hal_property_set_builder_place:
+ * @builder: the builder, once all properties have been measured
+ * @block: hal_property_set_builder_get_size() bytes for the set,
+ * aligned for any property value
+ * @snapshot: the snapshot @block is part of, or NULL if it was
+ * allocated with malloc()
+ *
+ * Make the set in @block, ready to be filled.
+ */
+void
+hal_property_set_builder_place (HalPropertySetBuilder *builder, void *block, HalSnapshot *snapshot)
+{
+	LibHalPropertySet *set = block;
+
+	set->snapshot = snapshot;
+	set->num_properties = 0;
+
+	builder->set = set;
+	builder->pointers = (char **) &set->properties[builder->num_properties];
+	builder->pointers_end = builder->pointers + builder->num_pointers;
+	builder->chars = (char *) builder->pointers_end;
+	builder->chars_end = builder->chars + builder->num_chars;
+}
+
+/**
+ * hal_property_set_builder_alloc:
+ * @builder: the builder, once all properties have been measured
+ *
+ * Allocate the set in one block, ready to be filled.  If filling it
+ * fails, free builder->set with free().
+ *
+ * Returns: FALSE if out of memory
+ */
+int
+hal_property_set_builder_alloc (HalPropertySetBuilder *builder)
+{
+	void *block;
+
+	block = malloc (hal_property_set_builder_get_size (builder));
+	if (block == NULL)
+		return FALSE;
+	hal_property_set_builder_place (builder, block, NULL);
+	return TRUE;
+}
+
+static int
+hal_property_compare (const void *a, const void *b)
+{
+	return strcmp (((const LibHalProperty *) a)->key, ((const LibHalProperty *) b)->key);
+}
+
+/**
+ * hal_property_set_builder_finish:
+ * @builder: the builder, once all properties have been copied
+ *
+ * Returns: the set, sorted by key
+ */
+LibHalPropertySet *
+hal_property_set_builder_finish (HalPropertySetBuilder *builder)
+{
+	qsort (builder->set->properties, builder->set->num_properties,
+	       sizeof (LibHalProperty), hal_property_compare);
+	return builder->set;
+}
+
+/* The property @key of @set, by a binary search, or NULL */
+static const LibHalProperty *
+hal_property_set_find (const LibHalPropertySet *set, const char *key)
+{
+	unsigned int lo = 0;
+	unsigned int hi = set->num_properties;
+	unsigned int mid;
+	int cmp;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = strcmp (set->properties[mid].key, key);
+		if (cmp == 0)
+			return &set->properties[mid];
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+/**
+ * hal_property_set_lookup:
+ * @set: the set
+ * @key: the property
+ * @value: where to store the value, pointing into @set
+ *
+ * Returns: the LIBHAL_PROPERTY_TYPE_* of the property, or
+ * LIBHAL_PROPERTY_TYPE_INVALID if it is not in @set
+ */
+int
+hal_property_set_lookup (const LibHalPropertySet *set, const char *key, HalValue *value)
+{
+	const LibHalProperty *p;
+
+	p = hal_property_set_find (set, key);
+	if (p == NULL)
+		return LIBHAL_PROPERTY_TYPE_INVALID;
+
+	switch (p->type) {
+	case LIBHAL_PROPERTY_TYPE_STRING:
+		value->str_value = p->v.str_value;
+		break;
+	case LIBHAL_PROPERTY_TYPE_INT32:
+		value->int_value = p->v.int_value;
+		break;
+	case LIBHAL_PROPERTY_TYPE_UINT64:
+		value->uint64_value = p->v.uint64_value;
+		break;
+	case LIBHAL_PROPERTY_TYPE_DOUBLE:
+		value->double_value = p->v.double_value;
+		break;
+	case LIBHAL_PROPERTY_TYPE_BOOLEAN:
+		value->bool_value = p->v.bool_value;
+		break;
+	case LIBHAL_PROPERTY_TYPE_STRLIST:
+		value->strlist_value = p->v.strlist_value;
+		break;
+	default:
+		break;
+	}
+	return p->type;
+}
 
 /**
  * libhal_device_get_all_properties:
@@ -288,11 +547,11 @@ hal_logger("%s", __func__);
 LibHalPropertySet *
 libhal_device_get_all_properties (LibHalContext *ctx, const char *udi, DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_get_all_properties);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, NULL);
 	LIBHAL_CHECK_UDI_VALID(udi, NULL);
 
-	return NULL;
+	return hal_store_get_all_properties (udi);
 }
 
 
@@ -300,12 +559,13 @@ hal_logger("%s", __func__);
  * libhal_property_set_sort:
  * @set: property-set to sort
  *
- * Sort all properties according to property name.
+ * Sort all properties according to property name.  Sets are sorted
+ * when they are made, so there is nothing left to do.
  */
 void 
 libhal_property_set_sort (LibHalPropertySet *set)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_property_set_sort);
 }
 
 /**
@@ -317,7 +577,14 @@ hal_logger("%s", __func__);
 void
 libhal_free_property_set (LibHalPropertySet * set)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_free_property_set);
+	if (set == NULL)
+		return;
+
+	if (set->snapshot != NULL)
+		hal_snapshot_unref (set->snapshot);
+	else
+		free (set);
 }
 
 /**
@@ -331,8 +598,10 @@ hal_logger("%s", __func__);
 unsigned int 
 libhal_property_set_get_num_elems (LibHalPropertySet *set)
 {
-hal_logger("%s", __func__);
-	return 0;
+HAL_TRACE (libhal_property_set_get_num_elems);
+	if (set == NULL)
+		return 0;
+	return set->num_properties;
 }
 
 /**
@@ -348,11 +617,16 @@ hal_logger("%s", __func__);
 LibHalPropertyType
 libhal_ps_get_type (const LibHalPropertySet *set, const char *key)
 {
-hal_logger("%s", __func__);
+	const LibHalProperty *p;
+
+HAL_TRACE (libhal_ps_get_type);
 	LIBHAL_CHECK_PARAM_VALID(set, "*set", LIBHAL_PROPERTY_TYPE_INVALID);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", LIBHAL_PROPERTY_TYPE_INVALID);
 
-	return LIBHAL_PROPERTY_TYPE_INVALID;
+	p = hal_property_set_find (set, key);
+	if (p == NULL)
+		return LIBHAL_PROPERTY_TYPE_INVALID;
+	return p->type;
 }
 
 /**
@@ -369,11 +643,16 @@ hal_logger("%s", __func__);
 const char *
 libhal_ps_get_string  (const LibHalPropertySet *set, const char *key)
 {
-hal_logger("%s", __func__);
+	const LibHalProperty *p;
+
+HAL_TRACE (libhal_ps_get_string);
 	LIBHAL_CHECK_PARAM_VALID(set, "*set", NULL);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", NULL);
 
-	return NULL;
+	p = hal_property_set_find (set, key);
+	if (p == NULL || p->type != LIBHAL_PROPERTY_TYPE_STRING)
+		return NULL;
+	return p->v.str_value;
 }
 
 /**
@@ -388,11 +667,16 @@ hal_logger("%s", __func__);
 dbus_int32_t
 libhal_ps_get_int32 (const LibHalPropertySet *set, const char *key)
 {
-hal_logger("%s", __func__);
+	const LibHalProperty *p;
+
+HAL_TRACE (libhal_ps_get_int32);
 	LIBHAL_CHECK_PARAM_VALID(set, "*set", 0);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", 0);
 
-	return 0;
+	p = hal_property_set_find (set, key);
+	if (p == NULL || p->type != LIBHAL_PROPERTY_TYPE_INT32)
+		return 0;
+	return p->v.int_value;
 }
 
 /**
@@ -407,11 +691,16 @@ hal_logger("%s", __func__);
 dbus_uint64_t
 libhal_ps_get_uint64 (const LibHalPropertySet *set, const char *key)
 {
-hal_logger("%s", __func__);
+	const LibHalProperty *p;
+
+HAL_TRACE (libhal_ps_get_uint64);
 	LIBHAL_CHECK_PARAM_VALID(set, "*set", 0);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", 0);
 
-	return 0;
+	p = hal_property_set_find (set, key);
+	if (p == NULL || p->type != LIBHAL_PROPERTY_TYPE_UINT64)
+		return 0;
+	return p->v.uint64_value;
 }
 
 /**
@@ -426,11 +715,16 @@ hal_logger("%s", __func__);
 double
 libhal_ps_get_double (const LibHalPropertySet *set, const char *key)
 {
-hal_logger("%s", __func__);
+	const LibHalProperty *p;
+
+HAL_TRACE (libhal_ps_get_double);
 	LIBHAL_CHECK_PARAM_VALID(set, "*set", 0.0);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", 0.0);
 
-	return 0.0;
+	p = hal_property_set_find (set, key);
+	if (p == NULL || p->type != LIBHAL_PROPERTY_TYPE_DOUBLE)
+		return 0.0;
+	return p->v.double_value;
 }
 
 /**
@@ -445,11 +739,16 @@ hal_logger("%s", __func__);
 dbus_bool_t
 libhal_ps_get_bool (const LibHalPropertySet *set, const char *key)
 {
-hal_logger("%s", __func__);
+	const LibHalProperty *p;
+
+HAL_TRACE (libhal_ps_get_bool);
 	LIBHAL_CHECK_PARAM_VALID(set, "*set", FALSE);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", FALSE);
 
-	return FALSE;
+	p = hal_property_set_find (set, key);
+	if (p == NULL || p->type != LIBHAL_PROPERTY_TYPE_BOOLEAN)
+		return FALSE;
+	return p->v.bool_value;
 }
 
 /**
@@ -464,11 +763,16 @@ hal_logger("%s", __func__);
 const char *const *
 libhal_ps_get_strlist (const LibHalPropertySet *set, const char *key)
 {
-hal_logger("%s", __func__);
+	const LibHalProperty *p;
+
+HAL_TRACE (libhal_ps_get_strlist);
 	LIBHAL_CHECK_PARAM_VALID(set, "*set", NULL);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", NULL);
 
-	return NULL;
+	p = hal_property_set_find (set, key);
+	if (p == NULL || p->type != LIBHAL_PROPERTY_TYPE_STRLIST)
+		return NULL;
+	return (const char *const *) p->v.strlist_value;
 }
 
 
@@ -483,9 +787,13 @@ hal_logger("%s", __func__);
 void
 libhal_psi_init (LibHalPropertySetIterator * iter, LibHalPropertySet * set)
 {
-hal_logger("%s", __func__);
-	if (set == NULL)
+HAL_TRACE (libhal_psi_init);
+	if (iter == NULL)
 		return;
+
+	iter->set = set;
+	iter->idx = 0;
+	iter->cur_prop = set != NULL ? set->properties : NULL;
 }
 
 
@@ -500,8 +808,8 @@ hal_logger("%s", __func__);
 dbus_bool_t
 libhal_psi_has_more (LibHalPropertySetIterator * iter)
 {
-hal_logger("%s", __func__);
-	return FALSE;
+HAL_TRACE (libhal_psi_has_more);
+	return iter->set != NULL && iter->idx < iter->set->num_properties;
 }
 
 /**
@@ -513,7 +821,9 @@ hal_logger("%s", __func__);
 void
 libhal_psi_next (LibHalPropertySetIterator * iter)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_psi_next);
+	iter->idx++;
+	iter->cur_prop++;
 }
 
 /**
@@ -527,8 +837,8 @@ hal_logger("%s", __func__);
 LibHalPropertyType
 libhal_psi_get_type (LibHalPropertySetIterator * iter)
 {
-hal_logger("%s", __func__);
-	return 0;
+HAL_TRACE (libhal_psi_get_type);
+	return iter->cur_prop->type;
 }
 
 /**
@@ -544,8 +854,8 @@ hal_logger("%s", __func__);
 char *
 libhal_psi_get_key (LibHalPropertySetIterator * iter)
 {
-hal_logger("%s", __func__);
-	return NULL;
+HAL_TRACE (libhal_psi_get_key);
+	return iter->cur_prop->key;
 }
 
 /**
@@ -561,8 +871,8 @@ hal_logger("%s", __func__);
 char *
 libhal_psi_get_string (LibHalPropertySetIterator * iter)
 {
-hal_logger("%s", __func__);
-	return NULL;
+HAL_TRACE (libhal_psi_get_string);
+	return iter->cur_prop->v.str_value;
 }
 
 /**
@@ -576,8 +886,8 @@ hal_logger("%s", __func__);
 dbus_int32_t
 libhal_psi_get_int (LibHalPropertySetIterator * iter)
 {
-hal_logger("%s", __func__);
-	return 0;
+HAL_TRACE (libhal_psi_get_int);
+	return iter->cur_prop->v.int_value;
 }
 
 /**
@@ -591,8 +901,8 @@ hal_logger("%s", __func__);
 dbus_uint64_t
 libhal_psi_get_uint64 (LibHalPropertySetIterator * iter)
 {
-hal_logger("%s", __func__);
-	return 0;
+HAL_TRACE (libhal_psi_get_uint64);
+	return iter->cur_prop->v.uint64_value;
 }
 
 /**
@@ -606,8 +916,8 @@ hal_logger("%s", __func__);
 double
 libhal_psi_get_double (LibHalPropertySetIterator * iter)
 {
-hal_logger("%s", __func__);
-	return 0.0;
+HAL_TRACE (libhal_psi_get_double);
+	return iter->cur_prop->v.double_value;
 }
 
 /**
@@ -621,8 +931,8 @@ hal_logger("%s", __func__);
 dbus_bool_t
 libhal_psi_get_bool (LibHalPropertySetIterator * iter)
 {
-hal_logger("%s", __func__);
-	return FALSE;
+HAL_TRACE (libhal_psi_get_bool);
+	return iter->cur_prop->v.bool_value;
 }
 
 /**
@@ -636,8 +946,8 @@ hal_logger("%s", __func__);
 char **
 libhal_psi_get_strlist (LibHalPropertySetIterator * iter)
 {
-hal_logger("%s", __func__);
-	return NULL;
+HAL_TRACE (libhal_psi_get_strlist);
+	return iter->cur_prop->v.strlist_value;
 }
 
 
@@ -656,12 +966,10 @@ hal_logger("%s", __func__);
 char **
 libhal_get_all_devices (LibHalContext *ctx, int *num_devices, DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_get_all_devices);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, NULL);
 
-	*num_devices = 0;
-
-	return NULL;
+	return hal_store_get_all_devices (num_devices);
 }
 
 /**
@@ -679,17 +987,13 @@ hal_logger("%s", __func__);
 LibHalPropertyType
 libhal_device_get_property_type (LibHalContext *ctx, const char *udi, const char *key, DBusError *error)
 {
-hal_logger("%s %s %s", __func__, udi, key);
+HAL_TRACE (libhal_device_get_property_type, udi, key);
 
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, LIBHAL_PROPERTY_TYPE_INVALID); /* or return NULL? */
 	LIBHAL_CHECK_UDI_VALID(udi, LIBHAL_PROPERTY_TYPE_INVALID);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", LIBHAL_PROPERTY_TYPE_INVALID);
 
-	if (strcmp(udi, "/org/freedesktop/Hal/devices/computer") == 0 &&
-	    strcmp(key, "system.hardware.serial") == 0)
-	    return DBUS_TYPE_STRING;
-
-	return LIBHAL_PROPERTY_TYPE_INVALID;
+	return hal_store_get_property_type (udi, key);
 }
 
 /**
@@ -709,12 +1013,17 @@ hal_logger("%s %s %s", __func__, udi, key);
 char **
 libhal_device_get_property_strlist (LibHalContext *ctx, const char *udi, const char *key, DBusError *error)
 {
-hal_logger("%s", __func__);
+	HalValue value;
+
+HAL_TRACE (libhal_device_get_property_strlist);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, NULL);
 	LIBHAL_CHECK_UDI_VALID(udi, NULL);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", NULL);
 
-	return NULL;
+	if (!hal_store_get_property (udi, key, LIBHAL_PROPERTY_TYPE_STRLIST, &value))
+		return NULL;
+
+	return value.strlist_value;
 }
 
 /**
@@ -734,17 +1043,18 @@ char *
 libhal_device_get_property_string (LibHalContext *ctx,
 				   const char *udi, const char *key, DBusError *error)
 {
-hal_logger("%s %s %s", __func__, udi, key);
+	HalValue value;
+
+HAL_TRACE (libhal_device_get_property_string, udi, key);
 
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, NULL);
 	LIBHAL_CHECK_UDI_VALID(udi, NULL);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", NULL);
 
-	if (strcmp(udi, "/org/freedesktop/Hal/devices/computer") == 0 &&
-	    strcmp(key, "system.hardware.serial") == 0)
-	    return strdup("System Serial Number");
+	if (!hal_store_get_property (udi, key, LIBHAL_PROPERTY_TYPE_STRING, &value))
+		return NULL;
 
-	return NULL;
+	return value.str_value;
 }
 
 /**
@@ -762,13 +1072,18 @@ dbus_int32_t
 libhal_device_get_property_int (LibHalContext *ctx, 
 				const char *udi, const char *key, DBusError *error)
 {
-hal_logger("%s %s %s", __func__, udi, key);
+	HalValue value;
+
+HAL_TRACE (libhal_device_get_property_int, udi, key);
 
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, -1);
 	LIBHAL_CHECK_UDI_VALID(udi, -1);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", -1);
 
-	return -1;
+	if (!hal_store_get_property (udi, key, LIBHAL_PROPERTY_TYPE_INT32, &value))
+		return -1;
+
+	return value.int_value;
 }
 
 /**
@@ -786,13 +1101,18 @@ dbus_uint64_t
 libhal_device_get_property_uint64 (LibHalContext *ctx, 
 				   const char *udi, const char *key, DBusError *error)
 {
-hal_logger("%s %s %s", __func__, udi, key);
+	HalValue value;
+
+HAL_TRACE (libhal_device_get_property_uint64, udi, key);
 
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, -1);
 	LIBHAL_CHECK_UDI_VALID(udi, -1);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", -1);
 
-	return -1;
+	if (!hal_store_get_property (udi, key, LIBHAL_PROPERTY_TYPE_UINT64, &value))
+		return -1;
+
+	return value.uint64_value;
 }
 
 /**
@@ -810,13 +1130,18 @@ double
 libhal_device_get_property_double (LibHalContext *ctx, 
 				   const char *udi, const char *key, DBusError *error)
 {
-hal_logger("%s %s %s", __func__, udi, key);
+	HalValue value;
+
+HAL_TRACE (libhal_device_get_property_double, udi, key);
 
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, -1.0);
 	LIBHAL_CHECK_UDI_VALID(udi, -1.0);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", -1.0);
 
-	return -1.0f;
+	if (!hal_store_get_property (udi, key, LIBHAL_PROPERTY_TYPE_DOUBLE, &value))
+		return -1.0;
+
+	return value.double_value;
 }
 
 /**
@@ -834,12 +1159,17 @@ dbus_bool_t
 libhal_device_get_property_bool (LibHalContext *ctx, 
 				 const char *udi, const char *key, DBusError *error)
 {
-hal_logger("%s", __func__);
+	HalValue value;
+
+HAL_TRACE (libhal_device_get_property_bool);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", FALSE);
 
-	return FALSE;
+	if (!hal_store_get_property (udi, key, LIBHAL_PROPERTY_TYPE_BOOLEAN, &value))
+		return FALSE;
+
+	return value.bool_value;
 }
 
 
@@ -863,13 +1193,16 @@ libhal_device_set_property_string (LibHalContext *ctx,
 				   const char *value,
 				   DBusError *error)
 {
-hal_logger("%s", __func__);
+	HalValue v;
+
+HAL_TRACE (libhal_device_set_property_string);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", FALSE);
 	LIBHAL_CHECK_PARAM_VALID(value, "*value", FALSE);
 
-	return FALSE;
+	v.str_value = (char *) value;
+	return hal_store_set_property (udi, key, LIBHAL_PROPERTY_TYPE_STRING, &v);
 }
 
 /**
@@ -889,12 +1222,15 @@ dbus_bool_t
 libhal_device_set_property_int (LibHalContext *ctx, const char *udi,
 				const char *key, dbus_int32_t value, DBusError *error)
 {
-hal_logger("%s", __func__);
+	HalValue v;
+
+HAL_TRACE (libhal_device_set_property_int);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", FALSE);
 
-	return FALSE;
+	v.int_value = value;
+	return hal_store_set_property (udi, key, LIBHAL_PROPERTY_TYPE_INT32, &v);
 }
 
 /**
@@ -914,12 +1250,15 @@ dbus_bool_t
 libhal_device_set_property_uint64 (LibHalContext *ctx, const char *udi,
 				   const char *key, dbus_uint64_t value, DBusError *error)
 {
-hal_logger("%s", __func__);
+	HalValue v;
+
+HAL_TRACE (libhal_device_set_property_uint64);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", FALSE);
-	
-	return FALSE;
+
+	v.uint64_value = value;
+	return hal_store_set_property (udi, key, LIBHAL_PROPERTY_TYPE_UINT64, &v);
 }
 
 /**
@@ -939,12 +1278,15 @@ dbus_bool_t
 libhal_device_set_property_double (LibHalContext *ctx, const char *udi,
 				   const char *key, double value, DBusError *error)
 {
-hal_logger("%s", __func__);
+	HalValue v;
+
+HAL_TRACE (libhal_device_set_property_double);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", FALSE);
-	
-	return FALSE;
+
+	v.double_value = value;
+	return hal_store_set_property (udi, key, LIBHAL_PROPERTY_TYPE_DOUBLE, &v);
 }
 
 /**
@@ -964,12 +1306,15 @@ dbus_bool_t
 libhal_device_set_property_bool (LibHalContext *ctx, const char *udi,
 				 const char *key, dbus_bool_t value, DBusError *error)
 {
-hal_logger("%s", __func__);
+	HalValue v;
+
+HAL_TRACE (libhal_device_set_property_bool);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", FALSE);
-	
-	return FALSE;
+
+	v.bool_value = value;
+	return hal_store_set_property (udi, key, LIBHAL_PROPERTY_TYPE_BOOLEAN, &v);
 }
 
 
@@ -989,12 +1334,12 @@ dbus_bool_t
 libhal_device_remove_property (LibHalContext *ctx, 
 			       const char *udi, const char *key, DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_remove_property);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", FALSE);
-	
-	return FALSE;
+
+	return hal_store_remove_property (udi, key);
 }
 
 /**
@@ -1017,13 +1362,13 @@ libhal_device_property_strlist_append (LibHalContext *ctx,
 				       const char *value,
 				       DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_property_strlist_append);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", FALSE);
 	LIBHAL_CHECK_PARAM_VALID(value, "*value", FALSE);
 
-	return FALSE;
+	return hal_store_strlist_insert (udi, key, value, FALSE);
 }
 
 /**
@@ -1046,13 +1391,13 @@ libhal_device_property_strlist_prepend (LibHalContext *ctx,
 					const char *value, 
 					DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_property_strlist_prepend);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", FALSE);
 	LIBHAL_CHECK_PARAM_VALID(value, "*value", FALSE);
 
-	return FALSE;
+	return hal_store_strlist_insert (udi, key, value, TRUE);
 }
 
 /**
@@ -1075,12 +1420,12 @@ libhal_device_property_strlist_remove_index (LibHalContext *ctx,
 					     unsigned int idx,
 					     DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_property_strlist_remove_index);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", FALSE);
 
-	return FALSE;
+	return hal_store_strlist_remove (udi, key, NULL, idx);
 }
 
 /**
@@ -1102,13 +1447,13 @@ libhal_device_property_strlist_remove (LibHalContext *ctx,
 				       const char *key,
 				       const char *value, DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_property_strlist_remove);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", FALSE);
 	LIBHAL_CHECK_PARAM_VALID(value, "*value", FALSE);
 
-	return FALSE;
+	return hal_store_strlist_remove (udi, key, value, 0);
 }
 
 
@@ -1130,7 +1475,7 @@ libhal_device_lock (LibHalContext *ctx,
 		    const char *reason_to_lock,
 		    char **reason_why_locked, DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_lock);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 
@@ -1155,7 +1500,7 @@ dbus_bool_t
 libhal_device_unlock (LibHalContext *ctx,
 		      const char *udi, DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_unlock);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 
@@ -1179,10 +1524,10 @@ hal_logger("%s", __func__);
 char *
 libhal_new_device (LibHalContext *ctx, DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_new_device);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, NULL);
 
-	return NULL;
+	return hal_store_new_device ();
 }
 
 
@@ -1210,12 +1555,12 @@ dbus_bool_t
 libhal_device_commit_to_gdl (LibHalContext *ctx, 
 			     const char *temp_udi, const char *udi, DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_commit_to_gdl);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(temp_udi, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 
-	return FALSE;
+	return hal_store_commit_device (temp_udi, udi);
 }
 
 /**
@@ -1236,11 +1581,11 @@ hal_logger("%s", __func__);
 dbus_bool_t
 libhal_remove_device (LibHalContext *ctx, const char *udi, DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_remove_device);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 
-	return FALSE;
+	return hal_store_remove_device (udi);
 }
 
 /**
@@ -1256,11 +1601,56 @@ hal_logger("%s", __func__);
 dbus_bool_t
 libhal_device_exists (LibHalContext *ctx, const char *udi, DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_exists);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 
-	return FALSE;
+	return hal_store_device_exists (udi);
+}
+
+/**
+ * libhal_device_get_generation:
+ * @ctx: the context for the connection to hald
+ * @udi: the Unique device id.
+ * @error: pointer to an initialized dbus error object for returning errors or NULL
+ *
+ * Get the generation of a device.  It grows each time a property or
+ * capability of the device changes, and when it is added to the GDL,
+ * so a caller that saw the same generation before need not read the
+ * device again.  Devices that have not changed since the GDL was
+ * loaded are generation 1.
+ *
+ * Returns: the generation, or 0 if the device does not exist
+ */
+dbus_uint64_t
+libhal_device_get_generation (LibHalContext *ctx, const char *udi, DBusError *error)
+{
+HAL_TRACE (libhal_device_get_generation);
+	LIBHAL_CHECK_LIBHALCONTEXT(ctx, 0);
+	LIBHAL_CHECK_UDI_VALID(udi, 0);
+
+	return hal_store_get_device_generation (udi);
+}
+
+/**
+ * libhal_get_gdl_generation:
+ * @ctx: the context for the connection to hald
+ * @error: pointer to an initialized dbus error object for returning errors or NULL
+ *
+ * Get the generation of the Global Device List.  It grows each time
+ * a device is added or removed, or any device in the GDL changes, so
+ * a caller that saw the same generation before need not look at any
+ * device again.  Reading it takes no lock.
+ *
+ * Returns: the generation, or 0 if @ctx is invalid
+ */
+dbus_uint64_t
+libhal_get_gdl_generation (LibHalContext *ctx, DBusError *error)
+{
+HAL_TRACE (libhal_get_gdl_generation);
+	LIBHAL_CHECK_LIBHALCONTEXT(ctx, 0);
+
+	return hal_store_get_gdl_generation ();
 }
 
 /**
@@ -1278,12 +1668,12 @@ dbus_bool_t
 libhal_device_property_exists (LibHalContext *ctx, 
 			       const char *udi, const char *key, DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_property_exists);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", FALSE);
 
-	return FALSE;
+	return hal_store_get_property_type (udi, key) != LIBHAL_PROPERTY_TYPE_INVALID;
 }
 
 /**
@@ -1301,7 +1691,7 @@ dbus_bool_t
 libhal_merge_properties (LibHalContext *ctx, 
 			 const char *target_udi, const char *source_udi, DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_merge_properties);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(target_udi, FALSE);
 	LIBHAL_CHECK_UDI_VALID(source_udi, FALSE);
@@ -1335,7 +1725,7 @@ libhal_device_matches (LibHalContext *ctx,
 		       const char *udi1, const char *udi2,
 		       const char *property_namespace, DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_matches);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi1, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi2, FALSE);
@@ -1357,7 +1747,7 @@ hal_logger("%s", __func__);
 dbus_bool_t
 libhal_device_print (LibHalContext *ctx, const char *udi, DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_print);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 
@@ -1382,15 +1772,13 @@ libhal_manager_find_device_string_match (LibHalContext *ctx,
 					 const char *key,
 					 const char *value, int *num_devices, DBusError *error)
 {
-hal_logger("%s %s %s", __func__, key, value);
+HAL_TRACE (libhal_manager_find_device_string_match, key, value);
 
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, NULL);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", NULL);
 	LIBHAL_CHECK_PARAM_VALID(value, "*value", NULL);
 
-	*num_devices = 0;
-
-	return NULL;
+	return hal_store_find_string_match (key, value, num_devices);
 }
 
 
@@ -1409,12 +1797,12 @@ dbus_bool_t
 libhal_device_add_capability (LibHalContext *ctx, 
 			      const char *udi, const char *capability, DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_add_capability);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 	LIBHAL_CHECK_PARAM_VALID(capability, "*capability", FALSE);
 
-	return FALSE;
+	return hal_store_add_capability (udi, capability);
 }
 
 /**
@@ -1432,12 +1820,12 @@ hal_logger("%s", __func__);
 dbus_bool_t
 libhal_device_query_capability (LibHalContext *ctx, const char *udi, const char *capability, DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_query_capability);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 	LIBHAL_CHECK_PARAM_VALID(capability, "*capability", FALSE);
 
-	return FALSE;
+	return hal_store_query_capability (udi, capability);
 }
 
 /**
@@ -1455,11 +1843,11 @@ char **
 libhal_find_device_by_capability (LibHalContext *ctx, 
 				  const char *capability, int *num_devices, DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_find_device_by_capability);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, NULL);
 	LIBHAL_CHECK_PARAM_VALID(capability, "*capability", NULL);
 
-	return NULL;
+	return hal_store_find_by_capability (capability, num_devices);
 }
 
 /**
@@ -1475,7 +1863,7 @@ hal_logger("%s", __func__);
 dbus_bool_t
 libhal_device_property_watch_all (LibHalContext *ctx, DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_property_watch_all);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 
 	return FALSE;
@@ -1485,7 +1873,7 @@ hal_logger("%s", __func__);
 dbus_bool_t
 libhal_device_property_remove_watch_all (LibHalContext *ctx, DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_property_remove_watch_all);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 
 	return FALSE;
@@ -1509,7 +1897,7 @@ hal_logger("%s", __func__);
 dbus_bool_t
 libhal_device_add_property_watch (LibHalContext *ctx, const char *udi, DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_add_property_watch);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 
@@ -1530,7 +1918,7 @@ hal_logger("%s", __func__);
 dbus_bool_t
 libhal_device_remove_property_watch (LibHalContext *ctx, const char *udi, DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_remove_property_watch);
 	return FALSE;
 }
 
@@ -1546,7 +1934,7 @@ LibHalContext *
 libhal_ctx_new (void)
 {
 	LibHalContext *ctx;
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_ctx_new);
 
 	ctx = calloc (1, sizeof (LibHalContext));
 	if (ctx == NULL) {
@@ -1577,7 +1965,7 @@ hal_logger("%s", __func__);
 dbus_bool_t
 libhal_ctx_set_cache (LibHalContext *ctx, dbus_bool_t use_cache)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_ctx_set_cache);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 
 	ctx->cache_enabled = use_cache;
@@ -1596,7 +1984,7 @@ hal_logger("%s", __func__);
 dbus_bool_t
 libhal_ctx_set_dbus_connection (LibHalContext *ctx, DBusConnection *conn)
 {
-hal_logger("%s %p %p", __func__, ctx, conn);
+HAL_TRACE (libhal_ctx_set_dbus_connection, ctx, conn);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 
 	if (conn == NULL)
@@ -1617,7 +2005,7 @@ hal_logger("%s %p %p", __func__, ctx, conn);
 DBusConnection *
 libhal_ctx_get_dbus_connection (LibHalContext *ctx)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_ctx_get_dbus_connection);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, NULL);
 
 	return ctx->connection;
@@ -1636,7 +2024,7 @@ hal_logger("%s", __func__);
 dbus_bool_t 
 libhal_ctx_init (LibHalContext *ctx, DBusError *error)
 {
-hal_logger("%s %p %p", __func__, ctx, error);
+HAL_TRACE (libhal_ctx_init, ctx, error);
 
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 
@@ -1662,7 +2050,7 @@ libhal_ctx_init_direct (DBusError *error)
 {
 	LibHalContext *ctx;
 
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_ctx_init_direct);
 	ctx = libhal_ctx_new ();
 	if (ctx == NULL)
 		goto out;
@@ -1692,7 +2080,7 @@ out:
 dbus_bool_t    
 libhal_ctx_shutdown (LibHalContext *ctx, DBusError *error)
 {
-hal_logger("%s %p %p", __func__, ctx, error);
+HAL_TRACE (libhal_ctx_shutdown, ctx, error);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 
 	ctx->is_initialized = FALSE;
@@ -1711,8 +2099,9 @@ hal_logger("%s %p %p", __func__, ctx, error);
 dbus_bool_t    
 libhal_ctx_free (LibHalContext *ctx)
 {
-hal_logger("%s %p", __func__, ctx);
+HAL_TRACE (libhal_ctx_free, ctx);
 	free (ctx);
+	hal_logger_flush ();
 	return TRUE;
 }
 
@@ -1728,7 +2117,7 @@ hal_logger("%s %p", __func__, ctx);
 dbus_bool_t
 libhal_ctx_set_device_added (LibHalContext *ctx, LibHalDeviceAdded callback)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_ctx_set_device_added);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 
 	ctx->device_added = callback;
@@ -1747,7 +2136,7 @@ hal_logger("%s", __func__);
 dbus_bool_t
 libhal_ctx_set_device_removed (LibHalContext *ctx, LibHalDeviceRemoved callback)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_ctx_set_device_removed);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 
 	ctx->device_removed = callback;
@@ -1766,7 +2155,7 @@ hal_logger("%s", __func__);
 dbus_bool_t
 libhal_ctx_set_device_new_capability (LibHalContext *ctx, LibHalDeviceNewCapability callback)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_ctx_set_device_new_capability);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 
 	ctx->device_new_capability = callback;
@@ -1785,7 +2174,7 @@ hal_logger("%s", __func__);
 dbus_bool_t
 libhal_ctx_set_device_lost_capability (LibHalContext *ctx, LibHalDeviceLostCapability callback)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_ctx_set_device_lost_capability);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 
 	ctx->device_lost_capability = callback;
@@ -1804,7 +2193,7 @@ hal_logger("%s", __func__);
 dbus_bool_t
 libhal_ctx_set_device_property_modified (LibHalContext *ctx, LibHalDevicePropertyModified callback)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_ctx_set_device_property_modified);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 
 	ctx->device_property_modified = callback;
@@ -1823,7 +2212,7 @@ hal_logger("%s", __func__);
 dbus_bool_t
 libhal_ctx_set_device_condition (LibHalContext *ctx, LibHalDeviceCondition callback)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_ctx_set_device_condition);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 
 	ctx->device_condition = callback;
@@ -1842,7 +2231,7 @@ hal_logger("%s", __func__);
 dbus_bool_t
 libhal_ctx_set_singleton_device_added (LibHalContext *ctx, LibHalSingletonDeviceAdded callback)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_ctx_set_singleton_device_added);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 
 	ctx->singleton_device_added = callback;
@@ -1861,7 +2250,7 @@ hal_logger("%s", __func__);
 dbus_bool_t
 libhal_ctx_set_singleton_device_removed (LibHalContext *ctx, LibHalSingletonDeviceRemoved callback)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_ctx_set_singleton_device_removed);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 
 	ctx->singleton_device_removed = callback;
@@ -1880,7 +2269,7 @@ unsigned int
 libhal_string_array_length (char **str_array)
 {
 	unsigned int i;
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_string_array_length);
 
 	if (str_array == NULL)
 		return 0;
@@ -1905,7 +2294,7 @@ hal_logger("%s", __func__);
 dbus_bool_t 
 libhal_device_rescan (LibHalContext *ctx, const char *udi, DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_rescan);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 
@@ -1925,7 +2314,7 @@ hal_logger("%s", __func__);
 dbus_bool_t
 libhal_device_reprobe (LibHalContext *ctx, const char *udi, DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_reprobe);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 
@@ -1951,7 +2340,7 @@ dbus_bool_t libhal_device_emit_condition (LibHalContext *ctx,
 					  const char *condition_details,
 					  DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_emit_condition);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 	LIBHAL_CHECK_PARAM_VALID(condition_name, "*condition_name", FALSE);
@@ -1979,7 +2368,7 @@ libhal_device_addon_is_ready (LibHalContext *ctx,
 			      const char *udi,
 			      DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_addon_is_ready);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 
@@ -2004,7 +2393,7 @@ libhal_device_singleton_addon_is_ready (LibHalContext *ctx,
 					const char *command_line,
 					DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_singleton_addon_is_ready);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_PARAM_VALID(command_line, "*command_line", FALSE);
 
@@ -2033,7 +2422,7 @@ libhal_device_claim_interface (LibHalContext *ctx,
 			       const char *introspection_xml,
 			       DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_claim_interface);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 	LIBHAL_CHECK_PARAM_VALID(interface_name, "*interface_name", FALSE);
@@ -2043,29 +2432,39 @@ hal_logger("%s", __func__);
 
 
 
-struct LibHalChangeSetElement_s;
+/*
+ * A changeset owns the changes it holds and the strings and string
+ * lists they set.  Its first changes and values are stored in the
+ * changeset itself; the rest are bump allocated from chunks, each
+ * twice the size of the previous one, and freed with it.  Building a
+ * small changeset and freeing it thus takes one malloc() and one
+ * free(), a large one a few more.  Keys are interned.  The changes
+ * are kept in the array hal_store_set_properties() takes, so that
+ * committing them copies nothing.
+ */
+
+#define LIBHAL_CHANGESET_INLINE_CHANGES 8
+#define LIBHAL_CHANGESET_INLINE_DATA    256     /* bytes */
+#define LIBHAL_CHANGESET_CHUNK_SIZE     4096    /* bytes, of the first chunk */
 
-typedef struct LibHalChangeSetElement_s LibHalChangeSetElement;
+typedef struct LibHalChangeSetChunk_s LibHalChangeSetChunk;
 
-struct LibHalChangeSetElement_s {
-	char *key;
-	int change_type;
-	union {
-		char *val_str;
-		dbus_int32_t val_int;
-		dbus_uint64_t val_uint64;
-		double val_double;
-		dbus_bool_t val_bool;
-		char **val_strlist;
-	} value;
-	LibHalChangeSetElement *next;
-	LibHalChangeSetElement *prev;
+struct LibHalChangeSetChunk_s {
+	LibHalChangeSetChunk *prev;
+	size_t size;                            /**< of data */
+	uint64_t data[];
 };
 
 struct LibHalChangeSet_s {
-	char *udi;
-	LibHalChangeSetElement *head;
-	LibHalChangeSetElement *tail;
+	const char *udi;			/**< interned */
+	HalPropertyChange *changes;		/**< inline_changes, or in a chunk */
+	unsigned int num_changes;
+	unsigned int max_changes;
+	LibHalChangeSetChunk *chunk;		/**< the last one, or NULL */
+	char *free;				/**< in inline_data or the last chunk */
+	size_t free_size;
+	HalPropertyChange inline_changes[LIBHAL_CHANGESET_INLINE_CHANGES];
+	uint64_t inline_data[LIBHAL_CHANGESET_INLINE_DATA / sizeof (uint64_t)];
 };
 
 /**
@@ -2081,46 +2480,103 @@ LibHalChangeSet *
 libhal_device_new_changeset (const char *udi)
 {
 	LibHalChangeSet *changeset;
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_new_changeset);
 
 	LIBHAL_CHECK_UDI_VALID(udi, NULL);
 
-	changeset = calloc (1, sizeof (LibHalChangeSet));
+	/* not calloc(), the inline storage needs no clearing */
+	changeset = malloc (sizeof (LibHalChangeSet));
 	if (changeset == NULL)
 		goto out;
 
-	changeset->udi = strdup (udi);
+	changeset->udi = hal_intern (udi);
 	if (changeset->udi == NULL) {
 		free (changeset);
 		changeset = NULL;
 		goto out;
 	}
 
-	changeset->head = NULL;
-	changeset->tail = NULL;
+	changeset->changes = changeset->inline_changes;
+	changeset->num_changes = 0;
+	changeset->max_changes = LIBHAL_CHANGESET_INLINE_CHANGES;
+	changeset->chunk = NULL;
+	changeset->free = (char *) changeset->inline_data;
+	changeset->free_size = sizeof (changeset->inline_data);
 
 out:
 	return changeset;
 }
 
-static void
-libhal_changeset_append (LibHalChangeSet *changeset, LibHalChangeSetElement *elem)
+/* Allocate from the changeset, for as long as it lives; NULL on OOM */
+static void *
+libhal_changeset_alloc (LibHalChangeSet *changeset, size_t size)
+{
+	LibHalChangeSetChunk *chunk;
+	size_t chunk_size;
+	void *p;
+
+	size = (size + sizeof (uint64_t) - 1) & ~(sizeof (uint64_t) - 1);
+	if (size > changeset->free_size) {
+		chunk_size = changeset->chunk != NULL ? 2 * changeset->chunk->size : LIBHAL_CHANGESET_CHUNK_SIZE;
+		if (chunk_size < size)
+			chunk_size = size;
+		chunk = malloc (sizeof (LibHalChangeSetChunk) + chunk_size);
+		if (chunk == NULL)
+			return NULL;
+		chunk->prev = changeset->chunk;
+		chunk->size = chunk_size;
+		changeset->chunk = chunk;
+		changeset->free = (char *) chunk->data;
+		changeset->free_size = chunk_size;
+	}
+
+	p = changeset->free;
+	changeset->free += size;
+	changeset->free_size -= size;
+	return p;
+}
+
+/* Copy a string into the changeset; NULL on OOM */
+static char *
+libhal_changeset_strdup (LibHalChangeSet *changeset, const char *str)
+{
+	size_t len = strlen (str) + 1;
+	char *copy;
+
+	copy = libhal_changeset_alloc (changeset, len);
+	if (copy != NULL)
+		memcpy (copy, str, len);
+	return copy;
+}
+
+/* Add a change of @key to the changeset, to be filled in; NULL on OOM */
+static HalPropertyChange *
+libhal_changeset_append (LibHalChangeSet *changeset, const char *key, int type)
 {
-hal_logger("%s", __func__);
-	LIBHAL_CHECK_PARAM_VALID(changeset, "*changeset", (void) NULL );
-	LIBHAL_CHECK_PARAM_VALID(elem, "*elem", (void) NULL);
+	HalPropertyChange *changes;
+	HalPropertyChange *change;
+	const char *interned;
 
-	if (changeset->head == NULL) {
-		changeset->head = elem;
-		changeset->tail = elem;
-		elem->next = NULL;
-		elem->prev = NULL;
-	} else {
-		elem->prev = changeset->tail;
-		elem->next = NULL;
-		elem->prev->next = elem;
-		changeset->tail = elem;
+HAL_TRACE (libhal_changeset_append);
+
+	interned = hal_intern (key);
+	if (interned == NULL)
+		return NULL;
+
+	if (changeset->num_changes == changeset->max_changes) {
+		/* the old array stays in the changeset until it is freed */
+		changes = libhal_changeset_alloc (changeset, 2 * changeset->max_changes * sizeof (HalPropertyChange));
+		if (changes == NULL)
+			return NULL;
+		memcpy (changes, changeset->changes, changeset->num_changes * sizeof (HalPropertyChange));
+		changeset->changes = changes;
+		changeset->max_changes *= 2;
 	}
+
+	change = &changeset->changes[changeset->num_changes++];
+	change->key = interned;
+	change->type = type;
+	return change;
 }
 
 
@@ -2137,36 +2593,24 @@ hal_logger("%s", __func__);
 dbus_bool_t
 libhal_changeset_set_property_string (LibHalChangeSet *changeset, const char *key, const char *value)
 {
-	LibHalChangeSetElement *elem;
+	HalPropertyChange *change;
+	char *value_copy;
 
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_changeset_set_property_string);
 
 	LIBHAL_CHECK_PARAM_VALID(changeset, "*changeset", FALSE);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", FALSE);
 	LIBHAL_CHECK_PARAM_VALID(value, "*value", FALSE);
 
-	elem = calloc (1, sizeof (LibHalChangeSetElement));
-	if (elem == NULL)
-		goto out;
-	elem->key = strdup (key);
-	if (elem->key == NULL) {
-		free (elem);
-		elem = NULL;
-		goto out;
-	}
-
-	elem->change_type = LIBHAL_PROPERTY_TYPE_STRING;
-	elem->value.val_str = strdup (value);
-	if (elem->value.val_str == NULL) {
-		free (elem->key);
-		free (elem);
-		elem = NULL;
-		goto out;
-	}
+	value_copy = libhal_changeset_strdup (changeset, value);
+	if (value_copy == NULL)
+		return FALSE;
 
-	libhal_changeset_append (changeset, elem);
-out:
-	return elem != NULL;
+	change = libhal_changeset_append (changeset, key, LIBHAL_PROPERTY_TYPE_STRING);
+	if (change == NULL)
+		return FALSE;
+	change->value.str_value = value_copy;
+	return TRUE;
 }
 
 /**
@@ -2182,29 +2626,18 @@ out:
 dbus_bool_t
 libhal_changeset_set_property_int (LibHalChangeSet *changeset, const char *key, dbus_int32_t value)
 {
-	LibHalChangeSetElement *elem;
+	HalPropertyChange *change;
 
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_changeset_set_property_int);
 
 	LIBHAL_CHECK_PARAM_VALID(changeset, "*changeset", FALSE);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", FALSE);
 
-	elem = calloc (1, sizeof (LibHalChangeSetElement));
-	if (elem == NULL)
-		goto out;
-	elem->key = strdup (key);
-	if (elem->key == NULL) {
-		free (elem);
-		elem = NULL;
-		goto out;
-	}
-
-	elem->change_type = LIBHAL_PROPERTY_TYPE_INT32;
-	elem->value.val_int = value;
-
-	libhal_changeset_append (changeset, elem);
-out:
-	return elem != NULL;
+	change = libhal_changeset_append (changeset, key, LIBHAL_PROPERTY_TYPE_INT32);
+	if (change == NULL)
+		return FALSE;
+	change->value.int_value = value;
+	return TRUE;
 }
 
 /**
@@ -2220,29 +2653,18 @@ out:
 dbus_bool_t
 libhal_changeset_set_property_uint64 (LibHalChangeSet *changeset, const char *key, dbus_uint64_t value)
 {
-	LibHalChangeSetElement *elem;
+	HalPropertyChange *change;
 
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_changeset_set_property_uint64);
 
 	LIBHAL_CHECK_PARAM_VALID(changeset, "*changeset", FALSE);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", FALSE);
 
-	elem = calloc (1, sizeof (LibHalChangeSetElement));
-	if (elem == NULL)
-		goto out;
-	elem->key = strdup (key);
-	if (elem->key == NULL) {
-		free (elem);
-		elem = NULL;
-		goto out;
-	}
-
-	elem->change_type = LIBHAL_PROPERTY_TYPE_UINT64;
-	elem->value.val_uint64 = value;
-
-	libhal_changeset_append (changeset, elem);
-out:
-	return elem != NULL;
+	change = libhal_changeset_append (changeset, key, LIBHAL_PROPERTY_TYPE_UINT64);
+	if (change == NULL)
+		return FALSE;
+	change->value.uint64_value = value;
+	return TRUE;
 }
 
 /**
@@ -2258,29 +2680,18 @@ out:
 dbus_bool_t
 libhal_changeset_set_property_double (LibHalChangeSet *changeset, const char *key, double value)
 {
-	LibHalChangeSetElement *elem;
+	HalPropertyChange *change;
 
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_changeset_set_property_double);
 
 	LIBHAL_CHECK_PARAM_VALID(changeset, "*changeset", FALSE);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", FALSE);
 
-	elem = calloc (1, sizeof (LibHalChangeSetElement));
-	if (elem == NULL)
-		goto out;
-	elem->key = strdup (key);
-	if (elem->key == NULL) {
-		free (elem);
-		elem = NULL;
-		goto out;
-	}
-
-	elem->change_type = LIBHAL_PROPERTY_TYPE_DOUBLE;
-	elem->value.val_double = value;
-
-	libhal_changeset_append (changeset, elem);
-out:
-	return elem != NULL;
+	change = libhal_changeset_append (changeset, key, LIBHAL_PROPERTY_TYPE_DOUBLE);
+	if (change == NULL)
+		return FALSE;
+	change->value.double_value = value;
+	return TRUE;
 }
 
 /**
@@ -2296,29 +2707,18 @@ out:
 dbus_bool_t
 libhal_changeset_set_property_bool (LibHalChangeSet *changeset, const char *key, dbus_bool_t value)
 {
-	LibHalChangeSetElement *elem;
+	HalPropertyChange *change;
 
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_changeset_set_property_bool);
 
 	LIBHAL_CHECK_PARAM_VALID(changeset, "*changeset", FALSE);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", FALSE);
 
-	elem = calloc (1, sizeof (LibHalChangeSetElement));
-	if (elem == NULL)
-		goto out;
-	elem->key = strdup (key);
-	if (elem->key == NULL) {
-		free (elem);
-		elem = NULL;
-		goto out;
-	}
-
-	elem->change_type = LIBHAL_PROPERTY_TYPE_BOOLEAN;
-	elem->value.val_bool = value;
-
-	libhal_changeset_append (changeset, elem);
-out:
-	return elem != NULL;
+	change = libhal_changeset_append (changeset, key, LIBHAL_PROPERTY_TYPE_BOOLEAN);
+	if (change == NULL)
+		return FALSE;
+	change->value.bool_value = value;
+	return TRUE;
 }
 
 /**
@@ -2334,59 +2734,35 @@ out:
 dbus_bool_t
 libhal_changeset_set_property_strlist (LibHalChangeSet *changeset, const char *key, const char **value)
 {
-	LibHalChangeSetElement *elem;
+	HalPropertyChange *change;
 	char **value_copy;
 	int len;
-	int i, j;
+	int i;
 
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_changeset_set_property_strlist);
 
         LIBHAL_CHECK_PARAM_VALID(changeset, "*changeset", FALSE);
         LIBHAL_CHECK_PARAM_VALID(key, "*key", FALSE);
 
-	elem = calloc (1, sizeof (LibHalChangeSetElement));
-	if (elem == NULL)
-		goto out;
-	elem->key = strdup (key);
-	if (elem->key == NULL) {
-		free (elem);
-		elem = NULL;
-		goto out;
-	}
-
 	for (i = 0; value[i] != NULL; i++)
 		;
 	len = i;
 
-	value_copy = calloc (len + 1, sizeof (char *));
-	if (value_copy == NULL) {
-		free (elem->key);
-		free (elem);
-		elem = NULL;
-		goto out;
-	}
-
+	value_copy = libhal_changeset_alloc (changeset, (len + 1) * sizeof (char *));
+	if (value_copy == NULL)
+		return FALSE;
 	for (i = 0; i < len; i++) {
-		value_copy[i] = strdup (value[i]);
-		if (value_copy[i] == NULL) {
-			for (j = 0; j < i; j++) {
-				free (value_copy[j]);
-			}
-			free (value_copy);
-			free (elem->key);
-			free (elem);
-			elem = NULL;
-			goto out;
-		}
+		value_copy[i] = libhal_changeset_strdup (changeset, value[i]);
+		if (value_copy[i] == NULL)
+			return FALSE;
 	}
 	value_copy[i] = NULL;
 
-	elem->change_type = LIBHAL_PROPERTY_TYPE_STRLIST;
-	elem->value.val_strlist = value_copy;
-
-	libhal_changeset_append (changeset, elem);
-out:
-	return elem != NULL;
+	change = libhal_changeset_append (changeset, key, LIBHAL_PROPERTY_TYPE_STRLIST);
+	if (change == NULL)
+		return FALSE;
+	change->value.strlist_value = value_copy;
+	return TRUE;
 }
 
 /**
@@ -2395,18 +2771,20 @@ out:
  * @changeset: the changeset to commit
  * @error: pointer to an initialized dbus error object for returning errors or NULL
  * 
- * Commit a changeset to the daemon.
+ * Commit a changeset to the daemon.  The changes are made in order
+ * but as one: the device gets a single new generation, readers see
+ * all of them or none, and if one fails none is made.
  * 
  * Returns: True if the changeset was committed on the daemon side
  */
 dbus_bool_t
 libhal_device_commit_changeset (LibHalContext *ctx, LibHalChangeSet *changeset, DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_commit_changeset);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(changeset->udi, FALSE);
 
-	return FALSE;
+	return hal_store_set_properties (changeset->udi, changeset->changes, changeset->num_changes);
 }
 
 /**
@@ -2418,40 +2796,19 @@ hal_logger("%s", __func__);
 void
 libhal_device_free_changeset (LibHalChangeSet *changeset)
 {
-	LibHalChangeSetElement *elem;
-	LibHalChangeSetElement *elem2;
-
-hal_logger("%s", __func__);
-
-	for (elem = changeset->head; elem != NULL; elem = elem2) {
-		elem2 = elem->next;
-
-		switch (elem->change_type) {
-		case LIBHAL_PROPERTY_TYPE_STRING:
-			free (elem->value.val_str);
-			break;
-		case LIBHAL_PROPERTY_TYPE_STRLIST:
-			libhal_free_string_array (elem->value.val_strlist);
-			break;
-                /* explicit fallthrough */
-		case LIBHAL_PROPERTY_TYPE_INT32:
-		case LIBHAL_PROPERTY_TYPE_UINT64:
-		case LIBHAL_PROPERTY_TYPE_DOUBLE:
-		case LIBHAL_PROPERTY_TYPE_BOOLEAN:
-			break;
-		default:
-			fprintf (stderr, "%s %d : unknown change_type %d\n", __FILE__, __LINE__, elem->change_type);
-			break;
-		}
-		free (elem->key);
-		free (elem);
+	LibHalChangeSetChunk *chunk;
+	LibHalChangeSetChunk *prev;
+
+HAL_TRACE (libhal_device_free_changeset);
+
+	for (chunk = changeset->chunk; chunk != NULL; chunk = prev) {
+		prev = chunk->prev;
+		free (chunk);
 	}
 
-	free (changeset->udi);
 	free (changeset);
 }
 
-
 /**
  * libhal_device_acquire_interface_lock:
  * @ctx: the context for the connection to hald
@@ -2471,7 +2828,7 @@ libhal_device_acquire_interface_lock (LibHalContext *ctx,
                                       dbus_bool_t exclusive,
                                       DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_acquire_interface_lock);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 	LIBHAL_CHECK_PARAM_VALID(interface, "*interface", FALSE);
@@ -2495,7 +2852,7 @@ dbus_bool_t libhal_device_release_interface_lock (LibHalContext *ctx,
                                                   const char *interface,
                                                   DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_release_interface_lock);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 	LIBHAL_CHECK_PARAM_VALID(interface, "*interface", FALSE);
@@ -2519,7 +2876,7 @@ dbus_bool_t libhal_acquire_global_interface_lock (LibHalContext *ctx,
                                                   dbus_bool_t exclusive,
                                                   DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_acquire_global_interface_lock);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_PARAM_VALID(interface, "*interface", FALSE);
 
@@ -2540,7 +2897,7 @@ dbus_bool_t libhal_release_global_interface_lock (LibHalContext *ctx,
                                                   const char *interface,
                                                   DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_release_global_interface_lock);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_PARAM_VALID(interface, "*interface", FALSE);
 
@@ -2568,7 +2925,7 @@ libhal_device_is_caller_locked_out (LibHalContext *ctx,
                                     const char *caller,
                                     DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_is_caller_locked_out);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, TRUE);
 	LIBHAL_CHECK_UDI_VALID(udi, TRUE);
 	LIBHAL_CHECK_PARAM_VALID(interface, "*interface", TRUE);
@@ -2590,7 +2947,7 @@ hal_logger("%s", __func__);
 dbus_bool_t
 libhal_ctx_set_global_interface_lock_acquired (LibHalContext *ctx, LibHalGlobalInterfaceLockAcquired callback)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_ctx_set_global_interface_lock_acquired);
 	LIBHAL_CHECK_LIBHALCONTEXT (ctx, FALSE);
 
 	ctx->global_interface_lock_acquired = callback;
@@ -2609,7 +2966,7 @@ hal_logger("%s", __func__);
 dbus_bool_t
 libhal_ctx_set_global_interface_lock_released (LibHalContext *ctx, LibHalGlobalInterfaceLockReleased callback)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_ctx_set_global_interface_lock_released);
 	LIBHAL_CHECK_LIBHALCONTEXT (ctx, FALSE);
 
 	ctx->global_interface_lock_released = callback;
@@ -2629,7 +2986,7 @@ hal_logger("%s", __func__);
 dbus_bool_t
 libhal_ctx_set_interface_lock_acquired (LibHalContext *ctx, LibHalInterfaceLockAcquired callback)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_ctx_set_interface_lock_acquired);
 	LIBHAL_CHECK_LIBHALCONTEXT (ctx, FALSE);
 
 	ctx->interface_lock_acquired = callback;
@@ -2648,7 +3005,7 @@ hal_logger("%s", __func__);
 dbus_bool_t
 libhal_ctx_set_interface_lock_released (LibHalContext *ctx, LibHalInterfaceLockReleased callback)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_ctx_set_interface_lock_released);
 	LIBHAL_CHECK_LIBHALCONTEXT (ctx, FALSE);
 
 	ctx->interface_lock_released = callback;
@@ -2674,7 +3031,7 @@ libhal_device_is_locked_by_others (LibHalContext *ctx,
                                    const char *interface,
                                    DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_is_locked_by_others);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, TRUE);
 	LIBHAL_CHECK_UDI_VALID(udi, TRUE);
 	LIBHAL_CHECK_PARAM_VALID(interface, "*interface", TRUE);
@@ -2706,7 +3063,7 @@ libhal_device_is_caller_privileged (LibHalContext *ctx,
                                     const char *caller,
                                     DBusError *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_device_is_caller_privileged);
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, NULL);
 	LIBHAL_CHECK_UDI_VALID(udi, NULL);
 	LIBHAL_CHECK_PARAM_VALID(action, "*action", NULL);
@@ -2723,6 +3080,8 @@ hal_logger("%s", __func__);
  * @error: Return location for error
  *
  * Get all devices in the hal database as well as all properties for each device.
+ * The udis and the sets are allocated in a single block, which is freed
+ * along with the last of them.
  *
  * Return: %TRUE if success; %FALSE and @error will be set.
  **/
@@ -2732,7 +3091,7 @@ dbus_bool_t libhal_get_all_devices_with_properties (LibHalContext       *ctx,
                                                     LibHalPropertySet ***out_properties, 
                                                     DBusError           *error)
 {
-hal_logger("%s", __func__);
+HAL_TRACE (libhal_get_all_devices_with_properties);
 	LIBHAL_CHECK_LIBHALCONTEXT (ctx, FALSE);
 	LIBHAL_CHECK_PARAM_VALID (out_num_devices, "*out_num_devices",FALSE);
 	LIBHAL_CHECK_PARAM_VALID (out_udi, "***out_udi", FALSE);
@@ -2742,5 +3101,109 @@ hal_logger("%s", __func__);
         *out_udi = NULL;
         *out_properties = NULL;
 
+	return hal_store_get_all_devices_with_properties (out_num_devices, out_udi, out_properties);
+}
+
+/**
+ * libhal_dummy_set_trace_mask:
+ * @functions: comma separated list of function name patterns
+ *
+ * Select which libhal calls are traced from now on, replacing the
+ * trace_functions setting.  Each entry is a shell wildcard pattern
+ * matched against the function names, e.g. "libhal_device_get_*";
+ * "all" and "none" select every or no function, and an entry
+ * starting with '-' removes the functions it matches.  The
+ * trace_level setting still applies.
+ *
+ * Returns: %TRUE if success; %FALSE if @functions is invalid
+ **/
+dbus_bool_t
+libhal_dummy_set_trace_mask (const char *functions)
+{
+HAL_TRACE (libhal_dummy_set_trace_mask);
+	LIBHAL_CHECK_PARAM_VALID (functions, "*functions", FALSE);
+
+	return hal_trace_set_functions (functions);
+}
+
+/**
+ * libhal_dummy_get_stats:
+ * @out_stats: Return location for an array of #LibHalDummyStats, one per
+ * libhal function. Caller should free it with libhal_dummy_free_stats() when done with it.
+ * @out_num_stats: Return location for the number of elements in @out_stats
+ *
+ * Get the number of calls made to each libhal function in this
+ * process since the last call to libhal_dummy_reset_stats(), and how
+ * long they took if the stats_timing setting is on.
+ *
+ * Returns: %TRUE if success; %FALSE if out of memory or statistics are
+ * turned off
+ **/
+dbus_bool_t
+libhal_dummy_get_stats (LibHalDummyStats **out_stats, int *out_num_stats)
+{
+HAL_TRACE (libhal_dummy_get_stats);
+	LIBHAL_CHECK_PARAM_VALID (out_stats, "**out_stats", FALSE);
+	LIBHAL_CHECK_PARAM_VALID (out_num_stats, "*out_num_stats", FALSE);
+
+	*out_stats = NULL;
+	*out_num_stats = 0;
+
+	if (!hal_stats_enabled)
+		return FALSE;
+
+	return hal_stats_get (out_stats, out_num_stats);
+}
+
+/**
+ * libhal_dummy_free_stats:
+ * @stats: the statistics to free
+ *
+ * Frees the statistics returned by libhal_dummy_get_stats(). If passed
+ * NULL, does nothing.
+ */
+void
+libhal_dummy_free_stats (LibHalDummyStats *stats)
+{
+HAL_TRACE (libhal_dummy_free_stats);
+	free (stats);
+}
+
+/**
+ * libhal_dummy_reset_stats:
+ *
+ * Start counting the calls reported by libhal_dummy_get_stats() from
+ * zero again.
+ */
+void
+libhal_dummy_reset_stats (void)
+{
+HAL_TRACE (libhal_dummy_reset_stats);
+	hal_stats_reset ();
+}
+
+/**
+ * libhal_dummy_get_string_pool_stats:
+ * @out_stats: Return location for the statistics
+ *
+ * Get how many udis and property keys are interned, and the memory
+ * the pool holding them uses.  The pool only grows.
+ *
+ * Returns: %TRUE if success; %FALSE if @out_stats is NULL
+ **/
+dbus_bool_t
+libhal_dummy_get_string_pool_stats (LibHalDummyStringPoolStats *out_stats)
+{
+	size_t num_strings;
+	size_t string_bytes;
+	size_t pool_bytes;
+
+HAL_TRACE (libhal_dummy_get_string_pool_stats);
+	LIBHAL_CHECK_PARAM_VALID (out_stats, "*out_stats", FALSE);
+
+	hal_intern_get_stats (&num_strings, &string_bytes, &pool_bytes);
+	out_stats->strings = num_strings;
+	out_stats->string_bytes = string_bytes;
+	out_stats->pool_bytes = pool_bytes;
 	return TRUE;
 }
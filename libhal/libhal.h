@@ -348,6 +348,12 @@ char        **libhal_get_all_devices (LibHalContext *ctx, int *num_devices, DBus
 /* Determine if a device exists. */
 dbus_bool_t   libhal_device_exists   (LibHalContext *ctx, const char *udi,  DBusError *error);
 
+/* Get the generation of the last change to a device. */
+dbus_uint64_t libhal_device_get_generation (LibHalContext *ctx, const char *udi, DBusError *error);
+
+/* Get the generation of the last change to the Global Device List (GDL). */
+dbus_uint64_t libhal_get_gdl_generation (LibHalContext *ctx, DBusError *error);
+
 /* Print a device to stdout; useful for debugging. */
 dbus_bool_t   libhal_device_print    (LibHalContext *ctx, const char *udi,  DBusError *error);
 
@@ -776,6 +782,57 @@ char* libhal_device_is_caller_privileged (LibHalContext *ctx,
                                           const char *caller,
                                           DBusError *error);
 
+/* Select which libhal calls the dummy library traces */
+dbus_bool_t libhal_dummy_set_trace_mask (const char *functions);
+
+#define LIBHAL_DUMMY_STATS_BUCKETS 32
+
+/** 
+ * LibHalDummyStats:
+ *
+ * Calls made to one libhal function, as counted by the dummy
+ * library.  histogram[0] counts calls that took no measurable time
+ * and histogram[i] those that took from 2^(i-1) up to 2^i - 1
+ * nanoseconds; the last bucket also counts everything slower.
+ * total_ns and histogram stay zero unless the stats_timing setting
+ * is on, as timing every call costs more than the call itself.
+ */
+struct LibHalDummyStats_s {
+	const char *function;                   /**< Name of the function */
+	unsigned long long calls;               /**< Number of calls */
+	unsigned long long errors;              /**< Calls that were given invalid parameters */
+	unsigned long long total_ns;            /**< Time spent in them */
+	unsigned long long histogram[LIBHAL_DUMMY_STATS_BUCKETS]; /**< Calls by duration */
+};
+
+typedef struct LibHalDummyStats_s LibHalDummyStats;
+
+/* Get call counts and latencies of every libhal function since the last reset */
+dbus_bool_t libhal_dummy_get_stats (LibHalDummyStats **out_stats, int *out_num_stats);
+
+/* Free the statistics returned by libhal_dummy_get_stats() */
+void libhal_dummy_free_stats (LibHalDummyStats *stats);
+
+/* Start counting from zero again */
+void libhal_dummy_reset_stats (void);
+
+/** 
+ * LibHalDummyStringPoolStats:
+ *
+ * Memory used by the pool of udis and property keys the dummy library
+ * shares between devices, property sets and changesets.
+ */
+struct LibHalDummyStringPoolStats_s {
+	unsigned long long strings;             /**< Distinct strings in the pool */
+	unsigned long long string_bytes;        /**< Their size, counting the terminating NULs */
+	unsigned long long pool_bytes;          /**< Memory held by the pool, with its hash tables */
+};
+
+typedef struct LibHalDummyStringPoolStats_s LibHalDummyStringPoolStats;
+
+/* Get the memory used by the string pool */
+dbus_bool_t libhal_dummy_get_string_pool_stats (LibHalDummyStringPoolStats *out_stats);
+
 
 #if defined(__cplusplus)
 }